@@ -0,0 +1,586 @@
+/* cbt_bench.c - benchmarks the operations of cbt.h
+
+   Build and run, e.g., with
+      cc -O3 -std=gnu99 bench/cbt_bench.c -o cbt_bench -lpthread -lm
+      ./cbt_bench --min-depth 10 --max-depth 30 --threads 1,2,4,8 > results.json
+
+   OPTIONS
+   --min-depth D    smallest maxDepth of the sweep (default 10)
+   --max-depth D    largest maxDepth of the sweep (default 30)
+   --depth-step S   maxDepth increment of the sweep (default 4)
+   --threads LIST   comma separated thread counts (default 1, 2, 4, ... and
+                    the processor count)
+   --repeat N       runs per measurement, the median is reported (default 3)
+   --queries N      maximum number of leaves decoded and encoded (default 2^20)
+   --rank-index B   1 to decode and encode with cbt_EnableRankIndex (default 0)
+
+   Each operation is timed for every maxDepth, initial state, and thread
+   count, on the built-in thread pool. The initial states are
+      root    cbt_ResetToRoot
+      ceil    cbt_ResetToCeil
+      random  cbt_ResetToDepth(maxDepth / 2) followed by random refinement
+      leb     the steady state of the LEB-like workload described below
+   The operations are
+      create     cbt_CreateAtDepth(maxDepth, 0)
+      reset      cbt_ResetToDepth to the initial state's depth
+      reduction  full sum reduction of the heap
+      update     cbt_Update with the LEB-like updater
+      deferred   cbt_UpdateDeferred with the LEB-like updater
+      decode     cbt_DecodeNode over random leaves
+      encode     cbt_EncodeNode over the same leaves
+   and the results are printed as JSON. nsPerItem divides the time by the
+   number of leaves (or queries) processed, gbPerSecond divides the heap
+   byte size by the time, and efficiency compares the time t to the time t0
+   measured with the first thread count of the list, i.e., with the default
+   list, t0 / (threads * t).
+
+   LEB-LIKE WORKLOAD
+   Each node is mapped to a rectangle of the unit square by splitting along
+   x and y in turn as the depth increases, which mimics the bisection of
+   triangles in LEB. Like a distance-based level of detail, a node is
+   split when its diagonal exceeds CBT_BENCH_LOD_FACTOR times its distance
+   to a target point, and merged when its parent's diagonal does not.
+   The target moves slightly at each update so that both splits and
+   merges occur at every step.
+*/
+
+#define CBT_IMPLEMENTATION
+#include "../cbt.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(_WIN32)
+#   include <windows.h>
+#else
+#   include <time.h>
+#endif
+
+#define CBT_BENCH_LOD_FACTOR 0.5
+
+typedef struct {
+    int64_t minDepth;
+    int64_t maxDepth;
+    int64_t depthStep;
+    int64_t threadCounts[64];
+    int64_t threadCountCount;
+    int64_t repeatCount;
+    int64_t queryCount;
+    bool useRankIndex;
+} Config;
+
+typedef struct {
+    double x, y;
+} Target;
+
+typedef enum {
+    STATE_ROOT,
+    STATE_CEIL,
+    STATE_RANDOM,
+    STATE_LEB,
+    STATE_COUNT
+} State;
+
+typedef enum {
+    OP_CREATE,
+    OP_RESET,
+    OP_REDUCTION,
+    OP_UPDATE,
+    OP_DEFERRED,
+    OP_DECODE,
+    OP_ENCODE,
+    OP_COUNT
+} Op;
+
+static const char *g_stateNames[STATE_COUNT] = {"root", "ceil", "random", "leb"};
+static const char *g_opNames[OP_COUNT] = {
+    "create", "reset", "reduction", "update", "deferred", "decode", "encode"
+};
+
+
+/*******************************************************************************
+ * Timer
+ *
+ */
+static double Now(void)
+{
+#if defined(_WIN32)
+    LARGE_INTEGER counter, frequency;
+
+    QueryPerformanceCounter(&counter);
+    QueryPerformanceFrequency(&frequency);
+
+    return (double)counter.QuadPart / (double)frequency.QuadPart;
+#else
+    struct timespec time;
+
+    clock_gettime(CLOCK_MONOTONIC, &time);
+
+    return (double)time.tv_sec + 1e-9 * (double)time.tv_nsec;
+#endif
+}
+
+static int CompareDoubles(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+static double Median(double *values, int64_t count)
+{
+    qsort(values, count, sizeof(double), &CompareDoubles);
+
+    return values[count / 2];
+}
+
+
+/*******************************************************************************
+ * Workloads
+ *
+ */
+static uint64_t Hash(uint64_t x)
+{
+    x^= x >> 33;
+    x*= 0xff51afd7ed558ccdULL;
+    x^= x >> 33;
+    x*= 0xc4ceb9fe1a85ec53ULL;
+    x^= x >> 33;
+
+    return x;
+}
+
+// rectangle of the unit square covered by a node
+static void
+NodeRectangle(const cbt_Node node, double *x, double *y, double *w, double *h)
+{
+    (*x) = (*y) = 0.0;
+    (*w) = (*h) = 1.0;
+
+    for (int64_t bitID = node.depth - 1; bitID >= 0; --bitID) {
+        uint64_t bit = (node.id >> bitID) & 1u;
+
+        if (((node.depth - 1 - bitID) & 1) == 0) {
+            (*w)*= 0.5;
+            (*x)+= bit * (*w);
+        } else {
+            (*h)*= 0.5;
+            (*y)+= bit * (*h);
+        }
+    }
+}
+
+static bool IsTooCoarse(const cbt_Node node, const Target *target)
+{
+    double x, y, w, h, dx, dy;
+
+    NodeRectangle(node, &x, &y, &w, &h);
+    dx = fmax(fmax(x - target->x, target->x - (x + w)), 0.0);
+    dy = fmax(fmax(y - target->y, target->y - (y + h)), 0.0);
+
+    return w * w + h * h > CBT_BENCH_LOD_FACTOR * CBT_BENCH_LOD_FACTOR
+                           * (dx * dx + dy * dy);
+}
+
+static void
+LebUpdater(cbt_Tree *tree, const cbt_Node node, const void *userData)
+{
+    const Target *target = (const Target *)userData;
+
+    if (IsTooCoarse(node, target)) {
+        cbt_SplitNode(tree, node);
+    } else if (!cbt_IsRootNode(node)
+               && !IsTooCoarse(cbt_ParentNode_Fast(node), target)) {
+        cbt_MergeNode(tree, node);
+    }
+}
+
+static void
+RandomUpdater(cbt_Tree *tree, const cbt_Node node, const void *userData)
+{
+    uint64_t seed = *(const uint64_t *)userData;
+
+    if (Hash(node.id ^ seed) & 1u)
+        cbt_SplitNode(tree, node);
+}
+
+static Target MovingTarget(int64_t stepID)
+{
+    Target target = {0.3 + 1e-3 * stepID, 0.4 + 5e-4 * stepID};
+
+    return target;
+}
+
+static void SetState(cbt_Tree *tree, State state)
+{
+    int64_t maxDepth = cbt_MaxDepth(tree);
+
+    switch (state) {
+    case STATE_ROOT:
+        cbt_ResetToRoot(tree);
+        break;
+    case STATE_CEIL:
+        cbt_ResetToCeil(tree);
+        break;
+    case STATE_RANDOM:
+        cbt_ResetToDepth(tree, maxDepth / 2);
+
+        for (uint64_t seed = 1; seed <= 4; ++seed) {
+            cbt_Update(tree, &RandomUpdater, &seed);
+        }
+        break;
+    default: {
+        Target target = MovingTarget(0);
+
+        cbt_ResetToRoot(tree);
+
+        for (int64_t stepID = 0; stepID < maxDepth + 2; ++stepID) {
+            cbt_Update(tree, &LebUpdater, &target);
+        }
+    } break;
+    }
+}
+
+static int64_t StateDepth(const cbt_Tree *tree, State state)
+{
+    switch (state) {
+    case STATE_CEIL: return cbt_MaxDepth(tree);
+    case STATE_RANDOM: return cbt_MaxDepth(tree) / 2;
+    default: return 0;
+    }
+}
+
+
+/*******************************************************************************
+ * Queries -- Decodes and encodes leaves in parallel
+ *
+ */
+typedef struct {
+    const cbt_Tree *tree;
+    int64_t *leafIDs;
+    cbt_Node *nodes;
+} QueryLoop;
+
+// decodes leafIDs into nodes
+static void DecodeRange(int64_t begin, int64_t end, void *callbackData)
+{
+    const QueryLoop *loop = (const QueryLoop *)callbackData;
+
+    for (int64_t queryID = begin; queryID < end; ++queryID) {
+        loop->nodes[queryID] = cbt_DecodeNode(loop->tree, loop->leafIDs[queryID]);
+    }
+}
+
+// encodes nodes into leafIDs
+static void EncodeRange(int64_t begin, int64_t end, void *callbackData)
+{
+    const QueryLoop *loop = (const QueryLoop *)callbackData;
+
+    for (int64_t queryID = begin; queryID < end; ++queryID) {
+        loop->leafIDs[queryID] = cbt_EncodeNode(loop->tree, loop->nodes[queryID]);
+    }
+}
+
+
+/*******************************************************************************
+ * Measurements
+ *
+ */
+typedef struct {
+    double seconds;
+    int64_t itemCount;
+    bool isHeapBound;
+} Measurement;
+
+static Measurement
+Measure(Op op, cbt_Tree *tree, State state, const cbt_Executor *executor,
+        const Config *config)
+{
+    int64_t maxDepth = cbt_MaxDepth(tree);
+    double *seconds = (double *)malloc(sizeof(double) * config->repeatCount);
+    Measurement measurement = {0.0, 0, false};
+
+    for (int64_t runID = 0; runID < config->repeatCount; ++runID) {
+        double start = 0.0, stop = 0.0;
+
+        SetState(tree, state);
+        measurement.itemCount = cbt_NodeCount(tree);
+
+        switch (op) {
+        case OP_CREATE: {
+            cbt_Tree *other;
+
+            start = Now();
+            other = cbt_CreateAtDepth(maxDepth, 0);
+            stop = Now();
+            cbt_Release(other);
+            measurement.isHeapBound = true;
+        } break;
+
+        case OP_RESET:
+            start = Now();
+            cbt_ResetToDepth(tree, StateDepth(tree, state));
+            stop = Now();
+            measurement.isHeapBound = true;
+            break;
+
+        case OP_REDUCTION:
+            start = Now();
+            cbt__ComputeSumReduction(tree);
+            stop = Now();
+            measurement.isHeapBound = true;
+            break;
+
+        case OP_UPDATE:
+        case OP_DEFERRED: {
+            Target target = MovingTarget(runID + 1);
+
+            start = Now();
+            if (op == OP_UPDATE)
+                cbt_Update(tree, &LebUpdater, &target);
+            else
+                cbt_UpdateDeferred(tree, &LebUpdater, &target);
+            stop = Now();
+        } break;
+
+        default: {
+            int64_t queryCount = cbt_NodeCount(tree);
+            QueryLoop loop;
+
+            if (queryCount > config->queryCount)
+                queryCount = config->queryCount;
+
+            loop.tree = tree;
+            loop.leafIDs = (int64_t *)malloc(sizeof(int64_t) * queryCount);
+            loop.nodes = (cbt_Node *)malloc(sizeof(cbt_Node) * queryCount);
+
+            for (int64_t queryID = 0; queryID < queryCount; ++queryID) {
+                int64_t leafID = Hash(queryID + 1) % cbt_NodeCount(tree);
+
+                loop.leafIDs[queryID] = leafID;
+                loop.nodes[queryID] = cbt_DecodeNode(tree, leafID);
+            }
+
+            start = Now();
+            cbt__ExecuteParallelFor(executor,
+                                    queryCount,
+                                    4096,
+                                    op == OP_DECODE ? &DecodeRange : &EncodeRange,
+                                    &loop);
+            stop = Now();
+
+            free(loop.leafIDs);
+            free(loop.nodes);
+            measurement.itemCount = queryCount;
+        } break;
+        }
+
+        seconds[runID] = stop - start;
+    }
+
+    measurement.seconds = Median(seconds, config->repeatCount);
+    free(seconds);
+
+    return measurement;
+}
+
+static void
+PrintResult(
+    bool *isFirst,
+    Op op,
+    State state,
+    int64_t maxDepth,
+    int64_t threadCount,
+    int64_t heapByteSize,
+    const Measurement *measurement,
+    double firstSeconds
+) {
+    double seconds = measurement->seconds > 0.0 ? measurement->seconds : 1e-12;
+    int64_t itemCount = measurement->itemCount > 0 ? measurement->itemCount : 1;
+
+    printf("%s\n    {\"op\": \"%s\", \"state\": \"%s\", \"maxDepth\": %lld, "
+           "\"threads\": %lld, \"heapBytes\": %lld, \"items\": %lld, "
+           "\"seconds\": %.9f, \"nsPerItem\": %.4f, ",
+           (*isFirst) ? "" : ",",
+           g_opNames[op],
+           g_stateNames[state],
+           (long long)maxDepth,
+           (long long)threadCount,
+           (long long)heapByteSize,
+           (long long)measurement->itemCount,
+           measurement->seconds,
+           1e9 * seconds / (double)itemCount);
+
+    if (measurement->isHeapBound)
+        printf("\"gbPerSecond\": %.4f, ", 1e-9 * (double)heapByteSize / seconds);
+    else
+        printf("\"gbPerSecond\": null, ");
+
+    printf("\"efficiency\": %.4f}",
+           firstSeconds / ((double)threadCount * seconds));
+    fflush(stdout);
+    (*isFirst) = false;
+}
+
+
+/*******************************************************************************
+ * Command line
+ *
+ */
+static void ParseThreadCounts(Config *config, const char *list)
+{
+    config->threadCountCount = 0;
+
+    while (*list != '\0' && config->threadCountCount < 64) {
+        char *end;
+        long threadCount = strtol(list, &end, 10);
+
+        if (end == list)
+            break;
+
+        if (threadCount > 0)
+            config->threadCounts[config->threadCountCount++] = threadCount;
+
+        list = (*end == ',') ? end + 1 : end;
+    }
+}
+
+static void DefaultThreadCounts(Config *config)
+{
+    int64_t processorCount = cbt__ProcessorCount();
+
+    config->threadCountCount = 0;
+
+    for (int64_t threadCount = 1;
+         threadCount < processorCount && config->threadCountCount < 63;
+         threadCount*= 2) {
+        config->threadCounts[config->threadCountCount++] = threadCount;
+    }
+
+    config->threadCounts[config->threadCountCount++] = processorCount;
+}
+
+static bool ParseCommandLine(Config *config, int argc, char **argv)
+{
+    config->minDepth = 10;
+    config->maxDepth = 30;
+    config->depthStep = 4;
+    config->repeatCount = 3;
+    config->queryCount = 1 << 20;
+    config->useRankIndex = false;
+    DefaultThreadCounts(config);
+
+    for (int i = 1; i < argc; ++i) {
+        const char *option = argv[i];
+        const char *value = (i + 1 < argc) ? argv[i + 1] : NULL;
+
+        if (value == NULL) {
+            fprintf(stderr, "cbt_bench: missing value for %s\n", option);
+            return false;
+        } else if (!strcmp(option, "--min-depth")) {
+            config->minDepth = atoll(value);
+        } else if (!strcmp(option, "--max-depth")) {
+            config->maxDepth = atoll(value);
+        } else if (!strcmp(option, "--depth-step")) {
+            config->depthStep = atoll(value);
+        } else if (!strcmp(option, "--threads")) {
+            ParseThreadCounts(config, value);
+        } else if (!strcmp(option, "--repeat")) {
+            config->repeatCount = atoll(value);
+        } else if (!strcmp(option, "--queries")) {
+            config->queryCount = atoll(value);
+        } else if (!strcmp(option, "--rank-index")) {
+            config->useRankIndex = atoll(value) != 0;
+        } else {
+            fprintf(stderr, "cbt_bench: unknown option %s\n", option);
+            return false;
+        }
+
+        ++i;
+    }
+
+    if (config->minDepth < 5 || config->maxDepth > 58
+        || config->minDepth > config->maxDepth || config->depthStep < 1
+        || config->repeatCount < 1 || config->queryCount < 1
+        || config->threadCountCount < 1) {
+        fprintf(stderr, "cbt_bench: invalid options\n");
+        return false;
+    }
+
+    return true;
+}
+
+
+/*******************************************************************************
+ * Main
+ *
+ */
+int main(int argc, char **argv)
+{
+    Config config;
+    bool isFirst = true;
+
+    if (!ParseCommandLine(&config, argc, argv))
+        return EXIT_FAILURE;
+
+    printf("{\n  \"processorCount\": %lld,\n  \"lodFactor\": %g,\n"
+           "  \"rankIndex\": %s,\n  \"results\": [",
+           (long long)cbt__ProcessorCount(),
+           CBT_BENCH_LOD_FACTOR,
+           config.useRankIndex ? "true" : "false");
+
+    for (int64_t maxDepth = config.minDepth;
+         maxDepth <= config.maxDepth;
+         maxDepth+= config.depthStep) {
+        cbt_Tree *tree = cbt_CreateAtDepth(maxDepth, 0);
+        int64_t heapByteSize = cbt_HeapByteSize(tree);
+
+        if (config.useRankIndex)
+            cbt_EnableRankIndex(tree);
+
+        for (int state = 0; state < STATE_COUNT; ++state) {
+            double firstSeconds[OP_COUNT];
+
+            for (int64_t i = 0; i < config.threadCountCount; ++i) {
+                int64_t threadCount = config.threadCounts[i];
+                cbt_ThreadPool *pool = cbt_CreateThreadPool(threadCount);
+                cbt_Executor executor = cbt_ThreadPoolExecutor(pool);
+
+                cbt_SetExecutor(tree, &executor);
+
+                for (int op = 0; op < OP_COUNT; ++op) {
+                    Measurement measurement;
+
+                    // creation does not depend on the state of the tree
+                    if (op == OP_CREATE && state != STATE_ROOT)
+                        continue;
+
+                    measurement = Measure((Op)op, tree, (State)state, &executor, &config);
+
+                    if (i == 0)
+                        firstSeconds[op] = measurement.seconds * threadCount;
+
+                    PrintResult(&isFirst,
+                                (Op)op,
+                                (State)state,
+                                maxDepth,
+                                threadCount,
+                                heapByteSize,
+                                &measurement,
+                                firstSeconds[op]);
+                }
+
+                cbt_SetExecutor(tree, NULL);
+                cbt_ReleaseThreadPool(pool);
+            }
+        }
+
+        cbt_Release(tree);
+    }
+
+    printf("\n  ]\n}\n");
+
+    return EXIT_SUCCESS;
+}
@@ -17,6 +17,10 @@ by Jonathan Dupuy
    define CBT_MALLOC(x) to use your own memory allocator
    define CBT_FREE(x) to use your own memory deallocator
    define CBT_MEMCPY(dst, src, num) to use your own memcpy routine
+   define CBT_NO_SIMD to disable the SIMD sum reduction kernels
+   define CBT_NO_THREAD_POOL to disable the built-in thread pool
+   define CBT_NO_ATOMICS if the trees are never modified by concurrent threads
+   define CBT_ENABLE_STATS to record operation counters and timings (see cbt_GetStats)
 */
 
 #ifndef CBT_INCLUDE_CBT_H
@@ -36,6 +40,11 @@ extern "C" {
 #include <stdbool.h>
 
 typedef struct cbt_Tree cbt_Tree;
+typedef enum {
+    CBT_LAYOUT_PACKED,       // densely packed nodes (default, GPU compatible)
+    CBT_LAYOUT_WORD_ALIGNED, // power-of-two node sizes aligned on 64-bit words
+    CBT_LAYOUT_BLOCKED       // subtrees stored contiguously in cache lines
+} cbt_Layout;
 typedef struct {
     uint64_t id   : 58; // heapID
     uint64_t depth:  6; // log2(heapID)
@@ -44,6 +53,33 @@ typedef struct {
 // create / destroy tree
 CBTDEF cbt_Tree *cbt_Create(int64_t maxDepth);
 CBTDEF cbt_Tree *cbt_CreateAtDepth(int64_t maxDepth, int64_t depth);
+CBTDEF cbt_Tree *cbt_CreateWithLayout(int64_t maxDepth,
+                                      int64_t depth,
+                                      cbt_Layout layout);
+CBTDEF cbt_Tree *cbt_CreateSparse(int64_t maxDepth,
+                                  int64_t depth,
+                                  cbt_Layout layout);
+typedef struct {
+    // returns byteSize bytes aligned on alignment bytes, or NULL
+    void *(*allocate)(int64_t byteSize, int64_t alignment, void *allocatorData);
+    void (*release)(void *memory, int64_t byteSize, void *allocatorData);
+    void *allocatorData;
+} cbt_Allocator;
+typedef struct {
+    int64_t maxDepth;
+    int64_t depth;
+    cbt_Layout layout;
+    const cbt_Allocator *allocator; // NULL to use CBT_MALLOC and CBT_FREE
+    int64_t heapAlignment;          // power of two, 0 for the default
+    bool useHugePages;              // 2 MiB aligned heap on huge pages
+    void *heap;                     // caller-owned heap memory, or NULL
+    int64_t heapByteSize;           // byte size of the caller-owned heap
+    bool keepHeap;                  // use the caller-owned heap as is
+} cbt_CreateInfo;
+CBTDEF cbt_Tree *cbt_CreateWithInfo(const cbt_CreateInfo *info);
+CBTDEF cbt_Tree *cbt_CreateInBuffer(void *buffer,
+                                    int64_t byteSize,
+                                    int64_t maxDepth);
 CBTDEF void cbt_Release(cbt_Tree *tree);
 
 // loaders
@@ -62,9 +98,98 @@ typedef void (*cbt_UpdateCallback)(cbt_Tree *tree,
 CBTDEF void cbt_Update(cbt_Tree *tree,
                        cbt_UpdateCallback updater,
                        const void *userData);
+CBTDEF void cbt_UpdateDeferred(cbt_Tree *tree,
+                               cbt_UpdateCallback updater,
+                               const void *userData);
+typedef enum {
+    CBT_UPDATE_KEEP,  // leave the leaf as is
+    CBT_UPDATE_SPLIT, // split the leaf, unless it is a ceil node
+    CBT_UPDATE_MERGE  // merge the leaf with its sibling, unless it is the root
+} cbt_UpdateDecision;
+typedef void (*cbt_BatchedUpdateCallback)(const cbt_Tree *tree,
+                                          const uint64_t *heapIDs,
+                                          const int64_t *depths,
+                                          int64_t firstHandle,
+                                          int64_t leafCount,
+                                          uint8_t *decisions,
+                                          const void *userData);
+CBTDEF void cbt_UpdateBatched(cbt_Tree *tree,
+                              cbt_BatchedUpdateCallback updater,
+                              const void *userData);
+typedef float (*cbt_PriorityCallback)(const cbt_Tree *tree,
+                                      const cbt_Node node,
+                                      const void *userData);
+CBTDEF void cbt_UpdatePrioritized(cbt_Tree *tree,
+                                  cbt_PriorityCallback priority,
+                                  int64_t maxNodeCount,
+                                  int64_t maxSplitCount,
+                                  const void *userData);
+
+// time-sliced sum reductions
+CBTDEF void cbt_SetReductionDeferred(cbt_Tree *tree, bool isDeferred);
+CBTDEF void cbt_BeginReduction(cbt_Tree *tree);
+CBTDEF bool cbt_ReductionStep(cbt_Tree *tree, int64_t maxWordCount);
+CBTDEF bool cbt_IsReductionPending(const cbt_Tree *tree);
+
+// parallel execution
+typedef void (*cbt_ParallelForCallback)(int64_t begin,
+                                        int64_t end,
+                                        void *callbackData);
+typedef struct {
+    // runs callback over [0, count) in ranges of at most grainSize
+    // items and returns once all of them are processed
+    void (*parallelFor)(int64_t count,
+                        int64_t grainSize,
+                        cbt_ParallelForCallback callback,
+                        void *callbackData,
+                        void *executorData);
+    void *executorData;
+    int64_t threadCount; // number of threads running the loops, 0 if unknown
+} cbt_Executor;
+CBTDEF void cbt_SetExecutor(cbt_Tree *tree, const cbt_Executor *executor);
+#ifndef CBT_NO_THREAD_POOL
+typedef struct cbt_ThreadPool cbt_ThreadPool;
+CBTDEF cbt_ThreadPool *cbt_CreateThreadPool(int64_t threadCount);
+CBTDEF void cbt_ReleaseThreadPool(cbt_ThreadPool *pool);
+CBTDEF cbt_Executor cbt_ThreadPoolExecutor(cbt_ThreadPool *pool);
+#endif
+
+// forests of trees sharing a single heap buffer
+typedef struct cbt_Forest cbt_Forest;
+typedef void (*cbt_ForestUpdateCallback)(cbt_Tree *tree,
+                                         int64_t treeID,
+                                         const cbt_Node node,
+                                         const void *userData);
+CBTDEF cbt_Forest *cbt_CreateForest(int64_t treeCount,
+                                    int64_t maxDepth,
+                                    int64_t depth);
+CBTDEF cbt_Forest *cbt_CreateForestInBuffer(void *buffer,
+                                            int64_t byteSize,
+                                            int64_t treeCount,
+                                            int64_t maxDepth,
+                                            int64_t depth);
+CBTDEF cbt_Forest *cbt_CreateForestFromBuffer(void *buffer,
+                                              int64_t byteSize,
+                                              int64_t treeCount);
+CBTDEF int64_t cbt_ForestBufferByteSize(int64_t treeCount, int64_t maxDepth);
+CBTDEF void cbt_ReleaseForest(cbt_Forest *forest);
+CBTDEF void cbt_ForestResetToDepth(cbt_Forest *forest, int64_t depth);
+CBTDEF void cbt_ForestUpdate(cbt_Forest *forest,
+                             cbt_ForestUpdateCallback updater,
+                             const void *userData);
+CBTDEF void cbt_ForestComputeSumReduction(cbt_Forest *forest);
+CBTDEF void cbt_ForestSetExecutor(cbt_Forest *forest,
+                                  const cbt_Executor *executor);
+CBTDEF int64_t cbt_ForestTreeCount(const cbt_Forest *forest);
+CBTDEF cbt_Tree *cbt_ForestTree(cbt_Forest *forest, int64_t treeID);
+CBTDEF int64_t cbt_ForestHeapByteSize(const cbt_Forest *forest);
+CBTDEF int64_t cbt_ForestHeapStride(const cbt_Forest *forest);
+CBTDEF const char *cbt_ForestGetHeap(const cbt_Forest *forest);
 
 // O(1) queries
 CBTDEF int64_t cbt_MaxDepth(const cbt_Tree *tree);
+CBTDEF cbt_Layout cbt_GetLayout(const cbt_Tree *tree);
+CBTDEF bool cbt_IsSparse(const cbt_Tree *tree);
 CBTDEF int64_t cbt_NodeCount(const cbt_Tree *tree);
 CBTDEF uint64_t cbt_HeapRead(const cbt_Tree *tree, const cbt_Node node);
 CBTDEF bool cbt_IsLeafNode(const cbt_Tree *tree, const cbt_Node node);
@@ -91,12 +216,85 @@ CBTDEF cbt_Node cbt_RightChildNode_Fast  (const cbt_Node node);
 // O(depth) queries
 CBTDEF cbt_Node cbt_DecodeNode(const cbt_Tree *tree, int64_t leafID);
 CBTDEF int64_t cbt_EncodeNode(const cbt_Tree *tree, const cbt_Node node);
+CBTDEF bool cbt_EnableRankIndex(cbt_Tree *tree); // near O(1) encoding and decoding
+
+// O(nodeCount) bulk queries, in parallel
+CBTDEF int64_t cbt_ExportLeaves(const cbt_Tree *tree, cbt_Node *leaves);
+CBTDEF int64_t cbt_ExportLeafHeapIDs(const cbt_Tree *tree, uint64_t *heapIDs);
+CBTDEF int64_t cbt_ExportLeavesSoA(const cbt_Tree *tree,
+                                   uint64_t *heapIDs,
+                                   int64_t *depths);
 
 // serialization
 CBTDEF int64_t cbt_HeapByteSize(const cbt_Tree *tree);
+CBTDEF int64_t cbt_LayoutHeapByteSize(int64_t maxDepth, cbt_Layout layout);
 CBTDEF const char *cbt_GetHeap(const cbt_Tree *tree);
 CBTDEF void cbt_SetHeap(cbt_Tree *tree, const char *heapToCopy);
 
+// files
+typedef enum {
+    CBT_FILE_READ_ONLY       = 0,
+    CBT_FILE_READ_WRITE      = 1 << 0,
+    CBT_FILE_VERIFY_CHECKSUM = 1 << 1
+} cbt_FileFlags;
+CBTDEF bool cbt_SaveFile(const cbt_Tree *tree, const char *path);
+CBTDEF cbt_Tree *cbt_LoadFile(const char *path);
+CBTDEF cbt_Tree *cbt_MapFile(const char *path, int flags);
+CBTDEF bool cbt_SyncFile(cbt_Tree *tree);
+
+// deltas
+CBTDEF int64_t cbt_ComputeDelta(const cbt_Tree *oldTree,
+                                const cbt_Tree *newTree,
+                                char *delta,
+                                int64_t deltaCapacity);
+CBTDEF bool cbt_ApplyDelta(cbt_Tree *tree,
+                           const char *delta,
+                           int64_t deltaByteSize);
+
+// snapshots, for threads that read a tree while it is being updated
+CBTDEF bool cbt_EnableSnapshots(cbt_Tree *tree);
+CBTDEF const cbt_Tree *cbt_AcquireSnapshot(const cbt_Tree *tree);
+CBTDEF void cbt_ReleaseSnapshot(const cbt_Tree *tree, const cbt_Tree *snapshot);
+CBTDEF int64_t cbt_SnapshotEpoch(const cbt_Tree *snapshot);
+
+// instrumentation (only recorded when CBT_ENABLE_STATS is defined)
+typedef struct {
+    int64_t splitCount;             // calls to cbt_SplitNode(_Fast) that write a bit
+    int64_t mergeCount;             // calls to cbt_MergeNode(_Fast) that write a bit
+    int64_t ceilSplitCount;         // no-op calls to cbt_SplitNode on ceil nodes
+    int64_t rootMergeCount;         // no-op calls to cbt_MergeNode on the root
+    int64_t rejectedMergeCount;     // merges rejected by cbt_UpdateDeferred
+    int64_t bitFieldWriteCount;     // bitfield words written
+    int64_t reducedWordCount;       // bitfield words whose sums were recomputed
+    int64_t nodeCountDelta;         // net number of leaves added by the updates
+    int64_t updateCount;
+    int64_t resetCount;
+    int64_t reductionCount;
+    int64_t decodeCount;
+    int64_t encodeCount;
+    int64_t updateNanoseconds;      // includes the callbacks and the reduction
+    int64_t callbackNanoseconds;    // parallel loop running the update callbacks
+    int64_t resetNanoseconds;
+    int64_t reductionNanoseconds;
+    int64_t reductionLevelNanoseconds[64]; // indexed by depth
+    int64_t decodeNanoseconds;
+    int64_t encodeNanoseconds;
+} cbt_Stats;
+typedef struct {
+    const char *name;
+    int64_t depth;                  // level of a reduction pass, -1 otherwise
+    int64_t beginNanoseconds;
+    int64_t endNanoseconds;
+} cbt_TraceEvent;
+typedef void (*cbt_TraceCallback)(const cbt_Tree *tree,
+                                  const cbt_TraceEvent *event,
+                                  void *userData);
+CBTDEF void cbt_GetStats(const cbt_Tree *tree, cbt_Stats *stats);
+CBTDEF void cbt_ResetStats(cbt_Tree *tree);
+CBTDEF void cbt_SetTraceCallback(cbt_Tree *tree,
+                                 cbt_TraceCallback callback,
+                                 void *userData);
+
 #ifdef __cplusplus
 } // extern "C"
 #endif
@@ -131,16 +329,109 @@ CBTDEF void cbt_SetHeap(cbt_Tree *tree, const char *heapToCopy);
 #ifndef _OPENMP
 #   define CBT_ATOMIC
 #   define CBT_PARALLEL_FOR
-#   define CBT_BARRIER
 #else
+#   include <omp.h>
 #   if defined(_WIN32)
 #       define CBT_ATOMIC          __pragma("omp atomic" )
-#       define CBT_PARALLEL_FOR    __pragma("omp parallel for")
-#       define CBT_BARRIER         __pragma("omp barrier")
+#       define CBT_PARALLEL_FOR    __pragma("omp parallel for schedule(dynamic, 1)")
 #   else
 #       define CBT_ATOMIC          _Pragma("omp atomic" )
-#       define CBT_PARALLEL_FOR    _Pragma("omp parallel for")
-#       define CBT_BARRIER         _Pragma("omp barrier")
+#       define CBT_PARALLEL_FOR    _Pragma("omp parallel for schedule(dynamic, 1)")
+#   endif
+#endif
+
+#if defined(_MSC_VER)
+#   include <intrin.h>
+#endif
+
+#ifndef CBT_NO_ATOMICS
+#   if defined(__cplusplus) && __cplusplus >= 202002L
+#       include <atomic>
+#       if defined(__cpp_lib_atomic_ref)
+#           define CBT__ATOMIC_REF
+#       endif
+#   elif !defined(__cplusplus) && defined(__STDC_VERSION__) \
+         && __STDC_VERSION__ >= 201112L && !defined(__STDC_NO_ATOMICS__)
+#       include <stdatomic.h>
+#       define CBT__STDATOMIC
+#   endif
+#endif
+
+#include <stdio.h> // fopen
+
+#if defined(__cplusplus)
+#   define CBT__THREAD_LOCAL thread_local
+#elif defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L
+#   define CBT__THREAD_LOCAL _Thread_local
+#elif defined(_MSC_VER)
+#   define CBT__THREAD_LOCAL __declspec(thread)
+#else
+#   define CBT__THREAD_LOCAL __thread
+#endif
+
+// windows.h must not leak its min and max macros into the including code
+#if defined(_WIN32)
+#   if !defined(WIN32_LEAN_AND_MEAN)
+#       define WIN32_LEAN_AND_MEAN
+#       define CBT__WIN32_LEAN_AND_MEAN
+#   endif
+#   if !defined(NOMINMAX)
+#       define NOMINMAX
+#       define CBT__NOMINMAX
+#   endif
+#   include <windows.h>
+#   if defined(CBT__WIN32_LEAN_AND_MEAN)
+#       undef WIN32_LEAN_AND_MEAN
+#       undef CBT__WIN32_LEAN_AND_MEAN
+#   endif
+#   if defined(CBT__NOMINMAX)
+#       undef NOMINMAX
+#       undef CBT__NOMINMAX
+#   endif
+#elif defined(__unix__) || defined(__APPLE__)
+#   include <sys/mman.h>
+#   include <sys/stat.h>
+#   include <fcntl.h>
+#   include <unistd.h>
+#   if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#       define MAP_ANONYMOUS MAP_ANON
+#   endif
+#   if !defined(MAP_NORESERVE)
+#       define MAP_NORESERVE 0
+#   endif
+#endif
+
+#if !defined(CBT_NO_THREAD_POOL) && !defined(_WIN32)
+#   include <pthread.h>
+#   include <unistd.h>
+#endif
+
+#ifdef CBT_ENABLE_STATS
+#   include <time.h>
+#   define CBT__STATS(...) __VA_ARGS__
+#else
+#   define CBT__STATS(...)
+#endif
+
+#if defined(_WIN32) || (defined(__BYTE_ORDER__) \
+                      && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+#   define CBT__LITTLE_ENDIAN
+#endif
+
+#ifndef CBT_NO_SIMD
+#   if defined(__x86_64__) || defined(_M_X64)
+#       define CBT__SIMD_X86
+#       if defined(_MSC_VER) && !defined(__clang__)
+#           include <intrin.h>
+#           define CBT__TARGET(x)
+#       else
+#           include <cpuid.h>
+#           define CBT__TARGET(x) __attribute__((target(x)))
+#       endif
+#       include <immintrin.h>
+#   elif defined(__aarch64__) || defined(_M_ARM64)
+#       define CBT__SIMD_NEON
+#       include <arm_neon.h>
 #   endif
 #endif
 
@@ -151,6 +442,15 @@ CBTDEF void cbt_SetHeap(cbt_Tree *tree, const char *heapToCopy);
  */
 static inline int64_t cbt__FindLSB(uint64_t x)
 {
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_ctzll(x);
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_ARM64))
+    unsigned long lsb;
+
+    _BitScanForward64(&lsb, x);
+
+    return lsb;
+#else
     int64_t lsb = 0;
 
     while (((x >> lsb) & 1u) == 0u) {
@@ -158,6 +458,7 @@ static inline int64_t cbt__FindLSB(uint64_t x)
     }
 
     return lsb;
+#endif
 }
 
 
@@ -167,6 +468,15 @@ static inline int64_t cbt__FindLSB(uint64_t x)
  */
 static inline int64_t cbt__FindMSB(uint64_t x)
 {
+#if defined(__GNUC__) || defined(__clang__)
+    return x > 0u ? 63 - __builtin_clzll(x) : 0;
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_ARM64))
+    unsigned long msb = 0;
+
+    _BitScanReverse64(&msb, x);
+
+    return msb;
+#else
     int64_t msb = 0;
 
     while (x > 1u) {
@@ -175,803 +485,6771 @@ static inline int64_t cbt__FindMSB(uint64_t x)
     }
 
     return msb;
+#endif
 }
 
 
 /*******************************************************************************
- * MinValue -- Returns the minimum value between two inputs
+ * PopCount -- Returns the number of bits set to one
  *
  */
-static inline uint64_t cbt__MinValue(uint64_t a, uint64_t b)
+static inline int64_t cbt__PopCount(uint64_t x)
 {
-    return a < b ? a : b;
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_popcountll(x);
+#else
+    x = x - ((x >> 1) & 0x5555555555555555ULL);
+    x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+    x = (x + (x >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+
+    return (int64_t)((x * 0x0101010101010101ULL) >> 56);
+#endif
 }
 
 
 /*******************************************************************************
- * SetBitValue -- Sets the value of a bit stored in a bitfield
+ * SelectBit -- Returns the position of the bit of a given rank set to one
+ *
+ * The bytes whose inclusive prefix count does not exceed the rank are
+ * counted in parallel, which gives the byte holding the bit, and the bit
+ * is then searched within this byte. The rank must be less than the
+ * number of bits set in x.
  *
  */
-static void
-cbt__SetBitValue(uint64_t *bitField, int64_t bitID, uint64_t bitValue)
+static inline int64_t cbt__SelectBit(uint64_t x, int64_t rank)
 {
-    const uint64_t bitMask = ~(1ULL << bitID);
+    uint64_t sums = x - ((x >> 1) & 0x5555555555555555ULL);
+    uint64_t isLess;
+    int64_t byteID;
+    uint64_t byteData;
+
+    sums = (sums & 0x3333333333333333ULL) + ((sums >> 2) & 0x3333333333333333ULL);
+    sums = ((sums + (sums >> 4)) & 0x0F0F0F0F0F0F0F0FULL) * 0x0101010101010101ULL;
+    isLess = (((uint64_t)rank * 0x0101010101010101ULL) | 0x8080808080808080ULL) - sums;
+    byteID = cbt__PopCount(isLess & 0x8080808080808080ULL);
+
+    if (byteID > 0)
+        rank-= (int64_t)((sums >> (8 * byteID - 8)) & 0xFFu);
+
+    byteData = (x >> (8 * byteID)) & 0xFFu;
+    while (rank-- > 0) {
+        byteData&= byteData - 1u;
+    }
 
-CBT_ATOMIC
-    (*bitField)&= bitMask;
-CBT_ATOMIC
-    (*bitField)|= (bitValue << bitID);
+    return 8 * byteID + cbt__FindLSB(byteData);
 }
 
 
 /*******************************************************************************
- * BitfieldInsert -- Inserts data in range [offset, offset + count - 1]
+ * MinValue -- Returns the minimum value between two inputs
  *
  */
-static inline void
-cbt__BitFieldInsert(
-    uint64_t *bitField,
-    int64_t  bitOffset,
-    int64_t  bitCount,
-    uint64_t bitData
-) {
-    CBT_ASSERT(bitOffset < 64 && bitCount <= 64 && bitOffset + bitCount <= 64);
-    uint64_t bitMask = ~(~(0xFFFFFFFFFFFFFFFFULL << bitCount) << bitOffset);
-CBT_ATOMIC
-    (*bitField)&= bitMask;
-CBT_ATOMIC
-    (*bitField)|= (bitData << bitOffset);
+static inline uint64_t cbt__MinValue(uint64_t a, uint64_t b)
+{
+    return a < b ? a : b;
 }
 
 
 /*******************************************************************************
- * BitFieldExtract -- Extracts bits [bitOffset, bitOffset + bitCount - 1] from
- * a bitfield, returning them in the least significant bits of the result.
+ * AtomicLoad -- Reads a word that other threads may modify concurrently
  *
- */
-static inline uint64_t
-cbt__BitFieldExtract(
-    const uint64_t bitField,
-    int64_t bitOffset,
-    int64_t bitCount
-) {
-    CBT_ASSERT(bitOffset < 64 && bitCount < 64 && bitOffset + bitCount <= 64);
-    uint64_t bitMask = ~(0xFFFFFFFFFFFFFFFFULL << bitCount);
-
-    return (bitField >> bitOffset) & bitMask;
-}
-
-
-/*******************************************************************************
- * Parallel Binary Tree Data-Structure
+ * The atomic operations below use relaxed ordering: the bitfield is only
+ * read back once the parallel loop that modifies it is over, and the loop
+ * synchronizes the threads. We rely on C11 or C++20 atomics when
+ * available, then on compiler intrinsics, and finally on OpenMP.
  *
  */
-struct cbt_Tree {
-    uint64_t *heap;
-};
+static inline uint64_t cbt__AtomicLoad(const uint64_t *bitField)
+{
+#if defined(CBT_NO_ATOMICS)
+    return *bitField;
+#elif defined(CBT__ATOMIC_REF)
+    return std::atomic_ref<uint64_t>(*const_cast<uint64_t *>(bitField))
+        .load(std::memory_order_relaxed);
+#elif defined(CBT__STDATOMIC)
+    return atomic_load_explicit((_Atomic uint64_t *)bitField, memory_order_relaxed);
+#elif defined(__GNUC__) || defined(__clang__)
+    return __atomic_load_n(bitField, __ATOMIC_RELAXED);
+#else
+    return *(const volatile uint64_t *)bitField;
+#endif
+}
 
 
 /*******************************************************************************
- * IsCeilNode -- Checks if a node is a ceil node, i.e., that can not split further
+ * AtomicAnd -- Atomically clears the bits of a word that are not in bitMask
  *
  */
-CBTDEF bool cbt_IsCeilNode(const cbt_Tree *tree, const cbt_Node node)
+static inline void cbt__AtomicAnd(uint64_t *bitField, uint64_t bitMask)
 {
-    return (node.depth == cbt_MaxDepth(tree));
+#if defined(CBT_NO_ATOMICS)
+    (*bitField)&= bitMask;
+#elif defined(CBT__ATOMIC_REF)
+    std::atomic_ref<uint64_t>(*bitField).fetch_and(bitMask, std::memory_order_relaxed);
+#elif defined(CBT__STDATOMIC)
+    atomic_fetch_and_explicit((_Atomic uint64_t *)bitField, bitMask, memory_order_relaxed);
+#elif defined(__GNUC__) || defined(__clang__)
+    __atomic_fetch_and(bitField, bitMask, __ATOMIC_RELAXED);
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_ARM64))
+    _InterlockedAnd64((volatile __int64 *)bitField, (__int64)bitMask);
+#else
+CBT_ATOMIC
+    (*bitField)&= bitMask;
+#endif
 }
 
 
 /*******************************************************************************
- * IsRootNode -- Checks if a node is a root node
+ * AtomicOr -- Atomically sets the bits of a word that are in bitMask
  *
  */
-CBTDEF bool cbt_IsRootNode(const cbt_Node node)
+static inline void cbt__AtomicOr(uint64_t *bitField, uint64_t bitMask)
 {
-    return (node.id == 1u);
+#if defined(CBT_NO_ATOMICS)
+    (*bitField)|= bitMask;
+#elif defined(CBT__ATOMIC_REF)
+    std::atomic_ref<uint64_t>(*bitField).fetch_or(bitMask, std::memory_order_relaxed);
+#elif defined(CBT__STDATOMIC)
+    atomic_fetch_or_explicit((_Atomic uint64_t *)bitField, bitMask, memory_order_relaxed);
+#elif defined(__GNUC__) || defined(__clang__)
+    __atomic_fetch_or(bitField, bitMask, __ATOMIC_RELAXED);
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_ARM64))
+    _InterlockedOr64((volatile __int64 *)bitField, (__int64)bitMask);
+#else
+CBT_ATOMIC
+    (*bitField)|= bitMask;
+#endif
 }
 
 
 /*******************************************************************************
- * IsNullNode -- Checks if a node is a null node
+ * AtomicXor -- Atomically flips the bits of a word that are in bitMask
  *
  */
-CBTDEF bool cbt_IsNullNode(const cbt_Node node)
+static inline void cbt__AtomicXor(uint64_t *bitField, uint64_t bitMask)
 {
-    return (node.id == 0u);
+#if defined(CBT_NO_ATOMICS)
+    (*bitField)^= bitMask;
+#elif defined(CBT__ATOMIC_REF)
+    std::atomic_ref<uint64_t>(*bitField).fetch_xor(bitMask, std::memory_order_relaxed);
+#elif defined(CBT__STDATOMIC)
+    atomic_fetch_xor_explicit((_Atomic uint64_t *)bitField, bitMask, memory_order_relaxed);
+#elif defined(__GNUC__) || defined(__clang__)
+    __atomic_fetch_xor(bitField, bitMask, __ATOMIC_RELAXED);
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_ARM64))
+    _InterlockedXor64((volatile __int64 *)bitField, (__int64)bitMask);
+#else
+CBT_ATOMIC
+    (*bitField)^= bitMask;
+#endif
 }
 
 
 /*******************************************************************************
- * CreateNode -- Constructor for the Node data structure
+ * AtomicAdd -- Atomically adds a value to a counter
  *
  */
-CBTDEF cbt_Node cbt_CreateNodeFromHeapID(uint64_t heapID)
+static inline void cbt__AtomicAdd(uint64_t *counter, uint64_t value)
 {
-    return cbt_CreateNode(heapID, cbt__FindMSB(heapID));
+#if defined(CBT_NO_ATOMICS)
+    (*counter)+= value;
+#elif defined(CBT__ATOMIC_REF)
+    std::atomic_ref<uint64_t>(*counter).fetch_add(value, std::memory_order_relaxed);
+#elif defined(CBT__STDATOMIC)
+    atomic_fetch_add_explicit((_Atomic uint64_t *)counter, value, memory_order_relaxed);
+#elif defined(__GNUC__) || defined(__clang__)
+    __atomic_fetch_add(counter, value, __ATOMIC_RELAXED);
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_ARM64))
+    _InterlockedExchangeAdd64((volatile __int64 *)counter, (__int64)value);
+#else
+CBT_ATOMIC
+    (*counter)+= value;
+#endif
 }
 
 
 /*******************************************************************************
- * CreateNode -- Constructor for the Node data structure
+ * AtomicLoad_SeqCst -- Sequentially consistent versions of the atomics
+ *
+ * These synchronize the threads that read the snapshots of a tree with the
+ * thread that publishes them (see Snapshots), so, unlike the ones above,
+ * they also order the memory accesses that surround them.
  *
  */
-CBTDEF cbt_Node cbt_CreateNode(uint64_t id, int64_t depth)
+static inline uint64_t cbt__AtomicLoad_SeqCst(const uint64_t *counter)
 {
-    cbt_Node node;
-
-    node.id = id;
-    node.depth = depth;
-
-    return node;
+#if defined(CBT_NO_ATOMICS)
+    return *counter;
+#elif defined(CBT__ATOMIC_REF)
+    return std::atomic_ref<uint64_t>(*const_cast<uint64_t *>(counter)).load();
+#elif defined(CBT__STDATOMIC)
+    return atomic_load((_Atomic uint64_t *)counter);
+#elif defined(__GNUC__) || defined(__clang__)
+    return __atomic_load_n(counter, __ATOMIC_SEQ_CST);
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_ARM64))
+    return (uint64_t)_InterlockedOr64((volatile __int64 *)counter, 0);
+#else
+    return *(const volatile uint64_t *)counter;
+#endif
 }
 
-
-/*******************************************************************************
- * ParentNode -- Computes the parent of the input node
- *
- */
-CBTDEF cbt_Node cbt_ParentNode_Fast(const cbt_Node node)
+static inline void cbt__AtomicStore_SeqCst(uint64_t *counter, uint64_t value)
 {
-    return cbt_CreateNode(node.id >> 1, node.depth - 1);
+#if defined(CBT_NO_ATOMICS)
+    (*counter) = value;
+#elif defined(CBT__ATOMIC_REF)
+    std::atomic_ref<uint64_t>(*counter).store(value);
+#elif defined(CBT__STDATOMIC)
+    atomic_store((_Atomic uint64_t *)counter, value);
+#elif defined(__GNUC__) || defined(__clang__)
+    __atomic_store_n(counter, value, __ATOMIC_SEQ_CST);
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_ARM64))
+    _InterlockedExchange64((volatile __int64 *)counter, (__int64)value);
+#else
+    (*(volatile uint64_t *)counter) = value;
+#endif
 }
 
-CBTDEF cbt_Node cbt_ParentNode(const cbt_Node node)
+static inline void cbt__AtomicAdd_SeqCst(uint64_t *counter, uint64_t value)
 {
-     return cbt_IsNullNode(node) ? node : cbt_ParentNode_Fast(node);
+#if defined(CBT_NO_ATOMICS)
+    (*counter)+= value;
+#elif defined(CBT__ATOMIC_REF)
+    std::atomic_ref<uint64_t>(*counter).fetch_add(value);
+#elif defined(CBT__STDATOMIC)
+    atomic_fetch_add((_Atomic uint64_t *)counter, value);
+#elif defined(__GNUC__) || defined(__clang__)
+    __atomic_fetch_add(counter, value, __ATOMIC_SEQ_CST);
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_ARM64))
+    _InterlockedExchangeAdd64((volatile __int64 *)counter, (__int64)value);
+#else
+CBT_ATOMIC
+    (*counter)+= value;
+#endif
 }
 
 
 /*******************************************************************************
- * CeilNode -- Returns the associated ceil node, i.e., the deepest possible leaf
+ * SetBitValue -- Sets the value of a bit stored in a bitfield
+ *
+ * Setting a bit is a single atomic or, and clearing it a single atomic and,
+ * so concurrent readers never observe an intermediate value.
  *
  */
-static cbt_Node cbt__CeilNode_Fast(const cbt_Tree *tree, const cbt_Node node)
+static void
+cbt__SetBitValue(uint64_t *bitField, int64_t bitID, uint64_t bitValue)
 {
-    int64_t maxDepth = cbt_MaxDepth(tree);
-
-    return cbt_CreateNode(node.id << (maxDepth - node.depth), maxDepth);
-}
+    CBT_ASSERT(bitValue <= 1u && "bitValue must be 0 or 1");
 
-static cbt_Node cbt__CeilNode(const cbt_Tree *tree, const cbt_Node node)
-{
-    return cbt_IsNullNode(node) ? node : cbt__CeilNode_Fast(tree, node);
+    if (bitValue != 0u)
+        cbt__AtomicOr(bitField, 1ULL << bitID);
+    else
+        cbt__AtomicAnd(bitField, ~(1ULL << bitID));
 }
 
 
 /*******************************************************************************
- * SiblingNode -- Computes the sibling of the input node
+ * BitfieldInsert -- Inserts data in range [offset, offset + count - 1]
+ *
+ * A range of bits is only ever written by a single thread at a time, while
+ * other threads may write the rest of the word. The bits of the range thus
+ * can not change between the load and the xor, which flips exactly the
+ * bits that differ from bitData in a single atomic operation. Ranges that
+ * already hold bitData are not written at all.
  *
  */
-CBTDEF cbt_Node cbt_SiblingNode_Fast(const cbt_Node node)
-{
-    return cbt_CreateNode(node.id ^ 1u, node.depth);
-}
+static inline void
+cbt__BitFieldInsert(
+    uint64_t *bitField,
+    int64_t  bitOffset,
+    int64_t  bitCount,
+    uint64_t bitData
+) {
+    CBT_ASSERT(bitOffset < 64 && bitCount < 64 && bitOffset + bitCount <= 64);
+    uint64_t bitMask = ~(0xFFFFFFFFFFFFFFFFULL << bitCount) << bitOffset;
+    uint64_t bitDelta = (cbt__AtomicLoad(bitField) ^ (bitData << bitOffset)) & bitMask;
 
-CBTDEF cbt_Node cbt_SiblingNode(const cbt_Node node)
-{
-    return cbt_IsNullNode(node) ? node : cbt_SiblingNode_Fast(node);
+    if (bitDelta != 0u)
+        cbt__AtomicXor(bitField, bitDelta);
 }
 
 
 /*******************************************************************************
- * RightSiblingNode -- Computes the right sibling of the input node
+ * BitFieldExtract -- Extracts bits [bitOffset, bitOffset + bitCount - 1] from
+ * a bitfield, returning them in the least significant bits of the result.
  *
  */
-CBTDEF cbt_Node cbt_RightSiblingNode_Fast(const cbt_Node node)
-{
-    return cbt_CreateNode(node.id | 1u, node.depth);
-}
+static inline uint64_t
+cbt__BitFieldExtract(
+    const uint64_t bitField,
+    int64_t bitOffset,
+    int64_t bitCount
+) {
+    CBT_ASSERT(bitOffset < 64 && bitCount < 64 && bitOffset + bitCount <= 64);
+    uint64_t bitMask = ~(0xFFFFFFFFFFFFFFFFULL << bitCount);
 
-CBTDEF cbt_Node cbt_RightSiblingNode(const cbt_Node node)
-{
-    return cbt_IsNullNode(node) ? node : cbt_RightSiblingNode_Fast(node);
+    return (bitField >> bitOffset) & bitMask;
 }
 
 
 /*******************************************************************************
- * LeftSiblingNode -- Computes the left sibling of the input node
+ * Parallel Binary Tree Data-Structure
+ *
+ * The location of the data of each level of the heap depends on the layout
+ * of the tree and is tabulated in levelBitOffsets, levelBitSizes,
+ * levelBlockShifts and levelBlockBitSizes.
+ * Next to the heap, the tree keeps a hierarchical bitmap that flags the
+ * 64-bit bitfield words modified since the last sum reduction. Level 0
+ * stores one bit per bitfield word and each subsequent level stores one bit
+ * per word of the level below, so that dirty words can be gathered in time
+ * proportional to their number.
  *
  */
-CBTDEF cbt_Node cbt_LeftSiblingNode_Fast(const cbt_Node node)
-{
-    return cbt_CreateNode(node.id & (~1u), node.depth);
-}
+#define CBT__DIRTY_LEVEL_COUNT_MAX 10
+#define CBT__LEVEL_COUNT_MAX 59
 
-CBTDEF cbt_Node cbt_LeftSiblingNode(const cbt_Node node)
-{
-    return cbt_IsNullNode(node) ? node : cbt_LeftSiblingNode_Fast(node);
-}
+typedef struct {
+    uint64_t bitID;    // bitfield bit of the right node that is written
+    uint32_t depth;    // depth of the right node
+    uint32_t bitValue; // 1 for splits, 0 for merges
+} cbt__Intent;
 
+typedef struct {
+    cbt__Intent *intents;
+    int64_t intentCount;
+    int64_t intentCapacity;
+} cbt__IntentBuffer;
 
-/*******************************************************************************
- * RightChildNode -- Computes the right child of the input node
- *
- */
-CBTDEF cbt_Node cbt_RightChildNode_Fast(const cbt_Node node)
-{
-    return cbt_CreateNode(node.id << 1u | 1u, node.depth + 1);
-}
+typedef struct {
+    uint64_t heapID;   // leaf that is split, or left leaf of the merged pair
+    uint32_t key;      // ordered priority key, the largest keys are selected
+    uint16_t depth;    // depth of the leaf
+    uint16_t isMerge;  // 1 for merges, 0 for splits
+} cbt__Candidate;
 
-CBTDEF cbt_Node cbt_RightChildNode(const cbt_Node node)
-{
-    return cbt_IsNullNode(node) ? node : cbt_RightChildNode_Fast(node);
-}
+typedef struct {
+    cbt__Candidate *candidates;
+    int64_t candidateCount;
+    int64_t candidateCapacity;
+    int64_t tieCounts[2]; // candidates whose key is the selection threshold
+} cbt__CandidateBuffer;
+
+typedef struct {
+    int64_t itemCount;  // dirty words, or all the bitfield words if isFull
+    int64_t cursor;     // first item that remains to be reduced
+    int64_t nodeCount;  // leaves prior to the update that began the job, or -1
+    bool isFull;        // whether the items are all the bitfield words
+    bool isPending;     // whether the sums above the bitfield are stale
+} cbt__ReductionJob;
+
+typedef struct cbt__MappedFile cbt__MappedFile;
+typedef struct cbt__Snapshots cbt__Snapshots;
+typedef struct cbt__RankIndex cbt__RankIndex;
+typedef struct cbt__Instrumentation cbt__Instrumentation;
+
+struct cbt_Tree {
+    uint64_t *heap;
+    cbt_Layout layout;
+    int64_t levelBitOffsets[CBT__LEVEL_COUNT_MAX];
+    int64_t levelBitSizes[CBT__LEVEL_COUNT_MAX];
+    int64_t levelBlockShifts[CBT__LEVEL_COUNT_MAX];
+    int64_t levelBlockBitSizes[CBT__LEVEL_COUNT_MAX];
+    uint64_t *dirtyBits;
+    uint64_t *dirtyBufferIDs;
+    int64_t dirtyBufferIDCapacity;
+    int64_t dirtyLevelOffsets[CBT__DIRTY_LEVEL_COUNT_MAX + 1];
+    int64_t dirtyLevelCount;
+    cbt_Executor executor;
+    cbt__IntentBuffer *intentBuffers;
+    int64_t intentBufferCount;
+    cbt__IntentBuffer intents;
+    cbt__IntentBuffer splits;
+    cbt__CandidateBuffer *candidateBuffers;
+    int64_t candidateBufferCount;
+    uint64_t *chunkIDs;
+    int64_t chunkIDCapacity;
+    cbt_Allocator allocator;
+    cbt__MappedFile *file;
+    cbt__Snapshots *snapshots;
+    int64_t snapshotEpoch;
+    cbt__RankIndex *rankIndex;
+    cbt__ReductionJob reduction;
+    bool isUpdating;    // whether the updater may be writing the bitfield
+    bool isReductionDeferred;
+    bool isHeapOwned;
+    bool isReadOnly;
+    bool isSparse;
+#ifdef CBT_ENABLE_STATS
+    cbt__Instrumentation *instrumentation;
+#endif
+};
 
 
+#ifdef CBT_ENABLE_STATS
 /*******************************************************************************
- * LeftChildNode -- Computes the left child of the input node
+ * Instrumentation -- Operation counters and timings of a tree
+ *
+ * The counters are updated atomically, since splits and merges are counted
+ * from the threads running the update callbacks. The instrumentation is
+ * allocated separately so that the routines taking a const tree, e.g.,
+ * cbt_DecodeNode, may record their statistics as well.
  *
  */
-CBTDEF cbt_Node cbt_LeftChildNode_Fast(const cbt_Node node)
-{
-    return cbt_CreateNode(node.id << 1u, node.depth + 1);
-}
+struct cbt__Instrumentation {
+    cbt_Stats stats;
+    cbt_TraceCallback traceCallback;
+    void *traceUserData;
+};
+#endif
 
-CBTDEF cbt_Node cbt_LeftChildNode(const cbt_Node node)
+static void cbt__ClearStats(cbt_Stats *stats)
 {
-    return cbt_IsNullNode(node) ? node : cbt_LeftChildNode_Fast(node);
+    int64_t *counters = (int64_t *)stats;
+
+    for (size_t i = 0; i < sizeof(cbt_Stats) / sizeof(int64_t); ++i) {
+        counters[i] = 0;
+    }
 }
 
+#ifdef CBT_ENABLE_STATS
 
-/*******************************************************************************
- * HeapByteSize -- Computes the number of Bytes to allocate for the bitfield
- *
- * For a tree of max depth D, the number of Bytes is 2^(D-1).
- * Note that 2 bits are "wasted" in the sense that they only serve
- * to round the required number of bytes to a power of two.
- *
- */
-static int64_t cbt__HeapByteSize(uint64_t treeMaxDepth)
+#define CBT__STATS_ADD(tree, counter, value)                                   \
+    cbt__AtomicAdd((uint64_t *)&(tree)->instrumentation->stats.counter,        \
+                   (uint64_t)(value))
+
+// returns a monotonic time in nanoseconds, or the processor time as a last resort
+static int64_t cbt__Time(void)
 {
-    return 1LL << (treeMaxDepth - 1);
-}
+#if defined(_WIN32)
+    LARGE_INTEGER counter, frequency;
 
+    QueryPerformanceCounter(&counter);
+    QueryPerformanceFrequency(&frequency);
 
-/*******************************************************************************
- * HeapUint64Size -- Computes the number of uints to allocate for the bitfield
- *
- */
-static inline int64_t cbt__HeapUint64Size(int64_t treeMaxDepth)
-{
-    return cbt__HeapByteSize(treeMaxDepth) >> 3;
-}
+    return (int64_t)((double)counter.QuadPart * 1e9 / (double)frequency.QuadPart);
+#elif defined(CLOCK_MONOTONIC)
+    struct timespec time;
 
+    clock_gettime(CLOCK_MONOTONIC, &time);
 
-/*******************************************************************************
- * NodeBitID -- Returns the bit index that stores data associated with a given node
- *
- * For a tree of max depth D and given an index in [0, 2^(D+1) - 1], this
- * functions is used to emulate the behaviour of a lookup in an array, i.e.,
- * uint[nodeID]. It provides the first bit in memory that stores
- * information associated with the element of index nodeID.
- *
- * For data located at level d, the bit offset is 2^d x (3 - d + D)
- * We then offset this quantity by the index by (nodeID - 2^d) x (D + 1 - d)
- * Note that the null index (nodeID = 0) is also supported.
- *
- */
-static inline int64_t cbt__NodeBitID(const cbt_Tree *tree, const cbt_Node node)
-{
-    int64_t tmp1 = 2LL << node.depth;
-    int64_t tmp2 = 1LL + cbt_MaxDepth(tree) - node.depth;
+    return (int64_t)time.tv_sec * 1000000000LL + (int64_t)time.tv_nsec;
+#elif defined(TIME_UTC)
+    struct timespec time;
+
+    timespec_get(&time, TIME_UTC);
 
-    return tmp1 + node.id * tmp2;
+    return (int64_t)time.tv_sec * 1000000000LL + (int64_t)time.tv_nsec;
+#else
+    return (int64_t)((double)clock() * 1e9 / (double)CLOCKS_PER_SEC);
+#endif
 }
 
+// adds the time elapsed since beginTime to a timer and forwards it as an event
+static void
+cbt__EndTimer(
+    const cbt_Tree *tree,
+    int64_t *timer,
+    const char *name,
+    int64_t depth,
+    int64_t beginTime
+) {
+    const cbt__Instrumentation *instrumentation = tree->instrumentation;
+    int64_t endTime = cbt__Time();
 
-/*******************************************************************************
- * NodeBitID_BitField -- Computes the bitfield bit location associated to a node
- *
- * Here, the node is converted into a final node and its bit offset is
- * returned, which is finalNodeID + 2^{D + 1}
- */
-static int64_t
-cbt__NodeBitID_BitField(const cbt_Tree *tree, const cbt_Node node)
-{
-    return cbt__NodeBitID(tree, cbt__CeilNode(tree, node));
-}
+    cbt__AtomicAdd((uint64_t *)timer, (uint64_t)(endTime - beginTime));
 
+    if (instrumentation->traceCallback != NULL && name != NULL) {
+        cbt_TraceEvent event;
 
-/*******************************************************************************
- * NodeBitSize -- Returns the number of bits storing the input node value
- *
- */
-static inline int64_t
-cbt__NodeBitSize(const cbt_Tree *tree, const cbt_Node node)
-{
-    return cbt_MaxDepth(tree) - node.depth + 1;
+        event.name = name;
+        event.depth = depth;
+        event.beginNanoseconds = beginTime;
+        event.endNanoseconds = endTime;
+        (*instrumentation->traceCallback)(tree, &event, instrumentation->traceUserData);
+    }
 }
 
+// passes that compute several levels are recorded under their deepest level
+static void
+cbt__EndLevelTimer(const cbt_Tree *tree, int64_t depth, int64_t beginTime)
+{
+    int64_t *timer = &tree->instrumentation->stats.reductionLevelNanoseconds[depth];
 
-/*******************************************************************************
- * HeapArgs
- *
- * The CBT heap data structure uses an array of 64-bit words to store its data.
- * Whenever we need to access a certain bit range, we need to query two such
- * words (because sometimes the requested bit range overlaps two 64-bit words).
- * The HeapArg data structure provides arguments for reading from and/or
- * writing to the two 64-bit words that bound the queries range.
- *
- */
-typedef struct {
-    uint64_t *bitFieldLSB, *bitFieldMSB;
-    int64_t bitOffsetLSB;
-    int64_t bitCountLSB, bitCountMSB;
-} cbt__HeapArgs;
+    cbt__EndTimer(tree, timer, "cbt_ReductionLevel", depth, beginTime);
+}
 
-cbt__HeapArgs
-cbt__CreateHeapArgs(const cbt_Tree *tree, const cbt_Node node, int64_t bitCount)
+static void cbt__EndReductionTimer(const cbt_Tree *tree, int64_t beginTime)
 {
-    int64_t alignedBitOffset = cbt__NodeBitID(tree, node);
-    int64_t maxBufferIndex = cbt__HeapUint64Size(cbt_MaxDepth(tree)) - 1;
-    int64_t bufferIndexLSB = (alignedBitOffset >> 6);
-    int64_t bufferIndexMSB = cbt__MinValue(bufferIndexLSB + 1, maxBufferIndex);
-    cbt__HeapArgs args;
-
-    args.bitOffsetLSB = alignedBitOffset & 63;
-    args.bitCountLSB = cbt__MinValue(64 - args.bitOffsetLSB, bitCount);
-    args.bitCountMSB = bitCount - args.bitCountLSB;
-    args.bitFieldLSB = &tree->heap[bufferIndexLSB];
-    args.bitFieldMSB = &tree->heap[bufferIndexMSB];
+    int64_t *timer = &tree->instrumentation->stats.reductionNanoseconds;
 
-    return args;
+    cbt__EndTimer(tree, timer, "cbt_Reduction", -1, beginTime);
 }
 
+static void cbt__EndCallbackTimer(const cbt_Tree *tree, int64_t beginTime)
+{
+    int64_t *timer = &tree->instrumentation->stats.callbackNanoseconds;
 
-/*******************************************************************************
- * HeapWrite -- Sets bitCount bits located at nodeID to bitData
- *
- * Note that this procedure writes to at most two uint64 elements.
- * Two elements are relevant whenever the specified interval overflows 64-bit
- * words.
- *
- */
+    cbt__EndTimer(tree, timer, "cbt_UpdateCallbacks", -1, beginTime);
+}
+
+// nodeCount is the number of leaves prior to the update
 static void
-cbt__HeapWriteExplicit(
+cbt__EndUpdateTimer(
     cbt_Tree *tree,
-    const cbt_Node node,
-    int64_t bitCount,
-    uint64_t bitData
+    const char *name,
+    int64_t nodeCount,
+    int64_t beginTime
 ) {
-    cbt__HeapArgs args = cbt__CreateHeapArgs(tree, node, bitCount);
+    int64_t *timer = &tree->instrumentation->stats.updateNanoseconds;
 
-    cbt__BitFieldInsert(args.bitFieldLSB,
-                        args.bitOffsetLSB,
-                        args.bitCountLSB,
-                        bitData);
-    cbt__BitFieldInsert(args.bitFieldMSB,
-                        0u,
-                        args.bitCountMSB,
-                        bitData >> args.bitCountLSB);
+    CBT__STATS_ADD(tree, updateCount, 1);
+    cbt__EndTimer(tree, timer, name, -1, beginTime);
+
+    // the leaves are counted once the deferred reduction completes
+    if (tree->reduction.isPending)
+        tree->reduction.nodeCount = nodeCount;
+    else
+        CBT__STATS_ADD(tree, nodeCountDelta, cbt_NodeCount(tree) - nodeCount);
 }
 
-static void
-cbt__HeapWrite(cbt_Tree *tree, const cbt_Node node, uint64_t bitData)
+// counts the leaves added by the update that began the reduction
+static void cbt__EndDeferredReduction(const cbt_Tree *tree)
 {
-    cbt__HeapWriteExplicit(tree, node, cbt__NodeBitSize(tree, node), bitData);
+    int64_t nodeCount = tree->reduction.nodeCount;
+
+    if (nodeCount >= 0)
+        CBT__STATS_ADD(tree, nodeCountDelta, cbt_NodeCount(tree) - nodeCount);
 }
+#endif
 
 
 /*******************************************************************************
- * HeapRead -- Returns bitCount bits located at nodeID
+ * ParallelFor_Default -- Default executor, based on OpenMP when available
  *
- * Note that this procedure reads from two uint64 elements.
- * This is because the data is not necessarily aligned with 64-bit
- * words.
+ * Each loop iteration processes one grain, so that OpenMP balances grains
+ * rather than items.
  *
  */
-static uint64_t
-cbt__HeapReadExplicit(
-    const cbt_Tree *tree,
-    const cbt_Node node,
-    int64_t bitCount
+static void
+cbt__ParallelFor_Default(
+    int64_t count,
+    int64_t grainSize,
+    cbt_ParallelForCallback callback,
+    void *callbackData,
+    void *executorData
 ) {
-    cbt__HeapArgs args = cbt__CreateHeapArgs(tree, node, bitCount);
-    uint64_t lsb = cbt__BitFieldExtract(*args.bitFieldLSB,
-                                        args.bitOffsetLSB,
-                                        args.bitCountLSB);
-    uint64_t msb = cbt__BitFieldExtract(*args.bitFieldMSB,
-                                        0u,
-                                        args.bitCountMSB);
+    int64_t grainCount = (count + grainSize - 1) / grainSize;
 
-    return (lsb | (msb << args.bitCountLSB));
+    (void)executorData;
+
+CBT_PARALLEL_FOR
+    for (int64_t grainID = 0; grainID < grainCount; ++grainID) {
+        int64_t begin = grainID * grainSize;
+        int64_t end = begin + grainSize < count ? begin + grainSize : count;
+
+        callback(begin, end, callbackData);
+    }
 }
 
-CBTDEF uint64_t cbt_HeapRead(const cbt_Tree *tree, const cbt_Node node)
+static int64_t cbt__DefaultThreadCount(void)
 {
-    return cbt__HeapReadExplicit(tree, node, cbt__NodeBitSize(tree, node));
+#ifdef _OPENMP
+    return (int64_t)omp_get_max_threads();
+#else
+    return 1;
+#endif
 }
 
 
 /*******************************************************************************
- * HeapWrite_BitField -- Sets the bit associated to a leaf node to bitValue
+ * ParallelFor_Serial -- Executor that runs the loops on the calling thread
  *
- * This is a dedicated routine to write directly to the bitfield.
+ * This is the executor of the trees of a forest, which are processed in
+ * parallel with each other rather than individually.
  *
  */
 static void
-cbt__HeapWrite_BitField(
-    cbt_Tree *tree,
-    const cbt_Node node,
-    const uint64_t bitValue
+cbt__ParallelFor_Serial(
+    int64_t count,
+    int64_t grainSize,
+    cbt_ParallelForCallback callback,
+    void *callbackData,
+    void *executorData
 ) {
-    int64_t bitID = cbt__NodeBitID_BitField(tree, node);
+    (void)executorData;
 
-    cbt__SetBitValue(&tree->heap[bitID >> 6], bitID & 63, bitValue);
+    for (int64_t begin = 0; begin < count; begin+= grainSize) {
+        int64_t end = begin + grainSize < count ? begin + grainSize : count;
+
+        callback(begin, end, callbackData);
+    }
 }
 
 
 /*******************************************************************************
- * ClearBitField -- Clears the bitfield
+ * ParallelFor -- Runs a loop over [0, count) with the executor of the tree
+ *
+ * Loops that fit in a single grain are run on the calling thread.
  *
  */
-static void cbt__ClearBitfield(cbt_Tree *tree)
-{
-    int64_t maxDepth = cbt_MaxDepth(tree);
-    int64_t bufferMinID = 1LL << (maxDepth - 5);
-    int64_t bufferMaxID = cbt__HeapUint64Size(maxDepth);
-
-CBT_PARALLEL_FOR
-    for (int bufferID = bufferMinID; bufferID < bufferMaxID; ++bufferID) {
-        tree->heap[bufferID] = 0;
+static void
+cbt__ExecuteParallelFor(
+    const cbt_Executor *executor,
+    int64_t count,
+    int64_t grainSize,
+    cbt_ParallelForCallback callback,
+    void *callbackData
+) {
+    if (count <= 0) {
+        return;
+    } else if (count <= grainSize) {
+        callback(0, count, callbackData);
+    } else {
+        executor->parallelFor(count,
+                              grainSize,
+                              callback,
+                              callbackData,
+                              executor->executorData);
     }
-CBT_BARRIER
+}
+
+static void
+cbt__ParallelFor(
+    const cbt_Tree *tree,
+    int64_t count,
+    int64_t grainSize,
+    cbt_ParallelForCallback callback,
+    void *callbackData
+) {
+    cbt__ExecuteParallelFor(&tree->executor,
+                            count,
+                            grainSize,
+                            callback,
+                            callbackData);
 }
 
 
 /*******************************************************************************
- * IsLeafNode -- Checks if a node is a leaf node, i.e., that has no descendants
+ * IsCeilNode -- Checks if a node is a ceil node, i.e., that can not split further
  *
  */
-CBTDEF bool cbt_IsLeafNode(const cbt_Tree *tree, const cbt_Node node)
+CBTDEF bool cbt_IsCeilNode(const cbt_Tree *tree, const cbt_Node node)
 {
-    return (cbt_HeapRead(tree, node) == 1u);
+    return (node.depth == cbt_MaxDepth(tree));
 }
 
 
 /*******************************************************************************
- * GetHeapMemory -- Returns a read-only pointer to the heap memory
+ * IsRootNode -- Checks if a node is a root node
  *
  */
-CBTDEF const char *cbt_GetHeap(const cbt_Tree *tree)
+CBTDEF bool cbt_IsRootNode(const cbt_Node node)
 {
-    return (const char *)tree->heap;
+    return (node.id == 1u);
 }
 
 
 /*******************************************************************************
- * SetHeapMemory -- Sets the heap memory from a read-only buffer
+ * IsNullNode -- Checks if a node is a null node
  *
  */
-CBTDEF void cbt_SetHeap(cbt_Tree *tree, const char *buffer)
+CBTDEF bool cbt_IsNullNode(const cbt_Node node)
 {
-    CBT_MEMCPY(tree->heap, buffer, cbt_HeapByteSize(tree));
+    return (node.id == 0u);
 }
 
 
 /*******************************************************************************
- * HeapByteSize -- Returns the amount of bytes consumed by the CBT heap
+ * CreateNode -- Constructor for the Node data structure
  *
  */
-CBTDEF int64_t cbt_HeapByteSize(const cbt_Tree *tree)
+CBTDEF cbt_Node cbt_CreateNodeFromHeapID(uint64_t heapID)
 {
-    return cbt__HeapByteSize(cbt_MaxDepth(tree));
+    return cbt_CreateNode(heapID, cbt__FindMSB(heapID));
 }
 
 
 /*******************************************************************************
- * ComputeSumReduction -- Sums the 2 elements below the current slot
+ * CreateNode -- Constructor for the Node data structure
  *
  */
-static void cbt__ComputeSumReduction(cbt_Tree *tree)
+CBTDEF cbt_Node cbt_CreateNode(uint64_t id, int64_t depth)
 {
-    int64_t depth = cbt_MaxDepth(tree);
-    uint64_t minNodeID = (1ULL << depth);
-    uint64_t maxNodeID = (2ULL << depth);
-
-    // prepass: processes deepest levels in parallel
-CBT_PARALLEL_FOR
-    for (uint64_t nodeID = minNodeID; nodeID < maxNodeID; nodeID+= 64u) {
-        cbt_Node heapNode = cbt_CreateNode(nodeID, depth);
-        int64_t alignedBitOffset = cbt__NodeBitID(tree, heapNode);
-        uint64_t bitField = tree->heap[alignedBitOffset >> 6];
-        uint64_t bitData = 0u;
-
-        // 2-bits
-        bitField = (bitField & 0x5555555555555555ULL)
-                 + ((bitField >>  1) & 0x5555555555555555ULL);
-        bitData = bitField;
-        tree->heap[(alignedBitOffset - minNodeID) >> 6] = bitData;
-
-        // 3-bits
-        bitField = (bitField & 0x3333333333333333ULL)
-                 + ((bitField >>  2) & 0x3333333333333333ULL);
-        bitData = ((bitField >>  0) & (7ULL <<  0))
-                | ((bitField >>  1) & (7ULL <<  3))
-                | ((bitField >>  2) & (7ULL <<  6))
-                | ((bitField >>  3) & (7ULL <<  9))
-                | ((bitField >>  4) & (7ULL << 12))
-                | ((bitField >>  5) & (7ULL << 15))
-                | ((bitField >>  6) & (7ULL << 18))
-                | ((bitField >>  7) & (7ULL << 21))
-                | ((bitField >>  8) & (7ULL << 24))
-                | ((bitField >>  9) & (7ULL << 27))
-                | ((bitField >> 10) & (7ULL << 30))
-                | ((bitField >> 11) & (7ULL << 33))
-                | ((bitField >> 12) & (7ULL << 36))
-                | ((bitField >> 13) & (7ULL << 39))
-                | ((bitField >> 14) & (7ULL << 42))
-                | ((bitField >> 15) & (7ULL << 45));
-        cbt__HeapWriteExplicit(tree, cbt_CreateNode(nodeID >> 2, depth - 2), 48ULL, bitData);
-
-        // 4-bits
-        bitField = (bitField & 0x0F0F0F0F0F0F0F0FULL)
-                 + ((bitField >>  4) & 0x0F0F0F0F0F0F0F0FULL);
-        bitData = ((bitField >>  0) & (15ULL <<  0))
-                | ((bitField >>  4) & (15ULL <<  4))
-                | ((bitField >>  8) & (15ULL <<  8))
-                | ((bitField >> 12) & (15ULL << 12))
-                | ((bitField >> 16) & (15ULL << 16))
-                | ((bitField >> 20) & (15ULL << 20))
-                | ((bitField >> 24) & (15ULL << 24))
-                | ((bitField >> 28) & (15ULL << 28));
-        cbt__HeapWriteExplicit(tree, cbt_CreateNode(nodeID >> 3, depth - 3), 32ULL, bitData);
-
-        // 5-bits
-        bitField = (bitField & 0x00FF00FF00FF00FFULL)
-                 + ((bitField >>  8) & 0x00FF00FF00FF00FFULL);
-        bitData = ((bitField >>  0) & (31ULL <<  0))
-                | ((bitField >> 11) & (31ULL <<  5))
-                | ((bitField >> 22) & (31ULL << 10))
-                | ((bitField >> 33) & (31ULL << 15));
-        cbt__HeapWriteExplicit(tree, cbt_CreateNode(nodeID >> 4, depth - 4), 20ULL, bitData);
-
-        // 6-bits
-        bitField = (bitField & 0x0000FFFF0000FFFFULL)
-                 + ((bitField >> 16) & 0x0000FFFF0000FFFFULL);
-        bitData = ((bitField >>  0) & (63ULL << 0))
-                | ((bitField >> 26) & (63ULL << 6));
-        cbt__HeapWriteExplicit(tree, cbt_CreateNode(nodeID >> 5, depth - 5), 12ULL, bitData);
-
-        // 7-bits
-        bitField = (bitField & 0x00000000FFFFFFFFULL)
-                 + ((bitField >> 32) & 0x00000000FFFFFFFFULL);
-        bitData = bitField;
-        cbt__HeapWriteExplicit(tree, cbt_CreateNode(nodeID >> 6, depth - 6),  7ULL, bitData);
-    }
-CBT_BARRIER
-    depth-= 6;
-
-    // iterate over elements atomically
-    while (--depth >= 0) {
-        uint64_t minNodeID = 1ULL << depth;
-        uint64_t maxNodeID = 2ULL << depth;
+    cbt_Node node;
 
-CBT_PARALLEL_FOR
-        for (uint64_t j = minNodeID; j < maxNodeID; ++j) {
-            uint64_t x0 = cbt_HeapRead(tree, cbt_CreateNode(j << 1    , depth + 1));
-            uint64_t x1 = cbt_HeapRead(tree, cbt_CreateNode(j << 1 | 1, depth + 1));
+    node.id = id;
+    node.depth = depth;
 
-            cbt__HeapWrite(tree, cbt_CreateNode(j, depth), x0 + x1);
-        }
-CBT_BARRIER
-    }
+    return node;
 }
 
 
 /*******************************************************************************
- * Buffer Ctor
+ * ParentNode -- Computes the parent of the input node
  *
  */
-CBTDEF cbt_Tree *cbt_CreateAtDepth(int64_t maxDepth, int64_t depth)
+CBTDEF cbt_Node cbt_ParentNode_Fast(const cbt_Node node)
 {
-    CBT_ASSERT(maxDepth >=  5 && "maxDepth must be at least 5");
-    CBT_ASSERT(maxDepth <= 58 && "maxDepth must be at most 58");
-    cbt_Tree *tree = (cbt_Tree *)CBT_MALLOC(sizeof(*tree));
-
-    tree->heap = (uint64_t *)CBT_MALLOC(cbt__HeapByteSize(maxDepth));
-    tree->heap[0] = 1ULL << (maxDepth); // store max Depth
-
-    cbt_ResetToDepth(tree, depth);
-
-    return tree;
+    return cbt_CreateNode(node.id >> 1, node.depth - 1);
 }
 
-CBTDEF cbt_Tree *cbt_Create(int64_t maxDepth)
+CBTDEF cbt_Node cbt_ParentNode(const cbt_Node node)
 {
-    return cbt_CreateAtDepth(maxDepth, 0);
+     return cbt_IsNullNode(node) ? node : cbt_ParentNode_Fast(node);
 }
 
 
 /*******************************************************************************
- * Buffer Dtor
+ * CeilNode -- Returns the associated ceil node, i.e., the deepest possible leaf
  *
  */
-CBTDEF void cbt_Release(cbt_Tree *tree)
+static cbt_Node cbt__CeilNode_Fast(const cbt_Tree *tree, const cbt_Node node)
 {
-    CBT_FREE(tree->heap);
-    CBT_FREE(tree);
-}
+    int64_t maxDepth = cbt_MaxDepth(tree);
 
+    return cbt_CreateNode(node.id << (maxDepth - node.depth), maxDepth);
+}
 
-/*******************************************************************************
- * ResetToDepth -- Initializes a CBT to its a specific subdivision level
- *
- */
-CBTDEF void cbt_ResetToDepth(cbt_Tree *tree, int64_t depth)
+static cbt_Node cbt__CeilNode(const cbt_Tree *tree, const cbt_Node node)
 {
-    CBT_ASSERT(depth >= 0 && "depth must be at least equal to 0");
-    CBT_ASSERT(depth <= cbt_MaxDepth(tree) && "depth must be at most equal to maxDepth");
-    uint64_t minNodeID = 1ULL << depth;
-    uint64_t maxNodeID = 2ULL << depth;
-
-    cbt__ClearBitfield(tree);
-
-CBT_PARALLEL_FOR
-    for (uint64_t nodeID = minNodeID; nodeID < maxNodeID; ++nodeID) {
-        cbt_Node node = cbt_CreateNode(nodeID, depth);
-
-        cbt__HeapWrite_BitField(tree, node, 1u);
-    }
-CBT_BARRIER
-
-    cbt__ComputeSumReduction(tree);
+    return cbt_IsNullNode(node) ? node : cbt__CeilNode_Fast(tree, node);
 }
 
 
 /*******************************************************************************
- * ResetToCeil -- Initializes a CBT to its maximum subdivision level
+ * SiblingNode -- Computes the sibling of the input node
  *
  */
-CBTDEF void cbt_ResetToCeil(cbt_Tree *tree)
+CBTDEF cbt_Node cbt_SiblingNode_Fast(const cbt_Node node)
 {
-    cbt_ResetToDepth(tree, cbt_MaxDepth(tree));
+    return cbt_CreateNode(node.id ^ 1u, node.depth);
 }
 
-
-/*******************************************************************************
- * ResetToRoot -- Initializes a CBT to its minimum subdivision level
- *
- */
-CBTDEF void cbt_ResetToRoot(cbt_Tree *tree)
+CBTDEF cbt_Node cbt_SiblingNode(const cbt_Node node)
 {
-    cbt_ResetToDepth(tree, 0);
+    return cbt_IsNullNode(node) ? node : cbt_SiblingNode_Fast(node);
 }
 
 
 /*******************************************************************************
- * Split -- Subdivides a node in two
- *
- * The _Fast version does not check if the node can actually split, so
- * use it wisely, i.e., when you're absolutely sure the node depth is
- * less than maxDepth.
+ * RightSiblingNode -- Computes the right sibling of the input node
  *
  */
-CBTDEF void cbt_SplitNode_Fast(cbt_Tree *tree, const cbt_Node node)
+CBTDEF cbt_Node cbt_RightSiblingNode_Fast(const cbt_Node node)
 {
-    cbt__HeapWrite_BitField(tree, cbt_RightChildNode(node), 1u);
+    return cbt_CreateNode(node.id | 1u, node.depth);
 }
 
-CBTDEF void cbt_SplitNode(cbt_Tree *tree, const cbt_Node node)
+CBTDEF cbt_Node cbt_RightSiblingNode(const cbt_Node node)
 {
-    if (!cbt_IsCeilNode(tree, node))
-        cbt_SplitNode_Fast(tree, node);
+    return cbt_IsNullNode(node) ? node : cbt_RightSiblingNode_Fast(node);
 }
 
 
 /*******************************************************************************
- * Merge -- Merges the node with its neighbour
+ * LeftSiblingNode -- Computes the left sibling of the input node
  *
- * The _Fast version does not check if the node can actually merge, so
- * use it wisely, i.e., when you're absolutely sure the node depth is
- * greater than 0.
+ */
+CBTDEF cbt_Node cbt_LeftSiblingNode_Fast(const cbt_Node node)
+{
+    return cbt_CreateNode(node.id & (~1u), node.depth);
+}
+
+CBTDEF cbt_Node cbt_LeftSiblingNode(const cbt_Node node)
+{
+    return cbt_IsNullNode(node) ? node : cbt_LeftSiblingNode_Fast(node);
+}
+
+
+/*******************************************************************************
+ * RightChildNode -- Computes the right child of the input node
  *
  */
-CBTDEF void cbt_MergeNode_Fast(cbt_Tree *tree, const cbt_Node node)
+CBTDEF cbt_Node cbt_RightChildNode_Fast(const cbt_Node node)
 {
-    cbt__HeapWrite_BitField(tree, cbt_RightSiblingNode(node), 0u);
+    return cbt_CreateNode(node.id << 1u | 1u, node.depth + 1);
 }
 
-CBTDEF void cbt_MergeNode(cbt_Tree *tree, const cbt_Node node)
+CBTDEF cbt_Node cbt_RightChildNode(const cbt_Node node)
 {
-    if (!cbt_IsRootNode(node))
-        cbt_MergeNode_Fast(tree, node);
+    return cbt_IsNullNode(node) ? node : cbt_RightChildNode_Fast(node);
 }
 
 
 /*******************************************************************************
- * Update -- Split or merge each node in parallel
+ * LeftChildNode -- Computes the left child of the input node
  *
- * The user provides an updater function that is responsible for
- * splitting or merging each node.
+ */
+CBTDEF cbt_Node cbt_LeftChildNode_Fast(const cbt_Node node)
+{
+    return cbt_CreateNode(node.id << 1u, node.depth + 1);
+}
+
+CBTDEF cbt_Node cbt_LeftChildNode(const cbt_Node node)
+{
+    return cbt_IsNullNode(node) ? node : cbt_LeftChildNode_Fast(node);
+}
+
+
+/*******************************************************************************
+ * HeapByteSize -- Computes the number of Bytes to allocate for the bitfield
+ *
+ * The bitfield is the last level of the heap, so the heap ends with the bit
+ * of the last node of max depth D. For the packed layout, the number of
+ * Bytes is 2^(D-1). Note that 2 bits are "wasted" in the sense that they
+ * only serve to round the required number of bytes to a power of two; we
+ * use them to store the layout.
  *
  */
-CBTDEF void
-cbt_Update(cbt_Tree *tree, cbt_UpdateCallback updater, const void *userData)
+static int64_t cbt__HeapByteSize(const cbt_Tree *tree, int64_t maxDepth)
 {
-CBT_PARALLEL_FOR
-    for (int64_t handle = 0; handle < cbt_NodeCount(tree); ++handle) {
-        updater(tree, cbt_DecodeNode(tree, handle), userData);
-    }
-CBT_BARRIER
+    int64_t bitCount = tree->levelBitOffsets[maxDepth] + (2LL << maxDepth);
 
-    cbt__ComputeSumReduction(tree);
+    return ((bitCount + 63) >> 6) << 3;
 }
 
 
 /*******************************************************************************
- * MaxDepth -- Returns the max CBT depth
+ * HeapUint64Size -- Computes the number of uints to allocate for the bitfield
  *
  */
-CBTDEF int64_t cbt_MaxDepth(const cbt_Tree *tree)
+static inline int64_t cbt__HeapUint64Size(const cbt_Tree *tree)
 {
-    return cbt__FindLSB(tree->heap[0]);
+    return cbt__HeapByteSize(tree, cbt_MaxDepth(tree)) >> 3;
 }
 
 
 /*******************************************************************************
- * NodeCount -- Returns the number of triangles in the CBT
+ * BitFieldUint64Size -- Computes the number of uints spanned by the bitfield
  *
  */
-CBTDEF int64_t cbt_NodeCount(const cbt_Tree *tree)
+static inline int64_t cbt__BitFieldUint64Size(int64_t treeMaxDepth)
 {
-    return cbt_HeapRead(tree, cbt_CreateNode(1u, 0));
+    return treeMaxDepth > 6 ? 1LL << (treeMaxDepth - 6) : 1LL;
 }
 
 
 /*******************************************************************************
- * DecodeNode -- Returns the leaf node associated to index nodeID
+ * CreateLayout -- Tabulates the location of each level of the heap
  *
- * This is procedure is for iterating over the nodes.
+ * For a tree of max depth D and given an index in [0, 2^(D+1) - 1], the
+ * tables are used to emulate the behaviour of a lookup in an array, i.e.,
+ * uint[nodeID]. The nodes of level d are grouped in blocks of
+ * 2^levelBlockShifts[d] consecutive nodes that span levelBlockBitSizes[d]
+ * bits, so that the first bit in memory that stores information associated
+ * with the element of index nodeID located at level d is
+ * levelBitOffsets[d] + (nodeID >> s) x levelBlockBitSizes[d]
+ *                    + (nodeID & (2^s - 1)) x levelBitSizes[d]
+ * where s = levelBlockShifts[d]. The packed and word-aligned layouts use
+ * blocks of a single node.
+ *
+ * For the packed layout, each node of level d is stored over D + 1 - d bits
+ * and the bit offset of the level is 2^d x (3 - d + D). We then offset this
+ * quantity by the index by (nodeID - 2^d) x (D + 1 - d).
+ * For the word-aligned layout, the number of bits is rounded up to the next
+ * power of two and each level starts on a new 64-bit word, right after a
+ * header word that stores the max depth, so that nodes never straddle two
+ * words. This costs about 12% more memory than the packed layout.
+ * Returns the number of Bytes to allocate for the heap.
  *
  */
-CBTDEF cbt_Node cbt_DecodeNode(const cbt_Tree *tree, int64_t handle)
+static int64_t cbt__NextPowerOfTwo(int64_t x)
 {
-    CBT_ASSERT(handle < cbt_NodeCount(tree) && "handle > NodeCount");
-    CBT_ASSERT(handle >= 0 && "handle < 0");
+    int64_t y = 1;
 
-    cbt_Node node = cbt_CreateNode(1u, 0);
+    while (y < x) {
+        y<<= 1;
+    }
+
+    return y;
+}
+
+/*******************************************************************************
+ * CreateLayout_Blocked -- Tabulates the location of the levels of a blocked heap
+ *
+ * The levels located above the bitfield are grouped into bands of
+ * consecutive levels. A band stores one complete subtree per node of its
+ * first level, and each subtree is stored contiguously, level by level, in
+ * a block of a power-of-two number of bits aligned on its size. Blocks span
+ * at most 512 bits so that they never cross a 64-Byte cache line, and a
+ * root to leaf traversal touches one cache line per band. The bands are
+ * built from the bitfield upwards with as many levels as fit in a block;
+ * the bitfield is stored after the bands. This costs about 28% more memory
+ * than the packed layout. Returns the first bit located after the bands.
+ *
+ */
+#define CBT__BLOCK_BIT_SIZE_MAX 512
 
-    while (cbt_HeapRead(tree, node) > 1u) {
-        cbt_Node heapNode = cbt_CreateNode(node.id<<= 1u, ++node.depth);
-        uint64_t cmp = cbt_HeapRead(tree, heapNode);
-        uint64_t b = (uint64_t)handle < cmp ? 0u : 1u;
+static int64_t
+cbt__BlockBitSize(int64_t maxDepth, int64_t depth, int64_t levelCount)
+{
+    int64_t bitCount = 0;
 
-        node.id|= b;
-        handle-= cmp * b;
+    for (int64_t i = 0; i < levelCount; ++i) {
+        bitCount+= (maxDepth + 1 - depth - i) << i;
     }
 
-    return node;
+    return bitCount;
+}
+
+static int64_t cbt__CreateLayout_Blocked(cbt_Tree *tree, int64_t maxDepth)
+{
+    int64_t bandDepths[CBT__LEVEL_COUNT_MAX + 1];
+    int64_t bandCount = 0;
+    int64_t bitOffset = 64;
+
+    // split the levels into bands, starting from the bitfield
+    bandDepths[bandCount++] = maxDepth;
+    while (bandDepths[bandCount - 1] > 0) {
+        int64_t depth = bandDepths[bandCount - 1];
+        int64_t levelCount = 1;
+
+        while (levelCount < depth
+               && cbt__BlockBitSize(maxDepth, depth - levelCount - 1, levelCount + 1)
+                  <= CBT__BLOCK_BIT_SIZE_MAX) {
+            ++levelCount;
+        }
+
+        bandDepths[bandCount++] = depth - levelCount;
+    }
+
+    // store the bands from the root
+    for (int64_t bandID = bandCount - 1; bandID > 0; --bandID) {
+        int64_t minDepth = bandDepths[bandID];
+        int64_t levelCount = bandDepths[bandID - 1] - minDepth;
+        int64_t blockBitSize =
+            cbt__NextPowerOfTwo(cbt__BlockBitSize(maxDepth, minDepth, levelCount));
+        int64_t levelBitOffset = 0;
+
+        if (blockBitSize < 64)
+            blockBitSize = 64;
+
+        bitOffset = (bitOffset + blockBitSize - 1) & ~(blockBitSize - 1);
+
+        for (int64_t i = 0; i < levelCount; ++i) {
+            int64_t depth = minDepth + i;
+            int64_t bitCount = maxDepth + 1 - depth;
+
+            tree->levelBitOffsets[depth] = bitOffset
+                                         - (blockBitSize << minDepth)
+                                         + levelBitOffset;
+            tree->levelBitSizes[depth] = bitCount;
+            tree->levelBlockShifts[depth] = i;
+            tree->levelBlockBitSizes[depth] = blockBitSize;
+            levelBitOffset+= bitCount << i;
+        }
+
+        bitOffset+= blockBitSize << minDepth;
+    }
+
+    return (bitOffset + CBT__BLOCK_BIT_SIZE_MAX - 1) & ~(CBT__BLOCK_BIT_SIZE_MAX - 1);
+}
+
+static int64_t
+cbt__CreateLayout(cbt_Tree *tree, int64_t maxDepth, cbt_Layout layout)
+{
+    int64_t bitOffset = 64;
+
+    if (layout == CBT_LAYOUT_BLOCKED) {
+        bitOffset = cbt__CreateLayout_Blocked(tree, maxDepth);
+        tree->levelBitOffsets[maxDepth] = bitOffset - (1LL << maxDepth);
+        tree->levelBitSizes[maxDepth] = 1;
+        tree->levelBlockShifts[maxDepth] = 0;
+        tree->levelBlockBitSizes[maxDepth] = 1;
+        tree->layout = layout;
+
+        return cbt__HeapByteSize(tree, maxDepth);
+    }
+
+    for (int64_t depth = 0; depth <= maxDepth; ++depth) {
+        int64_t bitCount = maxDepth + 1 - depth;
+
+        tree->levelBlockShifts[depth] = 0;
+
+        switch (layout) {
+        case CBT_LAYOUT_WORD_ALIGNED:
+            bitCount = cbt__NextPowerOfTwo(bitCount);
+            tree->levelBitOffsets[depth] = bitOffset - (bitCount << depth);
+            tree->levelBitSizes[depth] = bitCount;
+            tree->levelBlockBitSizes[depth] = bitCount;
+            bitOffset+= ((bitCount << depth) + 63) & ~63LL;
+            break;
+
+        default:
+            tree->levelBitOffsets[depth] = 2LL << depth;
+            tree->levelBitSizes[depth] = bitCount;
+            tree->levelBlockBitSizes[depth] = bitCount;
+            break;
+        }
+    }
+
+    tree->layout = layout;
+
+    return cbt__HeapByteSize(tree, maxDepth);
 }
 
 
 /*******************************************************************************
- * EncodeNode -- Returns the bit index associated with the Node
+ * NodeBitID -- Returns the bit index that stores data associated with a given node
  *
- * This does the inverse of the DecodeNode routine.
+ * Note that the null index (nodeID = 0) is also supported.
  *
  */
-CBTDEF int64_t cbt_EncodeNode(const cbt_Tree *tree, const cbt_Node node)
+static inline int64_t cbt__NodeBitID(const cbt_Tree *tree, const cbt_Node node)
 {
-    CBT_ASSERT(cbt_IsLeafNode(tree, node) && "node is not a leaf");
+    int64_t blockShift = tree->levelBlockShifts[node.depth];
+    uint64_t blockID = node.id >> blockShift;
+    uint64_t blockNodeID = node.id & ~(0xFFFFFFFFFFFFFFFFULL << blockShift);
 
-    int64_t handle = 0u;
-    cbt_Node nodeIterator = node;
+    return tree->levelBitOffsets[node.depth]
+         + blockID * tree->levelBlockBitSizes[node.depth]
+         + blockNodeID * tree->levelBitSizes[node.depth];
+}
 
-    while (nodeIterator.id > 1u) {
-        cbt_Node sibling = cbt_LeftSiblingNode_Fast(nodeIterator);
-        uint64_t nodeCount = cbt_HeapRead(tree, sibling);
 
-        handle+= (nodeIterator.id & 1u) * nodeCount;
-        nodeIterator = cbt_ParentNode_Fast(nodeIterator);
+/*******************************************************************************
+ * LevelBitID -- Returns the first bit that stores data for a given depth
+ *
+ */
+static inline int64_t cbt__LevelBitID(const cbt_Tree *tree, int64_t depth)
+{
+    return cbt__NodeBitID(tree, cbt_CreateNode(1ULL << depth, depth));
+}
+
+// returns the heap words of the bitfield, which are aligned for maxDepth >= 6
+static inline uint64_t *cbt__BitFieldWords(const cbt_Tree *tree)
+{
+    return &tree->heap[cbt__LevelBitID(tree, cbt_MaxDepth(tree)) >> 6];
+}
+
+
+/*******************************************************************************
+ * NodeBitID_BitField -- Computes the bitfield bit location associated to a node
+ *
+ * Here, the node is converted into a final node and its bit offset is
+ * returned, which is finalNodeID + 2^{D + 1}
+ */
+static int64_t
+cbt__NodeBitID_BitField(const cbt_Tree *tree, const cbt_Node node)
+{
+    return cbt__NodeBitID(tree, cbt__CeilNode(tree, node));
+}
+
+
+/*******************************************************************************
+ * NodeBitSize -- Returns the number of bits storing the input node value
+ *
+ */
+static inline int64_t
+cbt__NodeBitSize(const cbt_Tree *tree, const cbt_Node node)
+{
+    return tree->levelBitSizes[node.depth];
+}
+
+
+/*******************************************************************************
+ * HeapArgs
+ *
+ * The CBT heap data structure uses an array of 64-bit words to store its data.
+ * Whenever we need to access a certain bit range, we need to query two such
+ * words (because sometimes the requested bit range overlaps two 64-bit words).
+ * The HeapArg data structure provides arguments for reading from and/or
+ * writing to the two 64-bit words that bound the queries range.
+ *
+ */
+typedef struct {
+    uint64_t *bitFieldLSB, *bitFieldMSB;
+    int64_t bitOffsetLSB;
+    int64_t bitCountLSB, bitCountMSB;
+} cbt__HeapArgs;
+
+cbt__HeapArgs
+cbt__CreateHeapArgs(const cbt_Tree *tree, const cbt_Node node, int64_t bitCount)
+{
+    int64_t alignedBitOffset = cbt__NodeBitID(tree, node);
+    int64_t maxBufferIndex = cbt__HeapUint64Size(tree) - 1;
+    int64_t bufferIndexLSB = (alignedBitOffset >> 6);
+    int64_t bufferIndexMSB = cbt__MinValue(bufferIndexLSB + 1, maxBufferIndex);
+    cbt__HeapArgs args;
+
+    args.bitOffsetLSB = alignedBitOffset & 63;
+    args.bitCountLSB = cbt__MinValue(64 - args.bitOffsetLSB, bitCount);
+    args.bitCountMSB = bitCount - args.bitCountLSB;
+    args.bitFieldLSB = &tree->heap[bufferIndexLSB];
+    args.bitFieldMSB = &tree->heap[bufferIndexMSB];
+
+    return args;
+}
+
+
+/*******************************************************************************
+ * HeapWrite -- Sets bitCount bits located at nodeID to bitData
+ *
+ * Note that this procedure writes to at most two uint64 elements.
+ * Two elements are relevant whenever the specified interval overflows 64-bit
+ * words.
+ *
+ */
+static void
+cbt__HeapWriteExplicit(
+    cbt_Tree *tree,
+    const cbt_Node node,
+    int64_t bitCount,
+    uint64_t bitData
+) {
+    cbt__HeapArgs args = cbt__CreateHeapArgs(tree, node, bitCount);
+
+    cbt__BitFieldInsert(args.bitFieldLSB,
+                        args.bitOffsetLSB,
+                        args.bitCountLSB,
+                        bitData);
+    cbt__BitFieldInsert(args.bitFieldMSB,
+                        0u,
+                        args.bitCountMSB,
+                        bitData >> args.bitCountLSB);
+}
+
+/*******************************************************************************
+ * HeapWrite_WordAligned -- Sets bitCount bits located at bitID to bitData
+ *
+ * The bit range must be contained in a single 64-bit word. Byte-aligned
+ * ranges of 8, 16, 32 or 64 bits are written with plain stores, which do not
+ * interfere with concurrent writes to the rest of the word.
+ *
+ */
+static void
+cbt__HeapWrite_WordAligned(
+    cbt_Tree *tree,
+    int64_t bitID,
+    int64_t bitCount,
+    uint64_t bitData
+) {
+    CBT_ASSERT((bitID & 63) + bitCount <= 64 && "bit range straddles two words");
+
+    if (bitCount == 64) {
+        tree->heap[bitID >> 6] = bitData;
+        return;
     }
 
-    return handle;
+#ifdef CBT__LITTLE_ENDIAN
+    if (bitCount >= 8 && (bitID & (bitCount - 1)) == 0) {
+        char *bytes = (char *)tree->heap + (bitID >> 3);
+        uint8_t bitData8 = (uint8_t)bitData;
+        uint16_t bitData16 = (uint16_t)bitData;
+        uint32_t bitData32 = (uint32_t)bitData;
+
+        switch (bitCount) {
+        case 8 : CBT_MEMCPY(bytes, &bitData8 , 1); return;
+        case 16: CBT_MEMCPY(bytes, &bitData16, 2); return;
+        case 32: CBT_MEMCPY(bytes, &bitData32, 4); return;
+        default: break;
+        }
+    }
+#endif
+
+    cbt__BitFieldInsert(&tree->heap[bitID >> 6], bitID & 63, bitCount, bitData);
+}
+
+static void
+cbt__HeapWrite(cbt_Tree *tree, const cbt_Node node, uint64_t bitData)
+{
+    if (tree->layout == CBT_LAYOUT_WORD_ALIGNED) {
+        cbt__HeapWrite_WordAligned(tree,
+                                   cbt__NodeBitID(tree, node),
+                                   cbt__NodeBitSize(tree, node),
+                                   bitData);
+    } else {
+        cbt__HeapWriteExplicit(tree, node, cbt__NodeBitSize(tree, node), bitData);
+    }
+}
+
+
+/*******************************************************************************
+ * HeapRead -- Returns bitCount bits located at nodeID
+ *
+ * Note that this procedure reads from two uint64 elements.
+ * This is because the data is not necessarily aligned with 64-bit
+ * words.
+ *
+ */
+static uint64_t
+cbt__HeapReadExplicit(
+    const cbt_Tree *tree,
+    const cbt_Node node,
+    int64_t bitCount
+) {
+    cbt__HeapArgs args = cbt__CreateHeapArgs(tree, node, bitCount);
+    uint64_t lsb = cbt__BitFieldExtract(*args.bitFieldLSB,
+                                        args.bitOffsetLSB,
+                                        args.bitCountLSB);
+    uint64_t msb = cbt__BitFieldExtract(*args.bitFieldMSB,
+                                        0u,
+                                        args.bitCountMSB);
+
+    return (lsb | (msb << args.bitCountLSB));
+}
+
+static inline uint64_t
+cbt__HeapRead_WordAligned(const cbt_Tree *tree, const cbt_Node node)
+{
+    int64_t bitID = cbt__NodeBitID(tree, node);
+    int64_t bitCount = cbt__NodeBitSize(tree, node);
+
+    return (tree->heap[bitID >> 6] >> (bitID & 63))
+         & (0xFFFFFFFFFFFFFFFFULL >> (64 - bitCount));
+}
+
+// the reductions read the sums while they are pending
+static inline uint64_t cbt__HeapRead(const cbt_Tree *tree, const cbt_Node node)
+{
+    if (tree->layout == CBT_LAYOUT_WORD_ALIGNED)
+        return cbt__HeapRead_WordAligned(tree, node);
+
+    return cbt__HeapReadExplicit(tree, node, cbt__NodeBitSize(tree, node));
+}
+
+CBTDEF uint64_t cbt_HeapRead(const cbt_Tree *tree, const cbt_Node node)
+{
+    CBT_ASSERT(!tree->reduction.isPending && "sums are stale");
+
+    return cbt__HeapRead(tree, node);
+}
+
+
+/*******************************************************************************
+ * SetDirtyBit -- Flags a bitfield word as modified since the last reduction
+ *
+ * The bit is raised at each level of the dirty bitmap, starting from the
+ * finest one. We stop as soon as we find a bit that is already set because
+ * its ancestors are set as well.
+ *
+ */
+static void cbt__SetDirtyBit(cbt_Tree *tree, int64_t bufferID)
+{
+    for (int64_t level = 0; level < tree->dirtyLevelCount; ++level) {
+        int64_t bufferIndex = tree->dirtyLevelOffsets[level] + (bufferID >> 6);
+        uint64_t *bitField = &tree->dirtyBits[bufferIndex];
+        uint64_t bitMask = 1ULL << (bufferID & 63);
+
+        if ((cbt__AtomicLoad(bitField) & bitMask) != 0u)
+            break;
+
+        cbt__AtomicOr(bitField, bitMask);
+        bufferID>>= 6;
+    }
+}
+
+
+/*******************************************************************************
+ * ClearDirtyBits -- Marks all the bitfield words as up to date
+ *
+ */
+static void cbt__ClearDirtyBits(cbt_Tree *tree)
+{
+    int64_t bufferCount = tree->dirtyLevelOffsets[tree->dirtyLevelCount];
+
+    for (int64_t bufferID = 0; bufferID < bufferCount; ++bufferID) {
+        tree->dirtyBits[bufferID] = 0u;
+    }
+}
+
+
+/*******************************************************************************
+ * GatherDirtyBufferIDs -- Lists the dirty bitfield words in increasing order
+ *
+ * This walks down the dirty bitmap from the word bufferID of the provided
+ * level and appends the index of each dirty bitfield word to the output
+ * list. If the list is NULL, the words are only counted and the bitmap is
+ * left untouched; otherwise, the visited dirty bits are cleared.
+ *
+ */
+static int64_t
+cbt__GatherDirtyBufferIDs(
+    cbt_Tree *tree,
+    int64_t level,
+    int64_t bufferID,
+    uint64_t *bufferIDs,
+    int64_t bufferIDCount
+) {
+    uint64_t *bitField = &tree->dirtyBits[tree->dirtyLevelOffsets[level] + bufferID];
+    uint64_t bitData = *bitField;
+
+    if (bufferIDs != NULL)
+        (*bitField) = 0u;
+
+    while (bitData != 0u) {
+        int64_t childBufferID = (bufferID << 6) | cbt__FindLSB(bitData);
+
+        bitData&= bitData - 1u;
+
+        if (level == 0) {
+            if (bufferIDs != NULL)
+                bufferIDs[bufferIDCount] = childBufferID;
+
+            ++bufferIDCount;
+        } else {
+            bufferIDCount = cbt__GatherDirtyBufferIDs(tree,
+                                                      level - 1,
+                                                      childBufferID,
+                                                      bufferIDs,
+                                                      bufferIDCount);
+        }
+    }
+
+    return bufferIDCount;
+}
+
+
+/*******************************************************************************
+ * RankIndex -- Rank and select tables over the leaves of the bitfield
+ *
+ * The handle of a leaf is the number of bits set before its bit in the
+ * bitfield (rank), and conversely, the leaf of a handle holds the bit set
+ * at this rank (select). The index follows the rank9 structure over chunks
+ * of 512 bits: each chunk stores the number of leaves before it, and the
+ * 9-bit counts of the leaves located before each of its words, so that a
+ * rank reads two index words and one bitfield word. For selects, the chunk
+ * of every CBT__SELECT_SAMPLE_RATE-th leaf is sampled, and the chunk of a
+ * leaf is searched between two samples. Both tables are updated at the end
+ * of the sum reductions: the chunk counts are recomputed for the dirty
+ * chunks, and the leaf offsets and the samples from the first dirty chunk
+ * on, in parallel over blocks of chunks whose counts are read from the sum
+ * tree.
+ *
+ */
+#define CBT__SELECT_SAMPLE_RATE 512
+#define CBT__RANK_BLOCK_DEPTH 8
+
+struct cbt__RankIndex {
+    uint64_t *chunks;       // leaves before the chunk, then 7 packed counts
+    uint64_t *samples;      // chunk of every CBT__SELECT_SAMPLE_RATE-th leaf
+    int64_t chunkCount;
+    int64_t sampleCapacity;
+};
+
+typedef struct {
+    cbt_Tree *tree;
+    const uint64_t *bufferIDs;
+    int64_t firstBlockID;
+    int64_t blockDepth;
+} cbt__RankIndexLoop;
+
+static void cbt__UpdateRankIndexChunk(cbt_Tree *tree, int64_t chunkID)
+{
+    const uint64_t *words = &cbt__BitFieldWords(tree)[chunkID << 3];
+    uint64_t counts = 0u;
+    uint64_t count = 0u;
+
+    for (int64_t wordID = 0; wordID < 7; ++wordID) {
+        count+= cbt__PopCount(words[wordID]);
+        counts|= count << (9 * wordID);
+    }
+
+    tree->rankIndex->chunks[2 * chunkID + 1] = counts;
+}
+
+static void
+cbt__RankIndexLoop_Chunk(int64_t begin, int64_t end, void *callbackData)
+{
+    const cbt__RankIndexLoop *loop = (const cbt__RankIndexLoop *)callbackData;
+
+    for (int64_t i = begin; i < end; ++i) {
+        cbt__UpdateRankIndexChunk(loop->tree, i);
+    }
+}
+
+static void
+cbt__RankIndexLoop_DirtyChunk(int64_t begin, int64_t end, void *callbackData)
+{
+    const cbt__RankIndexLoop *loop = (const cbt__RankIndexLoop *)callbackData;
+    const uint64_t *bufferIDs = loop->bufferIDs;
+
+    for (int64_t i = begin; i < end; ++i) {
+        if (i > 0 && (bufferIDs[i - 1] >> 3) == (bufferIDs[i] >> 3))
+            continue;
+
+        cbt__UpdateRankIndexChunk(loop->tree, (int64_t)(bufferIDs[i] >> 3));
+    }
+}
+
+// writes the leaf offsets and the samples of the chunks of a block
+static void
+cbt__RankIndexLoop_Block(int64_t begin, int64_t end, void *callbackData)
+{
+    const cbt__RankIndexLoop *loop = (const cbt__RankIndexLoop *)callbackData;
+    cbt_Tree *tree = loop->tree;
+    cbt__RankIndex *rankIndex = tree->rankIndex;
+    int64_t chunkDepth = cbt_MaxDepth(tree) - 9;
+    int64_t blockChunkCount = 1LL << (chunkDepth - loop->blockDepth);
+
+    for (int64_t i = begin; i < end; ++i) {
+        int64_t blockID = loop->firstBlockID + i;
+        int64_t chunkID = blockID * blockChunkCount;
+        uint64_t leafOffset = rankIndex->chunks[2 * chunkID];
+
+        for (int64_t j = 0; j < blockChunkCount; ++j, ++chunkID) {
+            cbt_Node chunk = cbt_CreateNode((1ULL << chunkDepth) + chunkID, chunkDepth);
+            uint64_t leafCount = cbt__HeapRead(tree, chunk);
+            uint64_t sampleID = (leafOffset + CBT__SELECT_SAMPLE_RATE - 1)
+                              / CBT__SELECT_SAMPLE_RATE;
+
+            rankIndex->chunks[2 * chunkID] = leafOffset;
+
+            for (; sampleID * CBT__SELECT_SAMPLE_RATE < leafOffset + leafCount; ++sampleID) {
+                rankIndex->samples[sampleID] = (uint64_t)chunkID;
+            }
+
+            leafOffset+= leafCount;
+        }
+    }
+}
+
+static void
+cbt__UpdateRankIndex(
+    cbt_Tree *tree,
+    const uint64_t *bufferIDs,
+    int64_t bufferIDCount
+) {
+    cbt__RankIndex *rankIndex = tree->rankIndex;
+    int64_t chunkDepth = cbt_MaxDepth(tree) - 9;
+    int64_t blockDepth = cbt__MinValue(chunkDepth, CBT__RANK_BLOCK_DEPTH);
+    int64_t blockCount = 1LL << blockDepth;
+    int64_t sampleCount;
+    cbt__RankIndexLoop loop = {tree, bufferIDs, 0, blockDepth};
+    uint64_t leafOffset = 0u;
+
+    if (rankIndex == NULL)
+        return;
+
+    if (bufferIDs == NULL) {
+        cbt__ParallelFor(tree,
+                         rankIndex->chunkCount,
+                         256,
+                         &cbt__RankIndexLoop_Chunk,
+                         &loop);
+    } else if (bufferIDCount > 0) {
+        cbt__ParallelFor(tree,
+                         bufferIDCount,
+                         64,
+                         &cbt__RankIndexLoop_DirtyChunk,
+                         &loop);
+        loop.firstBlockID = (int64_t)(bufferIDs[0] >> (3 + chunkDepth - blockDepth));
+    } else {
+        return;
+    }
+
+    // the samples are reallocated as the tree grows, and then all rewritten
+    sampleCount = (int64_t)cbt__HeapRead(tree, cbt_CreateNode(1u, 0))
+                / CBT__SELECT_SAMPLE_RATE + 1;
+    if (sampleCount > rankIndex->sampleCapacity) {
+        CBT_FREE(rankIndex->samples);
+        rankIndex->samples = (uint64_t *)CBT_MALLOC(sizeof(uint64_t) * sampleCount);
+        rankIndex->sampleCapacity = sampleCount;
+        loop.firstBlockID = 0;
+    }
+
+    // the leaf offsets of the blocks are the prefix sums of their counts
+    for (int64_t blockID = 0; blockID < blockCount; ++blockID) {
+        cbt_Node block = cbt_CreateNode((1ULL << blockDepth) + blockID, blockDepth);
+        int64_t chunkID = blockID << (chunkDepth - blockDepth);
+
+        if (blockID >= loop.firstBlockID)
+            rankIndex->chunks[2 * chunkID] = leafOffset;
+
+        leafOffset+= cbt__HeapRead(tree, block);
+    }
+
+    cbt__ParallelFor(tree,
+                     blockCount - loop.firstBlockID,
+                     1,
+                     &cbt__RankIndexLoop_Block,
+                     &loop);
+}
+
+static bool cbt__CreateRankIndex(cbt_Tree *tree)
+{
+    int64_t chunkCount = 1LL << (cbt_MaxDepth(tree) - 9);
+    cbt__RankIndex *rankIndex;
+
+    rankIndex = (cbt__RankIndex *)CBT_MALLOC(sizeof(*rankIndex));
+    if (rankIndex == NULL)
+        return false;
+
+    rankIndex->chunks = (uint64_t *)CBT_MALLOC(sizeof(uint64_t) * 2 * chunkCount);
+    rankIndex->samples = NULL;
+    rankIndex->chunkCount = chunkCount;
+    rankIndex->sampleCapacity = 0;
+
+    if (rankIndex->chunks == NULL) {
+        CBT_FREE(rankIndex);
+
+        return false;
+    }
+
+    tree->rankIndex = rankIndex;
+    cbt__UpdateRankIndex(tree, NULL, 0);
+
+    return true;
+}
+
+static void cbt__ReleaseRankIndex(cbt_Tree *tree)
+{
+    if (tree->rankIndex != NULL) {
+        CBT_FREE(tree->rankIndex->chunks);
+        CBT_FREE(tree->rankIndex->samples);
+        CBT_FREE(tree->rankIndex);
+        tree->rankIndex = NULL;
+    }
+}
+
+// returns the number of leaves located before a bit of the bitfield
+static int64_t cbt__Rank(const cbt_Tree *tree, uint64_t bitID)
+{
+    const uint64_t *chunk = &tree->rankIndex->chunks[2 * (bitID >> 9)];
+    int64_t wordID = (int64_t)((bitID >> 6) & 7u);
+    uint64_t word = cbt__BitFieldWords(tree)[bitID >> 6];
+    uint64_t wordMask = (1ULL << (bitID & 63u)) - 1u;
+    int64_t rank = (int64_t)chunk[0] + cbt__PopCount(word & wordMask);
+
+    if (wordID > 0)
+        rank+= (int64_t)((chunk[1] >> (9 * wordID - 9)) & 0x1FFu);
+
+    return rank;
+}
+
+// returns the chunk that holds the leaf of a given handle
+static int64_t
+cbt__SelectChunk(const cbt_Tree *tree, int64_t handle, int64_t nodeCount)
+{
+    const cbt__RankIndex *rankIndex = tree->rankIndex;
+    int64_t sampleID = handle / CBT__SELECT_SAMPLE_RATE;
+    int64_t chunkID = (int64_t)rankIndex->samples[sampleID];
+    int64_t chunkCount = rankIndex->chunkCount - chunkID;
+
+    if ((sampleID + 1) * CBT__SELECT_SAMPLE_RATE < nodeCount)
+        chunkCount = (int64_t)rankIndex->samples[sampleID + 1] - chunkID + 1;
+
+    // last chunk whose leaf offset does not exceed the handle
+    while (chunkCount > 1) {
+        int64_t halfCount = chunkCount >> 1;
+        int64_t middleID = chunkID + halfCount;
+
+        chunkID = (int64_t)rankIndex->chunks[2 * middleID] <= handle
+                ? middleID
+                : chunkID;
+        chunkCount-= halfCount;
+    }
+
+    return chunkID;
+}
+
+// returns the bit of the leaf of a given rank within a chunk
+static uint64_t
+cbt__SelectInChunk(const cbt_Tree *tree, int64_t chunkID, int64_t rank)
+{
+    uint64_t counts = tree->rankIndex->chunks[2 * chunkID + 1];
+    int64_t wordID = 0;
+    uint64_t word;
+
+    for (int64_t i = 0; i < 7; ++i) {
+        wordID+= (int64_t)((counts >> (9 * i)) & 0x1FFu) <= rank;
+    }
+
+    if (wordID > 0)
+        rank-= (int64_t)((counts >> (9 * wordID - 9)) & 0x1FFu);
+
+    word = cbt__BitFieldWords(tree)[(chunkID << 3) + wordID];
+
+    return ((uint64_t)chunkID << 9)
+         + ((uint64_t)wordID << 6)
+         + (uint64_t)cbt__SelectBit(word, rank);
+}
+
+static uint64_t
+cbt__Select(const cbt_Tree *tree, int64_t handle, int64_t nodeCount)
+{
+    int64_t chunkID = cbt__SelectChunk(tree, handle, nodeCount);
+
+    return cbt__SelectInChunk(tree,
+                              chunkID,
+                              handle - (int64_t)tree->rankIndex->chunks[2 * chunkID]);
+}
+
+// the leaf is the largest aligned range of bits that holds the bit of the
+// handle and none of the bits of the neighboring handles, which are mostly
+// found within the same word, or else within the same chunk
+static cbt_Node cbt__DecodeNode_RankIndex(const cbt_Tree *tree, int64_t handle)
+{
+    const cbt__RankIndex *rankIndex = tree->rankIndex;
+    int64_t maxDepth = cbt_MaxDepth(tree);
+    int64_t nodeCount = (int64_t)cbt__HeapRead(tree, cbt_CreateNode(1u, 0));
+    int64_t chunkID = cbt__SelectChunk(tree, handle, nodeCount);
+    int64_t chunkRank = handle - (int64_t)rankIndex->chunks[2 * chunkID];
+    int64_t chunkLeafCount = chunkID + 1 < rankIndex->chunkCount
+                           ? (int64_t)rankIndex->chunks[2 * chunkID + 2]
+                           : nodeCount;
+    uint64_t bitID = cbt__SelectInChunk(tree, chunkID, chunkRank);
+    uint64_t word = cbt__BitFieldWords(tree)[bitID >> 6];
+    uint64_t wordBitID = bitID & ~63ULL;
+    uint64_t bitMask = 1ULL << (bitID & 63u);
+    uint64_t previousBits = word & (bitMask - 1u);
+    uint64_t nextBits = word & ~(bitMask | (bitMask - 1u));
+    int64_t depth = 0;
+
+    chunkLeafCount-= (int64_t)rankIndex->chunks[2 * chunkID];
+
+    if (handle > 0) {
+        uint64_t previousBitID;
+
+        if (previousBits != 0u)
+            previousBitID = wordBitID + cbt__FindMSB(previousBits);
+        else if (chunkRank > 0)
+            previousBitID = cbt__SelectInChunk(tree, chunkID, chunkRank - 1);
+        else
+            previousBitID = cbt__Select(tree, handle - 1, nodeCount);
+
+        depth = maxDepth - cbt__FindMSB(bitID ^ previousBitID);
+    }
+
+    if (handle + 1 < nodeCount) {
+        uint64_t nextBitID;
+        int64_t nextDepth;
+
+        if (nextBits != 0u)
+            nextBitID = wordBitID + cbt__FindLSB(nextBits);
+        else if (chunkRank + 1 < chunkLeafCount)
+            nextBitID = cbt__SelectInChunk(tree, chunkID, chunkRank + 1);
+        else
+            nextBitID = cbt__Select(tree, handle + 1, nodeCount);
+
+        nextDepth = maxDepth - cbt__FindMSB(bitID ^ nextBitID);
+        depth = depth > nextDepth ? depth : nextDepth;
+    }
+
+    return cbt_CreateNode(((1ULL << maxDepth) + bitID) >> (maxDepth - depth), depth);
+}
+
+static int64_t
+cbt__EncodeNode_RankIndex(const cbt_Tree *tree, const cbt_Node node)
+{
+    int64_t maxDepth = cbt_MaxDepth(tree);
+    uint64_t bitID = (node.id << (maxDepth - node.depth)) - (1ULL << maxDepth);
+
+    return cbt__Rank(tree, bitID);
+}
+
+
+/*******************************************************************************
+ * Snapshots -- Read-only copies of the heap that other threads can query
+ *
+ * A tree with snapshots keeps CBT__SNAPSHOT_COUNT read-only trees next to
+ * its heap. The public functions that modify the tree publish their result
+ * at the end of the sum reduction, by bringing a snapshot that no reader
+ * holds up to date and atomically making it the one that readers acquire.
+ * Each snapshot flags the bitfield words modified since it was last brought
+ * up to date in its own dirty bitmap, so that only these words and their
+ * sums are copied, unless the whole heap was rewritten. A reader increments
+ * the reader count of the published snapshot, and then checks that it is
+ * still the published one; otherwise, the writer may have started to
+ * modify it, and the reader tries again. The writer only reuses snapshots
+ * whose reader count is zero, and skips publishing when all of them are
+ * held, in which case the readers keep seeing the previous epoch.
+ *
+ */
+#define CBT__SNAPSHOT_COUNT 3
+
+struct cbt__Snapshots {
+    cbt_Tree *trees[CBT__SNAPSHOT_COUNT];
+    uint64_t readerCounts[CBT__SNAPSHOT_COUNT];
+    bool isOutdated[CBT__SNAPSHOT_COUNT];  // the whole heap must be copied
+    uint64_t publishedID;                  // snapshot returned to the readers
+    bool hasChanges;                       // changes since the last publication
+};
+
+static void
+cbt__RecordSnapshotChanges(
+    cbt_Tree *tree,
+    const uint64_t *bufferIDs,
+    int64_t bufferIDCount
+) {
+    cbt__Snapshots *snapshots = tree->snapshots;
+
+    if (snapshots == NULL)
+        return;
+
+    for (int64_t snapshotID = 0; snapshotID < CBT__SNAPSHOT_COUNT; ++snapshotID) {
+        if (bufferIDs == NULL) {
+            snapshots->isOutdated[snapshotID] = true;
+        } else if (!snapshots->isOutdated[snapshotID]) {
+            for (int64_t i = 0; i < bufferIDCount; ++i) {
+                cbt__SetDirtyBit(snapshots->trees[snapshotID], bufferIDs[i]);
+            }
+        }
+    }
+
+    snapshots->hasChanges = true;
+}
+
+static int64_t cbt__FreeSnapshotID(cbt__Snapshots *snapshots)
+{
+    for (int64_t snapshotID = 0; snapshotID < CBT__SNAPSHOT_COUNT; ++snapshotID) {
+        if ((uint64_t)snapshotID != snapshots->publishedID
+            && cbt__AtomicLoad_SeqCst(&snapshots->readerCounts[snapshotID]) == 0u) {
+            return snapshotID;
+        }
+    }
+
+    return -1;
+}
+
+static void cbt__CopySnapshot(const cbt_Tree *tree, cbt_Tree *snapshot)
+{
+    CBT_MEMCPY(snapshot->heap, tree->heap, cbt_HeapByteSize(tree));
+    cbt__ClearDirtyBits(snapshot);
+    cbt__UpdateRankIndex(snapshot, NULL, 0);
+}
+
+static void cbt__SwapSnapshot(cbt_Tree *tree, int64_t snapshotID)
+{
+    cbt__Snapshots *snapshots = tree->snapshots;
+
+    snapshots->trees[snapshotID]->snapshotEpoch = ++tree->snapshotEpoch;
+    snapshots->isOutdated[snapshotID] = false;
+    snapshots->hasChanges = false;
+    cbt__AtomicStore_SeqCst(&snapshots->publishedID, (uint64_t)snapshotID);
+}
+
+static void cbt__PublishSnapshot_Copy(cbt_Tree *tree)
+{
+    cbt__Snapshots *snapshots = tree->snapshots;
+    int64_t snapshotID;
+
+    if (snapshots == NULL || !snapshots->hasChanges)
+        return;
+
+    snapshotID = cbt__FreeSnapshotID(snapshots);
+
+    if (snapshotID >= 0) {
+        cbt__CopySnapshot(tree, snapshots->trees[snapshotID]);
+        cbt__SwapSnapshot(tree, snapshotID);
+    }
+}
+
+
+/*******************************************************************************
+ * HeapWrite_BitField -- Sets the bit associated to a leaf node to bitValue
+ *
+ * This is a dedicated routine to write directly to the bitfield. The
+ * modified bitfield word is flagged as dirty so that the next reduction
+ * only needs to update its ancestors.
+ *
+ */
+static void
+cbt__HeapWrite_BitField(
+    cbt_Tree *tree,
+    const cbt_Node node,
+    const uint64_t bitValue
+) {
+    int64_t bitID = cbt__NodeBitID_BitField(tree, node);
+    int64_t bitFieldBitID = bitID - cbt__LevelBitID(tree, cbt_MaxDepth(tree));
+
+    cbt__SetBitValue(&tree->heap[bitID >> 6], bitID & 63, bitValue);
+    cbt__SetDirtyBit(tree, bitFieldBitID >> 6);
+    CBT__STATS(CBT__STATS_ADD(tree, bitFieldWriteCount, 1);)
+}
+
+
+/*******************************************************************************
+ * ClearBitField -- Clears the bitfield
+ *
+ * The bitfield is the last level of the heap for all layouts.
+ *
+ */
+static void
+cbt__ClearBitfield_Range(int64_t begin, int64_t end, void *callbackData)
+{
+    cbt_Tree *tree = (cbt_Tree *)callbackData;
+    int64_t bufferMinID = cbt__LevelBitID(tree, cbt_MaxDepth(tree)) >> 6;
+
+    for (int64_t bufferID = bufferMinID + begin; bufferID < bufferMinID + end; ++bufferID) {
+        tree->heap[bufferID] = 0;
+    }
+}
+
+static void cbt__ClearBitfield(cbt_Tree *tree)
+{
+    int64_t maxDepth = cbt_MaxDepth(tree);
+    int64_t bufferMinID = cbt__LevelBitID(tree, maxDepth) >> 6;
+    int64_t bufferMaxID = cbt__HeapUint64Size(tree);
+
+    cbt__ParallelFor(tree,
+                     bufferMaxID - bufferMinID,
+                     4096,
+                     &cbt__ClearBitfield_Range,
+                     tree);
+}
+
+
+/*******************************************************************************
+ * IsLeafNode -- Checks if a node is a leaf node, i.e., that has no descendants
+ *
+ */
+CBTDEF bool cbt_IsLeafNode(const cbt_Tree *tree, const cbt_Node node)
+{
+    CBT_ASSERT(!tree->reduction.isPending && "sums are stale");
+
+    return (cbt__HeapRead(tree, node) == 1u);
+}
+
+
+/*******************************************************************************
+ * GetHeapMemory -- Returns a read-only pointer to the heap memory
+ *
+ */
+CBTDEF const char *cbt_GetHeap(const cbt_Tree *tree)
+{
+    return (const char *)tree->heap;
+}
+
+
+/*******************************************************************************
+ * SetHeapMemory -- Sets the heap memory from a read-only buffer
+ *
+ */
+CBTDEF void cbt_SetHeap(cbt_Tree *tree, const char *buffer)
+{
+    CBT_ASSERT(!tree->isReadOnly && "tree is read-only");
+    CBT_ASSERT(((const uint64_t *)buffer)[0] << 62 == tree->heap[0] << 62
+               && "heap has a different layout");
+    CBT_MEMCPY(tree->heap, buffer, cbt_HeapByteSize(tree));
+    tree->reduction.isPending = false;
+    cbt__ClearDirtyBits(tree);
+    cbt__UpdateRankIndex(tree, NULL, 0);
+    cbt__RecordSnapshotChanges(tree, NULL, 0);
+    cbt__PublishSnapshot_Copy(tree);
+}
+
+
+/*******************************************************************************
+ * HeapByteSize -- Returns the amount of bytes consumed by the CBT heap
+ *
+ */
+CBTDEF int64_t cbt_HeapByteSize(const cbt_Tree *tree)
+{
+    return cbt__HeapByteSize(tree, cbt_MaxDepth(tree));
+}
+
+// byte size of the heap of a tree that has yet to be created
+CBTDEF int64_t cbt_LayoutHeapByteSize(int64_t maxDepth, cbt_Layout layout)
+{
+    cbt_Tree tree;
+
+    return cbt__CreateLayout(&tree, maxDepth, layout);
+}
+
+
+/*******************************************************************************
+ * BitReader -- Reads consecutive bit ranges from a buffer of 64-bit words
+ *
+ */
+typedef struct {
+    const uint64_t *buffer;
+    int64_t bitOffset;
+} cbt__BitReader;
+
+static inline cbt__BitReader cbt__CreateBitReader(const uint64_t *buffer)
+{
+    cbt__BitReader reader;
+
+    reader.buffer = buffer;
+    reader.bitOffset = 0;
+
+    return reader;
+}
+
+static inline uint64_t
+cbt__BitReaderRead(cbt__BitReader *reader, int64_t bitCount)
+{
+    int64_t bitOffset = reader->bitOffset;
+    uint64_t bitData = reader->buffer[0] >> bitOffset;
+
+    if (bitOffset + bitCount > 64)
+        bitData|= reader->buffer[1] << (64 - bitOffset);
+
+    reader->bitOffset+= bitCount;
+
+    if (reader->bitOffset >= 64) {
+        reader->bitOffset-= 64;
+        ++reader->buffer;
+    }
+
+    return bitData & ~(0xFFFFFFFFFFFFFFFFULL << bitCount);
+}
+
+
+/*******************************************************************************
+ * BitWriter -- Writes consecutive bit ranges to a buffer of 64-bit words
+ *
+ * The words are written in full with plain stores, so the writer must own
+ * every word it touches; the bit range must end on a word boundary.
+ *
+ */
+typedef struct {
+    uint64_t *buffer;
+    uint64_t bitData;
+    int64_t bitCount;
+} cbt__BitWriter;
+
+static inline cbt__BitWriter cbt__CreateBitWriter(uint64_t *buffer)
+{
+    cbt__BitWriter writer;
+
+    writer.buffer = buffer;
+    writer.bitData = 0u;
+    writer.bitCount = 0;
+
+    return writer;
+}
+
+static inline void
+cbt__BitWriterWrite(cbt__BitWriter *writer, uint64_t bitData, int64_t bitCount)
+{
+    writer->bitData|= bitData << writer->bitCount;
+    writer->bitCount+= bitCount;
+
+    if (writer->bitCount >= 64) {
+        *writer->buffer++ = writer->bitData;
+        writer->bitCount-= 64;
+        writer->bitData = writer->bitCount > 0
+                        ? bitData >> (bitCount - writer->bitCount)
+                        : 0u;
+    }
+}
+
+
+/*******************************************************************************
+ * Prepass Kernels -- Sum the 6 deepest levels of a block of 64 bitfield words
+ *
+ * A block of 64 bitfield words spans 4096 leaves. For trees of max depth 12
+ * and more, the sums of the 6 levels above such a block occupy entire
+ * 64-bit words (64, 48, 32, 20, 12 and 7 words respectively), so that
+ * blocks can be reduced independently with plain stores. The sumBuffers
+ * array points to the first word of each of these levels.
+ *
+ * Each kernel performs the same SWAR reduction as the per-word prepass;
+ * the SIMD variants reduce several words at once and pack the variable
+ * width sums with PEXT.
+ *
+ */
+typedef void (*cbt__PrepassKernel)(const uint64_t *bitField,
+                                   uint64_t *sumBuffers[6]);
+
+static void
+cbt__WritePrepassSums(
+    cbt__BitWriter writers[5],
+    uint64_t bitField3,
+    uint64_t bitField4,
+    uint64_t bitField5,
+    uint64_t bitField6,
+    uint64_t bitField7
+) {
+    uint64_t bitData;
+
+    // 3-bits
+    bitData = ((bitField3 >>  0) & (7ULL <<  0))
+            | ((bitField3 >>  1) & (7ULL <<  3))
+            | ((bitField3 >>  2) & (7ULL <<  6))
+            | ((bitField3 >>  3) & (7ULL <<  9))
+            | ((bitField3 >>  4) & (7ULL << 12))
+            | ((bitField3 >>  5) & (7ULL << 15))
+            | ((bitField3 >>  6) & (7ULL << 18))
+            | ((bitField3 >>  7) & (7ULL << 21))
+            | ((bitField3 >>  8) & (7ULL << 24))
+            | ((bitField3 >>  9) & (7ULL << 27))
+            | ((bitField3 >> 10) & (7ULL << 30))
+            | ((bitField3 >> 11) & (7ULL << 33))
+            | ((bitField3 >> 12) & (7ULL << 36))
+            | ((bitField3 >> 13) & (7ULL << 39))
+            | ((bitField3 >> 14) & (7ULL << 42))
+            | ((bitField3 >> 15) & (7ULL << 45));
+    cbt__BitWriterWrite(&writers[0], bitData, 48);
+
+    // 4-bits
+    bitData = ((bitField4 >>  0) & (15ULL <<  0))
+            | ((bitField4 >>  4) & (15ULL <<  4))
+            | ((bitField4 >>  8) & (15ULL <<  8))
+            | ((bitField4 >> 12) & (15ULL << 12))
+            | ((bitField4 >> 16) & (15ULL << 16))
+            | ((bitField4 >> 20) & (15ULL << 20))
+            | ((bitField4 >> 24) & (15ULL << 24))
+            | ((bitField4 >> 28) & (15ULL << 28));
+    cbt__BitWriterWrite(&writers[1], bitData, 32);
+
+    // 5-bits
+    bitData = ((bitField5 >>  0) & (31ULL <<  0))
+            | ((bitField5 >> 11) & (31ULL <<  5))
+            | ((bitField5 >> 22) & (31ULL << 10))
+            | ((bitField5 >> 33) & (31ULL << 15));
+    cbt__BitWriterWrite(&writers[2], bitData, 20);
+
+    // 6-bits
+    bitData = ((bitField6 >>  0) & (63ULL << 0))
+            | ((bitField6 >> 26) & (63ULL << 6));
+    cbt__BitWriterWrite(&writers[3], bitData, 12);
+
+    // 7-bits
+    cbt__BitWriterWrite(&writers[4], bitField7, 7);
+}
+
+static void
+cbt__PrepassKernel_Scalar(const uint64_t *bitFields, uint64_t *sumBuffers[6])
+{
+    cbt__BitWriter writers[5];
+
+    for (int64_t i = 0; i < 5; ++i) {
+        writers[i] = cbt__CreateBitWriter(sumBuffers[i + 1]);
+    }
+
+    for (int64_t i = 0; i < 64; ++i) {
+        uint64_t bitField2, bitField3, bitField4, bitField5, bitField6, bitField7;
+
+        bitField2 = (bitFields[i] & 0x5555555555555555ULL)
+                  + ((bitFields[i] >> 1) & 0x5555555555555555ULL);
+        bitField3 = (bitField2 & 0x3333333333333333ULL)
+                  + ((bitField2 >>  2) & 0x3333333333333333ULL);
+        bitField4 = (bitField3 & 0x0F0F0F0F0F0F0F0FULL)
+                  + ((bitField3 >>  4) & 0x0F0F0F0F0F0F0F0FULL);
+        bitField5 = (bitField4 & 0x00FF00FF00FF00FFULL)
+                  + ((bitField4 >>  8) & 0x00FF00FF00FF00FFULL);
+        bitField6 = (bitField5 & 0x0000FFFF0000FFFFULL)
+                  + ((bitField5 >> 16) & 0x0000FFFF0000FFFFULL);
+        bitField7 = (bitField6 & 0x00000000FFFFFFFFULL)
+                  + ((bitField6 >> 32) & 0x00000000FFFFFFFFULL);
+
+        sumBuffers[0][i] = bitField2;
+        cbt__WritePrepassSums(writers,
+                              bitField3,
+                              bitField4,
+                              bitField5,
+                              bitField6,
+                              bitField7);
+    }
+}
+
+#if defined(CBT__SIMD_X86)
+CBT__TARGET("bmi2") static void
+cbt__WritePrepassSums_BMI2(
+    cbt__BitWriter writers[5],
+    const uint64_t *bitFields3,
+    const uint64_t *bitFields4,
+    const uint64_t *bitFields5,
+    const uint64_t *bitFields6,
+    const uint64_t *bitFields7,
+    int64_t count
+) {
+    for (int64_t i = 0; i < count; ++i) {
+        cbt__BitWriterWrite(&writers[0], _pext_u64(bitFields3[i], 0x7777777777777777ULL), 48);
+        cbt__BitWriterWrite(&writers[1], _pext_u64(bitFields4[i], 0x0F0F0F0F0F0F0F0FULL), 32);
+        cbt__BitWriterWrite(&writers[2], _pext_u64(bitFields5[i], 0x001F001F001F001FULL), 20);
+        cbt__BitWriterWrite(&writers[3], _pext_u64(bitFields6[i], 0x0000003F0000003FULL), 12);
+        cbt__BitWriterWrite(&writers[4], bitFields7[i], 7);
+    }
+}
+
+#define CBT__PREPASS_REDUCE_X86(bits, suffix, x, shift, mask)                  \
+    _mm##bits##_add_epi64(_mm##bits##_and_##suffix(x, mask),                   \
+                          _mm##bits##_and_##suffix(                            \
+                              _mm##bits##_srli_epi64(x, shift), mask))
+
+CBT__TARGET("avx2,bmi2") static void
+cbt__PrepassKernel_AVX2(const uint64_t *bitFields, uint64_t *sumBuffers[6])
+{
+    const __m256i m1 = _mm256_set1_epi64x(0x5555555555555555LL);
+    const __m256i m2 = _mm256_set1_epi64x(0x3333333333333333LL);
+    const __m256i m3 = _mm256_set1_epi64x(0x0F0F0F0F0F0F0F0FLL);
+    const __m256i m4 = _mm256_set1_epi64x(0x00FF00FF00FF00FFLL);
+    const __m256i m5 = _mm256_set1_epi64x(0x0000FFFF0000FFFFLL);
+    const __m256i m6 = _mm256_set1_epi64x(0x00000000FFFFFFFFLL);
+    cbt__BitWriter writers[5];
+
+    for (int64_t i = 0; i < 5; ++i) {
+        writers[i] = cbt__CreateBitWriter(sumBuffers[i + 1]);
+    }
+
+    for (int64_t i = 0; i < 64; i+= 4) {
+        uint64_t bitFields3[4], bitFields4[4], bitFields5[4];
+        uint64_t bitFields6[4], bitFields7[4];
+        __m256i x = _mm256_loadu_si256((const __m256i *)&bitFields[i]);
+
+        x = CBT__PREPASS_REDUCE_X86(256, si256, x,  1, m1);
+        _mm256_storeu_si256((__m256i *)&sumBuffers[0][i], x);
+        x = CBT__PREPASS_REDUCE_X86(256, si256, x,  2, m2);
+        _mm256_storeu_si256((__m256i *)bitFields3, x);
+        x = CBT__PREPASS_REDUCE_X86(256, si256, x,  4, m3);
+        _mm256_storeu_si256((__m256i *)bitFields4, x);
+        x = CBT__PREPASS_REDUCE_X86(256, si256, x,  8, m4);
+        _mm256_storeu_si256((__m256i *)bitFields5, x);
+        x = CBT__PREPASS_REDUCE_X86(256, si256, x, 16, m5);
+        _mm256_storeu_si256((__m256i *)bitFields6, x);
+        x = CBT__PREPASS_REDUCE_X86(256, si256, x, 32, m6);
+        _mm256_storeu_si256((__m256i *)bitFields7, x);
+
+        cbt__WritePrepassSums_BMI2(writers,
+                                   bitFields3,
+                                   bitFields4,
+                                   bitFields5,
+                                   bitFields6,
+                                   bitFields7,
+                                   4);
+    }
+}
+
+// the GCC headers pass an undefined vector to the builtin of
+// _mm512_srli_epi64, which g++ reports as (maybe) used uninitialized
+#if defined(__GNUC__) && !defined(__clang__)
+#   pragma GCC diagnostic push
+#   pragma GCC diagnostic ignored "-Wuninitialized"
+#   pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+CBT__TARGET("avx512f,bmi2") static void
+cbt__PrepassKernel_AVX512(const uint64_t *bitFields, uint64_t *sumBuffers[6])
+{
+    const __m512i m1 = _mm512_set1_epi64(0x5555555555555555LL);
+    const __m512i m2 = _mm512_set1_epi64(0x3333333333333333LL);
+    const __m512i m3 = _mm512_set1_epi64(0x0F0F0F0F0F0F0F0FLL);
+    const __m512i m4 = _mm512_set1_epi64(0x00FF00FF00FF00FFLL);
+    const __m512i m5 = _mm512_set1_epi64(0x0000FFFF0000FFFFLL);
+    const __m512i m6 = _mm512_set1_epi64(0x00000000FFFFFFFFLL);
+    cbt__BitWriter writers[5];
+
+    for (int64_t i = 0; i < 5; ++i) {
+        writers[i] = cbt__CreateBitWriter(sumBuffers[i + 1]);
+    }
+
+    for (int64_t i = 0; i < 64; i+= 8) {
+        uint64_t bitFields3[8], bitFields4[8], bitFields5[8];
+        uint64_t bitFields6[8], bitFields7[8];
+        __m512i x = _mm512_loadu_si512((const void *)&bitFields[i]);
+
+        x = CBT__PREPASS_REDUCE_X86(512, epi64, x,  1, m1);
+        _mm512_storeu_si512((void *)&sumBuffers[0][i], x);
+        x = CBT__PREPASS_REDUCE_X86(512, epi64, x,  2, m2);
+        _mm512_storeu_si512((void *)bitFields3, x);
+        x = CBT__PREPASS_REDUCE_X86(512, epi64, x,  4, m3);
+        _mm512_storeu_si512((void *)bitFields4, x);
+        x = CBT__PREPASS_REDUCE_X86(512, epi64, x,  8, m4);
+        _mm512_storeu_si512((void *)bitFields5, x);
+        x = CBT__PREPASS_REDUCE_X86(512, epi64, x, 16, m5);
+        _mm512_storeu_si512((void *)bitFields6, x);
+        x = CBT__PREPASS_REDUCE_X86(512, epi64, x, 32, m6);
+        _mm512_storeu_si512((void *)bitFields7, x);
+
+        cbt__WritePrepassSums_BMI2(writers,
+                                   bitFields3,
+                                   bitFields4,
+                                   bitFields5,
+                                   bitFields6,
+                                   bitFields7,
+                                   8);
+    }
+}
+#if defined(__GNUC__) && !defined(__clang__)
+#   pragma GCC diagnostic pop
+#endif
+
+#undef CBT__PREPASS_REDUCE_X86
+
+/*
+ * CPUID -- Returns the CPUID registers of a given leaf
+ */
+static void cbt__CPUID(uint32_t leaf, uint32_t subLeaf, uint32_t regs[4])
+{
+#if defined(_MSC_VER) && !defined(__clang__)
+    int tmp[4];
+
+    __cpuidex(tmp, (int)leaf, (int)subLeaf);
+    for (int i = 0; i < 4; ++i) regs[i] = (uint32_t)tmp[i];
+#else
+    __cpuid_count(leaf, subLeaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+static uint64_t cbt__XGETBV(void)
+{
+#if defined(_MSC_VER) && !defined(__clang__)
+    return _xgetbv(0);
+#else
+    uint32_t eax, edx;
+
+    __asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+
+    return ((uint64_t)edx << 32) | eax;
+#endif
+}
+#elif defined(CBT__SIMD_NEON)
+static void
+cbt__PrepassKernel_NEON(const uint64_t *bitFields, uint64_t *sumBuffers[6])
+{
+    const uint64x2_t m1 = vdupq_n_u64(0x5555555555555555ULL);
+    const uint64x2_t m2 = vdupq_n_u64(0x3333333333333333ULL);
+    const uint64x2_t m3 = vdupq_n_u64(0x0F0F0F0F0F0F0F0FULL);
+    const uint64x2_t m4 = vdupq_n_u64(0x00FF00FF00FF00FFULL);
+    const uint64x2_t m5 = vdupq_n_u64(0x0000FFFF0000FFFFULL);
+    const uint64x2_t m6 = vdupq_n_u64(0x00000000FFFFFFFFULL);
+    cbt__BitWriter writers[5];
+
+    for (int64_t i = 0; i < 5; ++i) {
+        writers[i] = cbt__CreateBitWriter(sumBuffers[i + 1]);
+    }
+
+    for (int64_t i = 0; i < 64; i+= 2) {
+        uint64_t bitFields3[2], bitFields4[2], bitFields5[2];
+        uint64_t bitFields6[2], bitFields7[2];
+        uint64x2_t x = vld1q_u64(&bitFields[i]);
+
+        x = vaddq_u64(vandq_u64(x, m1), vandq_u64(vshrq_n_u64(x,  1), m1));
+        vst1q_u64(&sumBuffers[0][i], x);
+        x = vaddq_u64(vandq_u64(x, m2), vandq_u64(vshrq_n_u64(x,  2), m2));
+        vst1q_u64(bitFields3, x);
+        x = vaddq_u64(vandq_u64(x, m3), vandq_u64(vshrq_n_u64(x,  4), m3));
+        vst1q_u64(bitFields4, x);
+        x = vaddq_u64(vandq_u64(x, m4), vandq_u64(vshrq_n_u64(x,  8), m4));
+        vst1q_u64(bitFields5, x);
+        x = vaddq_u64(vandq_u64(x, m5), vandq_u64(vshrq_n_u64(x, 16), m5));
+        vst1q_u64(bitFields6, x);
+        x = vaddq_u64(vandq_u64(x, m6), vandq_u64(vshrq_n_u64(x, 32), m6));
+        vst1q_u64(bitFields7, x);
+
+        for (int64_t j = 0; j < 2; ++j) {
+            cbt__WritePrepassSums(writers,
+                                  bitFields3[j],
+                                  bitFields4[j],
+                                  bitFields5[j],
+                                  bitFields6[j],
+                                  bitFields7[j]);
+        }
+    }
+}
+#endif
+
+
+/*******************************************************************************
+ * SelectPrepassKernel -- Picks the fastest prepass kernel supported by the CPU
+ *
+ * The selection is performed once using CPUID on x86-64; NEON is always
+ * available on AArch64.
+ *
+ */
+static cbt__PrepassKernel cbt__SelectPrepassKernel(void)
+{
+    static cbt__PrepassKernel kernel = NULL;
+
+    if (kernel == NULL) {
+        cbt__PrepassKernel selected = &cbt__PrepassKernel_Scalar;
+#if defined(CBT__SIMD_X86)
+        uint32_t regs[4];
+
+        cbt__CPUID(0, 0, regs);
+
+        if (regs[0] >= 7) {
+            uint32_t features1, features7;
+
+            cbt__CPUID(1, 0, regs);
+            features1 = regs[2];
+            cbt__CPUID(7, 0, regs);
+            features7 = regs[1];
+
+            // OSXSAVE and AVX, with the YMM (and ZMM) states enabled by the OS
+            if ((features1 & (1u << 27)) && (features1 & (1u << 28))) {
+                uint64_t xcr0 = cbt__XGETBV();
+                bool bmi2 = (features7 & (1u << 8)) != 0u;
+                bool avx2 = (features7 & (1u << 5)) != 0u && (xcr0 & 0x06) == 0x06;
+                bool avx512 = (features7 & (1u << 16)) != 0u && (xcr0 & 0xE6) == 0xE6;
+
+                if (bmi2 && avx512)
+                    selected = &cbt__PrepassKernel_AVX512;
+                else if (bmi2 && avx2)
+                    selected = &cbt__PrepassKernel_AVX2;
+            }
+        }
+#elif defined(CBT__SIMD_NEON)
+        selected = &cbt__PrepassKernel_NEON;
+#endif
+        kernel = selected;
+    }
+
+    return kernel;
+}
+
+
+/*******************************************************************************
+ * ComputeSumReductionPrepass_Block -- Sums the 6 deepest levels of a block
+ *
+ * The input node is the first node of the deepest level that is stored in
+ * the block of 64 bitfield words to process. Requires a max depth of at
+ * least 12.
+ *
+ */
+static void
+cbt__ComputeSumReductionPrepass_Block(
+    cbt_Tree *tree,
+    cbt__PrepassKernel kernel,
+    uint64_t nodeID
+) {
+    int64_t depth = cbt_MaxDepth(tree);
+    uint64_t *sumBuffers[6];
+    int64_t bitFieldBitID = cbt__NodeBitID(tree, cbt_CreateNode(nodeID, depth));
+
+    for (int64_t i = 0; i < 6; ++i) {
+        cbt_Node node = cbt_CreateNode(nodeID >> (i + 1), depth - i - 1);
+
+        sumBuffers[i] = &tree->heap[cbt__NodeBitID(tree, node) >> 6];
+    }
+
+    (*kernel)(&tree->heap[bitFieldBitID >> 6], sumBuffers);
+}
+
+
+/*******************************************************************************
+ * ComputeSumReductionLevel_Chunk -- Sums 64 consecutive nodes of a given level
+ *
+ * The sums of 64 consecutive nodes, starting at a multiple of 64, occupy
+ * entire 64-bit words for all levels of depth 6 and more. They are computed
+ * by streaming the fields of the level below, with plain stores.
+ *
+ */
+static void
+cbt__ComputeSumReductionLevel_Chunk(
+    cbt_Tree *tree,
+    uint64_t nodeID,
+    int64_t depth
+) {
+    cbt_Node node = cbt_CreateNode(nodeID, depth);
+    cbt_Node childNode = cbt_LeftChildNode_Fast(node);
+    int64_t bitCount = cbt__NodeBitSize(tree, node);
+    int64_t childBitCount = cbt__NodeBitSize(tree, childNode);
+    cbt__BitReader reader =
+        cbt__CreateBitReader(&tree->heap[cbt__NodeBitID(tree, childNode) >> 6]);
+    cbt__BitWriter writer =
+        cbt__CreateBitWriter(&tree->heap[cbt__NodeBitID(tree, node) >> 6]);
+
+    for (int64_t i = 0; i < 64; ++i) {
+        uint64_t x0 = cbt__BitReaderRead(&reader, childBitCount);
+        uint64_t x1 = cbt__BitReaderRead(&reader, childBitCount);
+
+        cbt__BitWriterWrite(&writer, x0 + x1, bitCount);
+    }
+}
+
+
+/*******************************************************************************
+ * ComputeSumReductionPrepass_WordAligned -- Word-aligned layout prepass
+ *
+ * The sums are computed with the same SWAR reduction as for the packed
+ * layout, using lanes of 2^k bits for the level located k levels above the
+ * bitfield. Whenever the bit size of the nodes of the level is smaller than
+ * the lanes, the lanes are packed before being written.
+ *
+ */
+static void
+cbt__ComputeSumReductionPrepass_WordAligned(cbt_Tree *tree, uint64_t nodeID)
+{
+    static const uint64_t laneMasks[7] = {
+        0u,
+        0x5555555555555555ULL,
+        0x3333333333333333ULL,
+        0x0F0F0F0F0F0F0F0FULL,
+        0x00FF00FF00FF00FFULL,
+        0x0000FFFF0000FFFFULL,
+        0x00000000FFFFFFFFULL
+    };
+    int64_t depth = cbt_MaxDepth(tree);
+    cbt_Node heapNode = cbt_CreateNode(nodeID, depth);
+    uint64_t bitField = tree->heap[cbt__NodeBitID(tree, heapNode) >> 6];
+
+    for (int64_t k = 1; k <= 6; ++k) {
+        cbt_Node node = cbt_CreateNode(nodeID >> k, depth - k);
+        int64_t laneBitCount = 1LL << k;
+        int64_t laneCount = 64 >> k;
+        int64_t bitCount = cbt__NodeBitSize(tree, node);
+        uint64_t bitData = 0u;
+
+        bitField = (bitField & laneMasks[k])
+                 + ((bitField >> (laneBitCount >> 1)) & laneMasks[k]);
+
+        if (bitCount == laneBitCount) {
+            bitData = bitField;
+        } else {
+            uint64_t bitMask = ~(0xFFFFFFFFFFFFFFFFULL << bitCount);
+
+            for (int64_t laneID = 0; laneID < laneCount; ++laneID) {
+                uint64_t laneData = (bitField >> (laneID * laneBitCount)) & bitMask;
+
+                bitData|= laneData << (laneID * bitCount);
+            }
+        }
+
+        cbt__HeapWrite_WordAligned(tree,
+                                   cbt__NodeBitID(tree, node),
+                                   laneCount * bitCount,
+                                   bitData);
+    }
+}
+
+
+/*******************************************************************************
+ * ComputeSumReductionPrepass_Blocked -- Blocked layout prepass
+ *
+ * The nodes located above a bitfield word are scattered across the blocks
+ * of the deepest band, so they are summed one by one.
+ *
+ */
+static void
+cbt__ComputeSumReductionPrepass_Blocked(cbt_Tree *tree, uint64_t nodeID)
+{
+    int64_t depth = cbt_MaxDepth(tree);
+
+    for (int64_t k = 1; k <= 6; ++k) {
+        uint64_t minNodeID = nodeID >> k;
+        uint64_t maxNodeID = minNodeID + (64u >> k);
+
+        for (uint64_t j = minNodeID; j < maxNodeID; ++j) {
+            uint64_t x0 = cbt__HeapRead(tree, cbt_CreateNode(j << 1    , depth - k + 1));
+            uint64_t x1 = cbt__HeapRead(tree, cbt_CreateNode(j << 1 | 1, depth - k + 1));
+
+            cbt__HeapWrite(tree, cbt_CreateNode(j, depth - k), x0 + x1);
+        }
+    }
+}
+
+
+/*******************************************************************************
+ * ComputeSumReductionPrepass -- Sums the 6 deepest levels above a bitfield word
+ *
+ * The input node is the first node of the deepest level that is stored in
+ * the 64-bit bitfield word to process.
+ *
+ */
+static void
+cbt__ComputeSumReductionPrepass(cbt_Tree *tree, uint64_t nodeID)
+{
+    if (tree->layout == CBT_LAYOUT_WORD_ALIGNED) {
+        cbt__ComputeSumReductionPrepass_WordAligned(tree, nodeID);
+        return;
+    } else if (tree->layout == CBT_LAYOUT_BLOCKED) {
+        cbt__ComputeSumReductionPrepass_Blocked(tree, nodeID);
+        return;
+    }
+
+    int64_t depth = cbt_MaxDepth(tree);
+    uint64_t minNodeID = (1ULL << depth);
+    cbt_Node heapNode = cbt_CreateNode(nodeID, depth);
+    int64_t alignedBitOffset = cbt__NodeBitID(tree, heapNode);
+    uint64_t bitField = tree->heap[alignedBitOffset >> 6];
+    uint64_t bitData = 0u;
+
+    // 2-bits
+    bitField = (bitField & 0x5555555555555555ULL)
+             + ((bitField >>  1) & 0x5555555555555555ULL);
+    bitData = bitField;
+    tree->heap[(alignedBitOffset - minNodeID) >> 6] = bitData;
+
+    // 3-bits
+    bitField = (bitField & 0x3333333333333333ULL)
+             + ((bitField >>  2) & 0x3333333333333333ULL);
+    bitData = ((bitField >>  0) & (7ULL <<  0))
+            | ((bitField >>  1) & (7ULL <<  3))
+            | ((bitField >>  2) & (7ULL <<  6))
+            | ((bitField >>  3) & (7ULL <<  9))
+            | ((bitField >>  4) & (7ULL << 12))
+            | ((bitField >>  5) & (7ULL << 15))
+            | ((bitField >>  6) & (7ULL << 18))
+            | ((bitField >>  7) & (7ULL << 21))
+            | ((bitField >>  8) & (7ULL << 24))
+            | ((bitField >>  9) & (7ULL << 27))
+            | ((bitField >> 10) & (7ULL << 30))
+            | ((bitField >> 11) & (7ULL << 33))
+            | ((bitField >> 12) & (7ULL << 36))
+            | ((bitField >> 13) & (7ULL << 39))
+            | ((bitField >> 14) & (7ULL << 42))
+            | ((bitField >> 15) & (7ULL << 45));
+    cbt__HeapWriteExplicit(tree, cbt_CreateNode(nodeID >> 2, depth - 2), 48ULL, bitData);
+
+    // 4-bits
+    bitField = (bitField & 0x0F0F0F0F0F0F0F0FULL)
+             + ((bitField >>  4) & 0x0F0F0F0F0F0F0F0FULL);
+    bitData = ((bitField >>  0) & (15ULL <<  0))
+            | ((bitField >>  4) & (15ULL <<  4))
+            | ((bitField >>  8) & (15ULL <<  8))
+            | ((bitField >> 12) & (15ULL << 12))
+            | ((bitField >> 16) & (15ULL << 16))
+            | ((bitField >> 20) & (15ULL << 20))
+            | ((bitField >> 24) & (15ULL << 24))
+            | ((bitField >> 28) & (15ULL << 28));
+    cbt__HeapWriteExplicit(tree, cbt_CreateNode(nodeID >> 3, depth - 3), 32ULL, bitData);
+
+    // 5-bits
+    bitField = (bitField & 0x00FF00FF00FF00FFULL)
+             + ((bitField >>  8) & 0x00FF00FF00FF00FFULL);
+    bitData = ((bitField >>  0) & (31ULL <<  0))
+            | ((bitField >> 11) & (31ULL <<  5))
+            | ((bitField >> 22) & (31ULL << 10))
+            | ((bitField >> 33) & (31ULL << 15));
+    cbt__HeapWriteExplicit(tree, cbt_CreateNode(nodeID >> 4, depth - 4), 20ULL, bitData);
+
+    // 6-bits
+    bitField = (bitField & 0x0000FFFF0000FFFFULL)
+             + ((bitField >> 16) & 0x0000FFFF0000FFFFULL);
+    bitData = ((bitField >>  0) & (63ULL << 0))
+            | ((bitField >> 26) & (63ULL << 6));
+    cbt__HeapWriteExplicit(tree, cbt_CreateNode(nodeID >> 5, depth - 5), 12ULL, bitData);
+
+    // 7-bits
+    bitField = (bitField & 0x00000000FFFFFFFFULL)
+             + ((bitField >> 32) & 0x00000000FFFFFFFFULL);
+    bitData = bitField;
+    cbt__HeapWriteExplicit(tree, cbt_CreateNode(nodeID >> 6, depth - 6),  7ULL, bitData);
+}
+
+
+/*******************************************************************************
+ * ComputeSumReductionBlock -- Sums the nodes of a block of the blocked layout
+ *
+ * The input node is the root of the block, i.e., the subtree of levelCount
+ * levels stored contiguously. The sums are computed from the children of
+ * the deepest level of the block, which belong to the band below (or to the
+ * bitfield), and the block is then written in full with plain stores.
+ *
+ */
+static void
+cbt__ComputeSumReductionBlock(
+    cbt_Tree *tree,
+    uint64_t nodeID,
+    int64_t depth,
+    int64_t levelCount
+) {
+    uint64_t sums[CBT__BLOCK_BIT_SIZE_MAX >> 1];
+    int64_t nodeCount = 1LL << (levelCount - 1);
+    int64_t bitCount = tree->levelBlockBitSizes[depth];
+    cbt_Node node = cbt_CreateNode(nodeID, depth);
+    cbt__BitWriter writer =
+        cbt__CreateBitWriter(&tree->heap[cbt__NodeBitID(tree, node) >> 6]);
+
+    // deepest level of the block
+    if (depth + levelCount == cbt_MaxDepth(tree)) {
+        cbt_Node childNode = cbt_CreateNode(nodeID << levelCount, depth + levelCount);
+        int64_t bitID = cbt__NodeBitID(tree, childNode);
+
+        for (int64_t i = 0; i < nodeCount; ++i, bitID+= 2) {
+            uint64_t bitData = tree->heap[bitID >> 6] >> (bitID & 63);
+
+            sums[nodeCount + i] = (bitData & 1u) + ((bitData >> 1) & 1u);
+        }
+    } else {
+        for (int64_t i = 0; i < nodeCount; ++i) {
+            uint64_t childID = ((nodeID << (levelCount - 1)) + i) << 1;
+            int64_t childDepth = depth + levelCount;
+            uint64_t x0 = cbt__HeapRead(tree, cbt_CreateNode(childID    , childDepth));
+            uint64_t x1 = cbt__HeapRead(tree, cbt_CreateNode(childID | 1, childDepth));
+
+            sums[nodeCount + i] = x0 + x1;
+        }
+    }
+
+    // remaining levels
+    for (int64_t i = nodeCount - 1; i > 0; --i) {
+        sums[i] = sums[i << 1] + sums[i << 1 | 1];
+    }
+
+    // write the block level by level and pad it with zeros
+    for (int64_t i = 0; i < levelCount; ++i) {
+        int64_t nodeBitCount = tree->levelBitSizes[depth + i];
+
+        for (int64_t j = 1LL << i; j < (2LL << i); ++j) {
+            cbt__BitWriterWrite(&writer, sums[j], nodeBitCount);
+            bitCount-= nodeBitCount;
+        }
+    }
+
+    while (bitCount > 0) {
+        int64_t padBitCount = cbt__MinValue(bitCount, 32);
+
+        cbt__BitWriterWrite(&writer, 0u, padBitCount);
+        bitCount-= padBitCount;
+    }
+}
+
+
+/*******************************************************************************
+ * ReductionLoop -- Arguments of the parallel loops of the sum reduction
+ *
+ * The loops iterate over [0, count), and each iteration is mapped to the
+ * nodes it processes by the callbacks below.
+ *
+ */
+typedef struct {
+    cbt_Tree *tree;
+    cbt__PrepassKernel kernel;
+    const uint64_t *bufferIDs;
+    uint64_t minNodeID;
+    int64_t depth;
+    int64_t levelCount; // number of levels in a block, or bufferID shift
+} cbt__ReductionLoop;
+
+static void
+cbt__ReductionLoop_Block(int64_t begin, int64_t end, void *callbackData)
+{
+    const cbt__ReductionLoop *loop = (const cbt__ReductionLoop *)callbackData;
+
+    for (int64_t i = begin; i < end; ++i) {
+        cbt__ComputeSumReductionBlock(loop->tree,
+                                      loop->minNodeID + i,
+                                      loop->depth,
+                                      loop->levelCount);
+    }
+}
+
+static void
+cbt__ReductionLoop_PrepassBlock(int64_t begin, int64_t end, void *callbackData)
+{
+    const cbt__ReductionLoop *loop = (const cbt__ReductionLoop *)callbackData;
+
+    for (int64_t i = begin; i < end; ++i) {
+        uint64_t nodeID = loop->minNodeID + ((uint64_t)i << 12);
+
+        cbt__ComputeSumReductionPrepass_Block(loop->tree, loop->kernel, nodeID);
+    }
+}
+
+static void
+cbt__ReductionLoop_Prepass(int64_t begin, int64_t end, void *callbackData)
+{
+    const cbt__ReductionLoop *loop = (const cbt__ReductionLoop *)callbackData;
+
+    for (int64_t i = begin; i < end; ++i) {
+        cbt__ComputeSumReductionPrepass(loop->tree, loop->minNodeID + ((uint64_t)i << 6));
+    }
+}
+
+static void
+cbt__ReductionLoop_Chunk(int64_t begin, int64_t end, void *callbackData)
+{
+    const cbt__ReductionLoop *loop = (const cbt__ReductionLoop *)callbackData;
+
+    for (int64_t i = begin; i < end; ++i) {
+        cbt__ComputeSumReductionLevel_Chunk(loop->tree,
+                                            loop->minNodeID + ((uint64_t)i << 6),
+                                            loop->depth);
+    }
+}
+
+static void
+cbt__ReductionLoop_Node(int64_t begin, int64_t end, void *callbackData)
+{
+    const cbt__ReductionLoop *loop = (const cbt__ReductionLoop *)callbackData;
+    cbt_Tree *tree = loop->tree;
+    int64_t depth = loop->depth;
+
+    for (int64_t i = begin; i < end; ++i) {
+        uint64_t j = loop->minNodeID + i;
+        uint64_t x0 = cbt__HeapRead(tree, cbt_CreateNode(j << 1    , depth + 1));
+        uint64_t x1 = cbt__HeapRead(tree, cbt_CreateNode(j << 1 | 1, depth + 1));
+
+        cbt__HeapWrite(tree, cbt_CreateNode(j, depth), x0 + x1);
+    }
+}
+
+
+/*******************************************************************************
+ * ComputeSumReduction_Blocked -- Sums the bands of the blocked layout
+ *
+ * The bands are processed from the bitfield upwards, and the blocks of a
+ * band in parallel.
+ *
+ */
+static void cbt__ComputeSumReduction_Blocked(cbt_Tree *tree)
+{
+    int64_t depth = cbt_MaxDepth(tree) - 1;
+
+    while (depth >= 0) {
+        cbt__ReductionLoop loop = {tree, NULL, NULL, 0u, 0, 0};
+        CBT__STATS(int64_t time = cbt__Time();)
+
+        loop.levelCount = tree->levelBlockShifts[depth] + 1;
+        loop.depth = depth - loop.levelCount + 1;
+        loop.minNodeID = 1ULL << loop.depth;
+        cbt__ParallelFor(tree,
+                         1LL << loop.depth,
+                         16,
+                         &cbt__ReductionLoop_Block,
+                         &loop);
+        CBT__STATS(cbt__EndLevelTimer(tree, depth, time);)
+
+        depth = loop.depth - 1;
+    }
+}
+
+
+/*******************************************************************************
+ * ComputeSumReductionSubtree -- Sums the levels of a subtree down to a depth
+ *
+ * The levels [subtree.depth, depth] of the subtree are summed from the
+ * deepest one upwards, on the calling thread. The 6 levels above the
+ * bitfield are computed by the prepass, so depth must either be maxDepth - 1
+ * or be less than maxDepth - 6, and the subtree must span whole prepass
+ * units. The levels deep enough for the subtree to span whole chunks of 64
+ * nodes are summed by chunks, the others node by node.
+ *
+ */
+static void
+cbt__ComputeSumReductionSubtree(
+    const cbt__ReductionLoop *loop,
+    const cbt_Node subtree,
+    int64_t depth
+) {
+    int64_t maxDepth = cbt_MaxDepth(loop->tree);
+    int64_t subtreeDepth = subtree.depth;
+    int64_t subtreeID = (int64_t)(subtree.id - (1ULL << subtreeDepth));
+    cbt__ReductionLoop levelLoop = *loop;
+
+    if (depth == maxDepth - 1) {
+        levelLoop.minNodeID = 1ULL << maxDepth;
+
+        if (loop->kernel != NULL) {
+            int64_t shift = maxDepth - 12 - subtreeDepth;
+
+            cbt__ReductionLoop_PrepassBlock(subtreeID << shift,
+                                            (subtreeID + 1) << shift,
+                                            &levelLoop);
+        } else {
+            int64_t shift = maxDepth - 6 - subtreeDepth;
+
+            cbt__ReductionLoop_Prepass(subtreeID << shift,
+                                       (subtreeID + 1) << shift,
+                                       &levelLoop);
+        }
+
+        depth = maxDepth - 7;
+    }
+
+    for (; depth >= subtreeDepth; --depth) {
+        levelLoop.minNodeID = 1ULL << depth;
+        levelLoop.depth = depth;
+
+        if (depth - 6 >= subtreeDepth) {
+            int64_t shift = depth - 6 - subtreeDepth;
+
+            cbt__ReductionLoop_Chunk(subtreeID << shift,
+                                     (subtreeID + 1) << shift,
+                                     &levelLoop);
+        } else {
+            int64_t shift = depth - subtreeDepth;
+
+            cbt__ReductionLoop_Node(subtreeID << shift,
+                                    (subtreeID + 1) << shift,
+                                    &levelLoop);
+        }
+    }
+}
+
+
+/*******************************************************************************
+ * ReductionLoop_Subtree -- Sums a subtree from the bitfield up to its root
+ *
+ * Each iteration owns a subtree rooted at loop->depth, which it splits into
+ * subtrees rooted at loop->levelCount that are small enough to remain in
+ * cache while they are summed from the bitfield up. The levels in between
+ * are summed once all of these are done.
+ *
+ */
+static void
+cbt__ReductionLoop_Subtree(int64_t begin, int64_t end, void *callbackData)
+{
+    const cbt__ReductionLoop *loop = (const cbt__ReductionLoop *)callbackData;
+    int64_t maxDepth = cbt_MaxDepth(loop->tree);
+    int64_t subtreeDepth = loop->depth;
+    int64_t cacheDepth = loop->levelCount;
+    int64_t shift = cacheDepth - subtreeDepth;
+
+    for (int64_t i = begin; i < end; ++i) {
+        cbt_Node subtree = cbt_CreateNode((1ULL << subtreeDepth) + i, subtreeDepth);
+
+        for (int64_t j = i << shift; j < (i + 1) << shift; ++j) {
+            cbt_Node cacheSubtree = cbt_CreateNode((1ULL << cacheDepth) + j, cacheDepth);
+
+            cbt__ComputeSumReductionSubtree(loop, cacheSubtree, maxDepth - 1);
+        }
+
+        cbt__ComputeSumReductionSubtree(loop, subtree, cacheDepth - 1);
+    }
+}
+
+
+/*******************************************************************************
+ * ComputeSumReduction -- Sums the 2 elements below the current slot
+ *
+ * Rather than summing the tree level by level, which requires one parallel
+ * loop per level, most of which have too few nodes to keep the threads
+ * busy, the threads sum independent subtrees from the bitfield up to a
+ * cutoff depth in a single parallel loop, and the calling thread then sums
+ * the few levels above the cutoff. The cutoff yields about 8 subtrees per
+ * thread for load balancing; the subtrees are themselves summed by pieces of
+ * at most 2^17 bitfield bits, whose sums fit in the L2 cache.
+ *
+ */
+#define CBT__REDUCTION_CACHE_DEPTH 17
+
+static void cbt__ComputeSumReduction(cbt_Tree *tree)
+{
+    int64_t maxDepth = cbt_MaxDepth(tree);
+    int64_t threadCount = tree->executor.threadCount > 0
+                        ? tree->executor.threadCount
+                        : 64;
+    int64_t unitDepth, cacheDepth, subtreeDepth;
+    cbt__ReductionLoop loop = {tree, NULL, NULL, 0u, 0, 0};
+    CBT__STATS(int64_t reductionTime = cbt__Time();)
+    CBT__STATS(int64_t time = reductionTime;)
+
+    cbt__RecordSnapshotChanges(tree, NULL, 0);
+    CBT__STATS(CBT__STATS_ADD(tree, reductionCount, 1);)
+    CBT__STATS(CBT__STATS_ADD(tree, reducedWordCount, cbt__BitFieldUint64Size(maxDepth));)
+
+    if (tree->layout == CBT_LAYOUT_BLOCKED) {
+        cbt__ComputeSumReduction_Blocked(tree);
+        cbt__ClearDirtyBits(tree);
+        cbt__UpdateRankIndex(tree, NULL, 0);
+        CBT__STATS(cbt__EndReductionTimer(tree, reductionTime);)
+        return;
+    }
+
+    // the subtrees must span whole prepass units
+    if (tree->layout == CBT_LAYOUT_PACKED && maxDepth >= 12) {
+        loop.kernel = cbt__SelectPrepassKernel();
+        unitDepth = maxDepth - 12;
+    } else {
+        unitDepth = maxDepth - 6;
+    }
+
+    cacheDepth = maxDepth - CBT__REDUCTION_CACHE_DEPTH;
+    cacheDepth = cacheDepth < 0 ? 0 : cacheDepth;
+    cacheDepth = cacheDepth < unitDepth ? cacheDepth : unitDepth;
+    subtreeDepth = cbt__FindMSB(2 * threadCount - 1) + 3;
+    subtreeDepth = subtreeDepth < cacheDepth ? subtreeDepth : cacheDepth;
+
+    // sum the subtrees in parallel
+    loop.depth = subtreeDepth;
+    loop.levelCount = cacheDepth;
+    cbt__ParallelFor(tree,
+                     1LL << subtreeDepth,
+                     1,
+                     &cbt__ReductionLoop_Subtree,
+                     &loop);
+    CBT__STATS(cbt__EndLevelTimer(tree, maxDepth - 1, time);)
+
+    // sum the levels above the subtrees
+    if (subtreeDepth > 0) {
+        CBT__STATS(time = cbt__Time();)
+        cbt__ComputeSumReductionSubtree(&loop,
+                                        cbt_CreateNode(1u, 0),
+                                        subtreeDepth - 1);
+        CBT__STATS(cbt__EndLevelTimer(tree, subtreeDepth - 1, time);)
+    }
+
+    cbt__ClearDirtyBits(tree);
+    cbt__UpdateRankIndex(tree, NULL, 0);
+    CBT__STATS(cbt__EndReductionTimer(tree, reductionTime);)
+}
+
+
+/*******************************************************************************
+ * IncrementalLoop -- Callbacks of the parallel loops of the incremental reduction
+ *
+ * Each iteration processes one dirty bitfield word. A word that shares its
+ * ancestor with the previous one is skipped, levelCount being the shift
+ * that maps a word to its ancestor.
+ *
+ */
+static inline bool
+cbt__IncrementalLoop_IsDuplicate(const cbt__ReductionLoop *loop, int64_t i)
+{
+    const uint64_t *bufferIDs = loop->bufferIDs;
+    int64_t shift = loop->levelCount;
+
+    return i > 0 && (bufferIDs[i - 1] >> shift) == (bufferIDs[i] >> shift);
+}
+
+static void
+cbt__IncrementalLoop_PrepassBlock(int64_t begin, int64_t end, void *callbackData)
+{
+    const cbt__ReductionLoop *loop = (const cbt__ReductionLoop *)callbackData;
+
+    for (int64_t i = begin; i < end; ++i) {
+        uint64_t nodeID = loop->minNodeID + ((loop->bufferIDs[i] >> 6) << 12);
+
+        if (cbt__IncrementalLoop_IsDuplicate(loop, i))
+            continue;
+
+        cbt__ComputeSumReductionPrepass_Block(loop->tree, loop->kernel, nodeID);
+    }
+}
+
+static void
+cbt__IncrementalLoop_Prepass(int64_t begin, int64_t end, void *callbackData)
+{
+    const cbt__ReductionLoop *loop = (const cbt__ReductionLoop *)callbackData;
+
+    for (int64_t i = begin; i < end; ++i) {
+        uint64_t nodeID = loop->minNodeID + (loop->bufferIDs[i] << 6);
+
+        cbt__ComputeSumReductionPrepass(loop->tree, nodeID);
+    }
+}
+
+static void
+cbt__IncrementalLoop_Node(int64_t begin, int64_t end, void *callbackData)
+{
+    const cbt__ReductionLoop *loop = (const cbt__ReductionLoop *)callbackData;
+    cbt_Tree *tree = loop->tree;
+    int64_t depth = loop->depth;
+
+    for (int64_t i = begin; i < end; ++i) {
+        uint64_t j = loop->minNodeID + (loop->bufferIDs[i] >> loop->levelCount);
+        uint64_t x0, x1;
+
+        if (cbt__IncrementalLoop_IsDuplicate(loop, i))
+            continue;
+
+        x0 = cbt__HeapRead(tree, cbt_CreateNode(j << 1    , depth + 1));
+        x1 = cbt__HeapRead(tree, cbt_CreateNode(j << 1 | 1, depth + 1));
+        cbt__HeapWrite(tree, cbt_CreateNode(j, depth), x0 + x1);
+    }
+}
+
+
+/*******************************************************************************
+ * ComputeSumReduction_Incremental -- Updates the sums above dirty bitfield words
+ *
+ * Only the prepass of the dirty bitfield words and the sums of their
+ * ancestors are recomputed, so the cost scales with the number of modified
+ * words rather than with the size of the tree. Since the dirty words are
+ * gathered in increasing order, the words that share an ancestor at a given
+ * level are contiguous and only the first one of them updates the ancestor.
+ * We fall back to the full reduction when many words are dirty.
+ *
+ */
+static void
+cbt__ReduceBufferIDs(cbt_Tree *tree, const uint64_t *bufferIDs, int64_t bufferIDCount)
+{
+    int64_t maxDepth = cbt_MaxDepth(tree);
+    cbt__ReductionLoop loop = {tree, NULL, NULL, 0u, 0, 0};
+    CBT__STATS(int64_t time = cbt__Time();)
+
+    // prepass: processes deepest levels of dirty words in parallel
+    loop.bufferIDs = bufferIDs;
+    loop.minNodeID = 1ULL << maxDepth;
+    if (tree->layout == CBT_LAYOUT_PACKED && maxDepth >= 12) {
+        loop.kernel = cbt__SelectPrepassKernel();
+        loop.levelCount = 6;
+        cbt__ParallelFor(tree,
+                         bufferIDCount,
+                         4,
+                         &cbt__IncrementalLoop_PrepassBlock,
+                         &loop);
+    } else {
+        cbt__ParallelFor(tree,
+                         bufferIDCount,
+                         64,
+                         &cbt__IncrementalLoop_Prepass,
+                         &loop);
+    }
+    CBT__STATS(cbt__EndLevelTimer(tree, maxDepth - 1, time);)
+
+    // update the ancestors of the dirty words level by level
+    for (int64_t depth = maxDepth - 7; depth >= 0; --depth) {
+        CBT__STATS(time = cbt__Time();)
+        loop.minNodeID = 1ULL << depth;
+        loop.depth = depth;
+        loop.levelCount = maxDepth - 6 - depth;
+        cbt__ParallelFor(tree,
+                         bufferIDCount,
+                         64,
+                         &cbt__IncrementalLoop_Node,
+                         &loop);
+        CBT__STATS(cbt__EndLevelTimer(tree, depth, time);)
+    }
+}
+
+// gathers the dirty words and clears their dirty bits
+static uint64_t *cbt__GatherDirtyBufferIDs_Scratch(cbt_Tree *tree, int64_t bufferIDCount)
+{
+    int64_t topLevel = tree->dirtyLevelCount - 1;
+
+    if (bufferIDCount > tree->dirtyBufferIDCapacity) {
+        CBT_FREE(tree->dirtyBufferIDs);
+        tree->dirtyBufferIDs = (uint64_t *)CBT_MALLOC(sizeof(uint64_t) * bufferIDCount);
+        tree->dirtyBufferIDCapacity = bufferIDCount;
+    }
+    cbt__GatherDirtyBufferIDs(tree, topLevel, 0, tree->dirtyBufferIDs, 0);
+
+    return tree->dirtyBufferIDs;
+}
+
+static void cbt__ComputeSumReduction_Incremental(cbt_Tree *tree)
+{
+    int64_t maxDepth = cbt_MaxDepth(tree);
+    int64_t topLevel = tree->dirtyLevelCount - 1;
+    int64_t bufferIDCount = cbt__GatherDirtyBufferIDs(tree, topLevel, 0, NULL, 0);
+    uint64_t *bufferIDs;
+    CBT__STATS(int64_t reductionTime = cbt__Time();)
+
+    if (bufferIDCount == 0) {
+        return;
+    } else if (bufferIDCount > (cbt__BitFieldUint64Size(maxDepth) >> 2)) {
+        cbt__ComputeSumReduction(tree);
+        return;
+    }
+
+    CBT__STATS(CBT__STATS_ADD(tree, reductionCount, 1);)
+    CBT__STATS(CBT__STATS_ADD(tree, reducedWordCount, bufferIDCount);)
+
+    bufferIDs = cbt__GatherDirtyBufferIDs_Scratch(tree, bufferIDCount);
+    cbt__RecordSnapshotChanges(tree, bufferIDs, bufferIDCount);
+    cbt__ReduceBufferIDs(tree, bufferIDs, bufferIDCount);
+    cbt__UpdateRankIndex(tree, bufferIDs, bufferIDCount);
+    CBT__STATS(cbt__EndReductionTimer(tree, reductionTime);)
+}
+
+
+/*******************************************************************************
+ * PublishSnapshot -- Brings a free snapshot up to date and publishes it
+ *
+ * The bitfield words flagged in the dirty bitmap of the snapshot are copied
+ * from the tree, and the snapshot then recomputes their sums on its own.
+ *
+ */
+static void cbt__SyncSnapshot(const cbt_Tree *tree, cbt_Tree *snapshot)
+{
+    int64_t maxDepth = cbt_MaxDepth(tree);
+    int64_t topLevel = snapshot->dirtyLevelCount - 1;
+    int64_t bufferIDCount;
+    const uint64_t *words = cbt__BitFieldWords(tree);
+    uint64_t *snapshotWords = cbt__BitFieldWords(snapshot);
+    uint64_t *bufferIDs;
+
+    bufferIDCount = cbt__GatherDirtyBufferIDs(snapshot, topLevel, 0, NULL, 0);
+    if (bufferIDCount > (cbt__BitFieldUint64Size(maxDepth) >> 2)) {
+        cbt__CopySnapshot(tree, snapshot);
+        return;
+    }
+
+    if (bufferIDCount > snapshot->dirtyBufferIDCapacity) {
+        CBT_FREE(snapshot->dirtyBufferIDs);
+        snapshot->dirtyBufferIDs = (uint64_t *)CBT_MALLOC(sizeof(uint64_t) * bufferIDCount);
+        snapshot->dirtyBufferIDCapacity = bufferIDCount;
+    }
+    bufferIDs = snapshot->dirtyBufferIDs;
+    cbt__GatherDirtyBufferIDs(snapshot, topLevel, 0, bufferIDs, 0);
+
+    for (int64_t i = 0; i < bufferIDCount; ++i) {
+        snapshotWords[bufferIDs[i]] = words[bufferIDs[i]];
+    }
+
+    // gathering cleared the dirty bits, so flag the words again for the sums
+    for (int64_t i = 0; i < bufferIDCount; ++i) {
+        cbt__SetDirtyBit(snapshot, bufferIDs[i]);
+    }
+
+    snapshot->executor = tree->executor;
+    cbt__ComputeSumReduction_Incremental(snapshot);
+}
+
+static void cbt__PublishSnapshot(cbt_Tree *tree)
+{
+    cbt__Snapshots *snapshots = tree->snapshots;
+    int64_t snapshotID;
+    cbt_Tree *snapshot;
+
+    if (snapshots == NULL || !snapshots->hasChanges)
+        return;
+
+    snapshotID = cbt__FreeSnapshotID(snapshots);
+    if (snapshotID < 0)
+        return;
+
+    snapshot = snapshots->trees[snapshotID];
+    if (snapshots->isOutdated[snapshotID]) {
+        cbt__CopySnapshot(tree, snapshot);
+    } else {
+        cbt__SyncSnapshot(tree, snapshot);
+    }
+
+    cbt__SwapSnapshot(tree, snapshotID);
+}
+
+
+/*******************************************************************************
+ * ReductionJob -- Sum reduction spread over several calls
+ *
+ * The job reduces a list of items, which are either the dirty bitfield words,
+ * gathered when the job begins, or all the bitfield words when there are too
+ * many of them. Each step prepasses a slice of consecutive items and
+ * recomputes the sums of their ancestors, as the incremental reduction does.
+ * The ancestors that are shared with the next slices are recomputed by these
+ * again, so their sums are only final once the last slice is done. Until
+ * then, the sums above the bitfield are stale and the tree must not be
+ * queried nor modified. The snapshots are published once the job completes,
+ * so that readers keep working with the previous version of the tree.
+ *
+ */
+static void
+cbt__ReduceBufferRange(cbt_Tree *tree, int64_t firstBufferID, int64_t bufferCount)
+{
+    int64_t maxDepth = cbt_MaxDepth(tree);
+    int64_t lastBufferID = firstBufferID + bufferCount - 1;
+    cbt__ReductionLoop loop = {tree, NULL, NULL, 0u, 0, 0};
+
+    loop.minNodeID = (1ULL << maxDepth) + ((uint64_t)firstBufferID << 6);
+    if (tree->layout == CBT_LAYOUT_PACKED && maxDepth >= 12) {
+        loop.kernel = cbt__SelectPrepassKernel();
+        cbt__ParallelFor(tree,
+                         (bufferCount + 63) >> 6,
+                         4,
+                         &cbt__ReductionLoop_PrepassBlock,
+                         &loop);
+    } else {
+        cbt__ParallelFor(tree,
+                         bufferCount,
+                         64,
+                         &cbt__ReductionLoop_Prepass,
+                         &loop);
+    }
+
+    for (int64_t depth = maxDepth - 7; depth >= 0; --depth) {
+        int64_t shift = maxDepth - 6 - depth;
+        int64_t firstNodeID = firstBufferID >> shift;
+
+        loop.minNodeID = (1ULL << depth) + (uint64_t)firstNodeID;
+        loop.depth = depth;
+        cbt__ParallelFor(tree,
+                         (lastBufferID >> shift) - firstNodeID + 1,
+                         64,
+                         &cbt__ReductionLoop_Node,
+                         &loop);
+    }
+}
+
+static void cbt__BeginReduction(cbt_Tree *tree, bool isFull)
+{
+    CBT_ASSERT(!tree->reduction.isPending && "a reduction is already pending");
+    int64_t maxDepth = cbt_MaxDepth(tree);
+    int64_t topLevel = tree->dirtyLevelCount - 1;
+    int64_t bufferCount = cbt__BitFieldUint64Size(maxDepth);
+    int64_t itemCount = isFull
+                      ? bufferCount
+                      : cbt__GatherDirtyBufferIDs(tree, topLevel, 0, NULL, 0);
+
+    if (itemCount == 0)
+        return;
+
+    CBT__STATS(CBT__STATS_ADD(tree, reductionCount, 1);)
+    tree->reduction.isFull = isFull || itemCount > (bufferCount >> 2);
+    tree->reduction.cursor = 0;
+    tree->reduction.nodeCount = -1;
+    tree->reduction.isPending = true;
+
+    if (tree->reduction.isFull) {
+        tree->reduction.itemCount = bufferCount;
+        cbt__ClearDirtyBits(tree);
+        cbt__RecordSnapshotChanges(tree, NULL, 0);
+    } else {
+        uint64_t *bufferIDs = cbt__GatherDirtyBufferIDs_Scratch(tree, itemCount);
+
+        tree->reduction.itemCount = itemCount;
+        cbt__RecordSnapshotChanges(tree, bufferIDs, itemCount);
+    }
+}
+
+// completes the pending reduction, if any
+static void cbt__EndReduction(cbt_Tree *tree)
+{
+    cbt_ReductionStep(tree, INT64_MAX);
+}
+
+// ends the modifications of a tree by an update
+static void cbt__ComputeSumReduction_Deferrable(cbt_Tree *tree)
+{
+    if (tree->isReductionDeferred) {
+        cbt__BeginReduction(tree, false);
+    } else {
+        cbt__ComputeSumReduction_Incremental(tree);
+        cbt__PublishSnapshot(tree);
+    }
+}
+
+CBTDEF void cbt_SetReductionDeferred(cbt_Tree *tree, bool isDeferred)
+{
+    tree->isReductionDeferred = isDeferred;
+}
+
+/*
+ * Begins a reduction of the bitfield words modified since the last one,
+ * e.g., after splitting and merging nodes outside of the updates.
+ */
+CBTDEF void cbt_BeginReduction(cbt_Tree *tree)
+{
+    CBT_ASSERT(!tree->isReadOnly && "tree is read-only");
+
+    cbt__BeginReduction(tree, false);
+}
+
+/*
+ * Reduces about maxWordCount more bitfield words of the pending reduction,
+ * and returns true once the sums are up to date.
+ */
+CBTDEF bool cbt_ReductionStep(cbt_Tree *tree, int64_t maxWordCount)
+{
+    CBT_ASSERT(maxWordCount > 0 && "maxWordCount must be positive");
+    cbt__ReductionJob *job = &tree->reduction;
+    int64_t itemCount;
+    CBT__STATS(int64_t reductionTime = cbt__Time();)
+
+    if (!job->isPending)
+        return true;
+
+    itemCount = job->itemCount - job->cursor;
+    itemCount = itemCount < maxWordCount ? itemCount : maxWordCount;
+
+    if (job->isFull) {
+        // slices span whole prepass blocks
+        itemCount = (itemCount + 63) & ~63LL;
+        itemCount = itemCount < job->itemCount - job->cursor
+                  ? itemCount
+                  : job->itemCount - job->cursor;
+        cbt__ReduceBufferRange(tree, job->cursor, itemCount);
+    } else {
+        cbt__ReduceBufferIDs(tree, &tree->dirtyBufferIDs[job->cursor], itemCount);
+    }
+
+    job->cursor += itemCount;
+    CBT__STATS(CBT__STATS_ADD(tree, reducedWordCount, itemCount);)
+    CBT__STATS(cbt__EndReductionTimer(tree, reductionTime);)
+
+    if (job->cursor < job->itemCount)
+        return false;
+
+    job->isPending = false;
+    if (job->isFull)
+        cbt__UpdateRankIndex(tree, NULL, 0);
+    else
+        cbt__UpdateRankIndex(tree, tree->dirtyBufferIDs, job->itemCount);
+    cbt__PublishSnapshot(tree);
+    CBT__STATS(cbt__EndDeferredReduction(tree);)
+
+    return true;
+}
+
+/*
+ * The queries assert that no reduction is pending, as they read the sums,
+ * e.g., cbt_HeapRead, cbt_IsLeafNode, and cbt_NodeCount. Release builds
+ * do not check this, and the queries then return stale results instead.
+ */
+CBTDEF bool cbt_IsReductionPending(const cbt_Tree *tree)
+{
+    return tree->reduction.isPending;
+}
+
+
+/*******************************************************************************
+ * Virtual Memory -- Zero-initialized memory allocated page by page
+ *
+ * Sparse trees reserve address space for their heap and their dirty bitmap,
+ * and the system only allocates the pages that get written; the pages that
+ * are only read are backed by a shared zero page. On Windows, the memory is
+ * committed up front but physical pages are still allocated on first touch.
+ * Where none of this is available, the memory is allocated and cleared.
+ *
+ */
+#if !defined(_WIN32) && !defined(MAP_ANONYMOUS)
+#   define CBT__NO_VIRTUAL_MEMORY
+#endif
+
+static int64_t cbt__VirtualByteSize(int64_t byteSize)
+{
+    return (byteSize + 0xFFFF) & ~0xFFFFLL;
+}
+
+static void *cbt__ReserveMemory(int64_t byteSize)
+{
+    int64_t virtualByteSize = cbt__VirtualByteSize(byteSize);
+#if defined(_WIN32)
+    return VirtualAlloc(NULL,
+                        (SIZE_T)virtualByteSize,
+                        MEM_RESERVE | MEM_COMMIT,
+                        PAGE_READWRITE);
+#elif !defined(CBT__NO_VIRTUAL_MEMORY)
+    void *memory = mmap(NULL,
+                        (size_t)virtualByteSize,
+                        PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                        -1,
+                        0);
+
+    return memory != MAP_FAILED ? memory : NULL;
+#else
+    uint64_t *memory = (uint64_t *)CBT_MALLOC(virtualByteSize);
+
+    for (int64_t bufferID = 0;
+         memory != NULL && bufferID < (virtualByteSize >> 3);
+         ++bufferID) {
+        memory[bufferID] = 0u;
+    }
+
+    return memory;
+#endif
+}
+
+static void cbt__ReleaseMemory(void *memory, int64_t byteSize)
+{
+#if defined(_WIN32)
+    (void)byteSize;
+    VirtualFree(memory, 0, MEM_RELEASE);
+#elif !defined(CBT__NO_VIRTUAL_MEMORY)
+    munmap(memory, (size_t)cbt__VirtualByteSize(byteSize));
+#else
+    (void)byteSize;
+    CBT_FREE(memory);
+#endif
+}
+
+// resets the memory to zero and gives its pages back to the system
+static void cbt__DiscardMemory(void *memory, int64_t byteSize)
+{
+    int64_t virtualByteSize = cbt__VirtualByteSize(byteSize);
+#if defined(_WIN32)
+    VirtualFree(memory, (SIZE_T)virtualByteSize, MEM_DECOMMIT);
+    VirtualAlloc(memory, (SIZE_T)virtualByteSize, MEM_COMMIT, PAGE_READWRITE);
+#elif !defined(CBT__NO_VIRTUAL_MEMORY)
+    mmap(memory,
+         (size_t)virtualByteSize,
+         PROT_READ | PROT_WRITE,
+         MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED,
+         -1,
+         0);
+#else
+    for (int64_t bufferID = 0; bufferID < (virtualByteSize >> 3); ++bufferID) {
+        ((uint64_t *)memory)[bufferID] = 0u;
+    }
+#endif
+}
+
+
+/*******************************************************************************
+ * File Mapping -- Maps a whole file in memory
+ *
+ * Writable mappings are shared with the file, so that modifications reach
+ * the file without copies; cbt__FlushFile waits until they do.
+ *
+ */
+#if !defined(_WIN32) && !defined(__unix__) && !defined(__APPLE__)
+#   define CBT__NO_FILE_MAPPING
+#endif
+
+struct cbt__MappedFile {
+    char *memory;
+    int64_t byteSize;
+    void *fileHandle;    // Win32 only
+    void *mappingHandle; // Win32 only
+};
+
+static bool
+cbt__MapFile(cbt__MappedFile *file, const char *path, bool isWritable)
+{
+#if defined(_WIN32)
+    HANDLE fileHandle = CreateFileA(path,
+                                    isWritable ? GENERIC_READ | GENERIC_WRITE
+                                               : GENERIC_READ,
+                                    FILE_SHARE_READ,
+                                    NULL,
+                                    OPEN_EXISTING,
+                                    FILE_ATTRIBUTE_NORMAL,
+                                    NULL);
+    HANDLE mappingHandle;
+    LARGE_INTEGER byteSize;
+
+    if (fileHandle == INVALID_HANDLE_VALUE)
+        return false;
+
+    if (!GetFileSizeEx(fileHandle, &byteSize) || byteSize.QuadPart <= 0) {
+        CloseHandle(fileHandle);
+
+        return false;
+    }
+
+    mappingHandle = CreateFileMappingA(fileHandle,
+                                       NULL,
+                                       isWritable ? PAGE_READWRITE : PAGE_READONLY,
+                                       0,
+                                       0,
+                                       NULL);
+
+    if (mappingHandle == NULL) {
+        CloseHandle(fileHandle);
+
+        return false;
+    }
+
+    file->memory = (char *)MapViewOfFile(mappingHandle,
+                                         isWritable ? FILE_MAP_WRITE : FILE_MAP_READ,
+                                         0,
+                                         0,
+                                         0);
+
+    if (file->memory == NULL) {
+        CloseHandle(mappingHandle);
+        CloseHandle(fileHandle);
+
+        return false;
+    }
+
+    file->byteSize = (int64_t)byteSize.QuadPart;
+    file->fileHandle = fileHandle;
+    file->mappingHandle = mappingHandle;
+
+    return true;
+#elif !defined(CBT__NO_FILE_MAPPING)
+    int fileDescriptor = open(path, isWritable ? O_RDWR : O_RDONLY);
+    struct stat fileStat;
+    void *memory;
+
+    if (fileDescriptor < 0)
+        return false;
+
+    if (fstat(fileDescriptor, &fileStat) != 0 || fileStat.st_size <= 0) {
+        close(fileDescriptor);
+
+        return false;
+    }
+
+    memory = mmap(NULL,
+                  (size_t)fileStat.st_size,
+                  isWritable ? PROT_READ | PROT_WRITE : PROT_READ,
+                  MAP_SHARED,
+                  fileDescriptor,
+                  0);
+    close(fileDescriptor);
+
+    if (memory == MAP_FAILED)
+        return false;
+
+    file->memory = (char *)memory;
+    file->byteSize = (int64_t)fileStat.st_size;
+    file->fileHandle = NULL;
+    file->mappingHandle = NULL;
+
+    return true;
+#else
+    (void)file;
+    (void)path;
+    (void)isWritable;
+
+    return false;
+#endif
+}
+
+static void cbt__FlushFile(const cbt__MappedFile *file)
+{
+#if defined(_WIN32)
+    FlushViewOfFile(file->memory, 0);
+    FlushFileBuffers((HANDLE)file->fileHandle);
+#elif !defined(CBT__NO_FILE_MAPPING)
+    msync(file->memory, (size_t)file->byteSize, MS_SYNC);
+#else
+    (void)file;
+#endif
+}
+
+static void cbt__UnmapFile(const cbt__MappedFile *file)
+{
+#if defined(_WIN32)
+    UnmapViewOfFile(file->memory);
+    CloseHandle((HANDLE)file->mappingHandle);
+    CloseHandle((HANDLE)file->fileHandle);
+#elif !defined(CBT__NO_FILE_MAPPING)
+    munmap(file->memory, (size_t)file->byteSize);
+#else
+    (void)file;
+#endif
+}
+
+
+/*******************************************************************************
+ * Allocator -- Default allocator, which forwards to CBT_MALLOC and CBT_FREE
+ *
+ * Allocations are padded so that they can be aligned, and the address
+ * returned by CBT_MALLOC is stored right before the aligned memory.
+ *
+ */
+#define CBT__HUGE_PAGE_SIZE (2LL << 20)
+
+static void *
+cbt__Allocate_Default(int64_t byteSize, int64_t alignment, void *allocatorData)
+{
+    char *memory = (char *)CBT_MALLOC(byteSize + alignment + sizeof(void *));
+    uintptr_t address;
+
+    (void)allocatorData;
+
+    if (memory == NULL)
+        return NULL;
+
+    address = (uintptr_t)(memory + sizeof(void *));
+    address = (address + alignment - 1) & ~(uintptr_t)(alignment - 1);
+    ((void **)address)[-1] = memory;
+
+    return (void *)address;
+}
+
+static void
+cbt__Release_Default(void *memory, int64_t byteSize, void *allocatorData)
+{
+    (void)byteSize;
+    (void)allocatorData;
+
+    if (memory != NULL)
+        CBT_FREE(((void **)memory)[-1]);
+}
+
+static const cbt_Allocator cbt__DefaultAllocator = {
+    &cbt__Allocate_Default,
+    &cbt__Release_Default,
+    NULL
+};
+
+// hints the system to back the memory with huge pages
+static void cbt__AdviseHugePages(void *memory, int64_t byteSize)
+{
+#if !defined(_WIN32) && defined(MADV_HUGEPAGE)
+    madvise(memory,
+            (size_t)(byteSize & ~(CBT__HUGE_PAGE_SIZE - 1)),
+            MADV_HUGEPAGE);
+#else
+    (void)memory;
+    (void)byteSize;
+#endif
+}
+
+
+/*******************************************************************************
+ * Buffer Ctor
+ *
+ * The tree, its dirty bitmap and its heap come from the allocator of the
+ * create info, unless the caller provides the heap memory, which is then
+ * overwritten and never released by the tree. Sparse trees allocate their
+ * heap and dirty bitmap with cbt__ReserveMemory instead. NULL is returned
+ * when an allocation fails. The scratch buffers used by the updates are
+ * allocated with CBT_MALLOC.
+ *
+ */
+// initializes the fields of a tree and returns the byte size of its heap
+static int64_t
+cbt__InitTree(cbt_Tree *tree, int64_t maxDepth, cbt_Layout layout, bool isSparse)
+{
+    int64_t dirtyBitCount = cbt__BitFieldUint64Size(maxDepth);
+    int64_t dirtyBufferCount = 0;
+    int64_t dirtyLevelCount = 0;
+
+    // layout of the dirty bitmap
+    do {
+        int64_t levelBufferCount = (dirtyBitCount + 63) >> 6;
+
+        tree->dirtyLevelOffsets[dirtyLevelCount++] = dirtyBufferCount;
+        dirtyBufferCount+= levelBufferCount;
+        dirtyBitCount = levelBufferCount;
+    } while (dirtyBitCount > 1);
+    tree->dirtyLevelOffsets[dirtyLevelCount] = dirtyBufferCount;
+    tree->dirtyLevelCount = dirtyLevelCount;
+    tree->dirtyBufferIDs = NULL;
+    tree->dirtyBufferIDCapacity = 0;
+    tree->executor.parallelFor = &cbt__ParallelFor_Default;
+    tree->executor.executorData = NULL;
+    tree->executor.threadCount = cbt__DefaultThreadCount();
+    tree->intentBuffers = NULL;
+    tree->intentBufferCount = 0;
+    tree->intents.intents = NULL;
+    tree->intents.intentCount = tree->intents.intentCapacity = 0;
+    tree->splits = tree->intents;
+    tree->candidateBuffers = NULL;
+    tree->candidateBufferCount = 0;
+    tree->chunkIDs = NULL;
+    tree->chunkIDCapacity = 0;
+    tree->allocator = cbt__DefaultAllocator;
+    tree->file = NULL;
+    tree->snapshots = NULL;
+    tree->snapshotEpoch = 0;
+    tree->rankIndex = NULL;
+    tree->reduction.itemCount = tree->reduction.cursor = 0;
+    tree->reduction.nodeCount = -1;
+    tree->reduction.isFull = tree->reduction.isPending = false;
+    tree->isUpdating = false;
+    tree->isReductionDeferred = false;
+    tree->isHeapOwned = true;
+    tree->isReadOnly = false;
+    tree->isSparse = isSparse;
+#ifdef CBT_ENABLE_STATS
+    tree->instrumentation = (cbt__Instrumentation *)
+        CBT_MALLOC(sizeof(cbt__Instrumentation));
+    tree->instrumentation->traceCallback = NULL;
+    tree->instrumentation->traceUserData = NULL;
+    cbt__ClearStats(&tree->instrumentation->stats);
+#endif
+
+    return cbt__CreateLayout(tree, maxDepth, layout);
+}
+
+static cbt_Tree *cbt__Create(const cbt_CreateInfo *info, bool isSparse)
+{
+    CBT_ASSERT(info->maxDepth >=  6 && "maxDepth must be at least 6");
+    CBT_ASSERT(info->maxDepth <= 58 && "maxDepth must be at most 58");
+    CBT_ASSERT((info->heapAlignment & (info->heapAlignment - 1)) == 0
+               && "heapAlignment must be a power of two");
+    const cbt_Allocator *allocator = info->allocator != NULL
+                                   ? info->allocator
+                                   : &cbt__DefaultAllocator;
+    int64_t heapAlignment = info->heapAlignment > 8 ? info->heapAlignment : 8;
+    cbt_Tree *tree = (cbt_Tree *)allocator->allocate(sizeof(*tree),
+                                                     8,
+                                                     allocator->allocatorData);
+    int64_t heapByteSize, dirtyBufferCount;
+
+    if (tree == NULL)
+        return NULL;
+
+    heapByteSize = cbt__InitTree(tree, info->maxDepth, info->layout, isSparse);
+    dirtyBufferCount = tree->dirtyLevelOffsets[tree->dirtyLevelCount];
+    tree->allocator = *allocator;
+    tree->isHeapOwned = (info->heap == NULL);
+
+    if (info->useHugePages && heapAlignment < CBT__HUGE_PAGE_SIZE)
+        heapAlignment = CBT__HUGE_PAGE_SIZE;
+
+    if (isSparse) {
+        tree->dirtyBits = (uint64_t *)cbt__ReserveMemory(sizeof(uint64_t) * dirtyBufferCount);
+        tree->heap = (uint64_t *)cbt__ReserveMemory(heapByteSize);
+
+        if (tree->dirtyBits == NULL || tree->heap == NULL) {
+            if (tree->dirtyBits != NULL)
+                cbt__ReleaseMemory(tree->dirtyBits, sizeof(uint64_t) * dirtyBufferCount);
+
+            if (tree->heap != NULL)
+                cbt__ReleaseMemory(tree->heap, heapByteSize);
+
+            allocator->release(tree, sizeof(*tree), allocator->allocatorData);
+
+            return NULL;
+        }
+    } else {
+        tree->dirtyBits = (uint64_t *)
+            allocator->allocate(sizeof(uint64_t) * dirtyBufferCount,
+                                8,
+                                allocator->allocatorData);
+
+        if (info->heap != NULL) {
+            CBT_ASSERT(info->heapByteSize >= heapByteSize && "heap is too small");
+            CBT_ASSERT(((uintptr_t)info->heap & 7) == 0 && "heap must be 8-byte aligned");
+            tree->heap = (uint64_t *)info->heap;
+        } else {
+            tree->heap = (uint64_t *)allocator->allocate(heapByteSize,
+                                                         heapAlignment,
+                                                         allocator->allocatorData);
+
+            if (tree->heap != NULL && info->useHugePages)
+                cbt__AdviseHugePages(tree->heap, heapByteSize);
+        }
+
+        if (tree->dirtyBits == NULL || tree->heap == NULL) {
+            if (tree->dirtyBits != NULL)
+                allocator->release(tree->dirtyBits,
+                                   sizeof(uint64_t) * dirtyBufferCount,
+                                   allocator->allocatorData);
+
+            if (tree->heap != NULL && tree->isHeapOwned)
+                allocator->release(tree->heap,
+                                   heapByteSize,
+                                   allocator->allocatorData);
+
+            allocator->release(tree, sizeof(*tree), allocator->allocatorData);
+
+            return NULL;
+        }
+
+        cbt__ClearDirtyBits(tree);
+
+        if (info->keepHeap) {
+            CBT_ASSERT(info->heap != NULL && "keepHeap requires a heap");
+            CBT_ASSERT(cbt_MaxDepth(tree) == info->maxDepth
+                       && (tree->heap[0] & 3u) == (uint64_t)info->layout
+                       && "heap has a different max depth or layout");
+
+            return tree;
+        }
+
+        // clear the padding bits of the layout so that heaps serialize identically
+        for (int64_t bufferID = 0; bufferID < (heapByteSize >> 3); ++bufferID) {
+            tree->heap[bufferID] = 0u;
+        }
+    }
+    tree->heap[0] = (1ULL << (info->maxDepth)) | info->layout; // store max Depth and layout
+
+    cbt_ResetToDepth(tree, info->depth);
+
+    return tree;
+}
+
+CBTDEF cbt_Tree *cbt_CreateWithInfo(const cbt_CreateInfo *info)
+{
+    return cbt__Create(info, false);
+}
+
+CBTDEF cbt_Tree *
+cbt_CreateInBuffer(void *buffer, int64_t byteSize, int64_t maxDepth)
+{
+    cbt_CreateInfo info = {
+        maxDepth, 0, CBT_LAYOUT_PACKED, NULL, 0, false, buffer, byteSize, false
+    };
+
+    return cbt__Create(&info, false);
+}
+
+CBTDEF cbt_Tree *
+cbt_CreateWithLayout(int64_t maxDepth, int64_t depth, cbt_Layout layout)
+{
+    cbt_CreateInfo info = {maxDepth, depth, layout, NULL, 0, false, NULL, 0, false};
+
+    return cbt__Create(&info, false);
+}
+
+CBTDEF cbt_Tree *
+cbt_CreateSparse(int64_t maxDepth, int64_t depth, cbt_Layout layout)
+{
+    cbt_CreateInfo info = {maxDepth, depth, layout, NULL, 0, false, NULL, 0, false};
+
+    return cbt__Create(&info, true);
+}
+
+CBTDEF cbt_Tree *cbt_CreateAtDepth(int64_t maxDepth, int64_t depth)
+{
+    return cbt_CreateWithLayout(maxDepth, depth, CBT_LAYOUT_PACKED);
+}
+
+CBTDEF cbt_Tree *cbt_Create(int64_t maxDepth)
+{
+    return cbt_CreateAtDepth(maxDepth, 0);
+}
+
+
+/*******************************************************************************
+ * Buffer Dtor
+ *
+ */
+static void cbt__ReleaseScratchBuffers(cbt_Tree *tree)
+{
+    for (int64_t bufferID = 0; bufferID < tree->intentBufferCount; ++bufferID) {
+        CBT_FREE(tree->intentBuffers[bufferID].intents);
+    }
+
+    for (int64_t bufferID = 0; bufferID < tree->candidateBufferCount; ++bufferID) {
+        CBT_FREE(tree->candidateBuffers[bufferID].candidates);
+    }
+
+    CBT_FREE(tree->intentBuffers);
+    CBT_FREE(tree->candidateBuffers);
+    CBT_FREE(tree->intents.intents);
+    CBT_FREE(tree->splits.intents);
+    CBT_FREE(tree->chunkIDs);
+    CBT_FREE(tree->dirtyBufferIDs);
+    CBT__STATS(CBT_FREE(tree->instrumentation);)
+}
+
+CBTDEF void cbt_Release(cbt_Tree *tree)
+{
+    cbt_Allocator allocator = tree->allocator;
+    int64_t dirtyBufferCount = tree->dirtyLevelOffsets[tree->dirtyLevelCount];
+
+    // syncing reduces the sums, which uses the scratch buffers
+    if (tree->file != NULL) {
+        if (!tree->isReadOnly)
+            cbt_SyncFile(tree);
+
+        cbt__UnmapFile(tree->file);
+        CBT_FREE(tree->file);
+    }
+
+    cbt__ReleaseScratchBuffers(tree);
+
+    if (tree->snapshots != NULL) {
+        for (int64_t snapshotID = 0; snapshotID < CBT__SNAPSHOT_COUNT; ++snapshotID) {
+            CBT_ASSERT(tree->snapshots->readerCounts[snapshotID] == 0u
+                       && "snapshot is still acquired");
+            cbt_Release(tree->snapshots->trees[snapshotID]);
+        }
+
+        CBT_FREE(tree->snapshots);
+    }
+
+    cbt__ReleaseRankIndex(tree);
+
+    if (tree->isSparse) {
+        cbt__ReleaseMemory(tree->dirtyBits, sizeof(uint64_t) * dirtyBufferCount);
+        cbt__ReleaseMemory(tree->heap, cbt_HeapByteSize(tree));
+    } else {
+        allocator.release(tree->dirtyBits,
+                          sizeof(uint64_t) * dirtyBufferCount,
+                          allocator.allocatorData);
+
+        if (tree->isHeapOwned)
+            allocator.release(tree->heap,
+                              cbt_HeapByteSize(tree),
+                              allocator.allocatorData);
+    }
+
+    allocator.release(tree, sizeof(*tree), allocator.allocatorData);
+}
+
+
+/*******************************************************************************
+ * Files -- Stores a tree in a file, as a header followed by the heap
+ *
+ * The header is 64 bytes long, so that the heap remains aligned on cache
+ * lines when the file is mapped, and all its fields are little endian.
+ * The checksum is a 64-bit FNV-1a hash of the heap words. Since computing
+ * it reads the whole heap, mapped files only verify it upon request, and
+ * read-write mappings update it when they are synced.
+ *
+ */
+#define CBT__FILE_VERSION 1
+
+typedef struct {
+    char magic[8];       // "CBTHEAP" followed by a zero byte
+    uint32_t version;    // CBT__FILE_VERSION
+    uint32_t layout;
+    int64_t maxDepth;
+    int64_t heapByteSize;
+    uint64_t checksum;
+    uint64_t reserved[3];
+} cbt__FileHeader;
+
+static const char cbt__FileMagic[8] = {'C', 'B', 'T', 'H', 'E', 'A', 'P', '\0'};
+
+static uint64_t cbt__Checksum(const uint64_t *words, int64_t wordCount)
+{
+    uint64_t hash = 14695981039346656037ULL;
+
+    for (int64_t wordID = 0; wordID < wordCount; ++wordID) {
+        hash = (hash ^ words[wordID]) * 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+static cbt__FileHeader cbt__CreateFileHeader(const cbt_Tree *tree)
+{
+    cbt__FileHeader header;
+    int64_t heapByteSize = cbt_HeapByteSize(tree);
+
+    CBT_MEMCPY(header.magic, cbt__FileMagic, sizeof(header.magic));
+    header.version = CBT__FILE_VERSION;
+    header.layout = (uint32_t)tree->layout;
+    header.maxDepth = cbt_MaxDepth(tree);
+    header.heapByteSize = heapByteSize;
+    header.checksum = cbt__Checksum(tree->heap, heapByteSize >> 3);
+    header.reserved[0] = header.reserved[1] = header.reserved[2] = 0u;
+
+    return header;
+}
+
+static bool
+cbt__IsFileHeaderValid(const cbt__FileHeader *header, int64_t fileByteSize)
+{
+    int64_t headerByteSize = (int64_t)sizeof(*header);
+
+    if (fileByteSize < headerByteSize
+        || header->magic[0] != cbt__FileMagic[0]
+        || header->magic[1] != cbt__FileMagic[1]
+        || header->magic[2] != cbt__FileMagic[2]
+        || header->magic[3] != cbt__FileMagic[3]
+        || header->magic[4] != cbt__FileMagic[4]
+        || header->magic[5] != cbt__FileMagic[5]
+        || header->magic[6] != cbt__FileMagic[6]
+        || header->magic[7] != cbt__FileMagic[7]
+        || header->version != CBT__FILE_VERSION
+        || header->layout > (uint32_t)CBT_LAYOUT_BLOCKED
+        || header->maxDepth < 6
+        || header->maxDepth > 58) {
+        return false;
+    }
+
+    return header->heapByteSize == cbt_LayoutHeapByteSize(header->maxDepth,
+                                                          (cbt_Layout)header->layout)
+        && fileByteSize - headerByteSize >= header->heapByteSize;
+}
+
+// checks that the max depth and layout stored in the heap match the header
+static bool
+cbt__IsFileHeapValid(const cbt__FileHeader *header, const uint64_t *heap)
+{
+    return (heap[0] & 3u) == header->layout
+        && cbt__FindLSB(heap[0] & ~3ULL) == header->maxDepth;
+}
+
+/*
+ * The sums of the tree must be up to date, which is the case after any
+ * of the update, reset, and load functions.
+ */
+CBTDEF bool cbt_SaveFile(const cbt_Tree *tree, const char *path)
+{
+    CBT_ASSERT(!tree->reduction.isPending && "sums are stale");
+    cbt__FileHeader header = cbt__CreateFileHeader(tree);
+    FILE *stream = fopen(path, "wb");
+    bool isWritten;
+
+    if (stream == NULL)
+        return false;
+
+    isWritten = fwrite(&header, sizeof(header), 1, stream) == 1
+             && fwrite(tree->heap, (size_t)header.heapByteSize, 1, stream) == 1;
+
+    return (fclose(stream) == 0) && isWritten;
+}
+
+// reads the file into a new tree, verifying its checksum
+CBTDEF cbt_Tree *cbt_LoadFile(const char *path)
+{
+    FILE *stream = fopen(path, "rb");
+    cbt__FileHeader header;
+    cbt_Tree *tree = NULL;
+
+    if (stream == NULL)
+        return NULL;
+
+    if (fread(&header, sizeof(header), 1, stream) == 1
+        && cbt__IsFileHeaderValid(&header, (int64_t)sizeof(header) + header.heapByteSize)) {
+        tree = cbt_CreateWithLayout(header.maxDepth, 0, (cbt_Layout)header.layout);
+
+        if (tree != NULL
+            && (fread(tree->heap, (size_t)header.heapByteSize, 1, stream) != 1
+                || !cbt__IsFileHeapValid(&header, tree->heap)
+                || cbt__Checksum(tree->heap, header.heapByteSize >> 3) != header.checksum)) {
+            cbt_Release(tree);
+            tree = NULL;
+        }
+    }
+
+    fclose(stream);
+
+    return tree;
+}
+
+/*
+ * The heap of the tree is the mapped file itself, so opening the file
+ * does not read it, and each page is loaded upon first access. Read-only
+ * trees must not be modified. The modifications of read-write trees are
+ * written to the file by cbt_SyncFile, and when the tree is released.
+ */
+CBTDEF cbt_Tree *cbt_MapFile(const char *path, int flags)
+{
+    bool isWritable = (flags & CBT_FILE_READ_WRITE) != 0;
+    cbt__MappedFile file;
+    cbt__FileHeader header;
+    cbt_CreateInfo info;
+    const uint64_t *heap;
+    cbt_Tree *tree;
+
+    if (!cbt__MapFile(&file, path, isWritable))
+        return NULL;
+
+    if (file.byteSize >= (int64_t)sizeof(header))
+        CBT_MEMCPY(&header, file.memory, sizeof(header));
+
+    heap = (const uint64_t *)(file.memory + sizeof(header));
+
+    if (!cbt__IsFileHeaderValid(&header, file.byteSize)
+        || !cbt__IsFileHeapValid(&header, heap)
+        || ((flags & CBT_FILE_VERIFY_CHECKSUM)
+            && cbt__Checksum(heap, header.heapByteSize >> 3) != header.checksum)) {
+        cbt__UnmapFile(&file);
+
+        return NULL;
+    }
+
+    info.maxDepth = header.maxDepth;
+    info.depth = 0;
+    info.layout = (cbt_Layout)header.layout;
+    info.allocator = NULL;
+    info.heapAlignment = 0;
+    info.useHugePages = false;
+    info.heap = file.memory + sizeof(header);
+    info.heapByteSize = header.heapByteSize;
+    info.keepHeap = true;
+    tree = cbt__Create(&info, false);
+
+    if (tree == NULL) {
+        cbt__UnmapFile(&file);
+
+        return NULL;
+    }
+
+    tree->file = (cbt__MappedFile *)CBT_MALLOC(sizeof(file));
+    (*tree->file) = file;
+    tree->isReadOnly = !isWritable;
+
+    return tree;
+}
+
+/*
+ * Brings the sums of a read-write mapped tree up to date, stores its
+ * checksum, and waits until the file is written. Returns false if the
+ * tree is not a read-write mapped file.
+ */
+CBTDEF bool cbt_SyncFile(cbt_Tree *tree)
+{
+    cbt__FileHeader header;
+
+    if (tree->file == NULL || tree->isReadOnly)
+        return false;
+
+    cbt__EndReduction(tree);
+    cbt__ComputeSumReduction_Incremental(tree);
+    cbt__PublishSnapshot(tree);
+    header = cbt__CreateFileHeader(tree);
+    CBT_MEMCPY(tree->file->memory, &header, sizeof(header));
+    cbt__FlushFile(tree->file);
+
+    return true;
+}
+
+
+/*******************************************************************************
+ * Deltas -- Encodes the bitfield words that differ between two trees
+ *
+ * A delta starts with a header followed by runs of consecutive bitfield
+ * words, each made of its first word index, its word count, and the new
+ * words. Runs separated by fewer than CBT__DELTA_GAP_MIN unchanged words
+ * are merged, as this is cheaper than starting a new run. The sums are
+ * not encoded since the reduction recomputes them from the bitfield.
+ *
+ */
+#define CBT__DELTA_GAP_MIN 3
+
+typedef struct {
+    char magic[8];        // "CBTDELT" followed by a zero byte
+    uint64_t heapHeader;  // max depth and layout, as stored in the heap
+    int64_t runCount;
+    int64_t byteSize;
+} cbt__DeltaHeader;
+
+typedef struct {
+    int64_t wordID;
+    int64_t wordCount;
+} cbt__DeltaRun;
+
+static const char cbt__DeltaMagic[8] = {'C', 'B', 'T', 'D', 'E', 'L', 'T', '\0'};
+
+static inline uint64_t cbt__HeapHeader(const cbt_Tree *tree)
+{
+    return (1ULL << cbt_MaxDepth(tree)) | tree->layout;
+}
+
+// appends data to the delta if it fits within its capacity
+static void
+cbt__WriteDelta(
+    char *delta,
+    int64_t deltaCapacity,
+    int64_t *byteSize,
+    const void *data,
+    int64_t dataByteSize
+) {
+    if ((*byteSize) + dataByteSize <= deltaCapacity)
+        CBT_MEMCPY(&delta[*byteSize], data, dataByteSize);
+
+    (*byteSize)+= dataByteSize;
+}
+
+/*
+ * Writes the delta that turns the bitfield of oldTree into that of
+ * newTree and returns its byte size. The delta is only complete if its
+ * byte size does not exceed deltaCapacity, which can be zero to query the
+ * byte size. A delta is never larger than cbt_HeapByteSize(newTree) + 64.
+ */
+CBTDEF int64_t
+cbt_ComputeDelta(
+    const cbt_Tree *oldTree,
+    const cbt_Tree *newTree,
+    char *delta,
+    int64_t deltaCapacity
+) {
+    CBT_ASSERT(cbt__HeapHeader(oldTree) == cbt__HeapHeader(newTree)
+               && "trees have a different max depth or layout");
+    const uint64_t *oldWords = cbt__BitFieldWords(oldTree);
+    const uint64_t *newWords = cbt__BitFieldWords(newTree);
+    int64_t wordCount = cbt__BitFieldUint64Size(cbt_MaxDepth(newTree));
+    int64_t byteSize = (int64_t)sizeof(cbt__DeltaHeader);
+    cbt__DeltaHeader header;
+    int64_t wordID = 0;
+
+    CBT_MEMCPY(header.magic, cbt__DeltaMagic, sizeof(header.magic));
+    header.heapHeader = cbt__HeapHeader(newTree);
+    header.runCount = 0;
+
+    while (wordID < wordCount) {
+        cbt__DeltaRun run;
+        int64_t runEnd;
+
+        if (oldWords[wordID] == newWords[wordID]) {
+            ++wordID;
+            continue;
+        }
+
+        run.wordID = wordID;
+        runEnd = wordID + 1;
+
+        for (wordID = runEnd; wordID < wordCount; ++wordID) {
+            if (oldWords[wordID] != newWords[wordID])
+                runEnd = wordID + 1;
+            else if (wordID - runEnd + 1 >= CBT__DELTA_GAP_MIN)
+                break;
+        }
+
+        run.wordCount = runEnd - run.wordID;
+        cbt__WriteDelta(delta, deltaCapacity, &byteSize, &run, sizeof(run));
+        cbt__WriteDelta(delta,
+                        deltaCapacity,
+                        &byteSize,
+                        &newWords[run.wordID],
+                        sizeof(uint64_t) * run.wordCount);
+        ++header.runCount;
+    }
+
+    header.byteSize = byteSize;
+
+    if (byteSize <= deltaCapacity)
+        CBT_MEMCPY(delta, &header, sizeof(header));
+
+    return byteSize;
+}
+
+/*
+ * Copies the words of the delta into the bitfield of the tree and updates
+ * the sums of the modified words only. Returns false, leaving the tree
+ * untouched, if the delta is malformed or was computed for trees of a
+ * different max depth or layout.
+ */
+CBTDEF bool
+cbt_ApplyDelta(cbt_Tree *tree, const char *delta, int64_t deltaByteSize)
+{
+    CBT_ASSERT(!tree->isReadOnly && "tree is read-only");
+    uint64_t *words = cbt__BitFieldWords(tree);
+    int64_t wordCount = cbt__BitFieldUint64Size(cbt_MaxDepth(tree));
+    cbt__DeltaHeader header;
+    int64_t byteOffset;
+
+    if (deltaByteSize < (int64_t)sizeof(header))
+        return false;
+
+    CBT_MEMCPY(&header, delta, sizeof(header));
+
+    if (header.magic[0] != cbt__DeltaMagic[0]
+        || header.magic[1] != cbt__DeltaMagic[1]
+        || header.magic[2] != cbt__DeltaMagic[2]
+        || header.magic[3] != cbt__DeltaMagic[3]
+        || header.magic[4] != cbt__DeltaMagic[4]
+        || header.magic[5] != cbt__DeltaMagic[5]
+        || header.magic[6] != cbt__DeltaMagic[6]
+        || header.magic[7] != cbt__DeltaMagic[7]
+        || header.heapHeader != cbt__HeapHeader(tree)
+        || header.byteSize > deltaByteSize
+        || header.runCount < 0) {
+        return false;
+    }
+
+    // check all the runs before modifying the tree
+    byteOffset = (int64_t)sizeof(header);
+    for (int64_t runID = 0; runID < header.runCount; ++runID) {
+        cbt__DeltaRun run;
+
+        if (header.byteSize - byteOffset < (int64_t)sizeof(run))
+            return false;
+
+        CBT_MEMCPY(&run, &delta[byteOffset], sizeof(run));
+        byteOffset+= sizeof(run);
+
+        if (run.wordID < 0 || run.wordCount <= 0
+            || run.wordCount > wordCount - run.wordID
+            || run.wordCount > (header.byteSize - byteOffset) >> 3) {
+            return false;
+        }
+
+        byteOffset+= sizeof(uint64_t) * run.wordCount;
+    }
+
+    cbt__EndReduction(tree);
+    byteOffset = (int64_t)sizeof(header);
+    for (int64_t runID = 0; runID < header.runCount; ++runID) {
+        cbt__DeltaRun run;
+
+        CBT_MEMCPY(&run, &delta[byteOffset], sizeof(run));
+        byteOffset+= sizeof(run);
+        CBT_MEMCPY(&words[run.wordID],
+                   &delta[byteOffset],
+                   sizeof(uint64_t) * run.wordCount);
+        byteOffset+= sizeof(uint64_t) * run.wordCount;
+
+        for (int64_t wordID = run.wordID; wordID < run.wordID + run.wordCount; ++wordID) {
+            cbt__SetDirtyBit(tree, wordID);
+        }
+    }
+
+    cbt__ComputeSumReduction_Incremental(tree);
+    cbt__PublishSnapshot(tree);
+
+    return true;
+}
+
+
+/*******************************************************************************
+ * ResetToDepth -- Initializes a CBT to its a specific subdivision level
+ *
+ */
+static void
+cbt__ResetToDepth_Range(int64_t begin, int64_t end, void *callbackData)
+{
+    const cbt__ReductionLoop *loop = (const cbt__ReductionLoop *)callbackData;
+
+    for (int64_t i = begin; i < end; ++i) {
+        cbt_Node node = cbt_CreateNode(loop->minNodeID + i, loop->depth);
+
+        cbt__HeapWrite_BitField(loop->tree, node, 1u);
+    }
+}
+
+CBTDEF void cbt_ResetToDepth(cbt_Tree *tree, int64_t depth)
+{
+    CBT_ASSERT(depth >= 0 && "depth must be at least equal to 0");
+    CBT_ASSERT(depth <= cbt_MaxDepth(tree) && "depth must be at most equal to maxDepth");
+    CBT_ASSERT(!tree->isReadOnly && "tree is read-only");
+    cbt__ReductionLoop loop = {tree, NULL, NULL, 1ULL << depth, depth, 0};
+    CBT__STATS(int64_t time = cbt__Time();)
+    CBT__STATS(int64_t *timer = &tree->instrumentation->stats.resetNanoseconds;)
+
+    // the pending reduction, if any, is superseded by that of the reset
+    tree->reduction.isPending = false;
+
+    if (tree->isSparse) {
+        int64_t dirtyBufferCount = tree->dirtyLevelOffsets[tree->dirtyLevelCount];
+        int64_t maxDepth = cbt_MaxDepth(tree);
+
+        // start over from an empty heap so that only the new leaves use memory
+        cbt__DiscardMemory(tree->heap, cbt_HeapByteSize(tree));
+        cbt__DiscardMemory(tree->dirtyBits, sizeof(uint64_t) * dirtyBufferCount);
+        tree->heap[0] = (1ULL << maxDepth) | tree->layout;
+        cbt__ParallelFor(tree, 1LL << depth, 4096, &cbt__ResetToDepth_Range, &loop);
+        cbt__ComputeSumReduction_Deferrable(tree);
+    } else {
+        cbt__ClearBitfield(tree);
+        cbt__ParallelFor(tree, 1LL << depth, 4096, &cbt__ResetToDepth_Range, &loop);
+
+        if (tree->isReductionDeferred) {
+            cbt__BeginReduction(tree, true);
+        } else {
+            cbt__ComputeSumReduction(tree);
+            cbt__PublishSnapshot(tree);
+        }
+    }
+
+    CBT__STATS(CBT__STATS_ADD(tree, resetCount, 1);)
+    CBT__STATS(cbt__EndTimer(tree, timer, "cbt_ResetToDepth", depth, time);)
+}
+
+
+/*******************************************************************************
+ * ResetToCeil -- Initializes a CBT to its maximum subdivision level
+ *
+ */
+CBTDEF void cbt_ResetToCeil(cbt_Tree *tree)
+{
+    cbt_ResetToDepth(tree, cbt_MaxDepth(tree));
+}
+
+
+/*******************************************************************************
+ * ResetToRoot -- Initializes a CBT to its minimum subdivision level
+ *
+ */
+CBTDEF void cbt_ResetToRoot(cbt_Tree *tree)
+{
+    cbt_ResetToDepth(tree, 0);
+}
+
+
+/*******************************************************************************
+ * DeferBitFieldWrite -- Records the bitfield write of a deferred update
+ *
+ * During cbt_UpdateDeferred, each thread points cbt__deferredIntents to the
+ * intent buffer of the chunk it processes. Splits and merges of the tree
+ * being updated are recorded there instead of being written to the heap.
+ *
+ */
+static CBT__THREAD_LOCAL const cbt_Tree *cbt__deferredTree = NULL;
+static CBT__THREAD_LOCAL cbt__IntentBuffer *cbt__deferredIntents = NULL;
+
+static void cbt__PushIntent(cbt__IntentBuffer *buffer, const cbt__Intent intent)
+{
+    if (buffer->intentCount == buffer->intentCapacity) {
+        int64_t capacity = buffer->intentCapacity > 0 ? 2 * buffer->intentCapacity : 64;
+        cbt__Intent *intents = (cbt__Intent *)CBT_MALLOC(sizeof(*intents) * capacity);
+
+        if (buffer->intentCount > 0) {
+            CBT_MEMCPY(intents,
+                       buffer->intents,
+                       sizeof(*intents) * buffer->intentCount);
+        }
+
+        CBT_FREE(buffer->intents);
+        buffer->intents = intents;
+        buffer->intentCapacity = capacity;
+    }
+
+    buffer->intents[buffer->intentCount++] = intent;
+}
+
+// intents are ordered by bitfield bit, splits first, and then by depth
+static bool cbt__IntentPrecedes(const cbt__Intent *x, const cbt__Intent *y)
+{
+    if (x->bitID != y->bitID)
+        return x->bitID < y->bitID;
+
+    if (x->bitValue != y->bitValue)
+        return x->bitValue > y->bitValue;
+
+    return x->depth < y->depth;
+}
+
+// the intents of a chunk are recorded in leaf order, so they are mostly
+// sorted already and an insertion sort only moves the few that are not
+static void cbt__SortIntents(cbt__IntentBuffer *buffer)
+{
+    cbt__Intent *intents = buffer->intents;
+
+    for (int64_t i = 1; i < buffer->intentCount; ++i) {
+        cbt__Intent intent = intents[i];
+        int64_t j = i;
+
+        while (j > 0 && cbt__IntentPrecedes(&intent, &intents[j - 1])) {
+            intents[j] = intents[j - 1];
+            --j;
+        }
+
+        intents[j] = intent;
+    }
+}
+
+static void
+cbt__HeapWrite_BitFieldOrDefer(
+    cbt_Tree *tree,
+    const cbt_Node node,
+    uint64_t bitValue
+) {
+    if (cbt__deferredTree == tree) {
+        int64_t maxDepth = cbt_MaxDepth(tree);
+        cbt__Intent intent;
+
+        intent.bitID = (node.id << (maxDepth - node.depth)) ^ (1ULL << maxDepth);
+        intent.depth = (uint32_t)node.depth;
+        intent.bitValue = (uint32_t)bitValue;
+        cbt__PushIntent(cbt__deferredIntents, intent);
+    } else {
+        cbt__HeapWrite_BitField(tree, node, bitValue);
+    }
+}
+
+
+/*******************************************************************************
+ * Split -- Subdivides a node in two
+ *
+ * The _Fast version does not check if the node can actually split, so
+ * use it wisely, i.e., when you're absolutely sure the node depth is
+ * less than maxDepth.
+ *
+ */
+CBTDEF void cbt_SplitNode_Fast(cbt_Tree *tree, const cbt_Node node)
+{
+    cbt__HeapWrite_BitFieldOrDefer(tree, cbt_RightChildNode(node), 1u);
+    CBT__STATS(CBT__STATS_ADD(tree, splitCount, 1);)
+}
+
+CBTDEF void cbt_SplitNode(cbt_Tree *tree, const cbt_Node node)
+{
+    if (!cbt_IsCeilNode(tree, node)) {
+        cbt_SplitNode_Fast(tree, node);
+    } else {
+        CBT__STATS(CBT__STATS_ADD(tree, ceilSplitCount, 1);)
+    }
+}
+
+
+/*******************************************************************************
+ * Merge -- Merges the node with its neighbour
+ *
+ * The _Fast version does not check if the node can actually merge, so
+ * use it wisely, i.e., when you're absolutely sure the node depth is
+ * greater than 0.
+ *
+ */
+CBTDEF void cbt_MergeNode_Fast(cbt_Tree *tree, const cbt_Node node)
+{
+    cbt__HeapWrite_BitFieldOrDefer(tree, cbt_RightSiblingNode(node), 0u);
+    CBT__STATS(CBT__STATS_ADD(tree, mergeCount, 1);)
+}
+
+CBTDEF void cbt_MergeNode(cbt_Tree *tree, const cbt_Node node)
+{
+    if (!cbt_IsRootNode(node)) {
+        cbt_MergeNode_Fast(tree, node);
+    } else {
+        CBT__STATS(CBT__STATS_ADD(tree, rootMergeCount, 1);)
+    }
+}
+
+
+/*******************************************************************************
+ * LeafAncestor -- Returns the leaf node that contains a node of count 1
+ *
+ * This is the shallowest ancestor of the input node (possibly the node
+ * itself) that stores a count of 1, i.e., the node cbt_DecodeNode would
+ * return for the only leaf located in the subtree of the input node.
+ *
+ */
+static cbt_Node cbt__LeafAncestor(const cbt_Tree *tree, cbt_Node node)
+{
+    while (!cbt_IsRootNode(node)) {
+        cbt_Node parent = cbt_ParentNode_Fast(node);
+
+        if (cbt__HeapRead(tree, parent) > 1u)
+            break;
+
+        node = parent;
+    }
+
+    return node;
+}
+
+
+/*******************************************************************************
+ * DecodeLeaves_Word -- Lists the leaves located below a node of a 64-bit word
+ *
+ * The sums array stores the counts of the 6 levels above a bitfield word,
+ * packed in SWAR fashion: sums[k] has 64 >> k lanes of 2^k bits that hold
+ * the counts of the nodes located k levels above the bitfield. The input
+ * node is located k levels above the bitfield and its subtree is walked
+ * down in-register until nodes of count 1 are found.
+ *
+ */
+static int64_t
+cbt__DecodeLeaves_Word(
+    const uint64_t sums[7],
+    const cbt_Node node,
+    int64_t k,
+    cbt_Node *leaves,
+    int64_t leafCount
+) {
+    uint64_t laneID = node.id & ((64u >> k) - 1u);
+    uint64_t nodeCount = (sums[k] >> (laneID << k)) & ((2ULL << k) - 1u);
+
+    if (nodeCount == 1u) {
+        leaves[leafCount++] = node;
+    } else if (nodeCount > 1u) {
+        cbt_Node leftChild = cbt_LeftChildNode_Fast(node);
+        cbt_Node rightChild = cbt_RightChildNode_Fast(node);
+
+        if (k == 1) {
+            leaves[leafCount++] = leftChild;
+            leaves[leafCount++] = rightChild;
+        } else {
+            leafCount = cbt__DecodeLeaves_Word(sums, leftChild, k - 1, leaves, leafCount);
+            leafCount = cbt__DecodeLeaves_Word(sums, rightChild, k - 1, leaves, leafCount);
+        }
+    }
+
+    return leafCount;
+}
+
+
+/*******************************************************************************
+ * DecodeLeaves_Subtree -- Lists the leaves located below a node in order
+ *
+ * The subtree is walked down until nodes of count 1 are found. Nodes of
+ * count 2 located right above the bitfield have two leaf children, which
+ * are listed without reading the bitfield.
+ *
+ */
+static int64_t
+cbt__DecodeLeaves_Subtree(
+    const cbt_Tree *tree,
+    const cbt_Node node,
+    cbt_Node *leaves,
+    int64_t leafCount
+) {
+    uint64_t nodeCount = cbt__HeapRead(tree, node);
+
+    if (nodeCount == 1u) {
+        leaves[leafCount++] = node;
+    } else if (nodeCount > 1u) {
+        cbt_Node leftChild = cbt_LeftChildNode_Fast(node);
+        cbt_Node rightChild = cbt_RightChildNode_Fast(node);
+
+        if (cbt_IsCeilNode(tree, leftChild)) {
+            leaves[leafCount++] = leftChild;
+            leaves[leafCount++] = rightChild;
+        } else {
+            leafCount = cbt__DecodeLeaves_Subtree(tree, leftChild, leaves, leafCount);
+            leafCount = cbt__DecodeLeaves_Subtree(tree, rightChild, leaves, leafCount);
+        }
+    }
+
+    return leafCount;
+}
+
+
+/*******************************************************************************
+ * DecodeLeaves_Chunk -- Lists the leaves of a chunk of the bitfield in order
+ *
+ * A chunk spans 8 consecutive 64-bit words of the bitfield, i.e., 512 ceil
+ * nodes, and the leaves it lists are those whose ceil node lies in the
+ * chunk. This yields the same nodes as calling cbt_DecodeNode on the
+ * corresponding range of handles, but streams through the chunk instead of
+ * walking down the tree for each leaf.
+ *
+ * Note that the bitfield itself is not read: the leaves are recovered from
+ * the 2-bit sums stored one level above it, which remain untouched until the
+ * next reduction, so that the chunks can be scanned while an update modifies
+ * the bitfield. Trees of max depth less than 9 consist of a single chunk.
+ * The sums are read as 64-bit words for the packed and word-aligned
+ * layouts, where they are stored contiguously.
+ *
+ */
+#define CBT__CHUNK_LEAF_COUNT 512
+
+static int64_t cbt__ChunkCount(int64_t maxDepth)
+{
+    return maxDepth >= 9 ? 1LL << (maxDepth - 9) : 1LL;
+}
+
+static int64_t
+cbt__DecodeLeaves_Chunk(const cbt_Tree *tree, int64_t chunkID, cbt_Node *leaves)
+{
+    int64_t maxDepth = cbt_MaxDepth(tree);
+    cbt_Node chunk;
+    uint64_t nodeCount;
+    cbt_Node pairNode;
+    const uint64_t *pairCounts;
+    int64_t leafCount = 0;
+
+    if (maxDepth < 9)
+        return cbt__DecodeLeaves_Subtree(tree, cbt_CreateNode(1u, 0), leaves, 0);
+
+    chunk = cbt_CreateNode((1ULL << (maxDepth - 9)) + chunkID, maxDepth - 9);
+    nodeCount = cbt__HeapRead(tree, chunk);
+
+    if (nodeCount == 0u) {
+        return 0;
+    } else if (nodeCount == 1u) {
+        leaves[0] = cbt__LeafAncestor(tree, chunk);
+
+        return 1;
+    } else if (tree->layout == CBT_LAYOUT_BLOCKED) {
+        return cbt__DecodeLeaves_Subtree(tree, chunk, leaves, 0);
+    }
+
+    pairNode = cbt_CreateNode(chunk.id << 8, maxDepth - 1);
+    pairCounts = &tree->heap[cbt__NodeBitID(tree, pairNode) >> 6];
+
+    for (int64_t bufferID = 0; bufferID < 8; ++bufferID) {
+        cbt_Node node = cbt_CreateNode((chunk.id << 3) + bufferID, maxDepth - 6);
+        uint64_t sums[7];
+
+        sums[1] = pairCounts[bufferID];
+        sums[2] = (sums[1] & 0x3333333333333333ULL)
+                + ((sums[1] >>  2) & 0x3333333333333333ULL);
+        sums[3] = (sums[2] & 0x0F0F0F0F0F0F0F0FULL)
+                + ((sums[2] >>  4) & 0x0F0F0F0F0F0F0F0FULL);
+        sums[4] = (sums[3] & 0x00FF00FF00FF00FFULL)
+                + ((sums[3] >>  8) & 0x00FF00FF00FF00FFULL);
+        sums[5] = (sums[4] & 0x0000FFFF0000FFFFULL)
+                + ((sums[4] >> 16) & 0x0000FFFF0000FFFFULL);
+        sums[6] = (sums[5] & 0x00000000FFFFFFFFULL)
+                + ((sums[5] >> 32) & 0x00000000FFFFFFFFULL);
+
+        if (sums[6] == 1u)
+            leaves[leafCount++] = cbt__LeafAncestor(tree, node);
+        else
+            leafCount = cbt__DecodeLeaves_Word(sums, node, 6, leaves, leafCount);
+    }
+
+    return leafCount;
+}
+
+
+/*******************************************************************************
+ * GatherChunkIDs -- Lists the bitfield chunks that contain leaves
+ *
+ * The sum tree is traversed down to the depth of the chunks, skipping the
+ * subtrees that have no leaves, so that the cost is proportional to the
+ * number of refined chunks rather than to the size of the bitfield.
+ * Chunks are only counted when the list is NULL.
+ *
+ */
+static int64_t
+cbt__GatherChunkIDs(
+    const cbt_Tree *tree,
+    const cbt_Node node,
+    uint64_t *chunkIDs,
+    int64_t chunkIDCount
+) {
+    int64_t chunkDepth = cbt_MaxDepth(tree) - 9;
+
+    if (cbt__HeapRead(tree, node) == 0u)
+        return chunkIDCount;
+
+    if (node.depth == chunkDepth) {
+        if (chunkIDs != NULL)
+            chunkIDs[chunkIDCount] = node.id - (1ULL << chunkDepth);
+
+        return chunkIDCount + 1;
+    }
+
+    chunkIDCount = cbt__GatherChunkIDs(tree,
+                                       cbt_LeftChildNode_Fast(node),
+                                       chunkIDs,
+                                       chunkIDCount);
+
+    return cbt__GatherChunkIDs(tree,
+                               cbt_RightChildNode_Fast(node),
+                               chunkIDs,
+                               chunkIDCount);
+}
+
+
+/*******************************************************************************
+ * LeafOffset -- Returns the number of leaves located left of a node
+ *
+ * This is the sum of the counts of the left siblings of the node and of its
+ * ancestors, i.e., an exclusive prefix sum of the leaf counts.
+ *
+ */
+static int64_t cbt__LeafOffset(const cbt_Tree *tree, const cbt_Node node)
+{
+    int64_t leafOffset = 0u;
+    cbt_Node nodeIterator = node;
+
+    while (nodeIterator.id > 1u) {
+        cbt_Node sibling = cbt_LeftSiblingNode_Fast(nodeIterator);
+        uint64_t nodeCount = cbt__HeapRead(tree, sibling);
+
+        leafOffset+= (nodeIterator.id & 1u) * nodeCount;
+        nodeIterator = cbt_ParentNode_Fast(nodeIterator);
+    }
+
+    return leafOffset;
+}
+
+
+/*******************************************************************************
+ * UpdateChunkIDs -- Returns the chunks the updater must be called on
+ *
+ * All the chunks of dense trees are processed; sparse trees only process
+ * the chunks that contain leaves, whose IDs are listed in tree->chunkIDs.
+ *
+ */
+static int64_t cbt__UpdateChunkIDs(cbt_Tree *tree, const uint64_t **chunkIDs)
+{
+    int64_t maxDepth = cbt_MaxDepth(tree);
+    cbt_Node root = cbt_CreateNode(1u, 0);
+    int64_t chunkCount;
+
+    if (!tree->isSparse || maxDepth < 9) {
+        (*chunkIDs) = NULL;
+
+        return cbt__ChunkCount(maxDepth);
+    }
+
+    chunkCount = cbt__GatherChunkIDs(tree, root, NULL, 0);
+
+    if (chunkCount > tree->chunkIDCapacity) {
+        CBT_FREE(tree->chunkIDs);
+        tree->chunkIDs = (uint64_t *)CBT_MALLOC(sizeof(uint64_t) * chunkCount);
+        tree->chunkIDCapacity = chunkCount;
+    }
+
+    cbt__GatherChunkIDs(tree, root, tree->chunkIDs, 0);
+    (*chunkIDs) = tree->chunkIDs;
+
+    return chunkCount;
+}
+
+
+/*******************************************************************************
+ * Update -- Split or merge each node in parallel
+ *
+ * The user provides an updater function that is responsible for
+ * splitting or merging each node. The leaves are enumerated by scanning
+ * chunks of the bitfield in parallel, which is linear in the size of the
+ * bitfield, and do not depend on the bitfield writes performed by the
+ * updater. The sum reduction that follows only processes the bitfield
+ * words that were modified by the updater.
+ *
+ */
+typedef struct {
+    cbt_Tree *tree;
+    cbt_UpdateCallback updater;
+    const void *userData;
+    const uint64_t *chunkIDs;
+    bool isDeferred;
+} cbt__UpdateLoop;
+
+static void cbt__Update_Range(int64_t begin, int64_t end, void *callbackData)
+{
+    const cbt__UpdateLoop *loop = (const cbt__UpdateLoop *)callbackData;
+    const cbt_Tree *deferredTree = cbt__deferredTree;
+    cbt__IntentBuffer *deferredIntents = cbt__deferredIntents;
+
+    for (int64_t i = begin; i < end; ++i) {
+        int64_t chunkID = loop->chunkIDs != NULL ? (int64_t)loop->chunkIDs[i] : i;
+        cbt_Node leaves[CBT__CHUNK_LEAF_COUNT];
+        int64_t leafCount = cbt__DecodeLeaves_Chunk(loop->tree, chunkID, leaves);
+
+        if (loop->isDeferred) {
+            cbt__deferredTree = loop->tree;
+            cbt__deferredIntents = &loop->tree->intentBuffers[i];
+        }
+
+        for (int64_t leafID = 0; leafID < leafCount; ++leafID) {
+            loop->updater(loop->tree, leaves[leafID], loop->userData);
+        }
+
+        if (loop->isDeferred)
+            cbt__SortIntents(&loop->tree->intentBuffers[i]);
+    }
+
+    cbt__deferredTree = deferredTree;
+    cbt__deferredIntents = deferredIntents;
+}
+
+CBTDEF void
+cbt_Update(cbt_Tree *tree, cbt_UpdateCallback updater, const void *userData)
+{
+    CBT_ASSERT(!tree->isReadOnly && "tree is read-only");
+    CBT_ASSERT(!tree->reduction.isPending && "sums are stale");
+    CBT__STATS(int64_t time = cbt__Time();)
+    CBT__STATS(int64_t nodeCount = cbt_NodeCount(tree);)
+    cbt__UpdateLoop loop = {tree, updater, userData, NULL, false};
+    int64_t chunkCount = cbt__UpdateChunkIDs(tree, &loop.chunkIDs);
+
+    tree->isUpdating = true;
+    cbt__ParallelFor(tree, chunkCount, 1, &cbt__Update_Range, &loop);
+    tree->isUpdating = false;
+    CBT__STATS(cbt__EndCallbackTimer(tree, time);)
+    cbt__ComputeSumReduction_Deferrable(tree);
+    CBT__STATS(cbt__EndUpdateTimer(tree, "cbt_Update", nodeCount, time);)
+}
+
+
+/*******************************************************************************
+ * UpdateBatched -- Split or merge batches of nodes in parallel
+ *
+ * Same as cbt_Update, except that the updater receives batches of up to
+ * CBT__CHUNK_LEAF_COUNT consecutive leaves, as arrays of heap IDs and
+ * depths along with the handle of the first leaf, and writes one
+ * cbt_UpdateDecision per leaf instead of modifying the tree. The leaves of
+ * the chunks of a range are appended to the same batch, so that sparsely
+ * refined chunks still make large batches. The decisions are applied once
+ * the updater returns, so the updater only sees the tree as it was before
+ * the batch.
+ *
+ */
+typedef struct {
+    uint64_t heapIDs[CBT__CHUNK_LEAF_COUNT];
+    int64_t depths[CBT__CHUNK_LEAF_COUNT];
+    uint8_t decisions[CBT__CHUNK_LEAF_COUNT];
+    int64_t firstHandle;
+    int64_t leafCount;
+} cbt__UpdateBatch;
+
+typedef struct {
+    cbt_Tree *tree;
+    cbt_BatchedUpdateCallback updater;
+    const void *userData;
+    const uint64_t *chunkIDs;
+} cbt__BatchedUpdateLoop;
+
+static void
+cbt__FlushUpdateBatch(const cbt__BatchedUpdateLoop *loop, cbt__UpdateBatch *batch)
+{
+    cbt_Tree *tree = loop->tree;
+
+    if (batch->leafCount == 0)
+        return;
+
+    for (int64_t leafID = 0; leafID < batch->leafCount; ++leafID) {
+        batch->decisions[leafID] = CBT_UPDATE_KEEP;
+    }
+
+    loop->updater(tree,
+                  batch->heapIDs,
+                  batch->depths,
+                  batch->firstHandle,
+                  batch->leafCount,
+                  batch->decisions,
+                  loop->userData);
+
+    for (int64_t leafID = 0; leafID < batch->leafCount; ++leafID) {
+        uint8_t decision = batch->decisions[leafID];
+
+        if (decision != CBT_UPDATE_KEEP) {
+            cbt_Node node = cbt_CreateNode(batch->heapIDs[leafID],
+                                           batch->depths[leafID]);
+
+            if (decision == CBT_UPDATE_SPLIT)
+                cbt_SplitNode(tree, node);
+            else if (decision == CBT_UPDATE_MERGE)
+                cbt_MergeNode(tree, node);
+        }
+    }
+
+    batch->firstHandle+= batch->leafCount;
+    batch->leafCount = 0;
+}
+
+static void cbt__UpdateBatched_Range(int64_t begin, int64_t end, void *callbackData)
+{
+    const cbt__BatchedUpdateLoop *loop = (const cbt__BatchedUpdateLoop *)callbackData;
+    const cbt_Tree *tree = loop->tree;
+    int64_t maxDepth = cbt_MaxDepth(tree);
+    int64_t chunkID = loop->chunkIDs != NULL ? (int64_t)loop->chunkIDs[begin] : begin;
+    cbt__UpdateBatch batch;
+
+    batch.firstHandle = 0;
+    batch.leafCount = 0;
+
+    if (maxDepth >= 9) {
+        uint64_t chunkNodeID = (1ULL << (maxDepth - 9)) + (uint64_t)chunkID;
+
+        batch.firstHandle = cbt__LeafOffset(tree, cbt_CreateNode(chunkNodeID, maxDepth - 9));
+    }
+
+    for (int64_t i = begin; i < end; ++i) {
+        cbt_Node leaves[CBT__CHUNK_LEAF_COUNT];
+        int64_t leafCount;
+
+        chunkID = loop->chunkIDs != NULL ? (int64_t)loop->chunkIDs[i] : i;
+        leafCount = cbt__DecodeLeaves_Chunk(tree, chunkID, leaves);
+
+        if (batch.leafCount + leafCount > CBT__CHUNK_LEAF_COUNT)
+            cbt__FlushUpdateBatch(loop, &batch);
+
+        for (int64_t leafID = 0; leafID < leafCount; ++leafID) {
+            batch.heapIDs[batch.leafCount + leafID] = leaves[leafID].id;
+            batch.depths[batch.leafCount + leafID] = leaves[leafID].depth;
+        }
+
+        batch.leafCount+= leafCount;
+    }
+
+    cbt__FlushUpdateBatch(loop, &batch);
+}
+
+CBTDEF void
+cbt_UpdateBatched(
+    cbt_Tree *tree,
+    cbt_BatchedUpdateCallback updater,
+    const void *userData
+) {
+    CBT_ASSERT(!tree->isReadOnly && "tree is read-only");
+    CBT_ASSERT(!tree->reduction.isPending && "sums are stale");
+    CBT__STATS(int64_t time = cbt__Time();)
+    CBT__STATS(int64_t nodeCount = cbt_NodeCount(tree);)
+    cbt__BatchedUpdateLoop loop = {tree, updater, userData, NULL};
+    int64_t chunkCount = cbt__UpdateChunkIDs(tree, &loop.chunkIDs);
+
+    tree->isUpdating = true;
+    cbt__ParallelFor(tree, chunkCount, 16, &cbt__UpdateBatched_Range, &loop);
+    tree->isUpdating = false;
+    CBT__STATS(cbt__EndCallbackTimer(tree, time);)
+    cbt__ComputeSumReduction_Deferrable(tree);
+    CBT__STATS(cbt__EndUpdateTimer(tree, "cbt_UpdateBatched", nodeCount, time);)
+}
+
+
+/*******************************************************************************
+ * GatherIntents -- Sorts the intents recorded by the chunks of the bitfield
+ *
+ * The intents are sorted by bitfield bit and splits come first, so that
+ * the intents that write a given bit are contiguous and the first of them
+ * tells whether the bit is split. The bits of the splits are also gathered
+ * in a separate array, which merges are validated against.
+ *
+ * Each chunk sorts its own intents while the updater runs, and the buffers
+ * are concatenated in chunk order. Since a leaf only writes bits located
+ * right of its first bit, the result is usually sorted already, and is then
+ * only scanned once. Otherwise, e.g., when the updater splits the neighbors
+ * of a leaf, the sorted runs are merged pairwise until a single one remains.
+ *
+ */
+static int64_t
+cbt__IntentRunEnd(const cbt__Intent *intents, int64_t begin, int64_t intentCount)
+{
+    int64_t end = begin + 1;
+
+    while (end < intentCount && !cbt__IntentPrecedes(&intents[end], &intents[end - 1]))
+        ++end;
+
+    return end;
+}
+
+// returns the array that holds the sorted intents, i.e., intents or scratch
+static cbt__Intent *
+cbt__MergeIntentRuns(cbt__Intent *intents, cbt__Intent *scratch, int64_t intentCount)
+{
+    for (;;) {
+        int64_t begin = 0;
+        int64_t runCount = 0;
+
+        while (begin < intentCount) {
+            int64_t middle = cbt__IntentRunEnd(intents, begin, intentCount);
+            int64_t end, i, j, k;
+
+            if (middle == intentCount) {
+                if (runCount == 0)
+                    return intents;
+
+                CBT_MEMCPY(&scratch[begin],
+                           &intents[begin],
+                           sizeof(cbt__Intent) * (intentCount - begin));
+                break;
+            }
+
+            end = cbt__IntentRunEnd(intents, middle, intentCount);
+            for (i = begin, j = middle, k = begin; k < end; ++k) {
+                if (j == end || (i < middle && !cbt__IntentPrecedes(&intents[j], &intents[i])))
+                    scratch[k] = intents[i++];
+                else
+                    scratch[k] = intents[j++];
+            }
+
+            ++runCount;
+            begin = end;
+        }
+
+        if (runCount == 0)
+            return intents;
+
+        {
+            cbt__Intent *tmp = intents;
+
+            intents = scratch;
+            scratch = tmp;
+        }
+    }
+}
+
+static void cbt__ReserveIntents(cbt__IntentBuffer *buffer, int64_t intentCount)
+{
+    if (intentCount > buffer->intentCapacity) {
+        CBT_FREE(buffer->intents);
+        buffer->intents = (cbt__Intent *)CBT_MALLOC(sizeof(cbt__Intent) * intentCount);
+        buffer->intentCapacity = intentCount;
+    }
+}
+
+static void cbt__GatherIntents(cbt_Tree *tree)
+{
+    cbt__IntentBuffer *intents = &tree->intents;
+    cbt__IntentBuffer *splits = &tree->splits;
+    int64_t intentCount = 0;
+
+    for (int64_t bufferID = 0; bufferID < tree->intentBufferCount; ++bufferID) {
+        intentCount+= tree->intentBuffers[bufferID].intentCount;
+    }
+
+    cbt__ReserveIntents(intents, intentCount);
+    intents->intentCount = 0;
+    for (int64_t bufferID = 0; bufferID < tree->intentBufferCount; ++bufferID) {
+        cbt__IntentBuffer *buffer = &tree->intentBuffers[bufferID];
+
+        if (buffer->intentCount > 0) {
+            CBT_MEMCPY(&intents->intents[intents->intentCount],
+                       buffer->intents,
+                       sizeof(cbt__Intent) * buffer->intentCount);
+            intents->intentCount+= buffer->intentCount;
+            buffer->intentCount = 0;
+        }
+    }
+
+    // the splits are gathered afterwards, so their buffer is free until then
+    cbt__ReserveIntents(splits, intentCount);
+    if (cbt__MergeIntentRuns(intents->intents, splits->intents, intentCount)
+        == splits->intents) {
+        cbt__IntentBuffer tmp = *intents;
+
+        *intents = *splits;
+        *splits = tmp;
+        intents->intentCount = intentCount;
+    }
+
+    splits->intentCount = 0;
+    for (int64_t i = 0; i < intentCount; ++i) {
+        const cbt__Intent *intent = &intents->intents[i];
+
+        if (intent->bitValue == 1u && (splits->intentCount == 0
+            || splits->intents[splits->intentCount - 1].bitID != intent->bitID)) {
+            splits->intents[splits->intentCount++] = *intent;
+        }
+    }
+}
+
+
+/*******************************************************************************
+ * ResolveIntents -- Rejects the merges that conflict with other intents
+ *
+ * Splits always apply. A merge clears the bit of a right node, and is only
+ * valid if its parent has exactly two leaves, i.e., the right node and its
+ * sibling, and none of them is split by the update. Otherwise, the merge
+ * would produce a node that does not belong to the tree. Since merges are
+ * validated against the state of the tree prior to the update, the outcome
+ * does not depend on the order in which the intents were recorded.
+ *
+ */
+#define CBT__INTENT_REJECTED 2u
+
+typedef struct {
+    cbt_Tree *tree;
+    cbt__Intent *intents;
+    int64_t intentCount;
+    int64_t bitFieldBitID;
+} cbt__IntentLoop;
+
+static bool cbt__IsSplitInRange(const cbt_Tree *tree, uint64_t begin, uint64_t end)
+{
+    const cbt__Intent *splits = tree->splits.intents;
+    int64_t min = 0, max = tree->splits.intentCount;
+
+    // find the first split bit greater than begin
+    while (min < max) {
+        int64_t mid = (min + max) >> 1;
+
+        if (splits[mid].bitID <= begin)
+            min = mid + 1;
+        else
+            max = mid;
+    }
+
+    return min < tree->splits.intentCount && splits[min].bitID < end;
+}
+
+static bool cbt__IsMergeValid(const cbt_Tree *tree, const cbt__Intent *intent)
+{
+    int64_t maxDepth = cbt_MaxDepth(tree);
+    int64_t depth = (int64_t)intent->depth;
+    uint64_t halfBitCount = 1ULL << (maxDepth - depth);
+    cbt_Node parent;
+
+    if (depth == 0)
+        return false;
+
+    parent = cbt_CreateNode((intent->bitID + (1ULL << maxDepth)) >> (maxDepth - depth + 1),
+                            depth - 1);
+
+    return cbt__HeapRead(tree, parent) == 2u
+        && !cbt__IsSplitInRange(tree,
+                                intent->bitID - halfBitCount,
+                                intent->bitID + halfBitCount);
+}
+
+static void
+cbt__ResolveIntents_Range(int64_t begin, int64_t end, void *callbackData)
+{
+    const cbt__IntentLoop *loop = (const cbt__IntentLoop *)callbackData;
+    cbt__Intent *intents = loop->intents;
+
+    for (int64_t i = begin; i < end; ++i) {
+        if (i > 0 && intents[i - 1].bitID == intents[i].bitID)
+            continue;
+
+        if (intents[i].bitValue == 0u && !cbt__IsMergeValid(loop->tree, &intents[i])) {
+            intents[i].bitValue = CBT__INTENT_REJECTED;
+            CBT__STATS(CBT__STATS_ADD(loop->tree, rejectedMergeCount, 1);)
+        }
+    }
+}
+
+
+/*******************************************************************************
+ * ApplyIntents -- Writes the resolved intents to the bitfield
+ *
+ * The intents that fall in the same 64-bit word are contiguous, so each
+ * modified word is written by a single thread with a single plain store.
+ *
+ */
+static void
+cbt__ApplyIntents_Range(int64_t begin, int64_t end, void *callbackData)
+{
+    const cbt__IntentLoop *loop = (const cbt__IntentLoop *)callbackData;
+    const cbt__Intent *intents = loop->intents;
+    int64_t bitFieldBitID = loop->bitFieldBitID;
+    CBT__STATS(int64_t writeCount = 0;)
+
+    for (int64_t i = begin; i < end; ++i) {
+        int64_t bufferID = (bitFieldBitID + intents[i].bitID) >> 6;
+        uint64_t setMask = 0u, clearMask = 0u;
+
+        if (i > 0 && (int64_t)((bitFieldBitID + intents[i - 1].bitID) >> 6) == bufferID)
+            continue;
+
+        for (int64_t j = i; j < loop->intentCount; ++j) {
+            uint64_t bitID = bitFieldBitID + intents[j].bitID;
+
+            if ((int64_t)(bitID >> 6) != bufferID)
+                break;
+
+            if (j > i && intents[j - 1].bitID == intents[j].bitID)
+                continue;
+
+            if (intents[j].bitValue == 1u)
+                setMask|= 1ULL << (bitID & 63);
+            else if (intents[j].bitValue == 0u)
+                clearMask|= 1ULL << (bitID & 63);
+        }
+
+        if ((setMask | clearMask) != 0u) {
+            uint64_t *bitField = &loop->tree->heap[bufferID];
+
+            *bitField = (*bitField & ~clearMask) | setMask;
+            cbt__SetDirtyBit(loop->tree, intents[i].bitID >> 6);
+            CBT__STATS(++writeCount;)
+        }
+    }
+
+    CBT__STATS(CBT__STATS_ADD(loop->tree, bitFieldWriteCount, writeCount);)
+}
+
+
+/*******************************************************************************
+ * UpdateDeferred -- Split or merge each node in parallel, deterministically
+ *
+ * Same as cbt_Update, except that the splits and merges requested by the
+ * updater are recorded in one buffer per chunk of the bitfield and applied
+ * once all the nodes are processed. Merges that conflict with a split, or
+ * with the topology of the tree, are rejected (see ResolveIntents), so the
+ * resulting tree does not depend on the scheduling of the threads. The
+ * updater only sees the tree as it was before the update.
+ *
+ */
+CBTDEF void
+cbt_UpdateDeferred(cbt_Tree *tree, cbt_UpdateCallback updater, const void *userData)
+{
+    CBT_ASSERT(!tree->isReadOnly && "tree is read-only");
+    CBT_ASSERT(!tree->reduction.isPending && "sums are stale");
+    CBT__STATS(int64_t time = cbt__Time();)
+    CBT__STATS(int64_t nodeCount = cbt_NodeCount(tree);)
+    cbt__UpdateLoop updateLoop = {tree, updater, userData, NULL, true};
+    int64_t chunkCount = cbt__UpdateChunkIDs(tree, &updateLoop.chunkIDs);
+    cbt__IntentLoop intentLoop;
+
+    if (tree->intentBufferCount < chunkCount) {
+        cbt__IntentBuffer *buffers = (cbt__IntentBuffer *)
+            CBT_MALLOC(sizeof(cbt__IntentBuffer) * chunkCount);
+
+        if (tree->intentBufferCount > 0) {
+            CBT_MEMCPY(buffers,
+                       tree->intentBuffers,
+                       sizeof(cbt__IntentBuffer) * tree->intentBufferCount);
+        }
+
+        for (int64_t bufferID = tree->intentBufferCount;
+             bufferID < chunkCount;
+             ++bufferID) {
+            buffers[bufferID].intents = NULL;
+            buffers[bufferID].intentCount = 0;
+            buffers[bufferID].intentCapacity = 0;
+        }
+
+        CBT_FREE(tree->intentBuffers);
+        tree->intentBuffers = buffers;
+        tree->intentBufferCount = chunkCount;
+    }
+
+    cbt__ParallelFor(tree, chunkCount, 1, &cbt__Update_Range, &updateLoop);
+    CBT__STATS(cbt__EndCallbackTimer(tree, time);)
+    cbt__GatherIntents(tree);
+
+    intentLoop.tree = tree;
+    intentLoop.intents = tree->intents.intents;
+    intentLoop.intentCount = tree->intents.intentCount;
+    intentLoop.bitFieldBitID = cbt__LevelBitID(tree, cbt_MaxDepth(tree));
+    cbt__ParallelFor(tree,
+                     intentLoop.intentCount,
+                     256,
+                     &cbt__ResolveIntents_Range,
+                     &intentLoop);
+    cbt__ParallelFor(tree,
+                     intentLoop.intentCount,
+                     256,
+                     &cbt__ApplyIntents_Range,
+                     &intentLoop);
+    cbt__ComputeSumReduction_Deferrable(tree);
+    CBT__STATS(cbt__EndUpdateTimer(tree, "cbt_UpdateDeferred", nodeCount, time);)
+}
+
+
+/*******************************************************************************
+ * UpdatePrioritized -- Split and merge the most important leaves under a budget
+ *
+ * The updater returns a priority per leaf instead of modifying the tree:
+ * positive priorities request a split, negative priorities request a merge
+ * and zero keeps the leaf as is. A pair of sibling leaves is merged when
+ * both of its leaves request it, and its priority is the largest of the two.
+ *
+ * Requested merges always apply. If the tree still has more than
+ * maxNodeCount leaves, the mergeable pairs are merged in increasing order
+ * of priority until it fits, and nothing is split. Otherwise, the leaves are
+ * split in decreasing order of priority until either maxNodeCount leaves or
+ * maxSplitCount splits are reached. A negative budget is not enforced. Since
+ * each leaf is split or merged at most once per call, a tree that is far
+ * from its budget converges over several calls.
+ *
+ * The candidates are recorded in one buffer per chunk of the bitfield, and
+ * the k largest priorities are found with a parallel radix select over
+ * their 32-bit ordered keys, i.e., one histogram per byte of the key,
+ * rather than with a global sort. Candidates whose key equals the selection
+ * threshold are taken in leaf order, so the result does not depend on the
+ * scheduling of the threads.
+ *
+ */
+typedef struct {
+    cbt_Tree *tree;
+    cbt_PriorityCallback priority;
+    const void *userData;
+    const uint64_t *chunkIDs;
+    uint64_t candidateCounts[2];   // split and merge candidates
+    uint64_t requestedMergeCount;
+    uint64_t histograms[2][256];
+    uint32_t prefixes[2];          // high bytes of the threshold keys found so far
+    uint32_t prefixMasks[2];
+    int64_t shift;
+    int64_t selectCounts[2];       // candidates left to select
+    bool isEnabled[2];             // whether some candidates are selected
+} cbt__PriorityLoop;
+
+static inline uint32_t cbt__PriorityKey(float priority)
+{
+    uint32_t bits;
+
+    CBT_MEMCPY(&bits, &priority, sizeof(bits));
+
+    return bits ^ ((uint32_t)((int32_t)bits >> 31) | 0x80000000u);
+}
+
+static void
+cbt__PushCandidate(
+    cbt__CandidateBuffer *buffer,
+    const cbt_Node node,
+    uint32_t key,
+    uint16_t isMerge
+) {
+    cbt__Candidate *candidate = &buffer->candidates[buffer->candidateCount++];
+
+    candidate->heapID = node.id;
+    candidate->key = key;
+    candidate->depth = (uint16_t)node.depth;
+    candidate->isMerge = isMerge;
+}
+
+static void
+cbt__EvaluatePriorities_Range(int64_t begin, int64_t end, void *callbackData)
+{
+    cbt__PriorityLoop *loop = (cbt__PriorityLoop *)callbackData;
+    const cbt_Tree *tree = loop->tree;
+    int64_t maxDepth = cbt_MaxDepth(tree);
+    uint64_t candidateCounts[2] = {0u, 0u};
+    uint64_t requestedMergeCount = 0u;
+
+    for (int64_t i = begin; i < end; ++i) {
+        int64_t chunkID = loop->chunkIDs != NULL ? (int64_t)loop->chunkIDs[i] : i;
+        cbt__CandidateBuffer *buffer = &loop->tree->candidateBuffers[i];
+        cbt_Node leaves[CBT__CHUNK_LEAF_COUNT];
+        float priorities[CBT__CHUNK_LEAF_COUNT];
+        int64_t leafCount = cbt__DecodeLeaves_Chunk(tree, chunkID, leaves);
+
+        for (int64_t leafID = 0; leafID < leafCount; ++leafID) {
+            priorities[leafID] = loop->priority(tree, leaves[leafID], loop->userData);
+        }
+
+        // a chunk yields at most one split and one merge per leaf
+        if (buffer->candidateCapacity < 2 * leafCount) {
+            int64_t capacity = 2 * leafCount;
+
+            CBT_FREE(buffer->candidates);
+            buffer->candidates = (cbt__Candidate *)
+                CBT_MALLOC(sizeof(cbt__Candidate) * capacity);
+            buffer->candidateCapacity = capacity;
+        }
+
+        buffer->candidateCount = 0;
+        for (int64_t leafID = 0; leafID < leafCount; ++leafID) {
+            const cbt_Node node = leaves[leafID];
+            float priority = priorities[leafID];
+
+            if (priority > 0.0f && node.depth < maxDepth) {
+                cbt__PushCandidate(buffer, node, cbt__PriorityKey(priority), 0u);
+                ++candidateCounts[0];
+            }
+
+            // pairs are recorded by their left leaf; the right leaf follows
+            // it in the chunk, unless its ceil node lies in a later chunk
+            if (node.id > 1u && (node.id & 1u) == 0u) {
+                cbt_Node sibling = cbt_RightSiblingNode_Fast(node);
+                bool isPair;
+                float siblingPriority = 0.0f;
+
+                if (leafID + 1 < leafCount) {
+                    isPair = (leaves[leafID + 1].id == sibling.id);
+                    siblingPriority = priorities[leafID + 1];
+                } else {
+                    isPair = (cbt__HeapRead(tree, sibling) == 1u);
+
+                    if (isPair)
+                        siblingPriority = loop->priority(tree, sibling, loop->userData);
+                }
+
+                if (isPair) {
+                    float pairPriority = priority > siblingPriority ? priority
+                                                                    : siblingPriority;
+
+                    cbt__PushCandidate(buffer, node, ~cbt__PriorityKey(pairPriority), 1u);
+                    ++candidateCounts[1];
+                    requestedMergeCount+= (pairPriority < 0.0f);
+                }
+            }
+        }
+    }
+
+    cbt__AtomicAdd(&loop->candidateCounts[0], candidateCounts[0]);
+    cbt__AtomicAdd(&loop->candidateCounts[1], candidateCounts[1]);
+    cbt__AtomicAdd(&loop->requestedMergeCount, requestedMergeCount);
+}
+
+static void
+cbt__PriorityHistogram_Range(int64_t begin, int64_t end, void *callbackData)
+{
+    cbt__PriorityLoop *loop = (cbt__PriorityLoop *)callbackData;
+    uint64_t histograms[2][256] = {{0u}};
+
+    for (int64_t i = begin; i < end; ++i) {
+        const cbt__CandidateBuffer *buffer = &loop->tree->candidateBuffers[i];
+
+        for (int64_t candidateID = 0; candidateID < buffer->candidateCount; ++candidateID) {
+            const cbt__Candidate *candidate = &buffer->candidates[candidateID];
+            int64_t kind = candidate->isMerge;
+
+            if ((candidate->key & loop->prefixMasks[kind]) == loop->prefixes[kind])
+                ++histograms[kind][(candidate->key >> loop->shift) & 255u];
+        }
+    }
+
+    for (int64_t kind = 0; kind < 2; ++kind) {
+        for (int64_t binID = 0; binID < 256; ++binID) {
+            if (histograms[kind][binID] > 0u)
+                cbt__AtomicAdd(&loop->histograms[kind][binID], histograms[kind][binID]);
+        }
+    }
+}
+
+static void
+cbt__CountPriorityTies_Range(int64_t begin, int64_t end, void *callbackData)
+{
+    const cbt__PriorityLoop *loop = (const cbt__PriorityLoop *)callbackData;
+
+    for (int64_t i = begin; i < end; ++i) {
+        cbt__CandidateBuffer *buffer = &loop->tree->candidateBuffers[i];
+
+        buffer->tieCounts[0] = buffer->tieCounts[1] = 0;
+        for (int64_t candidateID = 0; candidateID < buffer->candidateCount; ++candidateID) {
+            const cbt__Candidate *candidate = &buffer->candidates[candidateID];
+
+            buffer->tieCounts[candidate->isMerge]+=
+                (candidate->key == loop->prefixes[candidate->isMerge]);
+        }
+    }
+}
+
+static void
+cbt__ApplyPriorities_Range(int64_t begin, int64_t end, void *callbackData)
+{
+    const cbt__PriorityLoop *loop = (const cbt__PriorityLoop *)callbackData;
+    cbt_Tree *tree = loop->tree;
+
+    for (int64_t i = begin; i < end; ++i) {
+        cbt__CandidateBuffer *buffer = &tree->candidateBuffers[i];
+
+        for (int64_t candidateID = 0; candidateID < buffer->candidateCount; ++candidateID) {
+            const cbt__Candidate *candidate = &buffer->candidates[candidateID];
+            int64_t kind = candidate->isMerge;
+            cbt_Node node;
+
+            if (!loop->isEnabled[kind] || candidate->key < loop->prefixes[kind])
+                continue;
+
+            if (candidate->key == loop->prefixes[kind]) {
+                if (buffer->tieCounts[kind] == 0)
+                    continue;
+
+                --buffer->tieCounts[kind];
+            }
+
+            node = cbt_CreateNode(candidate->heapID, candidate->depth);
+
+            if (kind == 0)
+                cbt_SplitNode(tree, node);
+            else
+                cbt_MergeNode(tree, node);
+        }
+    }
+}
+
+// finds the threshold key of each kind of candidates and spreads the ties
+static void cbt__SelectPriorities(cbt__PriorityLoop *loop, int64_t chunkCount)
+{
+    cbt_Tree *tree = loop->tree;
+    bool isSelecting[2];
+
+    // all the candidates of a kind are selected with key 0 as the threshold,
+    // unless only some of them are
+    for (int64_t kind = 0; kind < 2; ++kind) {
+        loop->prefixes[kind] = loop->prefixMasks[kind] = 0u;
+        loop->isEnabled[kind] = loop->selectCounts[kind] > 0;
+        isSelecting[kind] = loop->isEnabled[kind]
+                         && loop->selectCounts[kind] < (int64_t)loop->candidateCounts[kind];
+    }
+
+    if (isSelecting[0] || isSelecting[1]) {
+        for (loop->shift = 24; loop->shift >= 0; loop->shift-= 8) {
+            for (int64_t kind = 0; kind < 2; ++kind) {
+                for (int64_t binID = 0; binID < 256; ++binID) {
+                    loop->histograms[kind][binID] = 0u;
+                }
+            }
+
+            cbt__ParallelFor(tree, chunkCount, 64, &cbt__PriorityHistogram_Range, loop);
+
+            // walk down from the largest keys until the selection is complete
+            for (int64_t kind = 0; kind < 2; ++kind) {
+                int64_t binID = 255;
+
+                if (!isSelecting[kind])
+                    continue;
+
+                while ((int64_t)loop->histograms[kind][binID] < loop->selectCounts[kind]) {
+                    loop->selectCounts[kind]-= loop->histograms[kind][binID];
+                    --binID;
+                }
+
+                loop->prefixes[kind]|= (uint32_t)binID << loop->shift;
+                loop->prefixMasks[kind]|= 255u << loop->shift;
+            }
+        }
+
+        cbt__ParallelFor(tree, chunkCount, 64, &cbt__CountPriorityTies_Range, loop);
+    }
+
+    // the remaining selections go to the first ties in leaf order
+    for (int64_t i = 0; i < chunkCount; ++i) {
+        cbt__CandidateBuffer *buffer = &tree->candidateBuffers[i];
+
+        for (int64_t kind = 0; kind < 2; ++kind) {
+            if (isSelecting[kind]) {
+                if (buffer->tieCounts[kind] > loop->selectCounts[kind])
+                    buffer->tieCounts[kind] = loop->selectCounts[kind];
+
+                loop->selectCounts[kind]-= buffer->tieCounts[kind];
+            } else {
+                buffer->tieCounts[kind] = INT64_MAX;
+            }
+        }
+    }
+}
+
+CBTDEF void
+cbt_UpdatePrioritized(
+    cbt_Tree *tree,
+    cbt_PriorityCallback priority,
+    int64_t maxNodeCount,
+    int64_t maxSplitCount,
+    const void *userData
+) {
+    CBT_ASSERT(!tree->isReadOnly && "tree is read-only");
+    CBT_ASSERT(!tree->reduction.isPending && "sums are stale");
+    CBT__STATS(int64_t time = cbt__Time();)
+    int64_t nodeCount = cbt_NodeCount(tree);
+    cbt__PriorityLoop loop;
+    int64_t chunkCount, mergeCount, splitCount;
+
+    loop.tree = tree;
+    loop.priority = priority;
+    loop.userData = userData;
+    loop.candidateCounts[0] = loop.candidateCounts[1] = 0u;
+    loop.requestedMergeCount = 0u;
+    chunkCount = cbt__UpdateChunkIDs(tree, &loop.chunkIDs);
+
+    if (tree->candidateBufferCount < chunkCount) {
+        cbt__CandidateBuffer *buffers = (cbt__CandidateBuffer *)
+            CBT_MALLOC(sizeof(cbt__CandidateBuffer) * chunkCount);
+
+        if (tree->candidateBufferCount > 0) {
+            CBT_MEMCPY(buffers,
+                       tree->candidateBuffers,
+                       sizeof(cbt__CandidateBuffer) * tree->candidateBufferCount);
+        }
+
+        for (int64_t bufferID = tree->candidateBufferCount;
+             bufferID < chunkCount;
+             ++bufferID) {
+            buffers[bufferID].candidates = NULL;
+            buffers[bufferID].candidateCount = 0;
+            buffers[bufferID].candidateCapacity = 0;
+        }
+
+        CBT_FREE(tree->candidateBuffers);
+        tree->candidateBuffers = buffers;
+        tree->candidateBufferCount = chunkCount;
+    }
+
+    cbt__ParallelFor(tree, chunkCount, 1, &cbt__EvaluatePriorities_Range, &loop);
+    CBT__STATS(cbt__EndCallbackTimer(tree, time);)
+
+    // merges first, since they make room for the splits
+    mergeCount = (int64_t)loop.requestedMergeCount;
+    if (maxNodeCount >= 0 && nodeCount - mergeCount > maxNodeCount) {
+        mergeCount = nodeCount - maxNodeCount;
+
+        if (mergeCount > (int64_t)loop.candidateCounts[1])
+            mergeCount = (int64_t)loop.candidateCounts[1];
+    }
+
+    splitCount = (int64_t)loop.candidateCounts[0];
+    if (maxSplitCount >= 0 && splitCount > maxSplitCount)
+        splitCount = maxSplitCount;
+
+    if (maxNodeCount >= 0 && splitCount > maxNodeCount - (nodeCount - mergeCount))
+        splitCount = maxNodeCount - (nodeCount - mergeCount);
+
+    loop.selectCounts[0] = splitCount > 0 ? splitCount : 0;
+    loop.selectCounts[1] = mergeCount;
+    cbt__SelectPriorities(&loop, chunkCount);
+    cbt__ParallelFor(tree, chunkCount, 16, &cbt__ApplyPriorities_Range, &loop);
+    cbt__ComputeSumReduction_Deferrable(tree);
+    CBT__STATS(cbt__EndUpdateTimer(tree, "cbt_UpdatePrioritized", nodeCount, time);)
+}
+
+
+/*******************************************************************************
+ * MaxDepth -- Returns the max CBT depth
+ *
+ */
+CBTDEF int64_t cbt_MaxDepth(const cbt_Tree *tree)
+{
+    return cbt__FindLSB(tree->heap[0] & ~3ULL);
+}
+
+
+/*******************************************************************************
+ * IsSparse -- Checks if the heap of the CBT is allocated on demand
+ *
+ */
+CBTDEF bool cbt_IsSparse(const cbt_Tree *tree)
+{
+    return tree->isSparse;
+}
+
+
+/*******************************************************************************
+ * GetLayout -- Returns the layout of the CBT heap
+ *
+ */
+CBTDEF cbt_Layout cbt_GetLayout(const cbt_Tree *tree)
+{
+    return tree->layout;
+}
+
+
+/*******************************************************************************
+ * NodeCount -- Returns the number of triangles in the CBT
+ *
+ */
+CBTDEF int64_t cbt_NodeCount(const cbt_Tree *tree)
+{
+    CBT_ASSERT(!tree->reduction.isPending && "sums are stale");
+
+    return cbt__HeapRead(tree, cbt_CreateNode(1u, 0));
+}
+
+
+/*******************************************************************************
+ * DecodeNode -- Returns the leaf node associated to index nodeID
+ *
+ * This is procedure is for iterating over the nodes.
+ *
+ */
+CBTDEF cbt_Node cbt_DecodeNode(const cbt_Tree *tree, int64_t handle)
+{
+    CBT_ASSERT(handle < cbt_NodeCount(tree) && "handle > NodeCount");
+    CBT_ASSERT(handle >= 0 && "handle < 0");
+    CBT__STATS(int64_t time = cbt__Time();)
+    CBT__STATS(int64_t *timer = &tree->instrumentation->stats.decodeNanoseconds;)
+
+    cbt_Node node = cbt_CreateNode(1u, 0);
+
+    if (tree->rankIndex != NULL && !tree->isUpdating) {
+        node = cbt__DecodeNode_RankIndex(tree, handle);
+    } else {
+        while (cbt__HeapRead(tree, node) > 1u) {
+            cbt_Node heapNode = cbt_CreateNode(node.id<<= 1u, ++node.depth);
+            uint64_t cmp = cbt__HeapRead(tree, heapNode);
+            uint64_t b = (uint64_t)handle < cmp ? 0u : 1u;
+
+            node.id|= b;
+            handle-= cmp * b;
+        }
+    }
+
+    CBT__STATS(CBT__STATS_ADD(tree, decodeCount, 1);)
+    CBT__STATS(cbt__EndTimer(tree, timer, NULL, -1, time);)
+
+    return node;
+}
+
+
+/*******************************************************************************
+ * EncodeNode -- Returns the bit index associated with the Node
+ *
+ * This does the inverse of the DecodeNode routine.
+ *
+ */
+CBTDEF int64_t cbt_EncodeNode(const cbt_Tree *tree, const cbt_Node node)
+{
+    CBT_ASSERT(!tree->reduction.isPending && "sums are stale");
+    CBT_ASSERT(cbt_IsLeafNode(tree, node) && "node is not a leaf");
+    CBT__STATS(int64_t time = cbt__Time();)
+    CBT__STATS(int64_t *timer = &tree->instrumentation->stats.encodeNanoseconds;)
+
+    int64_t handle = tree->rankIndex != NULL && !tree->isUpdating
+                   ? cbt__EncodeNode_RankIndex(tree, node)
+                   : cbt__LeafOffset(tree, node);
+
+    CBT__STATS(CBT__STATS_ADD(tree, encodeCount, 1);)
+    CBT__STATS(cbt__EndTimer(tree, timer, NULL, -1, time);)
+
+    return handle;
+}
+
+
+/*******************************************************************************
+ * EnableRankIndex -- Decodes and encodes nodes in constant time
+ *
+ * The index takes a quarter of the size of the bitfield, and is updated
+ * along with the sum tree (see RankIndex). It is not supported for sparse
+ * trees, nor for maximum depths below 9, where the tree is shallow anyway.
+ * Snapshots inherit the index, which must thus be enabled before them.
+ * Since the index reads the bitfield, it does not match the sums while the
+ * updaters of cbt_Update, cbt_UpdateBatched and cbt_ForestUpdate split and
+ * merge nodes: the queries of the updaters walk down the sum tree instead,
+ * and thus see the tree as it was before the update, as without the index.
+ *
+ */
+CBTDEF bool cbt_EnableRankIndex(cbt_Tree *tree)
+{
+    CBT_ASSERT(!tree->reduction.isPending && "sums are stale");
+
+    if (tree->rankIndex != NULL)
+        return true;
+
+    if (tree->isSparse || cbt_MaxDepth(tree) < 9)
+        return false;
+
+    // readers may already be querying the snapshots
+    if (tree->snapshots != NULL)
+        return false;
+
+    return cbt__CreateRankIndex(tree);
+}
+
+
+/*******************************************************************************
+ * ExportLeaves -- Writes all the leaves of the CBT in handle order
+ *
+ * The chunks of the bitfield are decoded in parallel, as in cbt_Update, and
+ * each range of chunks writes its leaves starting at the handle of its first
+ * leaf, which the sum tree provides (see LeafOffset). Since a chunk holds as
+ * many leaves as its count, the next chunk starts right after it, so the
+ * whole export streams through the heap instead of walking down the tree
+ * for each leaf. The output buffers must hold cbt_NodeCount(tree) elements,
+ * and the number of leaves is returned. The SoA variant accepts NULL for
+ * either array.
+ *
+ */
+typedef struct {
+    const cbt_Tree *tree;
+    const uint64_t *chunkIDs;
+    cbt_Node *leaves;
+    uint64_t *heapIDs;
+    int64_t *depths;
+} cbt__ExportLoop;
+
+static void cbt__ExportLeaves_Range(int64_t begin, int64_t end, void *callbackData)
+{
+    const cbt__ExportLoop *loop = (const cbt__ExportLoop *)callbackData;
+    const cbt_Tree *tree = loop->tree;
+    int64_t maxDepth = cbt_MaxDepth(tree);
+    int64_t chunkID = loop->chunkIDs != NULL ? (int64_t)loop->chunkIDs[begin] : begin;
+    int64_t leafID = 0;
+
+    if (maxDepth >= 9) {
+        uint64_t chunkNodeID = (1ULL << (maxDepth - 9)) + (uint64_t)chunkID;
+
+        leafID = cbt__LeafOffset(tree, cbt_CreateNode(chunkNodeID, maxDepth - 9));
+    }
+
+    for (int64_t i = begin; i < end; ++i) {
+        cbt_Node leaves[CBT__CHUNK_LEAF_COUNT];
+        int64_t leafCount;
+
+        chunkID = loop->chunkIDs != NULL ? (int64_t)loop->chunkIDs[i] : i;
+
+        if (loop->leaves != NULL) {
+            leafID+= cbt__DecodeLeaves_Chunk(tree, chunkID, &loop->leaves[leafID]);
+            continue;
+        }
+
+        leafCount = cbt__DecodeLeaves_Chunk(tree, chunkID, leaves);
+
+        if (loop->heapIDs != NULL) {
+            for (int64_t j = 0; j < leafCount; ++j) {
+                loop->heapIDs[leafID + j] = leaves[j].id;
+            }
+        }
+
+        if (loop->depths != NULL) {
+            for (int64_t j = 0; j < leafCount; ++j) {
+                loop->depths[leafID + j] = leaves[j].depth;
+            }
+        }
+
+        leafID+= leafCount;
+    }
+}
+
+static int64_t cbt__ExportLeaves(cbt__ExportLoop *loop)
+{
+    CBT_ASSERT(!loop->tree->reduction.isPending && "sums are stale");
+    const cbt_Tree *tree = loop->tree;
+    int64_t maxDepth = cbt_MaxDepth(tree);
+    int64_t chunkCount = cbt__ChunkCount(maxDepth);
+    uint64_t *chunkIDs = NULL;
+
+    // the sparse trees only list the chunks that contain leaves
+    if (tree->isSparse && maxDepth >= 9) {
+        cbt_Node root = cbt_CreateNode(1u, 0);
+
+        chunkCount = cbt__GatherChunkIDs(tree, root, NULL, 0);
+        chunkIDs = (uint64_t *)CBT_MALLOC(sizeof(uint64_t) * (chunkCount + 1));
+        cbt__GatherChunkIDs(tree, root, chunkIDs, 0);
+    }
+
+    loop->chunkIDs = chunkIDs;
+    cbt__ParallelFor(tree, chunkCount, 16, &cbt__ExportLeaves_Range, loop);
+    CBT_FREE(chunkIDs);
+
+    return cbt_NodeCount(tree);
+}
+
+CBTDEF int64_t cbt_ExportLeaves(const cbt_Tree *tree, cbt_Node *leaves)
+{
+    cbt__ExportLoop loop = {tree, NULL, leaves, NULL, NULL};
+
+    return cbt__ExportLeaves(&loop);
+}
+
+CBTDEF int64_t cbt_ExportLeafHeapIDs(const cbt_Tree *tree, uint64_t *heapIDs)
+{
+    cbt__ExportLoop loop = {tree, NULL, NULL, heapIDs, NULL};
+
+    return cbt__ExportLeaves(&loop);
+}
+
+CBTDEF int64_t
+cbt_ExportLeavesSoA(const cbt_Tree *tree, uint64_t *heapIDs, int64_t *depths)
+{
+    cbt__ExportLoop loop = {tree, NULL, NULL, heapIDs, depths};
+
+    return cbt__ExportLeaves(&loop);
+}
+
+
+/*******************************************************************************
+ * Snapshots -- Publishes read-only copies of the tree for reader threads
+ *
+ * Once enabled, every function that modifies the tree publishes a snapshot
+ * of its result, which other threads can acquire and query with the const
+ * functions of the API while the tree keeps being modified. A snapshot
+ * remains valid and unchanged until it is released. Sparse trees do not
+ * support snapshots.
+ *
+ */
+CBTDEF bool cbt_EnableSnapshots(cbt_Tree *tree)
+{
+    cbt_CreateInfo info = {
+        cbt_MaxDepth(tree), 0, tree->layout, &tree->allocator,
+        0, false, NULL, 0, false
+    };
+    cbt__Snapshots *snapshots;
+
+    CBT_ASSERT(!tree->isReadOnly && "tree is read-only");
+    CBT_ASSERT(!tree->reduction.isPending && "sums are stale");
+
+    if (tree->snapshots != NULL)
+        return true;
+
+    if (tree->isSparse)
+        return false;
+
+    snapshots = (cbt__Snapshots *)CBT_MALLOC(sizeof(*snapshots));
+    if (snapshots == NULL)
+        return false;
+
+    for (int64_t snapshotID = 0; snapshotID < CBT__SNAPSHOT_COUNT; ++snapshotID) {
+        cbt_Tree *snapshot = cbt__Create(&info, false);
+
+        if (snapshot != NULL
+            && tree->rankIndex != NULL
+            && !cbt__CreateRankIndex(snapshot)) {
+            cbt_Release(snapshot);
+            snapshot = NULL;
+        }
+
+        if (snapshot == NULL) {
+            while (snapshotID-- > 0) {
+                cbt_Release(snapshots->trees[snapshotID]);
+            }
+            CBT_FREE(snapshots);
+
+            return false;
+        }
+
+        snapshot->isReadOnly = true;
+        snapshots->trees[snapshotID] = snapshot;
+        snapshots->readerCounts[snapshotID] = 0u;
+        snapshots->isOutdated[snapshotID] = true;
+    }
+
+    cbt__CopySnapshot(tree, snapshots->trees[0]);
+    snapshots->trees[0]->snapshotEpoch = tree->snapshotEpoch;
+    snapshots->isOutdated[0] = false;
+    snapshots->publishedID = 0u;
+    snapshots->hasChanges = false;
+    tree->snapshots = snapshots;
+
+    return true;
+}
+
+CBTDEF const cbt_Tree *cbt_AcquireSnapshot(const cbt_Tree *tree)
+{
+    cbt__Snapshots *snapshots = tree->snapshots;
+
+    CBT_ASSERT(snapshots != NULL && "snapshots are not enabled");
+
+    for (;;) {
+        uint64_t snapshotID = cbt__AtomicLoad_SeqCst(&snapshots->publishedID);
+
+        cbt__AtomicAdd_SeqCst(&snapshots->readerCounts[snapshotID], 1u);
+
+        // the writer only reuses snapshots that are not published
+        if (cbt__AtomicLoad_SeqCst(&snapshots->publishedID) == snapshotID)
+            return snapshots->trees[snapshotID];
+
+        cbt__AtomicAdd_SeqCst(&snapshots->readerCounts[snapshotID], ~0ULL);
+    }
+}
+
+CBTDEF void
+cbt_ReleaseSnapshot(const cbt_Tree *tree, const cbt_Tree *snapshot)
+{
+    cbt__Snapshots *snapshots = tree->snapshots;
+
+    for (int64_t snapshotID = 0; snapshotID < CBT__SNAPSHOT_COUNT; ++snapshotID) {
+        if (snapshots->trees[snapshotID] == snapshot) {
+            cbt__AtomicAdd_SeqCst(&snapshots->readerCounts[snapshotID], ~0ULL);
+            return;
+        }
+    }
+
+    CBT_ASSERT(false && "snapshot does not belong to the tree");
+}
+
+CBTDEF int64_t cbt_SnapshotEpoch(const cbt_Tree *snapshot)
+{
+    return snapshot->snapshotEpoch;
+}
+
+
+/*******************************************************************************
+ * Stats -- Returns the counters and timings recorded since the last reset
+ *
+ * The statistics are only recorded when the library is compiled with
+ * CBT_ENABLE_STATS, and are all zero otherwise. Timings are in nanoseconds.
+ * Note that timing cbt_DecodeNode and cbt_EncodeNode costs about as much as
+ * the traversals themselves, so their timings are mostly useful relative to
+ * one another.
+ *
+ */
+CBTDEF void cbt_GetStats(const cbt_Tree *tree, cbt_Stats *stats)
+{
+#ifdef CBT_ENABLE_STATS
+    *stats = tree->instrumentation->stats;
+#else
+    (void)tree;
+    cbt__ClearStats(stats);
+#endif
+}
+
+CBTDEF void cbt_ResetStats(cbt_Tree *tree)
+{
+#ifdef CBT_ENABLE_STATS
+    cbt__ClearStats(&tree->instrumentation->stats);
+#else
+    (void)tree;
+#endif
+}
+
+
+/*******************************************************************************
+ * SetTraceCallback -- Forwards the timed phases of a tree to a callback
+ *
+ * The callback receives one event per update, reset, sum reduction, level
+ * of a sum reduction and parallel loop running the update callbacks, once
+ * the phase completes. It runs on the thread that called the operation,
+ * i.e., concurrently for the trees of a forest. Passing NULL disables the
+ * events. Does nothing unless the library is compiled with CBT_ENABLE_STATS.
+ *
+ */
+CBTDEF void
+cbt_SetTraceCallback(cbt_Tree *tree, cbt_TraceCallback callback, void *userData)
+{
+#ifdef CBT_ENABLE_STATS
+    tree->instrumentation->traceCallback = callback;
+    tree->instrumentation->traceUserData = userData;
+#else
+    (void)tree;
+    (void)callback;
+    (void)userData;
+#endif
+}
+
+
+/*******************************************************************************
+ * SetExecutor -- Sets the executor that runs the parallel loops of the CBT
+ *
+ * Passing NULL restores the default executor, which relies on OpenMP when
+ * it is enabled and runs the loops serially otherwise.
+ *
+ */
+CBTDEF void cbt_SetExecutor(cbt_Tree *tree, const cbt_Executor *executor)
+{
+    if (executor != NULL) {
+        CBT_ASSERT(executor->parallelFor != NULL && "parallelFor must be set");
+        tree->executor = *executor;
+    } else {
+        tree->executor.parallelFor = &cbt__ParallelFor_Default;
+        tree->executor.executorData = NULL;
+        tree->executor.threadCount = cbt__DefaultThreadCount();
+    }
+}
+
+
+/*******************************************************************************
+ * Forest -- Trees of the same depth stored in a single heap buffer
+ *
+ * The heaps of the trees use the packed layout and are stored one after
+ * the other, CBT__FOREST_HEAP_ALIGNMENT bytes apart, so that the buffer
+ * can be uploaded as-is and each heap bound at its offset as the heap
+ * buffer of the GPU implementation. The dirty bitmaps of the trees share
+ * a second allocation. Each tree runs its own loops serially, and the
+ * forest runs its loops in parallel across trees instead. The trees are
+ * owned by the forest and must not be released with cbt_Release.
+ *
+ * The packed layout is the heap format of the GPU implementation: the
+ * shaders read the same bits as uint32 words, so that a 64-bit word of
+ * the heap is the pair of 32-bit words that the GPU sees on little-endian
+ * hosts, and the max depth marker in heap[0] falls in its first 32-bit
+ * word. This holds up to CBT__GPU_MAX_DEPTH, beyond which the bit indices
+ * of the shaders overflow 32 bits, and test/cbt_gpu_test.c checks it
+ * against a C port of the shaders. A forest may also be created in a
+ * caller-owned buffer, e.g., a mapped upload or readback buffer, in which
+ * case the heaps are read and written there directly.
+ *
+ */
+#define CBT__FOREST_HEAP_ALIGNMENT 256
+#define CBT__GPU_MAX_DEPTH 30
+
+struct cbt_Forest {
+    char *heapMemory;       // allocated memory, NULL for a caller-owned buffer
+    uint64_t *heap;         // heap buffer, aligned within heapMemory
+    uint64_t *dirtyBits;
+    cbt_Tree *trees;
+    int64_t treeCount;
+    int64_t heapStride;     // byte offset between two heaps
+    cbt_Executor executor;
+};
+
+static int64_t cbt__ForestHeapStride(int64_t maxDepth)
+{
+    const int64_t alignment = CBT__FOREST_HEAP_ALIGNMENT;
+    int64_t heapByteSize = cbt_LayoutHeapByteSize(maxDepth, CBT_LAYOUT_PACKED);
+
+    return (heapByteSize + alignment - 1) & ~(alignment - 1);
+}
+
+static bool cbt__IsGpuHeapFormat(int64_t maxDepth)
+{
+    const uint32_t one = 1u;
+    uint8_t firstByte;
+
+    CBT_MEMCPY(&firstByte, &one, 1);
+
+    return firstByte == 1u && maxDepth <= CBT__GPU_MAX_DEPTH;
+}
+
+// creates a forest whose heaps are left as is; buffer may be NULL
+static cbt_Forest *
+cbt__CreateForest(
+    int64_t treeCount,
+    int64_t maxDepth,
+    void *buffer,
+    int64_t byteSize
+) {
+    CBT_ASSERT(treeCount >= 1 && "treeCount must be at least 1");
+    CBT_ASSERT(maxDepth >=  6 && "maxDepth must be at least 6");
+    CBT_ASSERT(maxDepth <= 58 && "maxDepth must be at most 58");
+    cbt_Forest *forest = (cbt_Forest *)CBT_MALLOC(sizeof(*forest));
+    const int64_t alignment = CBT__FOREST_HEAP_ALIGNMENT;
+    int64_t dirtyBufferCount;
+
+    forest->trees = (cbt_Tree *)CBT_MALLOC(sizeof(cbt_Tree) * treeCount);
+    forest->treeCount = treeCount;
+    forest->executor.parallelFor = &cbt__ParallelFor_Default;
+    forest->executor.executorData = NULL;
+    forest->executor.threadCount = cbt__DefaultThreadCount();
+
+    for (int64_t treeID = 0; treeID < treeCount; ++treeID) {
+        cbt_Tree *tree = &forest->trees[treeID];
+
+        cbt__InitTree(tree, maxDepth, CBT_LAYOUT_PACKED, false);
+        tree->executor.parallelFor = &cbt__ParallelFor_Serial;
+        tree->executor.threadCount = 1;
+    }
+
+    dirtyBufferCount = forest->trees[0].dirtyLevelOffsets[forest->trees[0].dirtyLevelCount];
+    forest->heapStride = cbt__ForestHeapStride(maxDepth);
+
+    if (buffer != NULL) {
+        CBT_ASSERT(byteSize >= forest->heapStride * treeCount && "buffer is too small");
+        CBT_ASSERT(((uintptr_t)buffer & 7) == 0 && "buffer must be 8-byte aligned");
+        forest->heapMemory = NULL;
+        forest->heap = (uint64_t *)buffer;
+    } else {
+        uintptr_t heapAddress;
+
+        forest->heapMemory = (char *)CBT_MALLOC(forest->heapStride * treeCount + alignment);
+        heapAddress = (uintptr_t)forest->heapMemory;
+        heapAddress = (heapAddress + alignment - 1) & ~(uintptr_t)(alignment - 1);
+        forest->heap = (uint64_t *)heapAddress;
+    }
+
+    forest->dirtyBits = (uint64_t *)
+        CBT_MALLOC(sizeof(uint64_t) * dirtyBufferCount * treeCount);
+
+    for (int64_t treeID = 0; treeID < treeCount; ++treeID) {
+        cbt_Tree *tree = &forest->trees[treeID];
+
+        tree->heap = &forest->heap[(forest->heapStride >> 3) * treeID];
+        tree->dirtyBits = &forest->dirtyBits[dirtyBufferCount * treeID];
+        tree->isHeapOwned = false;
+        cbt__ClearDirtyBits(tree);
+    }
+
+    return forest;
+}
+
+// clears the heaps and resets the trees to a given depth
+static void
+cbt__InitForestHeaps(cbt_Forest *forest, int64_t maxDepth, int64_t depth)
+{
+    int64_t heapBufferCount = (forest->heapStride * forest->treeCount) >> 3;
+
+    // clear the padding bits and the space between the heaps
+    for (int64_t bufferID = 0; bufferID < heapBufferCount; ++bufferID) {
+        forest->heap[bufferID] = 0u;
+    }
+
+    for (int64_t treeID = 0; treeID < forest->treeCount; ++treeID) {
+        forest->trees[treeID].heap[0] = 1ULL << maxDepth; // store max Depth and layout
+    }
+
+    cbt_ForestResetToDepth(forest, depth);
+}
+
+CBTDEF cbt_Forest *
+cbt_CreateForest(int64_t treeCount, int64_t maxDepth, int64_t depth)
+{
+    cbt_Forest *forest = cbt__CreateForest(treeCount, maxDepth, NULL, 0);
+
+    cbt__InitForestHeaps(forest, maxDepth, depth);
+
+    return forest;
+}
+
+CBTDEF cbt_Forest *
+cbt_CreateForestInBuffer(
+    void *buffer,
+    int64_t byteSize,
+    int64_t treeCount,
+    int64_t maxDepth,
+    int64_t depth
+) {
+    CBT_ASSERT(cbt__IsGpuHeapFormat(maxDepth)
+               && "maxDepth must be at most 30 on a little-endian host");
+    cbt_Forest *forest = cbt__CreateForest(treeCount, maxDepth, buffer, byteSize);
+
+    cbt__InitForestHeaps(forest, maxDepth, depth);
+
+    return forest;
+}
+
+/*
+ * The heaps are used as they are, so they must hold valid trees whose sum
+ * reduction is up to date, as left by the sum reduction shaders.
+ */
+CBTDEF cbt_Forest *
+cbt_CreateForestFromBuffer(void *buffer, int64_t byteSize, int64_t treeCount)
+{
+    uint32_t maxDepthMarker;
+    int64_t maxDepth;
+    cbt_Forest *forest;
+
+    CBT_ASSERT(byteSize >= 4 && "buffer is too small");
+    CBT_MEMCPY(&maxDepthMarker, buffer, 4);
+    CBT_ASSERT(maxDepthMarker != 0u && "buffer does not hold a heap");
+    maxDepth = cbt__FindLSB(maxDepthMarker);
+    CBT_ASSERT(maxDepth >= 6 && cbt__IsGpuHeapFormat(maxDepth)
+               && "buffer does not hold heaps in the GPU format");
+    forest = cbt__CreateForest(treeCount, maxDepth, buffer, byteSize);
+
+    for (int64_t treeID = 0; treeID < treeCount; ++treeID) {
+        uint64_t marker = forest->trees[treeID].heap[0] & ((2ULL << maxDepth) - 1u);
+
+        CBT_ASSERT(marker == (1ULL << maxDepth) && "heaps have different max depths");
+        (void)marker;
+    }
+
+    return forest;
+}
+
+CBTDEF int64_t cbt_ForestBufferByteSize(int64_t treeCount, int64_t maxDepth)
+{
+    return cbt__ForestHeapStride(maxDepth) * treeCount;
+}
+
+CBTDEF void cbt_ReleaseForest(cbt_Forest *forest)
+{
+    for (int64_t treeID = 0; treeID < forest->treeCount; ++treeID) {
+        cbt__ReleaseScratchBuffers(&forest->trees[treeID]);
+        cbt__ReleaseRankIndex(&forest->trees[treeID]);
+    }
+
+    CBT_FREE(forest->dirtyBits);
+    if (forest->heapMemory != NULL)
+        CBT_FREE(forest->heapMemory);
+    CBT_FREE(forest->trees);
+    CBT_FREE(forest);
+}
+
+static void
+cbt__ForestParallelFor(
+    const cbt_Forest *forest,
+    int64_t count,
+    int64_t grainSize,
+    cbt_ParallelForCallback callback,
+    void *callbackData
+) {
+    cbt__ExecuteParallelFor(&forest->executor,
+                            count,
+                            grainSize,
+                            callback,
+                            callbackData);
+}
+
+typedef struct {
+    cbt_Forest *forest;
+    cbt_ForestUpdateCallback updater;
+    const void *userData;
+    int64_t chunkCount;
+    int64_t depth;
+} cbt__ForestLoop;
+
+static void
+cbt__ForestResetToDepth_Range(int64_t begin, int64_t end, void *callbackData)
+{
+    const cbt__ForestLoop *loop = (const cbt__ForestLoop *)callbackData;
+
+    for (int64_t treeID = begin; treeID < end; ++treeID) {
+        cbt_ResetToDepth(&loop->forest->trees[treeID], loop->depth);
+    }
+}
+
+static void
+cbt__ForestComputeSumReduction_Range(int64_t begin, int64_t end, void *callbackData)
+{
+    const cbt__ForestLoop *loop = (const cbt__ForestLoop *)callbackData;
+
+    for (int64_t treeID = begin; treeID < end; ++treeID) {
+        cbt__ComputeSumReduction_Incremental(&loop->forest->trees[treeID]);
+    }
+}
+
+// each work item decodes and updates one chunk of leaves of one tree
+static void
+cbt__ForestUpdate_Range(int64_t begin, int64_t end, void *callbackData)
+{
+    const cbt__ForestLoop *loop = (const cbt__ForestLoop *)callbackData;
+
+    for (int64_t i = begin; i < end; ++i) {
+        int64_t treeID = i / loop->chunkCount;
+        int64_t chunkID = i - treeID * loop->chunkCount;
+        cbt_Tree *tree = &loop->forest->trees[treeID];
+        cbt_Node leaves[CBT__CHUNK_LEAF_COUNT];
+        int64_t leafCount = cbt__DecodeLeaves_Chunk(tree, chunkID, leaves);
+
+        for (int64_t leafID = 0; leafID < leafCount; ++leafID) {
+            loop->updater(tree, treeID, leaves[leafID], loop->userData);
+        }
+    }
+}
+
+CBTDEF void cbt_ForestResetToDepth(cbt_Forest *forest, int64_t depth)
+{
+    cbt__ForestLoop loop = {forest, NULL, NULL, 0, depth};
+
+    cbt__ForestParallelFor(forest,
+                           forest->treeCount,
+                           1,
+                           &cbt__ForestResetToDepth_Range,
+                           &loop);
+}
+
+/*
+ * Sums are updated for the words that were modified since the last
+ * reduction, so this only needs to be called after modifying the trees
+ * outside of cbt_ForestUpdate.
+ */
+CBTDEF void cbt_ForestComputeSumReduction(cbt_Forest *forest)
+{
+    cbt__ForestLoop loop = {forest, NULL, NULL, 0, 0};
+
+    cbt__ForestParallelFor(forest,
+                           forest->treeCount,
+                           1,
+                           &cbt__ForestComputeSumReduction_Range,
+                           &loop);
+}
+
+CBTDEF void
+cbt_ForestUpdate(
+    cbt_Forest *forest,
+    cbt_ForestUpdateCallback updater,
+    const void *userData
+) {
+    int64_t chunkCount = cbt__ChunkCount(cbt_MaxDepth(&forest->trees[0]));
+    cbt__ForestLoop loop = {forest, updater, userData, chunkCount, 0};
+
+    for (int64_t treeID = 0; treeID < forest->treeCount; ++treeID) {
+        forest->trees[treeID].isUpdating = true;
+    }
+
+    cbt__ForestParallelFor(forest,
+                           forest->treeCount * chunkCount,
+                           1,
+                           &cbt__ForestUpdate_Range,
+                           &loop);
+
+    for (int64_t treeID = 0; treeID < forest->treeCount; ++treeID) {
+        forest->trees[treeID].isUpdating = false;
+    }
+
+    cbt_ForestComputeSumReduction(forest);
+}
+
+CBTDEF void
+cbt_ForestSetExecutor(cbt_Forest *forest, const cbt_Executor *executor)
+{
+    if (executor != NULL) {
+        CBT_ASSERT(executor->parallelFor != NULL && "parallelFor must be set");
+        forest->executor = *executor;
+    } else {
+        forest->executor.parallelFor = &cbt__ParallelFor_Default;
+        forest->executor.executorData = NULL;
+        forest->executor.threadCount = cbt__DefaultThreadCount();
+    }
+}
+
+CBTDEF int64_t cbt_ForestTreeCount(const cbt_Forest *forest)
+{
+    return forest->treeCount;
+}
+
+CBTDEF cbt_Tree *cbt_ForestTree(cbt_Forest *forest, int64_t treeID)
+{
+    CBT_ASSERT(treeID >= 0 && treeID < forest->treeCount && "invalid treeID");
+
+    return &forest->trees[treeID];
+}
+
+CBTDEF int64_t cbt_ForestHeapByteSize(const cbt_Forest *forest)
+{
+    return forest->heapStride * forest->treeCount;
+}
+
+CBTDEF int64_t cbt_ForestHeapStride(const cbt_Forest *forest)
+{
+    return forest->heapStride;
+}
+
+CBTDEF const char *cbt_ForestGetHeap(const cbt_Forest *forest)
+{
+    return (const char *)forest->heap;
+}
+
+
+#ifndef CBT_NO_THREAD_POOL
+/*******************************************************************************
+ * Threading primitives -- Thin wrappers over Win32 and POSIX threads
+ *
+ */
+#if defined(_WIN32)
+typedef SRWLOCK cbt__Mutex;
+typedef CONDITION_VARIABLE cbt__Condition;
+typedef HANDLE cbt__Thread;
+
+static void cbt__CreateMutex(cbt__Mutex *mutex)
+{
+    InitializeSRWLock(mutex);
+}
+
+static void cbt__ReleaseMutex(cbt__Mutex *mutex)
+{
+    (void)mutex;
+}
+
+static void cbt__LockMutex(cbt__Mutex *mutex)
+{
+    AcquireSRWLockExclusive(mutex);
+}
+
+static void cbt__UnlockMutex(cbt__Mutex *mutex)
+{
+    ReleaseSRWLockExclusive(mutex);
+}
+
+static void cbt__CreateCondition(cbt__Condition *condition)
+{
+    InitializeConditionVariable(condition);
+}
+
+static void cbt__ReleaseCondition(cbt__Condition *condition)
+{
+    (void)condition;
+}
+
+static void cbt__WaitCondition(cbt__Condition *condition, cbt__Mutex *mutex)
+{
+    SleepConditionVariableSRW(condition, mutex, INFINITE, 0);
+}
+
+static void cbt__BroadcastCondition(cbt__Condition *condition)
+{
+    WakeAllConditionVariable(condition);
+}
+
+static int64_t cbt__ProcessorCount(void)
+{
+    SYSTEM_INFO info;
+
+    GetSystemInfo(&info);
+
+    return (int64_t)info.dwNumberOfProcessors;
+}
+#else
+typedef pthread_mutex_t cbt__Mutex;
+typedef pthread_cond_t cbt__Condition;
+typedef pthread_t cbt__Thread;
+
+static void cbt__CreateMutex(cbt__Mutex *mutex)
+{
+    pthread_mutex_init(mutex, NULL);
+}
+
+static void cbt__ReleaseMutex(cbt__Mutex *mutex)
+{
+    pthread_mutex_destroy(mutex);
+}
+
+static void cbt__LockMutex(cbt__Mutex *mutex)
+{
+    pthread_mutex_lock(mutex);
+}
+
+static void cbt__UnlockMutex(cbt__Mutex *mutex)
+{
+    pthread_mutex_unlock(mutex);
+}
+
+static void cbt__CreateCondition(cbt__Condition *condition)
+{
+    pthread_cond_init(condition, NULL);
+}
+
+static void cbt__ReleaseCondition(cbt__Condition *condition)
+{
+    pthread_cond_destroy(condition);
+}
+
+static void cbt__WaitCondition(cbt__Condition *condition, cbt__Mutex *mutex)
+{
+    pthread_cond_wait(condition, mutex);
+}
+
+static void cbt__BroadcastCondition(cbt__Condition *condition)
+{
+    pthread_cond_broadcast(condition);
+}
+
+static int64_t cbt__ProcessorCount(void)
+{
+    long processorCount = sysconf(_SC_NPROCESSORS_ONLN);
+
+    return processorCount > 0 ? (int64_t)processorCount : 1;
+}
+#endif
+
+
+/*******************************************************************************
+ * ThreadPool -- Work-stealing thread pool
+ *
+ * Each thread owns a range of grains, which it processes from the front.
+ * Once its range is empty, a thread steals the back half of the range of
+ * another thread, so that threads that run into cheap grains help the
+ * others. The calling thread participates as thread 0, and concurrent
+ * loops are serialized. Note that loops may not be nested, i.e., a
+ * callback may not run a loop on the pool that runs it.
+ *
+ */
+typedef struct {
+    cbt__Mutex mutex;
+    int64_t begin, end; // grains left to process
+    char padding[64];   // keeps the ranges on different cache lines
+} cbt__GrainRange;
+
+typedef struct {
+    cbt_ThreadPool *pool;
+    int64_t threadID;
+} cbt__Worker;
+
+struct cbt_ThreadPool {
+    cbt__Mutex loopMutex;
+    cbt__Mutex mutex;
+    cbt__Condition wakeCondition;
+    cbt__Condition doneCondition;
+    cbt__Thread *threads;
+    cbt__Worker *workers;
+    cbt__GrainRange *ranges;
+    int64_t threadCount;
+    int64_t loopID;
+    int64_t busyThreadCount;
+    bool quit;
+    // loop being processed
+    cbt_ParallelForCallback callback;
+    void *callbackData;
+    int64_t count;
+    int64_t grainSize;
+};
+
+static bool
+cbt__ThreadPool_PopGrain(cbt_ThreadPool *pool, int64_t threadID, int64_t *grainID)
+{
+    cbt__GrainRange *range = &pool->ranges[threadID];
+    bool isRangeEmpty;
+
+    cbt__LockMutex(&range->mutex);
+    isRangeEmpty = (range->begin == range->end);
+    if (!isRangeEmpty)
+        *grainID = range->begin++;
+    cbt__UnlockMutex(&range->mutex);
+
+    return !isRangeEmpty;
+}
+
+static bool cbt__ThreadPool_StealGrains(cbt_ThreadPool *pool, int64_t threadID)
+{
+    for (int64_t i = 1; i < pool->threadCount; ++i) {
+        cbt__GrainRange *victim = &pool->ranges[(threadID + i) % pool->threadCount];
+        int64_t begin, end;
+
+        cbt__LockMutex(&victim->mutex);
+        begin = victim->begin + ((victim->end - victim->begin) >> 1);
+        end = victim->end;
+        victim->end = begin;
+        cbt__UnlockMutex(&victim->mutex);
+
+        if (begin < end) {
+            cbt__GrainRange *range = &pool->ranges[threadID];
+
+            cbt__LockMutex(&range->mutex);
+            range->begin = begin;
+            range->end = end;
+            cbt__UnlockMutex(&range->mutex);
+
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static void cbt__ThreadPool_Run(cbt_ThreadPool *pool, int64_t threadID)
+{
+    int64_t grainID;
+
+    do {
+        while (cbt__ThreadPool_PopGrain(pool, threadID, &grainID)) {
+            int64_t begin = grainID * pool->grainSize;
+            int64_t end = begin + pool->grainSize;
+
+            pool->callback(begin,
+                           end < pool->count ? end : pool->count,
+                           pool->callbackData);
+        }
+    } while (cbt__ThreadPool_StealGrains(pool, threadID));
+}
+
+static void cbt__ThreadPool_Work(cbt__Worker *worker)
+{
+    cbt_ThreadPool *pool = worker->pool;
+    int64_t loopID = 0;
+
+    for (;;) {
+        cbt__LockMutex(&pool->mutex);
+        while (!pool->quit && pool->loopID == loopID)
+            cbt__WaitCondition(&pool->wakeCondition, &pool->mutex);
+
+        if (pool->quit) {
+            cbt__UnlockMutex(&pool->mutex);
+            return;
+        }
+        loopID = pool->loopID;
+        cbt__UnlockMutex(&pool->mutex);
+
+        cbt__ThreadPool_Run(pool, worker->threadID);
+
+        cbt__LockMutex(&pool->mutex);
+        if (--pool->busyThreadCount == 0)
+            cbt__BroadcastCondition(&pool->doneCondition);
+        cbt__UnlockMutex(&pool->mutex);
+    }
+}
+
+#if defined(_WIN32)
+static DWORD WINAPI cbt__ThreadPool_Main(LPVOID worker)
+{
+    cbt__ThreadPool_Work((cbt__Worker *)worker);
+
+    return 0;
+}
+#else
+static void *cbt__ThreadPool_Main(void *worker)
+{
+    cbt__ThreadPool_Work((cbt__Worker *)worker);
+
+    return NULL;
+}
+#endif
+
+static void
+cbt__ThreadPool_ParallelFor(
+    int64_t count,
+    int64_t grainSize,
+    cbt_ParallelForCallback callback,
+    void *callbackData,
+    void *executorData
+) {
+    cbt_ThreadPool *pool = (cbt_ThreadPool *)executorData;
+    int64_t grainCount = (count + grainSize - 1) / grainSize;
+    int64_t threadCount = pool->threadCount;
+
+    cbt__LockMutex(&pool->loopMutex);
+    pool->callback = callback;
+    pool->callbackData = callbackData;
+    pool->count = count;
+    pool->grainSize = grainSize;
+
+    // the workers are idle so their ranges can be set without locking
+    for (int64_t threadID = 0; threadID < threadCount; ++threadID) {
+        cbt__GrainRange *range = &pool->ranges[threadID];
+
+        range->begin = grainCount / threadCount * threadID
+                     + cbt__MinValue(threadID, grainCount % threadCount);
+        range->end = range->begin + grainCount / threadCount
+                   + (threadID < grainCount % threadCount ? 1 : 0);
+    }
+
+    cbt__LockMutex(&pool->mutex);
+    pool->busyThreadCount = threadCount - 1;
+    ++pool->loopID;
+    cbt__BroadcastCondition(&pool->wakeCondition);
+    cbt__UnlockMutex(&pool->mutex);
+
+    cbt__ThreadPool_Run(pool, 0);
+
+    cbt__LockMutex(&pool->mutex);
+    while (pool->busyThreadCount > 0)
+        cbt__WaitCondition(&pool->doneCondition, &pool->mutex);
+    cbt__UnlockMutex(&pool->mutex);
+    cbt__UnlockMutex(&pool->loopMutex);
+}
+
+
+/*******************************************************************************
+ * ThreadPool Ctor -- Spawns threadCount - 1 worker threads
+ *
+ * A threadCount less or equal to 0 spawns one thread per processor.
+ *
+ */
+CBTDEF cbt_ThreadPool *cbt_CreateThreadPool(int64_t threadCount)
+{
+    cbt_ThreadPool *pool = (cbt_ThreadPool *)CBT_MALLOC(sizeof(*pool));
+
+    if (threadCount <= 0)
+        threadCount = cbt__ProcessorCount();
+
+    cbt__CreateMutex(&pool->loopMutex);
+    cbt__CreateMutex(&pool->mutex);
+    cbt__CreateCondition(&pool->wakeCondition);
+    cbt__CreateCondition(&pool->doneCondition);
+    pool->threads = (cbt__Thread *)CBT_MALLOC(sizeof(cbt__Thread) * threadCount);
+    pool->workers = (cbt__Worker *)CBT_MALLOC(sizeof(cbt__Worker) * threadCount);
+    pool->ranges = (cbt__GrainRange *)CBT_MALLOC(sizeof(cbt__GrainRange) * threadCount);
+    pool->threadCount = threadCount;
+    pool->loopID = 0;
+    pool->busyThreadCount = 0;
+    pool->quit = false;
+
+    for (int64_t threadID = 0; threadID < threadCount; ++threadID) {
+        cbt__CreateMutex(&pool->ranges[threadID].mutex);
+        pool->ranges[threadID].begin = 0;
+        pool->ranges[threadID].end = 0;
+        pool->workers[threadID].pool = pool;
+        pool->workers[threadID].threadID = threadID;
+    }
+
+    for (int64_t threadID = 1; threadID < threadCount; ++threadID) {
+#if defined(_WIN32)
+        pool->threads[threadID] = CreateThread(NULL,
+                                               0,
+                                               &cbt__ThreadPool_Main,
+                                               &pool->workers[threadID],
+                                               0,
+                                               NULL);
+#else
+        pthread_create(&pool->threads[threadID],
+                       NULL,
+                       &cbt__ThreadPool_Main,
+                       &pool->workers[threadID]);
+#endif
+    }
+
+    return pool;
+}
+
+
+/*******************************************************************************
+ * ThreadPool Dtor -- Joins the worker threads
+ *
+ */
+CBTDEF void cbt_ReleaseThreadPool(cbt_ThreadPool *pool)
+{
+    cbt__LockMutex(&pool->mutex);
+    pool->quit = true;
+    cbt__BroadcastCondition(&pool->wakeCondition);
+    cbt__UnlockMutex(&pool->mutex);
+
+    for (int64_t threadID = 1; threadID < pool->threadCount; ++threadID) {
+#if defined(_WIN32)
+        WaitForSingleObject(pool->threads[threadID], INFINITE);
+        CloseHandle(pool->threads[threadID]);
+#else
+        pthread_join(pool->threads[threadID], NULL);
+#endif
+    }
+
+    for (int64_t threadID = 0; threadID < pool->threadCount; ++threadID) {
+        cbt__ReleaseMutex(&pool->ranges[threadID].mutex);
+    }
+
+    cbt__ReleaseCondition(&pool->doneCondition);
+    cbt__ReleaseCondition(&pool->wakeCondition);
+    cbt__ReleaseMutex(&pool->mutex);
+    cbt__ReleaseMutex(&pool->loopMutex);
+    CBT_FREE(pool->ranges);
+    CBT_FREE(pool->workers);
+    CBT_FREE(pool->threads);
+    CBT_FREE(pool);
+}
+
+
+/*******************************************************************************
+ * ThreadPoolExecutor -- Returns an executor that runs loops on a thread pool
+ *
+ * The pool must outlive the trees that use the executor.
+ *
+ */
+CBTDEF cbt_Executor cbt_ThreadPoolExecutor(cbt_ThreadPool *pool)
+{
+    cbt_Executor executor;
+
+    executor.parallelFor = &cbt__ThreadPool_ParallelFor;
+    executor.executorData = pool;
+    executor.threadCount = pool->threadCount;
+
+    return executor;
 }
+#endif // CBT_NO_THREAD_POOL
 
 
 #undef CBT_ATOMIC
 #undef CBT_PARALLEL_FOR
-#undef CBT_BARRIER
 #endif
 
@@ -0,0 +1,782 @@
+/* cbt.hpp - public domain C++ template for building binary trees in parallel
+by Jonathan Dupuy
+
+   This is a header-only companion to cbt.h where the max depth of the tree
+   is a template parameter. The bit offset and width of each level of the
+   heap are then known at compile time, levels whose fields never straddle
+   two 64-bit words are accessed with a single load, and the DecodeNode /
+   EncodeNode loops are fully unrolled. A C++17 compiler is required.
+
+   // i.e. it should look like this:
+   #include "cbt.hpp"
+
+   cbt::Tree<20> tree(depth);
+
+   The heap uses the exact same layout as cbt.h, so trees can be exchanged
+   between the C and C++ interfaces by copying the heap:
+   tree.SetHeap(cbt_GetHeap(cTree));
+   cbt_SetHeap(cTree, tree.GetHeap());
+   Note that this header does not require CBT_IMPLEMENTATION to be defined.
+
+   INTERFACING
+   define CBT_ASSERT(x) to avoid using assert.h
+   define CBT_MEMCPY(dst, src, num) to use your own memcpy routine
+*/
+
+#ifndef CBT_INCLUDE_CBT_HPP
+#define CBT_INCLUDE_CBT_HPP
+
+#ifndef CBT_INCLUDE_CBT_H
+#   include "cbt.h"
+#endif
+
+#ifndef CBT_ASSERT
+#    include <assert.h>
+#    define CBT_ASSERT(x) assert(x)
+#endif
+
+#ifndef CBT_MEMCPY
+#    include <string.h>
+#    define CBT_MEMCPY(dst, src, num) memcpy(dst, src, num)
+#endif
+
+#ifndef _OPENMP
+#   define CBTPP_ATOMIC
+#   define CBTPP_PARALLEL_FOR
+#else
+#   if defined(_WIN32)
+#       define CBTPP_ATOMIC          __pragma("omp atomic" )
+#       define CBTPP_PARALLEL_FOR    __pragma("omp parallel for")
+#   else
+#       define CBTPP_ATOMIC          _Pragma("omp atomic" )
+#       define CBTPP_PARALLEL_FOR    _Pragma("omp parallel for")
+#   endif
+#endif
+
+namespace cbt {
+
+typedef cbt_Node Node;
+
+
+/*******************************************************************************
+ * Node constructors -- Same as the _Fast variants of cbt.h
+ *
+ */
+constexpr Node CreateNode(uint64_t id, int64_t depth)
+{
+    return Node{id, (uint64_t)depth};
+}
+
+constexpr Node ParentNode(const Node node)
+{
+    return CreateNode(node.id >> 1, node.depth - 1);
+}
+
+constexpr Node SiblingNode(const Node node)
+{
+    return CreateNode(node.id ^ 1u, node.depth);
+}
+
+constexpr Node LeftSiblingNode(const Node node)
+{
+    return CreateNode(node.id & ~1ULL, node.depth);
+}
+
+constexpr Node RightSiblingNode(const Node node)
+{
+    return CreateNode(node.id | 1u, node.depth);
+}
+
+constexpr Node LeftChildNode(const Node node)
+{
+    return CreateNode(node.id << 1, node.depth + 1);
+}
+
+constexpr Node RightChildNode(const Node node)
+{
+    return CreateNode(node.id << 1 | 1u, node.depth + 1);
+}
+
+
+/*******************************************************************************
+ * Tree -- Concurrent binary tree of compile-time max depth
+ *
+ * The tree either owns its heap or wraps a heap provided by the user, in
+ * which case the memory must remain valid for the lifetime of the tree.
+ *
+ */
+template <int64_t MaxDepth>
+class Tree {
+    static_assert(MaxDepth >=  6, "MaxDepth must be at least 6");
+    static_assert(MaxDepth <= 58, "MaxDepth must be at most 58");
+
+public:
+    explicit Tree(int64_t depth = 0);
+    explicit Tree(uint64_t *heap);
+    ~Tree();
+    Tree(const Tree &) = delete;
+    Tree &operator=(const Tree &) = delete;
+
+    // heap layout
+    static constexpr int64_t HeapByteSize();
+    static constexpr int64_t HeapUint64Size();
+    static constexpr int64_t NodeBitSize(int64_t depth);
+    static constexpr int64_t LevelBitOffset(int64_t depth);
+    static constexpr int64_t NodeBitID(const Node node);
+    static constexpr bool IsWordAligned(int64_t depth);
+
+    // loaders
+    void ResetToRoot();
+    void ResetToCeil();
+    void ResetToDepth(int64_t depth);
+
+    // manipulation
+    void SplitNode_Fast(const Node node);
+    void SplitNode     (const Node node);
+    void MergeNode_Fast(const Node node);
+    void MergeNode     (const Node node);
+    template <typename Updater> void Update(const Updater &updater);
+
+    // O(1) queries
+    static constexpr int64_t GetMaxDepth() { return MaxDepth; }
+    int64_t NodeCount() const;
+    template <int64_t Depth> uint64_t HeapRead(uint64_t nodeID) const;
+    uint64_t HeapRead(const Node node) const;
+    bool IsLeafNode(const Node node) const;
+    static constexpr bool IsCeilNode(const Node node);
+    static constexpr bool IsRootNode(const Node node);
+    static constexpr bool IsNullNode(const Node node);
+
+    // O(depth) queries
+    Node DecodeNode(int64_t handle) const;
+    int64_t EncodeNode(const Node node) const;
+
+    // serialization
+    const char *GetHeap() const;
+    void SetHeap(const char *heapToCopy);
+
+private:
+    template <int64_t Depth> void HeapWrite(uint64_t nodeID, uint64_t bitData);
+    void HeapWrite_BitField(const Node node, uint64_t bitValue);
+    void ClearBitField();
+    template <int64_t Depth> void ComputeSumReductionLevel();
+    template <int64_t Depth> void ComputeSumReduction();
+    template <int64_t Depth> Node DecodeNode(uint64_t nodeID,
+                                             uint64_t nodeCount,
+                                             int64_t handle) const;
+    template <int64_t Depth> int64_t EncodeNode(const Node node) const;
+    Node LeafAncestor(Node node) const;
+    static bool IsMaxDepthOf(const uint64_t *heap);
+    template <int64_t Depth, typename Updater>
+    void UpdateSubtree(uint64_t nodeID,
+                       uint64_t nodeCount,
+                       const Updater &updater);
+
+    uint64_t *m_heap;
+    bool m_ownsHeap;
+};
+
+
+/*******************************************************************************
+ * HeapByteSize -- Computes the number of Bytes to allocate for the heap
+ *
+ */
+template <int64_t MaxDepth>
+constexpr int64_t Tree<MaxDepth>::HeapByteSize()
+{
+    return 1LL << (MaxDepth - 1);
+}
+
+template <int64_t MaxDepth>
+constexpr int64_t Tree<MaxDepth>::HeapUint64Size()
+{
+    return HeapByteSize() >> 3;
+}
+
+
+/*******************************************************************************
+ * NodeBitSize -- Returns the number of bits storing a node of a given depth
+ *
+ */
+template <int64_t MaxDepth>
+constexpr int64_t Tree<MaxDepth>::NodeBitSize(int64_t depth)
+{
+    return MaxDepth - depth + 1;
+}
+
+
+/*******************************************************************************
+ * LevelBitOffset -- Returns the first bit storing data for a given depth
+ *
+ * This is the bit of the leftmost node of the level, i.e., 2^d x (3 - d + D).
+ *
+ */
+template <int64_t MaxDepth>
+constexpr int64_t Tree<MaxDepth>::LevelBitOffset(int64_t depth)
+{
+    return (1LL << depth) * (3 + MaxDepth - depth);
+}
+
+
+/*******************************************************************************
+ * NodeBitID -- Returns the bit index that stores data associated with a node
+ *
+ */
+template <int64_t MaxDepth>
+constexpr int64_t Tree<MaxDepth>::NodeBitID(const Node node)
+{
+    return (2LL << node.depth) + node.id * NodeBitSize(node.depth);
+}
+
+
+/*******************************************************************************
+ * IsWordAligned -- Checks that no field of a given depth straddles two words
+ *
+ * The bit offsets of the fields of a level are periodic modulo 64, with a
+ * period that divides 64, so checking the first 64 fields is enough.
+ *
+ */
+template <int64_t MaxDepth>
+constexpr bool Tree<MaxDepth>::IsWordAligned(int64_t depth)
+{
+    int64_t bitCount = NodeBitSize(depth);
+    int64_t nodeCount = depth < 6 ? 1LL << depth : 64;
+
+    for (int64_t i = 0; i < nodeCount; ++i) {
+        int64_t bitOffset = (LevelBitOffset(depth) + i * bitCount) & 63;
+
+        if (bitOffset + bitCount > 64)
+            return false;
+    }
+
+    return true;
+}
+
+
+/*******************************************************************************
+ * HeapRead -- Returns the value stored at a node of a given depth
+ *
+ * Word-aligned levels read a single 64-bit word; other levels read two
+ * words without branching. The latter never happens for the last word of
+ * the heap since it is filled with word-aligned levels.
+ *
+ */
+template <int64_t MaxDepth>
+template <int64_t Depth>
+uint64_t Tree<MaxDepth>::HeapRead(uint64_t nodeID) const
+{
+    constexpr int64_t bitCount = NodeBitSize(Depth);
+    constexpr uint64_t bitMask = ~(~0ULL << bitCount);
+    const int64_t bitID = (2LL << Depth) + nodeID * bitCount;
+    const uint64_t *bitField = &m_heap[bitID >> 6];
+    const int64_t bitOffset = bitID & 63;
+
+    if constexpr (IsWordAligned(Depth)) {
+        return (bitField[0] >> bitOffset) & bitMask;
+    } else {
+        uint64_t lsb = bitField[0] >> bitOffset;
+        uint64_t msb = (bitField[1] << 1) << (63 - bitOffset);
+
+        return (lsb | msb) & bitMask;
+    }
+}
+
+template <int64_t MaxDepth>
+uint64_t Tree<MaxDepth>::HeapRead(const Node node) const
+{
+    const int64_t bitCount = NodeBitSize(node.depth);
+    const uint64_t bitMask = ~(~0ULL << bitCount);
+    const int64_t bitID = NodeBitID(node);
+    const int64_t bitOffset = bitID & 63;
+    const uint64_t *bitField = &m_heap[bitID >> 6];
+    uint64_t lsb = bitField[0] >> bitOffset;
+
+    if (bitOffset + bitCount <= 64)
+        return lsb & bitMask;
+
+    return (lsb | (bitField[1] << (64 - bitOffset))) & bitMask;
+}
+
+
+/*******************************************************************************
+ * HeapWrite -- Sets the value stored at a node of a given depth
+ *
+ */
+template <int64_t MaxDepth>
+template <int64_t Depth>
+void Tree<MaxDepth>::HeapWrite(uint64_t nodeID, uint64_t bitData)
+{
+    constexpr int64_t bitCount = NodeBitSize(Depth);
+    constexpr uint64_t bitMask = ~(~0ULL << bitCount);
+    const int64_t bitID = (2LL << Depth) + nodeID * bitCount;
+    uint64_t *bitField = &m_heap[bitID >> 6];
+    const int64_t bitOffset = bitID & 63;
+
+    const uint64_t bitDelta = (bitField[0] ^ (bitData << bitOffset))
+                            & (bitMask << bitOffset);
+
+    // flip the bits that differ in a single atomic operation, see cbt.h
+    if (bitDelta != 0u) {
+CBTPP_ATOMIC
+        bitField[0]^= bitDelta;
+    }
+
+    if constexpr (!IsWordAligned(Depth)) {
+        if (bitOffset + bitCount > 64) {
+            const int64_t bitCountLSB = 64 - bitOffset;
+            const uint64_t bitDeltaMSB = (bitField[1] ^ (bitData >> bitCountLSB))
+                                       & (bitMask >> bitCountLSB);
+
+            if (bitDeltaMSB != 0u) {
+CBTPP_ATOMIC
+                bitField[1]^= bitDeltaMSB;
+            }
+        }
+    }
+}
+
+
+/*******************************************************************************
+ * HeapWrite_BitField -- Sets the bit associated to a leaf node to bitValue
+ *
+ */
+template <int64_t MaxDepth>
+void
+Tree<MaxDepth>::HeapWrite_BitField(const Node node, uint64_t bitValue)
+{
+    const uint64_t nodeID = node.id << (MaxDepth - node.depth);
+    const int64_t bitID = (2LL << MaxDepth) + nodeID;
+    uint64_t *bitField = &m_heap[bitID >> 6];
+    const uint64_t bitMask = 1ULL << (bitID & 63);
+
+    if (bitValue != 0u) {
+CBTPP_ATOMIC
+        (*bitField)|= bitMask;
+    } else {
+CBTPP_ATOMIC
+        (*bitField)&= ~bitMask;
+    }
+}
+
+
+/*******************************************************************************
+ * ClearBitField -- Clears the two deepest levels of the heap
+ *
+ */
+template <int64_t MaxDepth>
+void Tree<MaxDepth>::ClearBitField()
+{
+    const int64_t bufferMinID = 1LL << (MaxDepth - 5);
+    const int64_t bufferMaxID = HeapUint64Size();
+
+CBTPP_PARALLEL_FOR
+    for (int64_t bufferID = bufferMinID; bufferID < bufferMaxID; ++bufferID) {
+        m_heap[bufferID] = 0u;
+    }
+}
+
+
+/*******************************************************************************
+ * ComputeSumReductionLevel -- Sums the children of each node of a given depth
+ *
+ * The level right above the bitfield stores 2-bit counts, so each of its
+ * words is computed from a single bitfield word.
+ *
+ */
+template <int64_t MaxDepth>
+template <int64_t Depth>
+void Tree<MaxDepth>::ComputeSumReductionLevel()
+{
+    if constexpr (Depth == MaxDepth - 1) {
+        const int64_t bufferMinID = 1LL << (MaxDepth - 5);
+        const int64_t bufferCount = MaxDepth > 6 ? 1LL << (MaxDepth - 6) : 1;
+        const uint64_t *bitField = &m_heap[(3LL << MaxDepth) >> 6];
+        const int64_t bitShift = MaxDepth > 5 ? 0 : 32;
+
+CBTPP_PARALLEL_FOR
+        for (int64_t bufferID = 0; bufferID < bufferCount; ++bufferID) {
+            const uint64_t mask = 0x5555555555555555ULL;
+            uint64_t x = bitField[bufferID] >> bitShift;
+
+            x = (x & mask) + ((x >> 1) & mask);
+
+            if constexpr (MaxDepth > 5) {
+                m_heap[bufferMinID + bufferID] = x;
+            } else {
+                m_heap[bufferMinID]&= ~0xFFFFFFFFULL;
+                m_heap[bufferMinID]|= x & 0xFFFFFFFFULL;
+            }
+        }
+    } else {
+        const int64_t minNodeID = 1LL << Depth;
+        const int64_t maxNodeID = 2LL << Depth;
+
+CBTPP_PARALLEL_FOR
+        for (int64_t nodeID = minNodeID; nodeID < maxNodeID; ++nodeID) {
+            uint64_t x0 = HeapRead<Depth + 1>(nodeID << 1);
+            uint64_t x1 = HeapRead<Depth + 1>(nodeID << 1 | 1u);
+
+            HeapWrite<Depth>(nodeID, x0 + x1);
+        }
+    }
+}
+
+
+/*******************************************************************************
+ * ComputeSumReduction -- Sums the levels located above a given depth
+ *
+ */
+template <int64_t MaxDepth>
+template <int64_t Depth>
+void Tree<MaxDepth>::ComputeSumReduction()
+{
+    ComputeSumReductionLevel<Depth>();
+
+    if constexpr (Depth > 0)
+        ComputeSumReduction<Depth - 1>();
+}
+
+
+/*******************************************************************************
+ * IsMaxDepthOf -- Checks that a heap was created with the same max depth
+ *
+ * The max depth is stored as the least significant bit of the first word.
+ *
+ */
+template <int64_t MaxDepth>
+bool Tree<MaxDepth>::IsMaxDepthOf(const uint64_t *heap)
+{
+    return (heap[0] & ((2ULL << MaxDepth) - 1u)) == (1ULL << MaxDepth);
+}
+
+
+/*******************************************************************************
+ * Buffer Ctor
+ *
+ */
+template <int64_t MaxDepth>
+Tree<MaxDepth>::Tree(int64_t depth):
+    m_heap(new uint64_t[HeapUint64Size()]),
+    m_ownsHeap(true)
+{
+    m_heap[0] = 1ULL << MaxDepth; // store max Depth
+    ResetToDepth(depth);
+}
+
+template <int64_t MaxDepth>
+Tree<MaxDepth>::Tree(uint64_t *heap):
+    m_heap(heap),
+    m_ownsHeap(false)
+{
+    CBT_ASSERT(IsMaxDepthOf(heap) && "heap has a different max depth");
+}
+
+
+/*******************************************************************************
+ * Buffer Dtor
+ *
+ */
+template <int64_t MaxDepth>
+Tree<MaxDepth>::~Tree()
+{
+    if (m_ownsHeap)
+        delete[] m_heap;
+}
+
+
+/*******************************************************************************
+ * ResetToDepth -- Initializes a CBT to its a specific subdivision level
+ *
+ */
+template <int64_t MaxDepth>
+void Tree<MaxDepth>::ResetToDepth(int64_t depth)
+{
+    CBT_ASSERT(depth >= 0 && "depth must be at least equal to 0");
+    CBT_ASSERT(depth <= MaxDepth && "depth must be at most equal to maxDepth");
+    const int64_t minNodeID = 1LL << depth;
+    const int64_t maxNodeID = 2LL << depth;
+
+    ClearBitField();
+
+CBTPP_PARALLEL_FOR
+    for (int64_t nodeID = minNodeID; nodeID < maxNodeID; ++nodeID) {
+        HeapWrite_BitField(CreateNode(nodeID, depth), 1u);
+    }
+
+    ComputeSumReduction<MaxDepth - 1>();
+}
+
+template <int64_t MaxDepth>
+void Tree<MaxDepth>::ResetToCeil()
+{
+    ResetToDepth(MaxDepth);
+}
+
+template <int64_t MaxDepth>
+void Tree<MaxDepth>::ResetToRoot()
+{
+    ResetToDepth(0);
+}
+
+
+/*******************************************************************************
+ * Split -- Subdivides a node in two
+ *
+ */
+template <int64_t MaxDepth>
+void Tree<MaxDepth>::SplitNode_Fast(const Node node)
+{
+    HeapWrite_BitField(RightChildNode(node), 1u);
+}
+
+template <int64_t MaxDepth>
+void Tree<MaxDepth>::SplitNode(const Node node)
+{
+    if (!IsCeilNode(node))
+        SplitNode_Fast(node);
+}
+
+
+/*******************************************************************************
+ * Merge -- Merges the node with its neighbour
+ *
+ */
+template <int64_t MaxDepth>
+void Tree<MaxDepth>::MergeNode_Fast(const Node node)
+{
+    HeapWrite_BitField(RightSiblingNode(node), 0u);
+}
+
+template <int64_t MaxDepth>
+void Tree<MaxDepth>::MergeNode(const Node node)
+{
+    if (!IsRootNode(node))
+        MergeNode_Fast(node);
+}
+
+
+/*******************************************************************************
+ * LeafAncestor -- Returns the leaf node that contains a node of count 1
+ *
+ */
+template <int64_t MaxDepth>
+Node Tree<MaxDepth>::LeafAncestor(Node node) const
+{
+    while (!IsRootNode(node)) {
+        const Node parent = ParentNode(node);
+
+        if (HeapRead(parent) > 1u)
+            break;
+
+        node = parent;
+    }
+
+    return node;
+}
+
+
+/*******************************************************************************
+ * UpdateSubtree -- Calls the updater on the leaves located below a node
+ *
+ * Nodes of count 2 located right above the bitfield have two leaf children,
+ * so the bitfield itself is never read.
+ *
+ */
+template <int64_t MaxDepth>
+template <int64_t Depth, typename Updater>
+void
+Tree<MaxDepth>::UpdateSubtree(
+    uint64_t nodeID,
+    uint64_t nodeCount,
+    const Updater &updater
+) {
+    if (nodeCount == 1u) {
+        updater(*this, CreateNode(nodeID, Depth));
+    } else if (nodeCount > 1u) {
+        if constexpr (Depth + 1 == MaxDepth) {
+            updater(*this, CreateNode(nodeID << 1, MaxDepth));
+            updater(*this, CreateNode(nodeID << 1 | 1u, MaxDepth));
+        } else {
+            uint64_t leftCount = HeapRead<Depth + 1>(nodeID << 1);
+
+            UpdateSubtree<Depth + 1>(nodeID << 1, leftCount, updater);
+            UpdateSubtree<Depth + 1>(nodeID << 1 | 1u,
+                                     nodeCount - leftCount,
+                                     updater);
+        }
+    }
+}
+
+
+/*******************************************************************************
+ * Update -- Split or merge each node in parallel
+ *
+ * The updater is a callable invoked as updater(tree, node) for each leaf.
+ * Subtrees of 512 leaves are processed in parallel and the leaves are
+ * enumerated from the sums of the heap, so they do not depend on the
+ * bitfield writes performed by the updater.
+ *
+ */
+template <int64_t MaxDepth>
+template <typename Updater>
+void Tree<MaxDepth>::Update(const Updater &updater)
+{
+    constexpr int64_t depth = MaxDepth > 9 ? MaxDepth - 9 : 0;
+    const int64_t minNodeID = 1LL << depth;
+    const int64_t maxNodeID = 2LL << depth;
+
+CBTPP_PARALLEL_FOR
+    for (int64_t nodeID = minNodeID; nodeID < maxNodeID; ++nodeID) {
+        uint64_t nodeCount = HeapRead<depth>(nodeID);
+
+        if (nodeCount == 1u)
+            updater(*this, LeafAncestor(CreateNode(nodeID, depth)));
+        else
+            UpdateSubtree<depth>(nodeID, nodeCount, updater);
+    }
+
+    ComputeSumReduction<MaxDepth - 1>();
+}
+
+
+/*******************************************************************************
+ * Node queries
+ *
+ */
+template <int64_t MaxDepth>
+int64_t Tree<MaxDepth>::NodeCount() const
+{
+    return HeapRead<0>(1u);
+}
+
+template <int64_t MaxDepth>
+bool Tree<MaxDepth>::IsLeafNode(const Node node) const
+{
+    return HeapRead(node) == 1u;
+}
+
+template <int64_t MaxDepth>
+constexpr bool Tree<MaxDepth>::IsCeilNode(const Node node)
+{
+    return node.depth == MaxDepth;
+}
+
+template <int64_t MaxDepth>
+constexpr bool Tree<MaxDepth>::IsRootNode(const Node node)
+{
+    return node.id == 1u;
+}
+
+template <int64_t MaxDepth>
+constexpr bool Tree<MaxDepth>::IsNullNode(const Node node)
+{
+    return node.id == 0u;
+}
+
+
+/*******************************************************************************
+ * DecodeNode -- Returns the leaf node associated to index nodeID
+ *
+ * The descent is unrolled over the levels of the tree. Each level reads
+ * the count of the left child only, the count of the right child being
+ * the difference with the count of the parent.
+ *
+ */
+template <int64_t MaxDepth>
+template <int64_t Depth>
+Node
+Tree<MaxDepth>::DecodeNode(
+    uint64_t nodeID,
+    uint64_t nodeCount,
+    int64_t handle
+) const {
+    if constexpr (Depth == MaxDepth) {
+        return CreateNode(nodeID, Depth);
+    } else {
+        if (nodeCount <= 1u)
+            return CreateNode(nodeID, Depth);
+
+        uint64_t cmp = HeapRead<Depth + 1>(nodeID << 1);
+        uint64_t b = (uint64_t)handle < cmp ? 0u : 1u;
+
+        return DecodeNode<Depth + 1>(nodeID << 1 | b,
+                                     b ? nodeCount - cmp : cmp,
+                                     handle - cmp * b);
+    }
+}
+
+template <int64_t MaxDepth>
+Node Tree<MaxDepth>::DecodeNode(int64_t handle) const
+{
+    CBT_ASSERT(handle < NodeCount() && "handle > NodeCount");
+    CBT_ASSERT(handle >= 0 && "handle < 0");
+
+    return DecodeNode<0>(1u, NodeCount(), handle);
+}
+
+
+/*******************************************************************************
+ * EncodeNode -- Returns the bit index associated with the Node
+ *
+ * The ascent is unrolled over the levels of the tree, starting from the
+ * deepest one; levels located below the node are skipped.
+ *
+ */
+template <int64_t MaxDepth>
+template <int64_t Depth>
+int64_t Tree<MaxDepth>::EncodeNode(const Node node) const
+{
+    if constexpr (Depth == 0) {
+        return 0;
+    } else {
+        int64_t handle = EncodeNode<Depth - 1>(node);
+
+        if ((int64_t)node.depth >= Depth) {
+            uint64_t nodeID = node.id >> (node.depth - Depth);
+
+            if (nodeID & 1u)
+                handle+= HeapRead<Depth>(nodeID ^ 1u);
+        }
+
+        return handle;
+    }
+}
+
+template <int64_t MaxDepth>
+int64_t Tree<MaxDepth>::EncodeNode(const Node node) const
+{
+    CBT_ASSERT(IsLeafNode(node) && "node is not a leaf");
+
+    return EncodeNode<MaxDepth>(node);
+}
+
+
+/*******************************************************************************
+ * GetHeap -- Returns a read-only pointer to the heap memory
+ *
+ */
+template <int64_t MaxDepth>
+const char *Tree<MaxDepth>::GetHeap() const
+{
+    return (const char *)m_heap;
+}
+
+
+/*******************************************************************************
+ * SetHeap -- Sets the heap memory from a read-only buffer
+ *
+ */
+template <int64_t MaxDepth>
+void Tree<MaxDepth>::SetHeap(const char *buffer)
+{
+    CBT_ASSERT(IsMaxDepthOf((const uint64_t *)buffer)
+               && "heap has a different max depth");
+    CBT_MEMCPY(m_heap, buffer, HeapByteSize());
+}
+
+} // namespace cbt
+
+#undef CBTPP_ATOMIC
+#undef CBTPP_PARALLEL_FOR
+
+#endif // CBT_INCLUDE_CBT_HPP
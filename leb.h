@@ -0,0 +1,703 @@
+/* leb.h - public domain library for longest edge bisection on top of cbt.h
+by Jonathan Dupuy
+
+   Do this:
+      #define LEB_IMPLEMENTATION
+   before you include this file in *one* C or C++ file to create the implementation.
+   The implementation of cbt.h must be created as well, as described there.
+
+   // i.e. it should look like this:
+   #include ...
+   #include ...
+   #include ...
+   #define LEB_IMPLEMENTATION
+   #include "leb.h"
+
+   The subdivision is stored in a cbt_Tree, whose nodes are the triangles of
+   the subdivision: the root is the base triangle, and the children of a
+   node are the two halves obtained by bisecting its longest edge. The
+   _Square variants subdivide a square made of two base triangles that
+   share their longest edge, whose root is the square itself and whose
+   nodes of depth 1 are the two triangles; such trees should be reset to
+   a depth of at least 1.
+
+   Triangles are described by 3 values per attribute, ordered so that the
+   longest edge joins the first and last vertices. The square is the
+   parallelogram whose diagonal is the longest edge of the base triangle.
+
+   INTERFACING
+   define LEB_ASSERT(x) to avoid using assert.h
+*/
+
+#ifndef LEB_INCLUDE_LEB_H
+#define LEB_INCLUDE_LEB_H
+
+#ifndef CBT_INCLUDE_CBT_H
+#   include "cbt.h"
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifdef LEB_STATIC
+#define LEBDEF static
+#else
+#define LEBDEF extern
+#endif
+
+// neighbors of a node at the same depth, or 0 along the boundary; the
+// vertices of every other depth are reversed to keep a consistent winding
+// (odd depths for triangles, even depths for squares), which swaps the
+// edges that the left and right neighbors refer to
+typedef struct {
+    uint64_t left;  // across the edge joining the 2nd and 3rd vertices
+    uint64_t right; // across the edge joining the 1st and 2nd vertices
+    uint64_t edge;  // across the longest edge
+    uint64_t node;
+} leb_SameDepthNeighborIDs;
+
+// the two nodes whose children share the longest edge of a node's parent
+typedef struct {
+    cbt_Node base;
+    cbt_Node top;
+} leb_DiamondParent;
+
+// O(depth) neighbor queries
+LEBDEF leb_SameDepthNeighborIDs leb_DecodeSameDepthNeighborIDs       (const cbt_Node node);
+LEBDEF leb_SameDepthNeighborIDs leb_DecodeSameDepthNeighborIDs_Square(const cbt_Node node);
+LEBDEF leb_DiamondParent leb_DecodeDiamondParent       (const cbt_Node node);
+LEBDEF leb_DiamondParent leb_DecodeDiamondParent_Square(const cbt_Node node);
+LEBDEF void leb_DecodeSameDepthNeighborIDsArray(const cbt_Node *nodes,
+                                                int64_t nodeCount,
+                                                leb_SameDepthNeighborIDs *neighborIDs);
+LEBDEF void leb_DecodeSameDepthNeighborIDsArray_Square(const cbt_Node *nodes,
+                                                       int64_t nodeCount,
+                                                       leb_SameDepthNeighborIDs *neighborIDs);
+
+// conforming updates
+LEBDEF void leb_SplitNode       (cbt_Tree *cbt, const cbt_Node node);
+LEBDEF void leb_SplitNode_Square(cbt_Tree *cbt, const cbt_Node node);
+LEBDEF void leb_MergeNode       (cbt_Tree *cbt,
+                                 const cbt_Node node,
+                                 const leb_DiamondParent diamond);
+LEBDEF void leb_MergeNode_Square(cbt_Tree *cbt,
+                                 const cbt_Node node,
+                                 const leb_DiamondParent diamond);
+
+// subdivision of attributes, e.g., vertex positions
+LEBDEF void leb_DecodeNodeAttributeArray       (const cbt_Node node,
+                                                int64_t attributeArraySize,
+                                                float attributeArray[][3]);
+LEBDEF void leb_DecodeNodeAttributeArray_Square(const cbt_Node node,
+                                                int64_t attributeArraySize,
+                                                float attributeArray[][3]);
+LEBDEF void leb_DecodeAttributeArrays       (const cbt_Node *nodes,
+                                             int64_t nodeCount,
+                                             int64_t attributeArraySize,
+                                             const float baseAttributeArray[][3],
+                                             float attributeArrays[][3]);
+LEBDEF void leb_DecodeAttributeArrays_Square(const cbt_Node *nodes,
+                                             int64_t nodeCount,
+                                             int64_t attributeArraySize,
+                                             const float baseAttributeArray[][3],
+                                             float attributeArrays[][3]);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+//
+//
+//// end header file ///////////////////////////////////////////////////////////
+#endif // LEB_INCLUDE_LEB_H
+
+#ifdef LEB_IMPLEMENTATION
+
+#ifndef LEB_ASSERT
+#    include <assert.h>
+#    define LEB_ASSERT(x) assert(x)
+#endif
+
+
+/*******************************************************************************
+ * GetBitValue -- Returns the value of a bit stored in a 64-bit word
+ *
+ */
+static inline uint64_t leb__GetBitValue(uint64_t bitField, int64_t bitID)
+{
+    return ((bitField >> bitID) & 1u);
+}
+
+
+/*******************************************************************************
+ * SplitNodeIDs -- Updates the same depth neighbors of a node upon splitting
+ *
+ * Given the neighbors of a node, this returns those of its child selected
+ * by splitBit. The child shares an edge with its sibling and with a child
+ * of two of the neighbors of its parent.
+ *
+ */
+static leb_SameDepthNeighborIDs
+leb__SplitNodeIDs(const leb_SameDepthNeighborIDs nodeIDs, uint64_t splitBit)
+{
+    uint64_t n1 = nodeIDs.left, n2 = nodeIDs.right;
+    uint64_t n3 = nodeIDs.edge, n4 = nodeIDs.node;
+    uint64_t b2 = (n2 == 0u) ? 0u : 1u;
+    uint64_t b3 = (n3 == 0u) ? 0u : 1u;
+    leb_SameDepthNeighborIDs childIDs;
+
+    if (splitBit == 0u) {
+        childIDs.left  = n4 << 1 | 1;
+        childIDs.right = n3 << 1 | b3;
+        childIDs.edge  = n2 << 1 | b2;
+        childIDs.node  = n4 << 1;
+    } else {
+        childIDs.left  = n3 << 1;
+        childIDs.right = n4 << 1;
+        childIDs.edge  = n1 << 1;
+        childIDs.node  = n4 << 1 | 1;
+    }
+
+    return childIDs;
+}
+
+
+/*******************************************************************************
+ * DecodeSameDepthNeighborIDs -- Decodes the IDs of the neighbors of a node
+ *
+ * The neighbors are propagated from the root down to the node, following
+ * the bits of its heap ID.
+ *
+ */
+LEBDEF leb_SameDepthNeighborIDs leb_DecodeSameDepthNeighborIDs(const cbt_Node node)
+{
+    leb_SameDepthNeighborIDs nodeIDs = {0u, 0u, 0u, 1u};
+
+    for (int64_t bitID = node.depth - 1; bitID >= 0; --bitID) {
+        nodeIDs = leb__SplitNodeIDs(nodeIDs, leb__GetBitValue(node.id, bitID));
+    }
+
+    return nodeIDs;
+}
+
+LEBDEF leb_SameDepthNeighborIDs
+leb_DecodeSameDepthNeighborIDs_Square(const cbt_Node node)
+{
+    int64_t depth = node.depth;
+    uint64_t b = leb__GetBitValue(node.id, depth > 0 ? depth - 1 : 0);
+    leb_SameDepthNeighborIDs nodeIDs = {0u, 0u, 3u - b, 2u + b};
+
+    for (int64_t bitID = depth - 2; bitID >= 0; --bitID) {
+        nodeIDs = leb__SplitNodeIDs(nodeIDs, leb__GetBitValue(node.id, bitID));
+    }
+
+    return nodeIDs;
+}
+
+
+/*******************************************************************************
+ * DecodeSameDepthNeighborIDsArray -- Decodes the neighbors of many nodes
+ *
+ * The nodes are typically the leaves exported with cbt_ExportLeaves, in
+ * which case consecutive nodes share most of their ancestors. The neighbors
+ * of the deepest common ancestor of a node and its predecessor are cached,
+ * so that only the bits below it are processed.
+ *
+ */
+static int64_t
+leb__CommonAncestorDepth(const cbt_Node node1, const cbt_Node node2, int64_t minDepth)
+{
+    int64_t depth1 = node1.depth, depth2 = node2.depth;
+    int64_t commonDepth = depth1 < depth2 ? depth1 : depth2;
+
+    while (commonDepth > minDepth
+           && (node1.id >> (depth1 - commonDepth)) != (node2.id >> (depth2 - commonDepth))) {
+        --commonDepth;
+    }
+
+    return commonDepth;
+}
+
+typedef struct {
+    cbt_Node node;
+    leb_SameDepthNeighborIDs nodeIDs[64]; // neighbors of the ancestors of node
+} leb__NeighborCache;
+
+static leb_SameDepthNeighborIDs
+leb__DecodeCachedNeighborIDs(
+    leb__NeighborCache *cache,
+    const cbt_Node node,
+    int64_t rootDepth
+) {
+    int64_t depth = node.depth;
+    int64_t commonDepth = leb__CommonAncestorDepth(cache->node, node, rootDepth);
+
+    for (int64_t ancestorDepth = commonDepth + 1; ancestorDepth <= depth; ++ancestorDepth) {
+        uint64_t splitBit = leb__GetBitValue(node.id, depth - ancestorDepth);
+
+        cache->nodeIDs[ancestorDepth] = leb__SplitNodeIDs(cache->nodeIDs[ancestorDepth - 1],
+                                                          splitBit);
+    }
+
+    cache->node = node;
+
+    return cache->nodeIDs[depth];
+}
+
+LEBDEF void
+leb_DecodeSameDepthNeighborIDsArray(
+    const cbt_Node *nodes,
+    int64_t nodeCount,
+    leb_SameDepthNeighborIDs *neighborIDs
+) {
+    leb__NeighborCache cache;
+
+    cache.node = cbt_CreateNode(1u, 0);
+    cache.nodeIDs[0] = leb_DecodeSameDepthNeighborIDs(cache.node);
+
+    for (int64_t nodeID = 0; nodeID < nodeCount; ++nodeID) {
+        neighborIDs[nodeID] = leb__DecodeCachedNeighborIDs(&cache, nodes[nodeID], 0);
+    }
+}
+
+LEBDEF void
+leb_DecodeSameDepthNeighborIDsArray_Square(
+    const cbt_Node *nodes,
+    int64_t nodeCount,
+    leb_SameDepthNeighborIDs *neighborIDs
+) {
+    leb__NeighborCache cache;
+
+    cache.node = cbt_CreateNode(2u, 1);
+    cache.nodeIDs[1] = leb_DecodeSameDepthNeighborIDs_Square(cache.node);
+
+    for (int64_t nodeID = 0; nodeID < nodeCount; ++nodeID) {
+        cbt_Node node = nodes[nodeID];
+
+        // the two halves of the square are the roots of the subdivision
+        if (node.depth == 0) {
+            neighborIDs[nodeID] = leb_DecodeSameDepthNeighborIDs_Square(node);
+            continue;
+        } else if ((node.id >> (node.depth - 1)) != (cache.node.id >> (cache.node.depth - 1))) {
+            cache.node = cbt_CreateNode(node.id >> (node.depth - 1), 1);
+            cache.nodeIDs[1] = leb_DecodeSameDepthNeighborIDs_Square(cache.node);
+        }
+
+        neighborIDs[nodeID] = leb__DecodeCachedNeighborIDs(&cache, node, 1);
+    }
+}
+
+
+/*******************************************************************************
+ * EdgeNeighbor -- Returns the neighbor of a node across its longest edge
+ *
+ * The returned node has an ID of 0 if the edge lies on the boundary.
+ *
+ */
+static cbt_Node leb__EdgeNeighbor(const cbt_Node node)
+{
+    uint64_t nodeID = leb_DecodeSameDepthNeighborIDs(node).edge;
+
+    return cbt_CreateNode(nodeID, nodeID > 0u ? node.depth : 0);
+}
+
+static cbt_Node leb__EdgeNeighbor_Square(const cbt_Node node)
+{
+    uint64_t nodeID = leb_DecodeSameDepthNeighborIDs_Square(node).edge;
+
+    return cbt_CreateNode(nodeID, nodeID > 0u ? node.depth : 0);
+}
+
+
+/*******************************************************************************
+ * DecodeDiamondParent -- Decodes the diamond associated with a node
+ *
+ * A node may only merge with its sibling if the neighbor of its parent
+ * across the longest edge merges its children as well, so that the edge
+ * remains conforming. Along the boundary, both nodes of the diamond are
+ * the parent.
+ *
+ */
+static leb_DiamondParent
+leb__CreateDiamondParent(const cbt_Node base, const cbt_Node top)
+{
+    leb_DiamondParent diamond;
+
+    diamond.base = base;
+    diamond.top = top;
+
+    return diamond;
+}
+
+LEBDEF leb_DiamondParent leb_DecodeDiamondParent(const cbt_Node node)
+{
+    cbt_Node parentNode = cbt_ParentNode_Fast(node);
+    cbt_Node edgeNeighborNode = leb__EdgeNeighbor(parentNode);
+
+    return leb__CreateDiamondParent(parentNode,
+                                    edgeNeighborNode.id > 0u
+                                    ? edgeNeighborNode
+                                    : parentNode);
+}
+
+LEBDEF leb_DiamondParent leb_DecodeDiamondParent_Square(const cbt_Node node)
+{
+    cbt_Node parentNode = cbt_ParentNode_Fast(node);
+    cbt_Node edgeNeighborNode = leb__EdgeNeighbor_Square(parentNode);
+
+    return leb__CreateDiamondParent(parentNode,
+                                    edgeNeighborNode.id > 0u
+                                    ? edgeNeighborNode
+                                    : parentNode);
+}
+
+
+/*******************************************************************************
+ * SplitNode -- Bisects a node and the nodes required to keep a conforming mesh
+ *
+ * Splitting a node requires its neighbor across the longest edge to split
+ * as well. If that neighbor is not a leaf yet, i.e., it lies inside a leaf
+ * of lower depth, its parent must split first, which in turn requires the
+ * edge neighbor of the parent to split, and so on. Each of these splits
+ * writes a single bit of the bitfield through cbt_SplitNode_Fast; splitting
+ * a node that is already split leaves the bitfield untouched, so that
+ * concurrent calls are safe.
+ *
+ */
+LEBDEF void leb_SplitNode(cbt_Tree *cbt, const cbt_Node node)
+{
+    if (!cbt_IsCeilNode(cbt, node)) {
+        const uint64_t minNodeID = 1u;
+        cbt_Node nodeIterator = node;
+
+        cbt_SplitNode_Fast(cbt, nodeIterator);
+        nodeIterator = leb__EdgeNeighbor(nodeIterator);
+
+        while (nodeIterator.id > minNodeID) {
+            cbt_SplitNode_Fast(cbt, nodeIterator);
+            nodeIterator = cbt_ParentNode_Fast(nodeIterator);
+            cbt_SplitNode_Fast(cbt, nodeIterator);
+            nodeIterator = leb__EdgeNeighbor(nodeIterator);
+        }
+    }
+}
+
+LEBDEF void leb_SplitNode_Square(cbt_Tree *cbt, const cbt_Node node)
+{
+    if (node.depth == 0) {
+        cbt_SplitNode(cbt, node);
+    } else if (!cbt_IsCeilNode(cbt, node)) {
+        const uint64_t minNodeID = 2u;
+        cbt_Node nodeIterator = node;
+
+        cbt_SplitNode_Fast(cbt, nodeIterator);
+        nodeIterator = leb__EdgeNeighbor_Square(nodeIterator);
+
+        while (nodeIterator.id >= minNodeID) {
+            cbt_SplitNode_Fast(cbt, nodeIterator);
+            nodeIterator = cbt_ParentNode_Fast(nodeIterator);
+
+            if (nodeIterator.id >= minNodeID) {
+                cbt_SplitNode_Fast(cbt, nodeIterator);
+                nodeIterator = leb__EdgeNeighbor_Square(nodeIterator);
+            }
+        }
+    }
+}
+
+
+/*******************************************************************************
+ * MergeNode -- Merges a node with its sibling if its diamond can merge
+ *
+ * The diamond can merge if both of its nodes have exactly two leaves, i.e.,
+ * their children. The four leaves of the diamond are expected to make the
+ * same decision, so that the two nodes of the diamond merge together.
+ *
+ */
+static bool
+leb__HasDiamondParent(const cbt_Tree *cbt, const leb_DiamondParent diamond)
+{
+    bool canMergeBase = cbt_HeapRead(cbt, diamond.base) <= 2u;
+    bool canMergeTop  = cbt_HeapRead(cbt, diamond.top) <= 2u;
+
+    return canMergeBase && canMergeTop;
+}
+
+LEBDEF void
+leb_MergeNode(cbt_Tree *cbt, const cbt_Node node, const leb_DiamondParent diamond)
+{
+    LEB_ASSERT(cbt_IsRootNode(node) || diamond.base.id == node.id >> 1);
+
+    if (!cbt_IsRootNode(node) && leb__HasDiamondParent(cbt, diamond))
+        cbt_MergeNode_Fast(cbt, node);
+}
+
+LEBDEF void
+leb_MergeNode_Square(cbt_Tree *cbt, const cbt_Node node, const leb_DiamondParent diamond)
+{
+    LEB_ASSERT(node.depth <= 1 || diamond.base.id == node.id >> 1);
+
+    if ((node.depth > 1) && leb__HasDiamondParent(cbt, diamond))
+        cbt_MergeNode_Fast(cbt, node);
+}
+
+
+/*******************************************************************************
+ * TransformationMatrix -- Maps the vertices of the root to those of a node
+ *
+ * The rows of the matrix hold the barycentric weights of the vertices of the
+ * node. Each split keeps one endpoint of the longest edge, replaces the
+ * other one with the midpoint of that edge, and moves the opposite vertex to
+ * the end, which amounts to selecting and averaging rows rather than to a
+ * full matrix product. Since each split flips the orientation of the
+ * triangle, the first and last rows are swapped for odd depths.
+ *
+ */
+static void leb__IdentityMatrix3x3(float m[3][3])
+{
+    for (int64_t i = 0; i < 3; ++i) {
+        for (int64_t j = 0; j < 3; ++j) {
+            m[i][j] = (i == j) ? 1.0f : 0.0f;
+        }
+    }
+}
+
+static void leb__CopyMatrix3x3(float dst[3][3], float src[3][3])
+{
+    for (int64_t i = 0; i < 3; ++i) {
+        for (int64_t j = 0; j < 3; ++j) {
+            dst[i][j] = src[i][j];
+        }
+    }
+}
+
+static void leb__SquareMatrix3x3(float m[3][3], uint64_t quadBit)
+{
+    float b = (float)quadBit;
+    float c = 1.0f - b;
+
+    m[0][0] = c; m[0][1] = 0.0f ; m[0][2] = b;
+    m[1][0] = b; m[1][1] = c - b; m[1][2] = b;
+    m[2][0] = b; m[2][1] = 0.0f ; m[2][2] = c;
+}
+
+static void leb__SplitMatrix3x3(float m[3][3], uint64_t splitBit)
+{
+    for (int64_t j = 0; j < 3; ++j) {
+        float m0 = m[0][j], m1 = m[1][j], m2 = m[2][j];
+
+        m[0][j] = splitBit ? m1 : m0;
+        m[1][j] = 0.5f * (m0 + m2);
+        m[2][j] = splitBit ? m2 : m1;
+    }
+}
+
+static void leb__WindingMatrix3x3(float m[3][3], uint64_t mirrorBit)
+{
+    for (int64_t j = 0; j < 3; ++j) {
+        float m0 = m[0][j], m2 = m[2][j];
+
+        m[0][j] = mirrorBit ? m2 : m0;
+        m[2][j] = mirrorBit ? m0 : m2;
+    }
+}
+
+static void leb__DecodeTransformationMatrix(const cbt_Node node, float m[3][3])
+{
+    leb__IdentityMatrix3x3(m);
+
+    for (int64_t bitID = node.depth - 1; bitID >= 0; --bitID) {
+        leb__SplitMatrix3x3(m, leb__GetBitValue(node.id, bitID));
+    }
+
+    leb__WindingMatrix3x3(m, node.depth & 1);
+}
+
+static void
+leb__DecodeTransformationMatrix_Square(const cbt_Node node, float m[3][3])
+{
+    int64_t depth = node.depth;
+
+    leb__SquareMatrix3x3(m, leb__GetBitValue(node.id, depth > 0 ? depth - 1 : 0));
+
+    for (int64_t bitID = depth - 2; bitID >= 0; --bitID) {
+        leb__SplitMatrix3x3(m, leb__GetBitValue(node.id, bitID));
+    }
+
+    leb__WindingMatrix3x3(m, (depth ^ 1) & 1);
+}
+
+
+/*******************************************************************************
+ * DecodeNodeAttributeArray -- Computes the attributes of a node
+ *
+ * Each attribute stores its values at the 3 vertices of the root triangle
+ * (or base triangle of the square) on input, and those at the vertices of
+ * the node on output.
+ *
+ */
+static void
+leb__TransformAttributeArray(
+    float m[3][3],
+    int64_t attributeArraySize,
+    float attributeArray[][3]
+) {
+    for (int64_t i = 0; i < attributeArraySize; ++i) {
+        float x0 = attributeArray[i][0];
+        float x1 = attributeArray[i][1];
+        float x2 = attributeArray[i][2];
+
+        for (int64_t j = 0; j < 3; ++j) {
+            attributeArray[i][j] = m[j][0] * x0 + m[j][1] * x1 + m[j][2] * x2;
+        }
+    }
+}
+
+LEBDEF void
+leb_DecodeNodeAttributeArray(
+    const cbt_Node node,
+    int64_t attributeArraySize,
+    float attributeArray[][3]
+) {
+    float m[3][3];
+
+    leb__DecodeTransformationMatrix(node, m);
+    leb__TransformAttributeArray(m, attributeArraySize, attributeArray);
+}
+
+LEBDEF void
+leb_DecodeNodeAttributeArray_Square(
+    const cbt_Node node,
+    int64_t attributeArraySize,
+    float attributeArray[][3]
+) {
+    float m[3][3];
+
+    leb__DecodeTransformationMatrix_Square(node, m);
+    leb__TransformAttributeArray(m, attributeArraySize, attributeArray);
+}
+
+
+/*******************************************************************************
+ * DecodeAttributeArrays -- Computes the attributes of many nodes
+ *
+ * The attributes of the i-th node are written to the attributeArraySize
+ * rows of attributeArrays starting at row i * attributeArraySize. As for
+ * leb_DecodeSameDepthNeighborIDsArray, the transformation matrices of the
+ * ancestors of the previous node are cached, so that exported leaves cost
+ * O(1) row operations on average instead of O(depth). The cached matrices
+ * go through the same operations as with leb_DecodeNodeAttributeArray, so
+ * that both produce the same values.
+ *
+ */
+static void
+leb__CopyAttributeArray(
+    int64_t attributeArraySize,
+    const float baseAttributeArray[][3],
+    float attributeArray[][3]
+) {
+    for (int64_t i = 0; i < attributeArraySize; ++i) {
+        for (int64_t j = 0; j < 3; ++j) {
+            attributeArray[i][j] = baseAttributeArray[i][j];
+        }
+    }
+}
+
+typedef struct {
+    cbt_Node node;
+    float matrices[64][3][3]; // transformations of the ancestors of node
+} leb__MatrixCache;
+
+static void
+leb__DecodeCachedTransformationMatrix(
+    leb__MatrixCache *cache,
+    const cbt_Node node,
+    int64_t rootDepth,
+    float m[3][3]
+) {
+    int64_t depth = node.depth;
+    int64_t commonDepth = leb__CommonAncestorDepth(cache->node, node, rootDepth);
+
+    for (int64_t ancestorDepth = commonDepth + 1; ancestorDepth <= depth; ++ancestorDepth) {
+        uint64_t splitBit = leb__GetBitValue(node.id, depth - ancestorDepth);
+
+        leb__CopyMatrix3x3(cache->matrices[ancestorDepth],
+                           cache->matrices[ancestorDepth - 1]);
+        leb__SplitMatrix3x3(cache->matrices[ancestorDepth], splitBit);
+    }
+
+    cache->node = node;
+    leb__CopyMatrix3x3(m, cache->matrices[depth]);
+}
+
+LEBDEF void
+leb_DecodeAttributeArrays(
+    const cbt_Node *nodes,
+    int64_t nodeCount,
+    int64_t attributeArraySize,
+    const float baseAttributeArray[][3],
+    float attributeArrays[][3]
+) {
+    leb__MatrixCache cache;
+
+    cache.node = cbt_CreateNode(1u, 0);
+    leb__IdentityMatrix3x3(cache.matrices[0]);
+
+    for (int64_t nodeID = 0; nodeID < nodeCount; ++nodeID) {
+        const cbt_Node node = nodes[nodeID];
+        float m[3][3];
+
+        leb__DecodeCachedTransformationMatrix(&cache, node, 0, m);
+        leb__WindingMatrix3x3(m, node.depth & 1);
+        leb__CopyAttributeArray(attributeArraySize,
+                                baseAttributeArray,
+                                &attributeArrays[nodeID * attributeArraySize]);
+        leb__TransformAttributeArray(m,
+                                     attributeArraySize,
+                                     &attributeArrays[nodeID * attributeArraySize]);
+    }
+}
+
+LEBDEF void
+leb_DecodeAttributeArrays_Square(
+    const cbt_Node *nodes,
+    int64_t nodeCount,
+    int64_t attributeArraySize,
+    const float baseAttributeArray[][3],
+    float attributeArrays[][3]
+) {
+    leb__MatrixCache cache;
+
+    cache.node = cbt_CreateNode(2u, 1);
+    leb__SquareMatrix3x3(cache.matrices[1], 0u);
+
+    for (int64_t nodeID = 0; nodeID < nodeCount; ++nodeID) {
+        const cbt_Node node = nodes[nodeID];
+        float m[3][3];
+
+        // the two halves of the square are the roots of the subdivision
+        if (node.depth == 0) {
+            leb__DecodeTransformationMatrix_Square(node, m);
+        } else {
+            uint64_t quadBit = leb__GetBitValue(node.id, node.depth - 1);
+
+            if (quadBit != leb__GetBitValue(cache.node.id, cache.node.depth - 1)) {
+                cache.node = cbt_CreateNode(2u | quadBit, 1);
+                leb__SquareMatrix3x3(cache.matrices[1], quadBit);
+            }
+
+            leb__DecodeCachedTransformationMatrix(&cache, node, 1, m);
+            leb__WindingMatrix3x3(m, (node.depth ^ 1) & 1);
+        }
+
+        leb__CopyAttributeArray(attributeArraySize,
+                                baseAttributeArray,
+                                &attributeArrays[nodeID * attributeArraySize]);
+        leb__TransformAttributeArray(m,
+                                     attributeArraySize,
+                                     &attributeArrays[nodeID * attributeArraySize]);
+    }
+}
+
+#endif // LEB_IMPLEMENTATION
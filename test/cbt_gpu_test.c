@@ -0,0 +1,520 @@
+/* cbt_gpu_test.c - checks that cbt.h and the GLSL shaders share their heaps
+
+   Build and run, e.g., with
+      cc -O2 -std=gnu99 test/cbt_gpu_test.c -o cbt_gpu_test -lpthread -lm
+      ./cbt_gpu_test --min-depth 6 --max-depth 30
+
+   OPTIONS
+   --min-depth D    smallest maxDepth of the sweep (default 6)
+   --max-depth D    largest maxDepth of the sweep (default 30)
+
+   The packed layout of cbt.h is documented to be the heap format of
+   glsl/cbt.glsl and hlsl/ConcurrentBinaryTree.hlsl on little-endian hosts,
+   for max depths up to 30. This program checks it on the CPU with a C port
+   of cbt.glsl, cbt_SumReductionPrepass.glsl and cbt_SumReduction.glsl.
+   The port works on the uint32 view of the heaps, dispatches the passes in
+   the order of the host code of the GPU implementation, and emulates each
+   invocation with one iteration of a loop. For each max depth, it
+      - builds a forest with cbt_CreateForestInBuffer and updates it,
+      - overwrites the sums above the bitfield with random values, both in
+        the buffer and in a copy of it,
+      - recomputes the sums of the buffer with cbt__ComputeSumReduction and
+        those of the copy with the shader passes, which must match bit for
+        bit,
+      - splits leaves of the copy with the port of cbt_SplitNode and reduces
+        it again, as a GPU refinement step would,
+      - adopts the copy with cbt_CreateForestFromBuffer, whose trees must
+        decode the same leaves as the port and leave the sums as they are
+        when reduced again on the CPU.
+   The program prints one line per max depth and returns a non-zero value
+   if any check fails. The full sweep takes a few minutes on one core,
+   mostly for the deepest trees, and needs about 1 GiB of memory at depth 30.
+*/
+
+#define CBT_IMPLEMENTATION
+#include "../cbt.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CBT_GPU_TEST_MAX_TREE_COUNT 3
+
+static int64_t cbt__testFailureCount = 0;
+
+#define CBT_TEST_CHECK(x)                                                      \
+    do {                                                                       \
+        if (!(x)) {                                                            \
+            ++cbt__testFailureCount;                                           \
+            fprintf(stderr, "%s:%i: check failed: %s\n", __FILE__, __LINE__, #x);\
+        }                                                                      \
+    } while (0)
+
+
+/*******************************************************************************
+ * GLSL -- C port of the parts of glsl/cbt.glsl used by the sum reduction
+ *
+ * The functions keep the names and the arithmetic of the shaders: uint is
+ * uint32_t, and u_CbtBuffers[cbtID].heap points to the heap of the tree as
+ * the shaders see it. The atomic operations are plain ones, since the
+ * invocations run one after the other.
+ *
+ */
+typedef struct {
+    uint32_t id;
+    int depth;
+} glsl_Node;
+
+typedef struct {
+    uint32_t *heap;
+} glsl_Buffer;
+
+static glsl_Buffer u_CbtBuffers[CBT_GPU_TEST_MAX_TREE_COUNT];
+
+static int glsl_FindLSB(uint32_t x)
+{
+    int bitID = 0;
+
+    while (((x >> bitID) & 1u) == 0u)
+        ++bitID;
+
+    return bitID;
+}
+
+static glsl_Node glsl_CreateNode(uint32_t id, int depth)
+{
+    glsl_Node node;
+
+    node.id = id;
+    node.depth = depth;
+
+    return node;
+}
+
+static int glsl_MaxDepth(const int cbtID)
+{
+    return glsl_FindLSB(u_CbtBuffers[cbtID].heap[0]);
+}
+
+static uint32_t glsl__HeapByteSize(uint32_t cbtMaxDepth)
+{
+    return 1u << (cbtMaxDepth - 1);
+}
+
+static uint32_t glsl__HeapUint32Size(uint32_t cbtMaxDepth)
+{
+    return glsl__HeapByteSize(cbtMaxDepth) >> 2;
+}
+
+static uint32_t glsl__NodeBitID(const int cbtID, const glsl_Node node)
+{
+    uint32_t tmp1 = 2u << node.depth;
+    uint32_t tmp2 = (uint32_t)(1 + glsl_MaxDepth(cbtID) - node.depth);
+
+    return tmp1 + node.id * tmp2;
+}
+
+static glsl_Node glsl__CeilNode(const int cbtID, const glsl_Node node)
+{
+    int maxDepth = glsl_MaxDepth(cbtID);
+
+    return glsl_CreateNode(node.id << (maxDepth - node.depth), maxDepth);
+}
+
+static int glsl__NodeBitSize(const int cbtID, const glsl_Node node)
+{
+    return glsl_MaxDepth(cbtID) - node.depth + 1;
+}
+
+typedef struct {
+    uint32_t heapIndexLSB, heapIndexMSB;
+    uint32_t bitOffsetLSB;
+    uint32_t bitCountLSB, bitCountMSB;
+} glsl__HeapArgs;
+
+static glsl__HeapArgs
+glsl__CreateHeapArgs(const int cbtID, const glsl_Node node, int bitCount)
+{
+    uint32_t alignedBitOffset = glsl__NodeBitID(cbtID, node);
+    uint32_t maxHeapIndex = glsl__HeapUint32Size(glsl_MaxDepth(cbtID)) - 1u;
+    uint32_t heapIndexLSB = (alignedBitOffset >> 5u);
+    uint32_t heapIndexMSB = heapIndexLSB + 1u < maxHeapIndex
+                          ? heapIndexLSB + 1u
+                          : maxHeapIndex;
+    glsl__HeapArgs args;
+
+    args.bitOffsetLSB = alignedBitOffset & 31u;
+    args.bitCountLSB = 32u - args.bitOffsetLSB < (uint32_t)bitCount
+                     ? 32u - args.bitOffsetLSB
+                     : (uint32_t)bitCount;
+    args.bitCountMSB = (uint32_t)bitCount - args.bitCountLSB;
+    args.heapIndexLSB = heapIndexLSB;
+    args.heapIndexMSB = heapIndexMSB;
+
+    return args;
+}
+
+static void
+glsl__BitFieldInsert(
+    const int cbtID,
+    uint32_t bufferID,
+    uint32_t bitOffset,
+    uint32_t bitCount,
+    uint32_t bitData
+) {
+    uint32_t bitMask = ~(~(0xFFFFFFFFu << bitCount) << bitOffset);
+
+    u_CbtBuffers[cbtID].heap[bufferID]&= bitMask;
+    u_CbtBuffers[cbtID].heap[bufferID]|= bitData << bitOffset;
+}
+
+static uint32_t
+glsl__BitFieldExtract(uint32_t bitField, uint32_t bitOffset, uint32_t bitCount)
+{
+    uint32_t bitMask = ~(0xFFFFFFFFu << bitCount);
+
+    return (bitField >> bitOffset) & bitMask;
+}
+
+static void
+glsl__HeapWriteExplicit(
+    const int cbtID,
+    const glsl_Node node,
+    int bitCount,
+    uint32_t bitData
+) {
+    glsl__HeapArgs args = glsl__CreateHeapArgs(cbtID, node, bitCount);
+
+    glsl__BitFieldInsert(cbtID,
+                         args.heapIndexLSB,
+                         args.bitOffsetLSB,
+                         args.bitCountLSB,
+                         bitData);
+    glsl__BitFieldInsert(cbtID,
+                         args.heapIndexMSB,
+                         0u,
+                         args.bitCountMSB,
+                         bitData >> args.bitCountLSB);
+}
+
+static void glsl__HeapWrite(const int cbtID, const glsl_Node node, uint32_t bitData)
+{
+    glsl__HeapWriteExplicit(cbtID, node, glsl__NodeBitSize(cbtID, node), bitData);
+}
+
+static uint32_t glsl_HeapRead(const int cbtID, const glsl_Node node)
+{
+    glsl__HeapArgs args = glsl__CreateHeapArgs(cbtID, node, glsl__NodeBitSize(cbtID, node));
+    uint32_t lsb = glsl__BitFieldExtract(u_CbtBuffers[cbtID].heap[args.heapIndexLSB],
+                                         args.bitOffsetLSB,
+                                         args.bitCountLSB);
+    uint32_t msb = glsl__BitFieldExtract(u_CbtBuffers[cbtID].heap[args.heapIndexMSB],
+                                         0u,
+                                         args.bitCountMSB);
+
+    return (lsb | (msb << args.bitCountLSB));
+}
+
+static void glsl_SplitNode(const int cbtID, const glsl_Node node)
+{
+    if (node.depth != glsl_MaxDepth(cbtID)) {
+        glsl_Node rightChild = glsl_CreateNode((node.id << 1) | 1u, node.depth + 1);
+        uint32_t bitID = glsl__NodeBitID(cbtID, glsl__CeilNode(cbtID, rightChild));
+        uint32_t bufferID = bitID >> 5u;
+
+        u_CbtBuffers[cbtID].heap[bufferID]&= ~(1u << (bitID & 31u));
+        u_CbtBuffers[cbtID].heap[bufferID]|= 1u << (bitID & 31u);
+    }
+}
+
+static uint32_t glsl_NodeCount(const int cbtID)
+{
+    return glsl_HeapRead(cbtID, glsl_CreateNode(1u, 0));
+}
+
+static glsl_Node glsl_DecodeNode(const int cbtID, uint32_t nodeID)
+{
+    glsl_Node node = glsl_CreateNode(1u, 0);
+
+    while (glsl_HeapRead(cbtID, node) > 1u) {
+        glsl_Node leftChild = glsl_CreateNode(node.id << 1, node.depth + 1);
+        uint32_t cmp = glsl_HeapRead(cbtID, leftChild);
+        uint32_t b = nodeID < cmp ? 0u : 1u;
+
+        node = leftChild;
+        node.id|= b;
+        nodeID-= cmp * b;
+    }
+
+    return node;
+}
+
+
+/*******************************************************************************
+ * SumReductionPrepass -- Port of glsl/cbt_SumReductionPrepass.glsl
+ *
+ * Each invocation reduces 32 bits of the bitfield into the 5 levels above it.
+ *
+ */
+static void glsl_SumReductionPrepass(const int cbtID, int u_PassID)
+{
+    uint32_t cnt = (1u << u_PassID);
+
+    for (uint32_t threadID = 0u; threadID < cnt; threadID+= 32u) {
+        uint32_t nodeID = threadID + cnt;
+        uint32_t alignedBitOffset = glsl__NodeBitID(cbtID, glsl_CreateNode(nodeID, u_PassID));
+        uint32_t bitField = u_CbtBuffers[cbtID].heap[alignedBitOffset >> 5u];
+        uint32_t bitData = 0u;
+
+        // 2-bits
+        bitField = (bitField & 0x55555555u) + ((bitField >> 1u) & 0x55555555u);
+        bitData = bitField;
+        u_CbtBuffers[cbtID].heap[(alignedBitOffset - cnt) >> 5u] = bitData;
+
+        // 3-bits
+        bitField = (bitField & 0x33333333u) + ((bitField >>  2u) & 0x33333333u);
+        bitData = ((bitField >> 0u) & (7u <<  0u))
+                | ((bitField >> 1u) & (7u <<  3u))
+                | ((bitField >> 2u) & (7u <<  6u))
+                | ((bitField >> 3u) & (7u <<  9u))
+                | ((bitField >> 4u) & (7u << 12u))
+                | ((bitField >> 5u) & (7u << 15u))
+                | ((bitField >> 6u) & (7u << 18u))
+                | ((bitField >> 7u) & (7u << 21u));
+        glsl__HeapWriteExplicit(cbtID, glsl_CreateNode(nodeID >> 2u, u_PassID - 2), 24, bitData);
+
+        // 4-bits
+        bitField = (bitField & 0x0F0F0F0Fu) + ((bitField >>  4u) & 0x0F0F0F0Fu);
+        bitData = ((bitField >>  0u) & (15u <<  0u))
+                | ((bitField >>  4u) & (15u <<  4u))
+                | ((bitField >>  8u) & (15u <<  8u))
+                | ((bitField >> 12u) & (15u << 12u));
+        glsl__HeapWriteExplicit(cbtID, glsl_CreateNode(nodeID >> 3u, u_PassID - 3), 16, bitData);
+
+        // 5-bits
+        bitField = (bitField & 0x00FF00FFu) + ((bitField >>  8u) & 0x00FF00FFu);
+        bitData = ((bitField >>  0u) & (31u << 0u))
+                | ((bitField >> 11u) & (31u << 5u));
+        glsl__HeapWriteExplicit(cbtID, glsl_CreateNode(nodeID >> 4u, u_PassID - 4), 10, bitData);
+
+        // 6-bits
+        bitField = (bitField & 0x0000FFFFu) + ((bitField >> 16u) & 0x0000FFFFu);
+        bitData = bitField;
+        glsl__HeapWriteExplicit(cbtID, glsl_CreateNode(nodeID >> 5u, u_PassID - 5),  6, bitData);
+    }
+}
+
+
+/*******************************************************************************
+ * SumReduction -- Port of glsl/cbt_SumReduction.glsl and of its dispatches
+ *
+ * The host runs the prepass at the max depth, and then one pass per level
+ * from the max depth minus 6 up to the root.
+ *
+ */
+static void glsl_SumReductionPass(const int cbtID, int u_PassID)
+{
+    uint32_t cnt = (1u << u_PassID);
+
+    for (uint32_t threadID = 0u; threadID < cnt; ++threadID) {
+        uint32_t nodeID = threadID + cnt;
+        uint32_t x0 = glsl_HeapRead(cbtID, glsl_CreateNode(nodeID << 1u     , u_PassID + 1));
+        uint32_t x1 = glsl_HeapRead(cbtID, glsl_CreateNode(nodeID << 1u | 1u, u_PassID + 1));
+
+        glsl__HeapWrite(cbtID, glsl_CreateNode(nodeID, u_PassID), x0 + x1);
+    }
+}
+
+static void glsl_SumReduction(const int cbtID)
+{
+    int it = glsl_MaxDepth(cbtID);
+
+    glsl_SumReductionPrepass(cbtID, it);
+    it-= 5;
+    while (--it >= 0) {
+        glsl_SumReductionPass(cbtID, it);
+    }
+}
+
+
+/*******************************************************************************
+ * Test -- Compares the CPU and shader reductions for one max depth
+ *
+ */
+static uint64_t cbt__TestHash(uint64_t x)
+{
+    x^= x >> 33;
+    x*= 0xff51afd7ed558ccdULL;
+    x^= x >> 33;
+    x*= 0xc4ceb9fe1a85ec53ULL;
+
+    return x ^ (x >> 33);
+}
+
+// splits and merges leaves pseudo-randomly
+static void
+cbt__TestUpdater(
+    cbt_Tree *tree,
+    int64_t treeID,
+    const cbt_Node node,
+    const void *userData
+) {
+    uint64_t seed = *(const uint64_t *)userData;
+    uint64_t hash = cbt__TestHash(node.id * 31u + treeID * 7u + seed) % 8u;
+
+    if (hash < 3u) {
+        cbt_SplitNode(tree, node);
+    } else if (hash == 3u && (node.id & 1u) == 0u && !cbt_IsRootNode(node)
+               && cbt_IsLeafNode(tree, cbt_SiblingNode(node))) {
+        cbt_MergeNode(tree, node);
+    }
+}
+
+// overwrites the sums above the bitfield, so that a reduction must
+// recompute all of them
+static void cbt__TestScrambleSums(const int cbtID, uint64_t seed)
+{
+    int maxDepth = glsl_MaxDepth(cbtID);
+
+    for (int depth = 0; depth < maxDepth; ++depth) {
+        for (uint32_t id = 1u << depth; id < (2u << depth); ++id) {
+            seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+            glsl__HeapWrite(cbtID, glsl_CreateNode(id, depth), (uint32_t)(seed >> 33));
+        }
+    }
+}
+
+static void cbt__TestBindHeaps(char *buffer, int64_t stride, int64_t treeCount)
+{
+    for (int64_t cbtID = 0; cbtID < treeCount; ++cbtID) {
+        u_CbtBuffers[cbtID].heap = (uint32_t *)(buffer + cbtID * stride);
+    }
+}
+
+static void cbt__TestMaxDepth(int64_t maxDepth)
+{
+    int64_t treeCount = maxDepth <= 20 ? CBT_GPU_TEST_MAX_TREE_COUNT : 1;
+    int64_t iterationCount = maxDepth <= 20 ? 4 : 1;
+    int64_t byteSize = cbt_ForestBufferByteSize(treeCount, maxDepth);
+    char *buffer = (char *)malloc(byteSize);
+    char *gpuBuffer = (char *)malloc(byteSize);
+    cbt_Forest *forest, *gpuForest;
+    int64_t stride;
+
+    if (buffer == NULL || gpuBuffer == NULL) {
+        fprintf(stderr, "maxDepth %i: out of memory, skipped\n", (int)maxDepth);
+        free(buffer);
+        free(gpuBuffer);
+        return;
+    }
+
+    forest = cbt_CreateForestInBuffer(buffer, byteSize, treeCount, maxDepth, maxDepth / 3);
+    stride = cbt_ForestHeapStride(forest);
+    CBT_TEST_CHECK(cbt_ForestGetHeap(forest) == buffer);
+    CBT_TEST_CHECK(stride % 256 == 0 && stride * treeCount == byteSize);
+
+    // the shader reduction matches the library's
+    for (uint64_t it = 0; it < (uint64_t)iterationCount; ++it) {
+        cbt_ForestUpdate(forest, &cbt__TestUpdater, &it);
+        memcpy(gpuBuffer, buffer, byteSize);
+
+        for (int64_t cbtID = 0; cbtID < treeCount; ++cbtID) {
+            cbt__TestBindHeaps(buffer, stride, treeCount);
+            cbt__TestScrambleSums((int)cbtID, 2 * it);
+            cbt__ComputeSumReduction(cbt_ForestTree(forest, cbtID));
+
+            cbt__TestBindHeaps(gpuBuffer, stride, treeCount);
+            cbt__TestScrambleSums((int)cbtID, 2 * it + 1);
+            glsl_SumReduction((int)cbtID);
+            CBT_TEST_CHECK(glsl_MaxDepth((int)cbtID) == maxDepth);
+        }
+
+        CBT_TEST_CHECK(memcmp(gpuBuffer, buffer, byteSize) == 0);
+    }
+    cbt_ReleaseForest(forest);
+
+    // refinement on the GPU
+    cbt__TestBindHeaps(gpuBuffer, stride, treeCount);
+    for (int64_t cbtID = 0; cbtID < treeCount; ++cbtID) {
+        glsl_Node leaves[32];
+        uint32_t nodeCount = glsl_NodeCount((int)cbtID);
+
+        for (int64_t i = 0; i < 32; ++i) {
+            uint32_t nodeID = (uint32_t)(cbt__TestHash(i + cbtID * 32) % nodeCount);
+
+            leaves[i] = glsl_DecodeNode((int)cbtID, nodeID);
+        }
+
+        for (int64_t i = 0; i < 32; ++i) {
+            glsl_SplitNode((int)cbtID, leaves[i]);
+        }
+
+        glsl_SumReduction((int)cbtID);
+    }
+
+    // the library reads back the trees as they are
+    memcpy(buffer, gpuBuffer, byteSize);
+    gpuForest = cbt_CreateForestFromBuffer(gpuBuffer, byteSize, treeCount);
+    CBT_TEST_CHECK(cbt_ForestTreeCount(gpuForest) == treeCount);
+    CBT_TEST_CHECK(cbt_ForestHeapStride(gpuForest) == stride);
+    CBT_TEST_CHECK(cbt_ForestGetHeap(gpuForest) == gpuBuffer);
+
+    for (int64_t cbtID = 0; cbtID < treeCount; ++cbtID) {
+        cbt_Tree *tree = cbt_ForestTree(gpuForest, cbtID);
+        int64_t nodeCount = cbt_NodeCount(tree);
+
+        CBT_TEST_CHECK(cbt_MaxDepth(tree) == maxDepth);
+        CBT_TEST_CHECK(nodeCount == (int64_t)glsl_NodeCount((int)cbtID));
+
+        for (int64_t i = 0; i < 1024 && i < nodeCount; ++i) {
+            int64_t nodeID = nodeCount <= 1024 ? i : (int64_t)(cbt__TestHash(i) % nodeCount);
+            cbt_Node node = cbt_DecodeNode(tree, nodeID);
+            glsl_Node gpuNode = glsl_DecodeNode((int)cbtID, (uint32_t)nodeID);
+
+            CBT_TEST_CHECK(node.id == gpuNode.id && (int)node.depth == gpuNode.depth);
+            CBT_TEST_CHECK(cbt_EncodeNode(tree, node) == nodeID);
+        }
+
+        cbt__ComputeSumReduction(tree);
+    }
+    CBT_TEST_CHECK(memcmp(gpuBuffer, buffer, byteSize) == 0);
+
+    cbt_ReleaseForest(gpuForest);
+    free(buffer);
+    free(gpuBuffer);
+}
+
+int main(int argc, char **argv)
+{
+    int64_t minDepth = 6, maxDepth = 30;
+
+    for (int i = 1; i + 1 < argc; i+= 2) {
+        if (strcmp(argv[i], "--min-depth") == 0) {
+            minDepth = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "--max-depth") == 0) {
+            maxDepth = atoi(argv[i + 1]);
+        } else {
+            fprintf(stderr, "unknown option %s\n", argv[i]);
+
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (minDepth < 6 || maxDepth > CBT__GPU_MAX_DEPTH || minDepth > maxDepth) {
+        fprintf(stderr, "the max depths must lie in [6, %i]\n", CBT__GPU_MAX_DEPTH);
+
+        return EXIT_FAILURE;
+    }
+
+    for (int64_t depth = minDepth; depth <= maxDepth; ++depth) {
+        int64_t failureCount = cbt__testFailureCount;
+
+        cbt__TestMaxDepth(depth);
+        printf("maxDepth %2i: %s\n",
+               (int)depth,
+               cbt__testFailureCount == failureCount ? "ok" : "FAILED");
+        fflush(stdout);
+    }
+
+    return cbt__testFailureCount == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,296 @@
+/* cbt_test.c - checks the behaviour of the cbt.h API in corner cases
+
+   Build and run, e.g., with
+      cc -O2 -std=gnu99 -fsanitize=address,undefined test/cbt_test.c \
+         -o cbt_test -lpthread -lm
+      ./cbt_test
+
+   Each case prints one line and the program returns a non-zero value if
+   any check fails. The file cases write and remove a temporary file in
+   the current directory.
+*/
+
+#define CBT_IMPLEMENTATION
+#include "../cbt.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CBT_TEST_FILE_PATH "cbt_test.cbt"
+
+static int64_t cbt__testFailureCount = 0;
+
+#define CBT_TEST_CHECK(x)                                                      \
+    do {                                                                       \
+        if (!(x)) {                                                            \
+            ++cbt__testFailureCount;                                           \
+            fprintf(stderr, "%s:%i: check failed: %s\n", __FILE__, __LINE__, #x);\
+        }                                                                      \
+    } while (0)
+
+
+/*******************************************************************************
+ * Utilities
+ *
+ */
+static uint64_t cbt__TestHash(uint64_t x)
+{
+    x^= x >> 33;
+    x*= 0xff51afd7ed558ccdULL;
+    x^= x >> 33;
+    x*= 0xc4ceb9fe1a85ec53ULL;
+
+    return x ^ (x >> 33);
+}
+
+// splits leaves pseudo-randomly
+static void
+cbt__TestSplitter(cbt_Tree *tree, const cbt_Node node, const void *userData)
+{
+    uint64_t seed = *(const uint64_t *)userData;
+
+    if (cbt__TestHash(node.id * 31u + seed) % 4u == 0u)
+        cbt_SplitNode(tree, node);
+}
+
+static bool cbt__TestHeapsMatch(const cbt_Tree *tree1, const cbt_Tree *tree2)
+{
+    return cbt_HeapByteSize(tree1) == cbt_HeapByteSize(tree2)
+        && memcmp(cbt_GetHeap(tree1),
+                  cbt_GetHeap(tree2),
+                  cbt_HeapByteSize(tree1)) == 0;
+}
+
+
+/*******************************************************************************
+ * Files -- Releases mapped trees whose sums are not reduced yet
+ *
+ * cbt_Release syncs read-write mapped trees, and the file must then hold
+ * the same heap as a tree that went through the same modifications.
+ *
+ */
+typedef enum {
+    CBT__TEST_RELEASE_AFTER_DEFERRED_UPDATE,
+    CBT__TEST_RELEASE_AFTER_SPLIT,
+    CBT__TEST_RELEASE_AFTER_DEFERRED_REDUCTION
+} cbt__TestReleaseCase;
+
+static void cbt__TestModify(cbt_Tree *tree, cbt__TestReleaseCase releaseCase)
+{
+    uint64_t seed = 0u;
+
+    switch (releaseCase) {
+    case CBT__TEST_RELEASE_AFTER_DEFERRED_UPDATE:
+        cbt_UpdateDeferred(tree, &cbt__TestSplitter, &seed);
+        break;
+    case CBT__TEST_RELEASE_AFTER_SPLIT:
+        cbt_Update(tree, &cbt__TestSplitter, &seed);
+        cbt_SplitNode(tree, cbt_CreateNode(2u, 1));
+        cbt_SplitNode(tree, cbt_CreateNode((3u << 9) | 1u, 10));
+        break;
+    case CBT__TEST_RELEASE_AFTER_DEFERRED_REDUCTION:
+        cbt_SetReductionDeferred(tree, true);
+        cbt_Update(tree, &cbt__TestSplitter, &seed);
+        cbt_ReductionStep(tree, 1);
+        break;
+    }
+}
+
+static void cbt__TestReleaseMappedFile(cbt__TestReleaseCase releaseCase)
+{
+    cbt_Tree *expected = cbt_CreateAtDepth(16, 8);
+    cbt_Tree *tree;
+
+    CBT_TEST_CHECK(cbt_SaveFile(expected, CBT_TEST_FILE_PATH));
+    cbt__TestModify(expected, releaseCase);
+    cbt_ReductionStep(expected, INT64_MAX);
+    cbt_BeginReduction(expected);
+    cbt_ReductionStep(expected, INT64_MAX);
+
+    tree = cbt_MapFile(CBT_TEST_FILE_PATH, CBT_FILE_READ_WRITE);
+    CBT_TEST_CHECK(tree != NULL);
+    if (tree != NULL) {
+        cbt__TestModify(tree, releaseCase);
+        cbt_Release(tree);
+    }
+
+    tree = cbt_MapFile(CBT_TEST_FILE_PATH, CBT_FILE_VERIFY_CHECKSUM);
+    CBT_TEST_CHECK(tree != NULL);
+    if (tree != NULL) {
+        CBT_TEST_CHECK(cbt_NodeCount(tree) == cbt_NodeCount(expected));
+        CBT_TEST_CHECK(cbt__TestHeapsMatch(tree, expected));
+        cbt_Release(tree);
+    }
+
+    cbt_Release(expected);
+    remove(CBT_TEST_FILE_PATH);
+}
+
+// files of trees that cbt.h cannot create are rejected
+static void cbt__TestRejectMaxDepth(int64_t maxDepth)
+{
+    uint64_t heap[2] = {1ULL << maxDepth, 0u};
+    cbt__FileHeader header;
+    FILE *stream = fopen(CBT_TEST_FILE_PATH, "wb");
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, cbt__FileMagic, sizeof(header.magic));
+    header.version = CBT__FILE_VERSION;
+    header.layout = CBT_LAYOUT_PACKED;
+    header.maxDepth = maxDepth;
+    header.heapByteSize = sizeof(heap);
+    header.checksum = cbt__Checksum(heap, 2);
+
+    CBT_TEST_CHECK(stream != NULL);
+    if (stream != NULL) {
+        fwrite(&header, sizeof(header), 1, stream);
+        fwrite(heap, sizeof(heap), 1, stream);
+        fclose(stream);
+        CBT_TEST_CHECK(cbt_LoadFile(CBT_TEST_FILE_PATH) == NULL);
+        CBT_TEST_CHECK(cbt_MapFile(CBT_TEST_FILE_PATH, CBT_FILE_READ_ONLY) == NULL);
+    }
+
+    remove(CBT_TEST_FILE_PATH);
+}
+
+static void cbt__TestFiles(void)
+{
+    cbt__TestReleaseMappedFile(CBT__TEST_RELEASE_AFTER_DEFERRED_UPDATE);
+    cbt__TestReleaseMappedFile(CBT__TEST_RELEASE_AFTER_SPLIT);
+    cbt__TestReleaseMappedFile(CBT__TEST_RELEASE_AFTER_DEFERRED_REDUCTION);
+    cbt__TestRejectMaxDepth(5);
+}
+
+
+/*******************************************************************************
+ * RankIndex -- Encodes and decodes leaves from the updaters
+ *
+ * The updaters see the tree as it was before the update, whose leaves are
+ * exported beforehand, while the other updaters split leaves.
+ *
+ */
+typedef struct {
+    const cbt_Node *leaves;
+    int64_t leafCount;
+    uint64_t seed;
+    uint64_t mismatchCount;
+} cbt__TestQueryData;
+
+static bool
+cbt__TestQueryMatches(const cbt_Tree *tree, const cbt__TestQueryData *data,
+                      const cbt_Node node, int64_t handle)
+{
+    cbt_Node leaf;
+
+    if (handle < 0 || handle >= data->leafCount)
+        return false;
+
+    leaf = cbt_DecodeNode(tree, handle);
+
+    return leaf.id == node.id && leaf.depth == node.depth
+        && data->leaves[handle].id == node.id
+        && data->leaves[handle].depth == node.depth
+        && cbt_NodeCount(tree) == data->leafCount;
+}
+
+static void
+cbt__TestQueryUpdater(cbt_Tree *tree, const cbt_Node node, const void *userData)
+{
+    cbt__TestQueryData *data = (cbt__TestQueryData *)userData;
+
+    if (!cbt_IsLeafNode(tree, node)
+        || !cbt__TestQueryMatches(tree, data, node, cbt_EncodeNode(tree, node)))
+        cbt__AtomicAdd(&data->mismatchCount, 1u);
+
+    cbt__TestSplitter(tree, node, &data->seed);
+}
+
+static void
+cbt__TestBatchedQueryUpdater(
+    const cbt_Tree *tree,
+    const uint64_t *heapIDs,
+    const int64_t *depths,
+    int64_t firstHandle,
+    int64_t leafCount,
+    uint8_t *decisions,
+    const void *userData
+) {
+    cbt__TestQueryData *data = (cbt__TestQueryData *)userData;
+
+    for (int64_t leafID = 0; leafID < leafCount; ++leafID) {
+        cbt_Node node = cbt_CreateNode(heapIDs[leafID], depths[leafID]);
+
+        if (!cbt__TestQueryMatches(tree, data, node, firstHandle + leafID)
+            || cbt_EncodeNode(tree, node) != firstHandle + leafID)
+            cbt__AtomicAdd(&data->mismatchCount, 1u);
+
+        if (cbt__TestHash(node.id * 31u + data->seed) % 4u == 0u)
+            decisions[leafID] = CBT_UPDATE_SPLIT;
+    }
+}
+
+static void cbt__TestRankIndex(void)
+{
+    cbt_Tree *tree = cbt_CreateAtDepth(16, 8);
+    cbt_Node *leaves = (cbt_Node *)malloc(sizeof(cbt_Node) << 16);
+    cbt__TestQueryData data = {leaves, 0, 0u, 0u};
+
+    CBT_TEST_CHECK(cbt_EnableRankIndex(tree));
+
+    for (uint64_t it = 0; it < 8; ++it) {
+        data.leafCount = cbt_ExportLeaves(tree, leaves);
+        data.seed = it;
+        data.mismatchCount = 0u;
+
+        if (it & 1u)
+            cbt_UpdateBatched(tree, &cbt__TestBatchedQueryUpdater, &data);
+        else
+            cbt_Update(tree, &cbt__TestQueryUpdater, &data);
+
+        CBT_TEST_CHECK(data.mismatchCount == 0u);
+        CBT_TEST_CHECK(cbt_NodeCount(tree) > data.leafCount);
+    }
+
+    // the index is up to date once the update returns
+    data.leafCount = cbt_ExportLeaves(tree, leaves);
+    for (int64_t handle = 0; handle < data.leafCount; ++handle) {
+        CBT_TEST_CHECK(cbt__TestQueryMatches(tree, &data, leaves[handle], handle));
+        CBT_TEST_CHECK(cbt_EncodeNode(tree, leaves[handle]) == handle);
+    }
+
+    free(leaves);
+    cbt_Release(tree);
+}
+
+
+/*******************************************************************************
+ * Main
+ *
+ */
+typedef struct {
+    const char *name;
+    void (*run)(void);
+} cbt__TestCase;
+
+int main(int argc, char **argv)
+{
+    const cbt__TestCase testCases[] = {
+        {"files", &cbt__TestFiles},
+        {"rank", &cbt__TestRankIndex}
+    };
+    (void)argc;
+    (void)argv;
+
+    for (size_t i = 0; i < sizeof(testCases) / sizeof(testCases[0]); ++i) {
+        int64_t failureCount = cbt__testFailureCount;
+
+        testCases[i].run();
+        printf("%-8s: %s\n",
+               testCases[i].name,
+               cbt__testFailureCount == failureCount ? "ok" : "FAILED");
+        fflush(stdout);
+    }
+
+    return cbt__testFailureCount == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}